@@ -0,0 +1,84 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <limits>
+
+#include "Vector3D.h"
+
+// axis-aligned bounding box, starts out empty
+class AABB
+{
+public:
+    AABB()
+    {
+        float inf = std::numeric_limits<float>::infinity();
+        m_min = Vector3D(inf, inf, inf);
+        m_max = Vector3D(-inf, -inf, -inf);
+    }
+    AABB(Vector3D min, Vector3D max)
+    {
+        m_min = min;
+        m_max = max;
+    }
+
+    void grow(const Vector3D& p)
+    {
+        m_min = Vector3D(min_float(m_min.m_x, p.m_x), min_float(m_min.m_y, p.m_y), min_float(m_min.m_z, p.m_z));
+        m_max = Vector3D(max_float(m_max.m_x, p.m_x), max_float(m_max.m_y, p.m_y), max_float(m_max.m_z, p.m_z));
+    }
+    void grow(const AABB& b)
+    {
+        if (b.empty())
+            return;
+        grow(b.m_min);
+        grow(b.m_max);
+    }
+
+    bool empty() const
+    {
+        return m_min.m_x > m_max.m_x;
+    }
+    Vector3D center() const
+    {
+        return 0.5f * (m_min + m_max);
+    }
+    Vector3D extent() const
+    {
+        return m_max - m_min;
+    }
+    float surface_area() const
+    {
+        if (empty())
+            return 0;
+        Vector3D e = extent();
+        return 2 * (e.m_x * e.m_y + e.m_y * e.m_z + e.m_z * e.m_x);
+    }
+    int longest_axis() const
+    {
+        Vector3D e = extent();
+        if (e.m_x > e.m_y && e.m_x > e.m_z) return 0;
+        return e.m_y > e.m_z ? 1 : 2;
+    }
+
+    // slab test against a ray given by origin and 1/direction, t_enter is the
+    // distance the ray enters the box at
+    bool hit(const Vector3D& origin, const Vector3D& inv_dir, float min_t, float max_t, float& t_enter) const
+    {
+        float tx0 = (m_min.m_x - origin.m_x) * inv_dir.m_x;
+        float tx1 = (m_max.m_x - origin.m_x) * inv_dir.m_x;
+        float ty0 = (m_min.m_y - origin.m_y) * inv_dir.m_y;
+        float ty1 = (m_max.m_y - origin.m_y) * inv_dir.m_y;
+        float tz0 = (m_min.m_z - origin.m_z) * inv_dir.m_z;
+        float tz1 = (m_max.m_z - origin.m_z) * inv_dir.m_z;
+        float t0 = max_float(max_float(min_float(tx0, tx1), min_float(ty0, ty1)), max_float(min_float(tz0, tz1), min_t));
+        float t1 = min_float(min_float(max_float(tx0, tx1), max_float(ty0, ty1)), min_float(max_float(tz0, tz1), max_t));
+        t_enter = t0;
+        return t0 <= t1;
+    }
+
+public:
+    Vector3D m_min;
+    Vector3D m_max;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// bump allocator: objects are carved out of large chunks one after another and
+// all of them are freed together by release(), there is no per-object free
+class Arena
+{
+public:
+    Arena(size_t chunk_size = 1 << 20)
+    {
+        m_chunkSize = chunk_size;
+        m_cur = nullptr;
+        m_left = 0;
+        m_used = 0;
+    }
+    ~Arena()
+    {
+        release();
+    }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // construct a T inside the arena, T must not need its destructor run
+    template <typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        void* p = allocate(sizeof(T), alignof(T));
+        return new (p) T(std::forward<Args>(args)...);
+    }
+
+    void* allocate(size_t size, size_t align);
+    void release();
+
+    size_t bytes_used() const
+    {
+        return m_used;
+    }
+
+private:
+    std::vector<char*> m_chunks;
+    char* m_cur;
+    size_t m_left;
+    size_t m_chunkSize;
+    size_t m_used;
+};
+
+void* Arena::allocate(size_t size, size_t align)
+{
+    // padding needed to align the bump pointer
+    size_t pad = (align - reinterpret_cast<size_t>(m_cur) % align) % align;
+    if (m_cur == nullptr || pad + size > m_left)
+    {
+        // start a new chunk, oversized requests get a chunk of their own
+        size_t bytes = size + align > m_chunkSize ? size + align : m_chunkSize;
+        char* chunk = static_cast<char*>(std::malloc(bytes));
+        if (chunk == nullptr)
+            throw std::bad_alloc();
+        m_chunks.push_back(chunk);
+        m_cur = chunk;
+        m_left = bytes;
+        pad = (align - reinterpret_cast<size_t>(m_cur) % align) % align;
+    }
+    char* p = m_cur + pad;
+    m_cur = p + size;
+    m_left -= pad + size;
+    m_used += size;
+    return p;
+}
+
+void Arena::release()
+{
+    for (char* chunk : m_chunks)
+        std::free(chunk);
+    m_chunks.clear();
+    m_cur = nullptr;
+    m_left = 0;
+    m_used = 0;
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <chrono>
+#include <iostream>
+#include <limits>
+
+#include "Camera.h"
+#include "World.h"
+
+// cheap guess without tracing anything: a handful of spheres is fastest
+// without any structure, spheres spread evenly (like the generate_scene_*
+// lattices) suit a uniform grid, and anything clumpy goes to a BVH
+Accelerator choose_accelerator(World& world)
+{
+    int count = static_cast<int>(world.m_spheres.size());
+    if (count < 16)
+        return Accelerator::None;
+
+    UniformGrid grid;
+    grid.build(world.m_spheres);
+    int occupied = grid.occupied_cells();
+    int largest = 0;
+    for (int c = 0; c < grid.cell_count(); ++c)
+        largest = std::max(largest, grid.m_cellStart[c + 1] - grid.m_cellStart[c]);
+    float average = occupied > 0 ? static_cast<float>(grid.m_items.size()) / occupied : 0;
+    float occupancy = static_cast<float>(occupied) / grid.cell_count();
+    if (occupancy > 0.3f && largest <= 4 * average + 4)
+        return Accelerator::Grid;
+#if defined(__AVX2__)
+    return Accelerator::BVH8;
+#else
+    return Accelerator::BVH;
+#endif
+}
+
+// build every structure and time ray_count camera rays, each followed by one
+// random bounce, through it; keeps the fastest one built in the world
+Accelerator autotune_accelerator(World& world, Camera& camera, int ray_count = 20000, bool verbose = true)
+{
+    Accelerator candidates[5] = { Accelerator::None, Accelerator::BVH, Accelerator::BVH8, Accelerator::Grid, Accelerator::HashGrid };
+    Accelerator best = Accelerator::None;
+    double best_seconds = std::numeric_limits<double>::infinity();
+
+    for (Accelerator candidate : candidates)
+    {
+        // brute force is hopeless past a few hundred spheres
+        if (candidate == Accelerator::None && world.m_spheres.size() > 256)
+            continue;
+
+        auto start = std::chrono::steady_clock::now();
+        world.build_accelerator(candidate);
+        double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        seed_random(1);
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < ray_count; ++i)
+        {
+            Ray r = camera.generate_ray(random_float(), random_float());
+            HitResult hit = world.hit(r, 0.001, std::numeric_limits<float>::infinity());
+            if (hit.m_isHit)
+            {
+                Vector3D dir = hit.m_hitNormal + normalize(Vector3D::random(-1, 1));
+                Ray bounce(hit.m_hitPos, dir);
+                world.hit(bounce, 0.001, std::numeric_limits<float>::infinity());
+            }
+        }
+        double trace = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (verbose)
+        {
+            std::cout << "  " << accelerator_name(candidate) << ": build " << build * 1000.0
+                      << " ms, trial " << trace * 1000.0 << " ms" << std::endl;
+        }
+        if (trace < best_seconds)
+        {
+            best_seconds = trace;
+            best = candidate;
+        }
+    }
+
+    world.build_accelerator(best);
+    if (verbose)
+        std::cout << "using " << accelerator_name(best) << std::endl;
+    return best;
+}
+
+#endif
@@ -0,0 +1,431 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <vector>
+
+#include "AABB.h"
+#include "Sphere.h"
+#include "TraversalStats.h"
+
+class BVHNode
+{
+public:
+    AABB m_bounds;
+    // children, both -1 for a leaf
+    int m_left;
+    int m_right;
+    // every node covers the contiguous range [m_first, m_first + m_count) of BVH::m_indices
+    int m_first;
+    int m_count;
+    // surface area when the node was last built, to measure how far refits have degraded it
+    float m_builtArea;
+
+    bool is_leaf() const
+    {
+        return m_left < 0;
+    }
+};
+
+// binary bounding volume hierarchy over World::m_spheres. Spheres are never
+// reordered, leaves point into m_indices which holds sphere indices, so sphere
+// indices stay stable and moved spheres can be refit in place.
+class BVH
+{
+public:
+    BVH()
+    {
+        m_root = -1;
+    }
+
+    bool built() const
+    {
+        return m_root >= 0;
+    }
+    void clear()
+    {
+        m_nodes.clear();
+        m_indices.clear();
+        m_freeNodes.clear();
+        m_root = -1;
+    }
+
+    // full top-down binned SAH build
+    void build(const std::vector<Sphere>& spheres);
+    // recompute every node's bounds bottom-up after spheres moved, keeping the topology
+    void refit(const std::vector<Sphere>& spheres);
+    // rebuild every topmost subtree whose area grew past threshold times its built area,
+    // returns how many subtrees were rebuilt
+    int rebuild_degraded(const std::vector<Sphere>& spheres, float threshold);
+    // expected cost of a random ray under the surface area heuristic
+    float sah_cost() const;
+
+    // narrow hit_result down to the closest sphere hit, m_t is the current max_t
+    void hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result);
+    // true as soon as any sphere blocks the ray between min_t and max_t
+    bool occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t);
+
+    int node_count() const
+    {
+        return static_cast<int>(m_nodes.size() - m_freeNodes.size());
+    }
+
+public:
+    std::vector<BVHNode> m_nodes;
+    std::vector<int> m_indices;
+    int m_root;
+
+    static const int max_leaf_size = 4;
+    static const int bin_count = 12;
+    // SAH cost of one node visit relative to one sphere test
+    static constexpr float traversal_cost = 1.0f;
+
+private:
+    friend class LBVHBuilder;
+
+    int alloc_node();
+    void free_subtree(int node);
+    void build_node(const std::vector<Sphere>& spheres, int node, int first, int count);
+    void refit_node(const std::vector<Sphere>& spheres, int node);
+    int rebuild_degraded_node(const std::vector<Sphere>& spheres, int node, float threshold);
+
+    std::vector<int> m_freeNodes;
+};
+
+int BVH::alloc_node()
+{
+    if (!m_freeNodes.empty())
+    {
+        int node = m_freeNodes.back();
+        m_freeNodes.pop_back();
+        return node;
+    }
+    m_nodes.push_back(BVHNode());
+    return static_cast<int>(m_nodes.size()) - 1;
+}
+
+void BVH::free_subtree(int node)
+{
+    if (m_nodes[node].is_leaf())
+        return;
+    int left = m_nodes[node].m_left;
+    int right = m_nodes[node].m_right;
+    free_subtree(left);
+    free_subtree(right);
+    m_freeNodes.push_back(left);
+    m_freeNodes.push_back(right);
+    m_nodes[node].m_left = m_nodes[node].m_right = -1;
+}
+
+void BVH::build(const std::vector<Sphere>& spheres)
+{
+    clear();
+    if (spheres.empty())
+        return;
+    m_indices.resize(spheres.size());
+    for (size_t i = 0; i < spheres.size(); ++i)
+        m_indices[i] = static_cast<int>(i);
+    m_root = alloc_node();
+    build_node(spheres, m_root, 0, static_cast<int>(spheres.size()));
+}
+
+void BVH::build_node(const std::vector<Sphere>& spheres, int node, int first, int count)
+{
+    AABB bounds;
+    AABB centroids;
+    for (int i = first; i < first + count; ++i)
+    {
+        AABB b = spheres[m_indices[i]].bounds();
+        bounds.grow(b);
+        centroids.grow(b.center());
+    }
+    m_nodes[node].m_bounds = bounds;
+    m_nodes[node].m_builtArea = bounds.surface_area();
+    m_nodes[node].m_first = first;
+    m_nodes[node].m_count = count;
+    m_nodes[node].m_left = m_nodes[node].m_right = -1;
+
+    if (count <= max_leaf_size)
+        return;
+
+    // bin the centroids along the longest axis and sweep for the cheapest split
+    int axis = centroids.longest_axis();
+    float lo = axis == 0 ? centroids.m_min.m_x : axis == 1 ? centroids.m_min.m_y : centroids.m_min.m_z;
+    float hi = axis == 0 ? centroids.m_max.m_x : axis == 1 ? centroids.m_max.m_y : centroids.m_max.m_z;
+    if (hi <= lo)
+    {
+        // all centroids coincide, halve the range so leaves stay small
+        int left = alloc_node();
+        int right = alloc_node();
+        m_nodes[node].m_left = left;
+        m_nodes[node].m_right = right;
+        build_node(spheres, left, first, count / 2);
+        build_node(spheres, right, first + count / 2, count - count / 2);
+        return;
+    }
+    float scale = bin_count / (hi - lo);
+
+    AABB bin_bounds[bin_count];
+    int bin_counts[bin_count] = {};
+    auto bin_of = [&](int sphere) {
+        Vector3D c = spheres[sphere].m_center;
+        float v = axis == 0 ? c.m_x : axis == 1 ? c.m_y : c.m_z;
+        return std::min(bin_count - 1, static_cast<int>((v - lo) * scale));
+    };
+    for (int i = first; i < first + count; ++i)
+    {
+        int b = bin_of(m_indices[i]);
+        bin_counts[b]++;
+        bin_bounds[b].grow(spheres[m_indices[i]].bounds());
+    }
+
+    // areas and counts of everything left of each split plane, swept from the right
+    float right_area[bin_count];
+    int right_count[bin_count];
+    AABB acc;
+    int n = 0;
+    for (int b = bin_count - 1; b > 0; --b)
+    {
+        acc.grow(bin_bounds[b]);
+        n += bin_counts[b];
+        right_area[b] = acc.surface_area();
+        right_count[b] = n;
+    }
+    float best_cost = std::numeric_limits<float>::infinity();
+    int best_split = -1;
+    acc = AABB();
+    n = 0;
+    for (int b = 1; b < bin_count; ++b)
+    {
+        acc.grow(bin_bounds[b - 1]);
+        n += bin_counts[b - 1];
+        float cost = acc.surface_area() * n + right_area[b] * right_count[b];
+        if (n > 0 && right_count[b] > 0 && cost < best_cost)
+        {
+            best_cost = cost;
+            best_split = b;
+        }
+    }
+    if (best_split < 0)
+        return;
+
+    // splitting must beat testing every sphere of the node
+    float leaf_cost = bounds.surface_area() * count;
+    if (best_cost + traversal_cost * bounds.surface_area() >= leaf_cost && count <= 4 * max_leaf_size)
+        return;
+
+    int* mid = std::partition(&m_indices[first], &m_indices[first] + count,
+                              [&](int sphere) { return bin_of(sphere) < best_split; });
+    int left_count = static_cast<int>(mid - &m_indices[first]);
+
+    int left = alloc_node();
+    int right = alloc_node();
+    m_nodes[node].m_left = left;
+    m_nodes[node].m_right = right;
+    build_node(spheres, left, first, left_count);
+    build_node(spheres, right, first + left_count, count - left_count);
+}
+
+void BVH::refit(const std::vector<Sphere>& spheres)
+{
+    if (built())
+        refit_node(spheres, m_root);
+}
+
+void BVH::refit_node(const std::vector<Sphere>& spheres, int node)
+{
+    BVHNode& n = m_nodes[node];
+    if (n.is_leaf())
+    {
+        AABB bounds;
+        for (int i = n.m_first; i < n.m_first + n.m_count; ++i)
+            bounds.grow(spheres[m_indices[i]].bounds());
+        n.m_bounds = bounds;
+        return;
+    }
+    refit_node(spheres, n.m_left);
+    refit_node(spheres, n.m_right);
+    AABB bounds = m_nodes[n.m_left].m_bounds;
+    bounds.grow(m_nodes[n.m_right].m_bounds);
+    m_nodes[node].m_bounds = bounds;
+}
+
+int BVH::rebuild_degraded(const std::vector<Sphere>& spheres, float threshold)
+{
+    if (!built())
+        return 0;
+    return rebuild_degraded_node(spheres, m_root, threshold);
+}
+
+int BVH::rebuild_degraded_node(const std::vector<Sphere>& spheres, int node, float threshold)
+{
+    BVHNode& n = m_nodes[node];
+    if (n.is_leaf())
+        return 0;
+    if (n.m_bounds.surface_area() > threshold * n.m_builtArea)
+    {
+        // the subtree's spheres are contiguous in m_indices, so it can be rebuilt in place
+        int first = n.m_first;
+        int count = n.m_count;
+        free_subtree(node);
+        build_node(spheres, node, first, count);
+        return 1;
+    }
+    int left = n.m_left;
+    int right = n.m_right;
+    return rebuild_degraded_node(spheres, left, threshold) + rebuild_degraded_node(spheres, right, threshold);
+}
+
+float BVH::sah_cost() const
+{
+    if (!built())
+        return 0;
+    float root_area = m_nodes[m_root].m_bounds.surface_area();
+    if (root_area <= 0)
+        return 0;
+    float cost = 0;
+    std::vector<int> stack(1, m_root);
+    while (!stack.empty())
+    {
+        const BVHNode& n = m_nodes[stack.back()];
+        stack.pop_back();
+        float p = n.m_bounds.surface_area() / root_area;
+        if (n.is_leaf())
+        {
+            cost += p * n.m_count;
+        }
+        else
+        {
+            cost += p * traversal_cost;
+            stack.push_back(n.m_left);
+            stack.push_back(n.m_right);
+        }
+    }
+    return cost;
+}
+
+void BVH::hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result)
+{
+    if (!built())
+        return;
+
+    Vector3D origin = ray.origin();
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+
+    int stack[64];
+    int top = 0;
+    float t_enter;
+    if (!m_nodes[m_root].m_bounds.hit(origin, inv_dir, min_t, hit_result.m_t, t_enter))
+        return;
+    stack[top++] = m_root;
+
+    while (top > 0)
+    {
+        const BVHNode& n = m_nodes[stack[--top]];
+        COUNT_NODE_VISIT();
+        if (n.is_leaf())
+        {
+            COUNT_PRIMITIVE_TESTS(n.m_count);
+            for (int i = n.m_first; i < n.m_first + n.m_count; ++i)
+            {
+                HitResult hit = spheres[m_indices[i]].hit(ray, min_t, hit_result.m_t);
+                if (hit.m_isHit)
+                {
+                    hit_result = hit;
+                    hit_result.m_sphere = m_indices[i];
+                }
+            }
+            continue;
+        }
+
+        // push the farther child first so the nearer one is visited next
+        float t_left, t_right;
+        bool hit_left = m_nodes[n.m_left].m_bounds.hit(origin, inv_dir, min_t, hit_result.m_t, t_left);
+        bool hit_right = m_nodes[n.m_right].m_bounds.hit(origin, inv_dir, min_t, hit_result.m_t, t_right);
+        if (hit_left && hit_right)
+        {
+            if (t_left < t_right)
+            {
+                stack[top++] = n.m_right;
+                stack[top++] = n.m_left;
+            }
+            else
+            {
+                stack[top++] = n.m_left;
+                stack[top++] = n.m_right;
+            }
+        }
+        else if (hit_left)
+        {
+            stack[top++] = n.m_left;
+        }
+        else if (hit_right)
+        {
+            stack[top++] = n.m_right;
+        }
+    }
+}
+
+bool BVH::occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t)
+{
+    if (!built())
+        return false;
+
+    Vector3D origin = ray.origin();
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+
+    int stack[64];
+    int top = 0;
+    float t_enter;
+    if (!m_nodes[m_root].m_bounds.hit(origin, inv_dir, min_t, max_t, t_enter))
+        return false;
+    stack[top++] = m_root;
+
+    while (top > 0)
+    {
+        const BVHNode& n = m_nodes[stack[--top]];
+        COUNT_NODE_VISIT();
+        if (n.is_leaf())
+        {
+            COUNT_PRIMITIVE_TESTS(n.m_count);
+            for (int i = n.m_first; i < n.m_first + n.m_count; ++i)
+            {
+                if (spheres[m_indices[i]].occludes(ray, min_t, max_t))
+                    return true;
+            }
+            continue;
+        }
+
+        // any hit ends the search, so try the larger child first: it is the
+        // more likely one to hold an occluder
+        float t_left, t_right;
+        bool hit_left = m_nodes[n.m_left].m_bounds.hit(origin, inv_dir, min_t, max_t, t_left);
+        bool hit_right = m_nodes[n.m_right].m_bounds.hit(origin, inv_dir, min_t, max_t, t_right);
+        if (hit_left && hit_right)
+        {
+            if (m_nodes[n.m_left].m_bounds.surface_area() > m_nodes[n.m_right].m_bounds.surface_area())
+            {
+                stack[top++] = n.m_right;
+                stack[top++] = n.m_left;
+            }
+            else
+            {
+                stack[top++] = n.m_left;
+                stack[top++] = n.m_right;
+            }
+        }
+        else if (hit_left)
+        {
+            stack[top++] = n.m_left;
+        }
+        else if (hit_right)
+        {
+            stack[top++] = n.m_right;
+        }
+    }
+    return false;
+}
+
+#endif
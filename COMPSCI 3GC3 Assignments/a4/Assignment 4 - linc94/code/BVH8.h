@@ -0,0 +1,400 @@
+#ifndef BVH8_H
+#define BVH8_H
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "BVH.h"
+#include "TraversalStats.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// one node of the compressed 8-wide BVH (80 bytes). Child boxes are stored as
+// 8-bit offsets on a per-axis power-of-two grid anchored at m_origin, so one
+// node holds all eight child boxes in a couple of cache lines.
+class BVH8Node
+{
+public:
+    float m_origin[3];
+    // biased exponents of the grid spacing per axis, spacing = 2^(e - 127)
+    unsigned char m_exponent[3];
+    unsigned char m_pad;
+    // internal children are stored contiguously from m_childBase
+    int m_childBase;
+    // leaf children's spheres are stored contiguously in BVH8::m_indices from m_primBase
+    int m_primBase;
+    // per child: 0 empty, 0x80 | k internal child m_childBase + k, otherwise the leaf's sphere count
+    unsigned char m_meta[8];
+    unsigned char m_lo[3][8];
+    unsigned char m_hi[3][8];
+
+    float spacing(int axis) const
+    {
+        // the biased exponent is exactly the exponent field of the float
+        unsigned int bits = static_cast<unsigned int>(m_exponent[axis]) << 23;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+};
+
+// 8-wide BVH collapsed from the binary BVH, with quantized child bounds. With
+// AVX2 all eight children of a node are tested in one go.
+class BVH8
+{
+public:
+    bool built() const
+    {
+        return !m_nodes.empty();
+    }
+    void clear()
+    {
+        m_nodes.clear();
+        m_indices.clear();
+    }
+
+    void build(const BVH& bvh);
+    // narrow hit_result down to the closest sphere hit, m_t is the current max_t
+    void hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result);
+    // true as soon as any sphere blocks the ray between min_t and max_t
+    bool occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t);
+
+    size_t bytes() const
+    {
+        return m_nodes.size() * sizeof(BVH8Node) + m_indices.size() * sizeof(int);
+    }
+
+public:
+    std::vector<BVH8Node> m_nodes;
+    std::vector<int> m_indices;
+
+private:
+    void encode(int slot, const BVH& bvh, const std::vector<int>& children);
+    // entry distances of the children the ray hits, returns a bit mask of them
+    int intersect_children(const BVH8Node& node, const Vector3D& origin, const Vector3D& inv_dir,
+                           float min_t, float max_t, float* t_enter) const;
+};
+
+void BVH8::build(const BVH& bvh)
+{
+    clear();
+    if (!bvh.built())
+        return;
+
+    // breadth first, every slot is filled from one binary node
+    std::vector<int> queue_bvh(1, bvh.m_root);
+    std::vector<int> queue_slot(1, 0);
+    m_nodes.push_back(BVH8Node());
+    for (size_t q = 0; q < queue_bvh.size(); ++q)
+    {
+        int binary = queue_bvh[q];
+        int slot = queue_slot[q];
+
+        // open the largest internal child until there are eight
+        std::vector<int> children;
+        if (bvh.m_nodes[binary].is_leaf())
+        {
+            children.push_back(binary);
+        }
+        else
+        {
+            children.push_back(bvh.m_nodes[binary].m_left);
+            children.push_back(bvh.m_nodes[binary].m_right);
+        }
+        while (children.size() < 8)
+        {
+            int best = -1;
+            float best_area = -1;
+            for (int k = 0; k < static_cast<int>(children.size()); ++k)
+            {
+                const BVHNode& n = bvh.m_nodes[children[k]];
+                if (!n.is_leaf() && n.m_bounds.surface_area() > best_area)
+                {
+                    best = k;
+                    best_area = n.m_bounds.surface_area();
+                }
+            }
+            if (best < 0)
+                break;
+            int opened = children[best];
+            children[best] = bvh.m_nodes[opened].m_left;
+            children.push_back(bvh.m_nodes[opened].m_right);
+        }
+
+        encode(slot, bvh, children);
+
+        // queue the internal children in the slots encode() reserved
+        int k = 0;
+        for (int child : children)
+        {
+            if (!bvh.m_nodes[child].is_leaf())
+            {
+                queue_bvh.push_back(child);
+                queue_slot.push_back(m_nodes[slot].m_childBase + k++);
+            }
+        }
+    }
+}
+
+void BVH8::encode(int slot, const BVH& bvh, const std::vector<int>& children)
+{
+    AABB bounds;
+    int internal_count = 0;
+    for (int child : children)
+    {
+        bounds.grow(bvh.m_nodes[child].m_bounds);
+        if (!bvh.m_nodes[child].is_leaf())
+            ++internal_count;
+    }
+
+    BVH8Node node;
+    std::memset(&node, 0, sizeof(node));
+    node.m_childBase = static_cast<int>(m_nodes.size());
+    node.m_primBase = static_cast<int>(m_indices.size());
+    m_nodes.resize(m_nodes.size() + internal_count);
+
+    float lo[3] = { bounds.m_min.m_x, bounds.m_min.m_y, bounds.m_min.m_z };
+    float hi[3] = { bounds.m_max.m_x, bounds.m_max.m_y, bounds.m_max.m_z };
+    float spacing[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        // smallest power of two spacing whose 255 steps cover the node
+        int e = hi[a] > lo[a] ? static_cast<int>(std::ceil(std::log2((hi[a] - lo[a]) / 255.0f))) : -100;
+        if (e < -126)
+            e = -126;
+        node.m_origin[a] = lo[a];
+        node.m_exponent[a] = static_cast<unsigned char>(e + 127);
+        spacing[a] = node.spacing(a);
+    }
+
+    int internal = 0;
+    for (size_t c = 0; c < children.size(); ++c)
+    {
+        const BVHNode& child = bvh.m_nodes[children[c]];
+        float clo[3] = { child.m_bounds.m_min.m_x, child.m_bounds.m_min.m_y, child.m_bounds.m_min.m_z };
+        float chi[3] = { child.m_bounds.m_max.m_x, child.m_bounds.m_max.m_y, child.m_bounds.m_max.m_z };
+        for (int a = 0; a < 3; ++a)
+        {
+            // round outwards so the quantized box always contains the child
+            float qlo = std::floor((clo[a] - lo[a]) / spacing[a]);
+            float qhi = std::ceil((chi[a] - lo[a]) / spacing[a]);
+            node.m_lo[a][c] = static_cast<unsigned char>(qlo < 0 ? 0 : qlo > 255 ? 255 : qlo);
+            node.m_hi[a][c] = static_cast<unsigned char>(qhi < 0 ? 0 : qhi > 255 ? 255 : qhi);
+        }
+        if (child.is_leaf())
+        {
+            node.m_meta[c] = static_cast<unsigned char>(child.m_count);
+            for (int i = child.m_first; i < child.m_first + child.m_count; ++i)
+                m_indices.push_back(bvh.m_indices[i]);
+        }
+        else
+        {
+            node.m_meta[c] = static_cast<unsigned char>(0x80 | internal++);
+        }
+    }
+    m_nodes[slot] = node;
+}
+
+int BVH8::intersect_children(const BVH8Node& node, const Vector3D& origin, const Vector3D& inv_dir,
+                             float min_t, float max_t, float* t_enter) const
+{
+#if defined(__AVX2__)
+    const float o[3] = { origin.m_x, origin.m_y, origin.m_z };
+    const float inv[3] = { inv_dir.m_x, inv_dir.m_y, inv_dir.m_z };
+    __m256 t0 = _mm256_set1_ps(min_t);
+    __m256 t1 = _mm256_set1_ps(max_t);
+    for (int a = 0; a < 3; ++a)
+    {
+        __m256 qlo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.m_lo[a]))));
+        __m256 qhi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.m_hi[a]))));
+        // with the ray origin folded in: t = (node origin - ray origin + q * spacing) / d
+        __m256 base = _mm256_set1_ps((node.m_origin[a] - o[a]) * inv[a]);
+        __m256 step = _mm256_set1_ps(node.spacing(a) * inv[a]);
+        __m256 ta = _mm256_add_ps(base, _mm256_mul_ps(qlo, step));
+        __m256 tb = _mm256_add_ps(base, _mm256_mul_ps(qhi, step));
+        t0 = _mm256_max_ps(t0, _mm256_min_ps(ta, tb));
+        t1 = _mm256_min_ps(t1, _mm256_max_ps(ta, tb));
+    }
+    _mm256_storeu_ps(t_enter, t0);
+    int mask = _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+    __m128i meta = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.m_meta));
+    int empty = _mm_movemask_epi8(_mm_cmpeq_epi8(meta, _mm_setzero_si128())) & 0xFF;
+    return mask & ~empty;
+#else
+    const float o[3] = { origin.m_x, origin.m_y, origin.m_z };
+    const float inv[3] = { inv_dir.m_x, inv_dir.m_y, inv_dir.m_z };
+    int mask = 0;
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node.m_meta[c] == 0)
+            continue;
+        float t0 = min_t;
+        float t1 = max_t;
+        for (int a = 0; a < 3; ++a)
+        {
+            float base = (node.m_origin[a] - o[a]) * inv[a];
+            float step = node.spacing(a) * inv[a];
+            float ta = base + node.m_lo[a][c] * step;
+            float tb = base + node.m_hi[a][c] * step;
+            t0 = max_float(t0, min_float(ta, tb));
+            t1 = min_float(t1, max_float(ta, tb));
+        }
+        t_enter[c] = t0;
+        if (t0 <= t1)
+            mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+void BVH8::hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result)
+{
+    if (!built())
+        return;
+
+    Vector3D origin = ray.origin();
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+
+    // stack entries are internal nodes (count 0) or runs of spheres in m_indices
+    struct Entry
+    {
+        int m_index;
+        int m_count;
+        float m_t;
+    };
+    Entry stack[8 * 32];
+    int top = 0;
+    stack[top++] = { 0, 0, min_t };
+
+    while (top > 0)
+    {
+        Entry e = stack[--top];
+        if (e.m_t > hit_result.m_t)
+            continue;
+        if (e.m_count > 0)
+        {
+            COUNT_PRIMITIVE_TESTS(e.m_count);
+            for (int i = e.m_index; i < e.m_index + e.m_count; ++i)
+            {
+                HitResult hit = spheres[m_indices[i]].hit(ray, min_t, hit_result.m_t);
+                if (hit.m_isHit)
+                {
+                    hit_result = hit;
+                    hit_result.m_sphere = m_indices[i];
+                }
+            }
+            continue;
+        }
+
+        const BVH8Node& node = m_nodes[e.m_index];
+        COUNT_NODE_VISIT();
+        float t_enter[8];
+        int mask = intersect_children(node, origin, inv_dir, min_t, hit_result.m_t, t_enter);
+
+        // hit children sorted far to near, so the nearest is popped first
+        Entry hits[8];
+        int hit_count = 0;
+        int prim = node.m_primBase;
+        for (int c = 0; c < 8; ++c)
+        {
+            unsigned char meta = node.m_meta[c];
+            if (meta == 0)
+                continue;
+            bool leaf = !(meta & 0x80);
+            if (mask & (1 << c))
+            {
+                Entry child;
+                child.m_index = leaf ? prim : node.m_childBase + (meta & 0x7F);
+                child.m_count = leaf ? meta : 0;
+                child.m_t = t_enter[c];
+                int k = hit_count++;
+                while (k > 0 && hits[k - 1].m_t < child.m_t)
+                {
+                    hits[k] = hits[k - 1];
+                    --k;
+                }
+                hits[k] = child;
+            }
+            if (leaf)
+                prim += meta;
+        }
+        for (int k = 0; k < hit_count; ++k)
+            stack[top++] = hits[k];
+    }
+}
+
+bool BVH8::occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t)
+{
+    if (!built())
+        return false;
+
+    Vector3D origin = ray.origin();
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+
+    int stack[8 * 32];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const BVH8Node& node = m_nodes[stack[--top]];
+        COUNT_NODE_VISIT();
+        float t_enter[8];
+        int mask = intersect_children(node, origin, inv_dir, min_t, max_t, t_enter);
+
+        // leaves are tested right away, internal children are pushed smallest
+        // first so the largest, likeliest to block, is popped next
+        int children[8];
+        float sizes[8];
+        int child_count = 0;
+        int prim = node.m_primBase;
+        for (int c = 0; c < 8; ++c)
+        {
+            unsigned char meta = node.m_meta[c];
+            if (meta == 0)
+                continue;
+            bool leaf = !(meta & 0x80);
+            if (mask & (1 << c))
+            {
+                if (leaf)
+                {
+                    COUNT_PRIMITIVE_TESTS(meta);
+                    for (int i = prim; i < prim + meta; ++i)
+                    {
+                        if (spheres[m_indices[i]].occludes(ray, min_t, max_t))
+                            return true;
+                    }
+                }
+                else
+                {
+                    // half the quantized surface area, the grid spacing is shared by all children
+                    float ex = (node.m_hi[0][c] - node.m_lo[0][c]) * node.spacing(0);
+                    float ey = (node.m_hi[1][c] - node.m_lo[1][c]) * node.spacing(1);
+                    float ez = (node.m_hi[2][c] - node.m_lo[2][c]) * node.spacing(2);
+                    float size = ex * ey + ey * ez + ez * ex;
+                    int k = child_count++;
+                    while (k > 0 && sizes[k - 1] > size)
+                    {
+                        sizes[k] = sizes[k - 1];
+                        children[k] = children[k - 1];
+                        --k;
+                    }
+                    sizes[k] = size;
+                    children[k] = node.m_childBase + (meta & 0x7F);
+                }
+            }
+            if (leaf)
+                prim += meta;
+        }
+        for (int k = 0; k < child_count; ++k)
+            stack[top++] = children[k];
+    }
+    return false;
+}
+
+#endif
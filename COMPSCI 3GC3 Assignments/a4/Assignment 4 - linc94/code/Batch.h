@@ -0,0 +1,520 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Autotune.h"
+#include "Camera.h"
+#include "Parallel.h"
+#include "Renderer.h"
+#include "Sequence.h"
+#include "World.h"
+
+// one image of a batch, defaults as in main.cpp
+class BatchJob
+{
+public:
+    BatchJob()
+    {
+        m_scene = "all";
+        m_eye = Vector3D(20, 3, 3);
+        m_target = Vector3D(0, 0, 0);
+        m_fov = 20;
+        m_width = 768;
+        m_height = 540;
+        m_raysPerPixel = 100;
+        m_priority = 0;
+        m_share = 1;
+        m_seconds = 0;
+        m_rayCount = 0;
+        m_failed = false;
+    }
+
+    // one_diffuse, one_specular, multi_diffuse, multi_specular, all, mixed,
+    // lights[:count], sphere_field[:half_extent] or textured (with the two textures)
+    std::string m_scene;
+    std::string m_sphereTexture;
+    std::string m_floorTexture;
+    Vector3D m_eye;
+    Vector3D m_target;
+    float m_fov;
+    int m_width;
+    int m_height;
+    int m_raysPerPixel;
+    // workers only render a job's tiles when no job of a higher priority has any left to hand out
+    int m_priority;
+    // jobs of one priority are rendered side by side, each getting samples in
+    // proportion to its share
+    float m_share;
+    std::string m_output;
+
+    // filled in by BatchRenderer: seconds from the start of the batch until
+    // the image was written, and rays traced for it
+    double m_seconds;
+    long long m_rayCount;
+    bool m_failed;
+};
+
+// a job per line of whitespace separated key=value fields, keys being scene,
+// sphere_texture, floor_texture, eye=x,y,z, target=x,y,z, fov, width, height,
+// spp, priority, share and output; values with spaces go in double quotes and
+// lines starting with # are comments. Every job needs an output.
+bool read_batch_manifest(const std::string& path, std::vector<BatchJob>& jobs, std::ostream& errors)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        errors << "can't read " << path << std::endl;
+        return false;
+    }
+    bool ok = true;
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number)
+    {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+
+        BatchJob job;
+        size_t p = start;
+        while (p < line.size())
+        {
+            size_t equals = line.find('=', p);
+            if (equals == std::string::npos)
+            {
+                errors << path << ":" << number << ": expected key=value at '" << line.substr(p) << "'" << std::endl;
+                ok = false;
+                break;
+            }
+            std::string key = line.substr(p, equals - p);
+            std::string value;
+            p = equals + 1;
+            if (p < line.size() && line[p] == '"')
+            {
+                size_t close = line.find('"', p + 1);
+                close = close == std::string::npos ? line.size() : close;
+                value = line.substr(p + 1, close - p - 1);
+                p = close + 1;
+            }
+            else
+            {
+                size_t end = line.find_first_of(" \t\r", p);
+                end = end == std::string::npos ? line.size() : end;
+                value = line.substr(p, end - p);
+                p = end;
+            }
+            p = line.find_first_not_of(" \t\r", p);
+            p = p == std::string::npos ? line.size() : p;
+
+            std::istringstream field(value);
+            char comma;
+            bool parsed = true;
+            if (key == "scene")
+                job.m_scene = value;
+            else if (key == "sphere_texture")
+                job.m_sphereTexture = value;
+            else if (key == "floor_texture")
+                job.m_floorTexture = value;
+            else if (key == "output")
+                job.m_output = value;
+            else if (key == "eye")
+                parsed = static_cast<bool>(field >> job.m_eye.m_x >> comma >> job.m_eye.m_y >> comma >> job.m_eye.m_z);
+            else if (key == "target")
+                parsed = static_cast<bool>(field >> job.m_target.m_x >> comma >> job.m_target.m_y >> comma >> job.m_target.m_z);
+            else if (key == "fov")
+                parsed = static_cast<bool>(field >> job.m_fov);
+            else if (key == "width")
+                parsed = static_cast<bool>(field >> job.m_width) && job.m_width > 1;
+            else if (key == "height")
+                parsed = static_cast<bool>(field >> job.m_height) && job.m_height > 1;
+            else if (key == "spp")
+                parsed = static_cast<bool>(field >> job.m_raysPerPixel) && job.m_raysPerPixel > 0;
+            else if (key == "priority")
+                parsed = static_cast<bool>(field >> job.m_priority);
+            else if (key == "share")
+                parsed = static_cast<bool>(field >> job.m_share) && job.m_share > 0;
+            else
+            {
+                errors << path << ":" << number << ": unknown key " << key << std::endl;
+                ok = false;
+            }
+            if (!parsed)
+            {
+                errors << path << ":" << number << ": bad value for " << key << ": " << value << std::endl;
+                ok = false;
+            }
+        }
+        if (job.m_output.empty())
+        {
+            errors << path << ":" << number << ": job has no output" << std::endl;
+            ok = false;
+        }
+        jobs.push_back(job);
+    }
+    return ok;
+}
+
+// builds the job's scene (from a fixed seed, so every job naming it gets the
+// same one) with the accelerator choose_accelerator picks; false for an unknown scene
+bool build_batch_scene(World& world, const BatchJob& job)
+{
+    std::string name = job.m_scene;
+    int count = -1;
+    size_t colon = name.find(':');
+    if (colon != std::string::npos)
+    {
+        count = atoi(name.c_str() + colon + 1);
+        name = name.substr(0, colon);
+    }
+
+    seed_random(1);
+    if (name == "one_diffuse")
+        world.generate_scene_one_diffuse();
+    else if (name == "one_specular")
+        world.generate_scene_one_specular();
+    else if (name == "multi_diffuse")
+        world.generate_scene_multi_diffuse();
+    else if (name == "multi_specular")
+        world.generate_scene_multi_specular();
+    else if (name == "all")
+        world.generate_scene_all();
+    else if (name == "mixed")
+        world.generate_scene_mixed();
+    else if (name == "lights")
+        world.generate_scene_lights(count > 0 ? count : 300);
+    else if (name == "sphere_field")
+        world.generate_scene_sphere_field(count > 0 ? count : 1 << 15);
+    else if (name == "textured")
+        world.generate_scene_textured(job.m_sphereTexture, job.m_floorTexture);
+    else
+        return false;
+    world.build_accelerator(choose_accelerator(world));
+    return true;
+}
+
+// renders a list of jobs on one pool of worker threads. Every job is cut into
+// tiles and a worker that is free takes the next tile of whichever job is most
+// entitled to it, so workers never sit idle at the end of one image while
+// others are still queued, and small jobs don't wait behind big ones. Jobs
+// naming the same scene share one copy of it, built by the first worker that
+// needs it (from a fixed seed) and freed after that scene's last job is written.
+// A job's image is the one Renderer would make with the same settings.
+class BatchRenderer
+{
+public:
+    // m_threadCount, m_tileSize, m_maxLightBounceNum and m_seed apply to every job
+    BatchRenderer(const RenderSettings& settings)
+    {
+        m_settings = settings;
+        m_seconds = 0;
+        m_rayCount = 0;
+        m_sceneCount = 0;
+        m_sceneSeconds = 0;
+        m_verbose = true;
+    }
+
+    // false when any job failed (unknown scene or unwritable output), the others are still rendered
+    bool render(std::vector<BatchJob>& jobs);
+
+    RenderSettings m_settings;
+    double m_seconds;
+    long long m_rayCount;
+    // distinct scenes built, and the time workers spent building them
+    int m_sceneCount;
+    double m_sceneSeconds;
+    // print a line as every job finishes
+    bool m_verbose;
+
+private:
+    class Scene
+    {
+    public:
+        std::string m_key;
+        // first job naming the scene, to build it from
+        int m_job;
+        std::unique_ptr<World> m_world;
+        // picked once the world is built, see choose_kernel()
+        KernelChoice m_kernel;
+        bool m_building;
+        bool m_ready;
+        int m_jobsLeft;
+    };
+    class Job
+    {
+    public:
+        int m_scene;
+        int m_tilesX;
+        int m_tileCount;
+        int m_nextTile;
+        int m_tilesDone;
+        // samples handed out so far, over the job's share
+        double m_usage;
+        // sum of the samples of every pixel, allocated when the first tile is handed out
+        std::vector<Vector3D> m_pixels;
+        std::unique_ptr<Camera> m_camera;
+    };
+
+    void worker();
+    // under m_mutex: a scene to build (set scene) or a tile to render (set job
+    // and tile), false if neither is available right now
+    bool next_task(int& scene, int& job, int& tile);
+    void render_tile(Job& job, const BatchJob& settings, World& world, const KernelChoice& kernel, int tile, long long& ray_count);
+    void finish_job(int job);
+
+    std::vector<BatchJob>* m_jobList;
+    std::vector<Scene> m_scenes;
+    std::vector<Job> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    // jobs with tiles still to hand out or scenes still to build
+    int m_jobsPending;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+bool BatchRenderer::render(std::vector<BatchJob>& jobs)
+{
+    m_start = std::chrono::steady_clock::now();
+    m_jobList = &jobs;
+    m_scenes.clear();
+    m_jobs.clear();
+    m_jobs.resize(jobs.size());
+    m_jobsPending = 0;
+    m_rayCount = 0;
+    m_sceneCount = 0;
+    m_sceneSeconds = 0;
+
+    for (size_t j = 0; j < jobs.size(); ++j)
+    {
+        BatchJob& settings = jobs[j];
+        settings.m_seconds = 0;
+        settings.m_rayCount = 0;
+        settings.m_failed = false;
+        std::string key = settings.m_scene;
+        if (settings.m_scene == "textured")
+            key += "|" + settings.m_sphereTexture + "|" + settings.m_floorTexture;
+        int scene = -1;
+        for (size_t s = 0; s < m_scenes.size(); ++s)
+            if (m_scenes[s].m_key == key)
+                scene = static_cast<int>(s);
+        if (scene < 0)
+        {
+            scene = static_cast<int>(m_scenes.size());
+            m_scenes.push_back(Scene());
+            m_scenes[scene].m_key = key;
+            m_scenes[scene].m_job = static_cast<int>(j);
+            m_scenes[scene].m_building = false;
+            m_scenes[scene].m_ready = false;
+            m_scenes[scene].m_jobsLeft = 0;
+        }
+        m_scenes[scene].m_jobsLeft++;
+
+        Job& job = m_jobs[j];
+        int size = m_settings.m_tileSize;
+        job.m_scene = scene;
+        job.m_tilesX = (settings.m_width + size - 1) / size;
+        job.m_tileCount = job.m_tilesX * ((settings.m_height + size - 1) / size);
+        job.m_nextTile = 0;
+        job.m_tilesDone = 0;
+        job.m_usage = 0;
+        job.m_camera.reset(new Camera(settings.m_eye, settings.m_target, Vector3D(0, 1, 0), settings.m_fov,
+                                      settings.m_width / float(settings.m_height)));
+        ++m_jobsPending;
+    }
+
+    int thread_count = m_settings.m_threadCount > 0 ? m_settings.m_threadCount : default_thread_count();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; ++t)
+        threads.push_back(std::thread(&BatchRenderer::worker, this));
+    for (auto& t : threads)
+        t.join();
+
+    m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    bool ok = true;
+    for (const BatchJob& job : jobs)
+        ok = ok && !job.m_failed;
+    return ok;
+}
+
+bool BatchRenderer::next_task(int& scene, int& job, int& tile)
+{
+    std::vector<BatchJob>& jobs = *m_jobList;
+
+    // the most entitled job with tiles left: highest priority, then furthest
+    // behind its share, then first in the manifest
+    int best = -1;
+    for (size_t j = 0; j < m_jobs.size(); ++j)
+    {
+        const Job& candidate = m_jobs[j];
+        if (jobs[j].m_failed || candidate.m_nextTile >= candidate.m_tileCount)
+            continue;
+        const Scene& s = m_scenes[candidate.m_scene];
+        // a scene some other worker is building holds its jobs back
+        if (!s.m_ready && s.m_building)
+            continue;
+        if (best < 0 || jobs[j].m_priority > jobs[best].m_priority ||
+            (jobs[j].m_priority == jobs[best].m_priority && candidate.m_usage < m_jobs[best].m_usage))
+            best = static_cast<int>(j);
+    }
+    if (best < 0)
+        return false;
+
+    Job& chosen = m_jobs[best];
+    if (!m_scenes[chosen.m_scene].m_ready)
+    {
+        scene = chosen.m_scene;
+        m_scenes[scene].m_building = true;
+        return true;
+    }
+
+    job = best;
+    tile = chosen.m_nextTile++;
+    if (chosen.m_pixels.empty())
+        chosen.m_pixels.assign(jobs[best].m_width * jobs[best].m_height, Vector3D(0, 0, 0));
+    if (chosen.m_nextTile == chosen.m_tileCount)
+        --m_jobsPending;
+    int size = m_settings.m_tileSize;
+    chosen.m_usage += (double)size * size * jobs[best].m_raysPerPixel / jobs[best].m_share;
+    return true;
+}
+
+void BatchRenderer::worker()
+{
+    std::vector<BatchJob>& jobs = *m_jobList;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_jobsPending > 0)
+    {
+        int scene = -1, job = -1, tile = -1;
+        if (!next_task(scene, job, tile))
+        {
+            // everything left waits for scenes other workers are building
+            m_changed.wait(lock);
+            continue;
+        }
+
+        if (scene >= 0)
+        {
+            lock.unlock();
+            auto build_start = std::chrono::steady_clock::now();
+            std::unique_ptr<World> world(new World());
+            bool built = build_batch_scene(*world, jobs[m_scenes[scene].m_job]);
+            KernelChoice kernel;
+            if (built && m_settings.m_specializeKernels)
+                kernel = choose_kernel(*world, m_settings.m_maxLightBounceNum);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+            lock.lock();
+
+            m_sceneSeconds += seconds;
+            m_scenes[scene].m_building = false;
+            if (built)
+            {
+                m_scenes[scene].m_world = std::move(world);
+                m_scenes[scene].m_kernel = kernel;
+                m_scenes[scene].m_ready = true;
+                ++m_sceneCount;
+            }
+            else
+            {
+                std::cerr << "unknown scene " << jobs[m_scenes[scene].m_job].m_scene << std::endl;
+                for (size_t j = 0; j < m_jobs.size(); ++j)
+                {
+                    if (m_jobs[j].m_scene == scene)
+                    {
+                        jobs[j].m_failed = true;
+                        --m_jobsPending;
+                    }
+                }
+            }
+            m_changed.notify_all();
+            continue;
+        }
+
+        // the scene stays alive until this job's last tile is done
+        World& world = *m_scenes[m_jobs[job].m_scene].m_world;
+        const KernelChoice& kernel = m_scenes[m_jobs[job].m_scene].m_kernel;
+        lock.unlock();
+        long long rays = 0;
+        render_tile(m_jobs[job], jobs[job], world, kernel, tile, rays);
+        lock.lock();
+
+        jobs[job].m_rayCount += rays;
+        m_rayCount += rays;
+        if (++m_jobs[job].m_tilesDone == m_jobs[job].m_tileCount)
+        {
+            lock.unlock();
+            finish_job(job);
+            lock.lock();
+        }
+    }
+    // wake the others, they may be waiting on a scene that failed
+    m_changed.notify_all();
+}
+
+// Renderer::render_tile for a single pass
+void BatchRenderer::render_tile(Job& job, const BatchJob& settings, World& world, const KernelChoice& kernel, int tile,
+                                long long& ray_count)
+{
+    int size = m_settings.m_tileSize;
+    int x0 = (tile % job.m_tilesX) * size;
+    int y0 = (tile / job.m_tilesX) * size;
+    int width = settings.m_width;
+    int height = settings.m_height;
+    Camera& camera = *job.m_camera;
+    float spread = camera.pixel_spread(height);
+
+    seed_random((tile + 1) ^ ((unsigned long long)m_settings.m_seed << 40));
+    for (int j = y0; j < y0 + size && j < height; ++j)
+    {
+        for (int i = x0; i < x0 + size && i < width; ++i)
+        {
+            Vector3D pixel_color(0, 0, 0);
+            for (int s = 0; s < settings.m_raysPerPixel; ++s)
+            {
+                float col = (i + random_float()) / (width - 1);
+                float row = (j + random_float()) / (height - 1);
+                Ray r = camera.generate_ray(col, row);
+                r.m_coneSpread = spread;
+                pixel_color += kernel.m_function ? kernel.m_function(r, world, kernel.m_kinds.data(), ray_count)
+                                                 : ray_hit_color(r, world, m_settings.m_maxLightBounceNum, ray_count);
+            }
+            // tiles don't overlap, so no other worker writes these pixels
+            job.m_pixels[j * width + i] = pixel_color;
+        }
+    }
+}
+
+// writes a job's image and lets go of its pixels, and of its scene when no other job needs it
+void BatchRenderer::finish_job(int job)
+{
+    BatchJob& settings = (*m_jobList)[job];
+    std::vector<Vector3D> pixels;
+    pixels.swap(m_jobs[job].m_pixels);
+    for (Vector3D& p : pixels)
+        p = p / settings.m_raysPerPixel;
+    bool written = write_ppm(settings.m_output, settings.m_width, settings.m_height, pixels);
+    pixels = std::vector<Vector3D>();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    settings.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    if (--m_scenes[m_jobs[job].m_scene].m_jobsLeft == 0)
+        m_scenes[m_jobs[job].m_scene].m_world.reset();
+    if (!written)
+    {
+        settings.m_failed = true;
+        std::cerr << "can't write " << settings.m_output << std::endl;
+    }
+    else if (m_verbose)
+        std::cout << "  " << settings.m_output << " (" << settings.m_scene << ", " << settings.m_width << "x"
+                  << settings.m_height << ", " << settings.m_raysPerPixel << " spp) done at " << settings.m_seconds
+                  << " s" << std::endl;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include <limits>
+#include <utility>
+
+#include "Ray.h"
+#include "HitResult.h"
+#include "AABB.h"
+
+using namespace std;
+
+// axis-aligned box spanning m_min to m_max
+class Box {
+
+public:
+    Box() {}
+    Box(Vector3D min, Vector3D max, int material)
+    {
+        m_min = min;
+        m_max = max;
+        m_material = material;
+    }
+    HitResult hit(Ray& r, float min_t, float max_t);
+    bool occludes(Ray& r, float min_t, float max_t);
+    AABB bounds() const
+    {
+        return AABB(m_min, m_max);
+    }
+
+public:
+    Vector3D m_min;
+    Vector3D m_max;
+    // index into World::m_materials
+    int m_material;
+};
+
+//test if ray hits this box within range min_t and max_t (slab test)
+HitResult Box::hit(Ray& ray, float min_t, float max_t)
+{
+    HitResult hit_result;
+
+    Vector3D o = ray.origin();
+    Vector3D d = ray.direction();
+    float o_axis[3] = { o.x(), o.y(), o.z() };
+    float d_axis[3] = { d.x(), d.y(), d.z() };
+    float lo[3] = { m_min.x(), m_min.y(), m_min.z() };
+    float hi[3] = { m_max.x(), m_max.y(), m_max.z() };
+
+    // entry and exit distances, and which slab the entry happened on
+    float t_enter = -std::numeric_limits<float>::infinity();
+    float t_exit = std::numeric_limits<float>::infinity();
+    int enter_axis = 0;
+    float enter_sign = -1;
+    int exit_axis = 0;
+    float exit_sign = 1;
+
+    for (int a = 0; a < 3; ++a)
+    {
+        float inv_d = 1.0f / d_axis[a];
+        float t0 = (lo[a] - o_axis[a]) * inv_d;
+        float t1 = (hi[a] - o_axis[a]) * inv_d;
+        // face normal sign of the near slab plane
+        float sign = -1;
+        if (inv_d < 0)
+        {
+            std::swap(t0, t1);
+            sign = 1;
+        }
+        if (t0 > t_enter)
+        {
+            t_enter = t0;
+            enter_axis = a;
+            enter_sign = sign;
+        }
+        if (t1 < t_exit)
+        {
+            t_exit = t1;
+            exit_axis = a;
+            exit_sign = -sign;
+        }
+    }
+
+    if (t_enter > t_exit)
+        return hit_result;
+
+    // use the entry point unless the ray starts inside the box
+    float t = t_enter;
+    int axis = enter_axis;
+    float sign = enter_sign;
+    if (t <= min_t)
+    {
+        t = t_exit;
+        axis = exit_axis;
+        sign = exit_sign;
+    }
+    if (t <= min_t || t >= max_t)
+        return hit_result;
+
+    float n[3] = { 0, 0, 0 };
+    n[axis] = sign;
+
+    hit_result.m_isHit = true;
+    hit_result.m_t = t;
+    hit_result.m_hitPos = ray.at(t);
+    hit_result.m_hitNormal = Vector3D(n[0], n[1], n[2]);
+    hit_result.m_hitMaterial = m_material;
+
+    return hit_result;
+}
+
+//test if the ray passes through the box surface within range min_t and max_t
+bool Box::occludes(Ray& ray, float min_t, float max_t)
+{
+    Vector3D o = ray.origin();
+    Vector3D d = ray.direction();
+    Vector3D inv_d(1.0f / d.x(), 1.0f / d.y(), 1.0f / d.z());
+    float t_enter;
+    if (!AABB(m_min, m_max).hit(o, inv_d, -std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), t_enter))
+        return false;
+
+    // the surface is crossed at the entry or, from inside, at the exit
+    float tx = fmaxf((m_min.x() - o.x()) * inv_d.x(), (m_max.x() - o.x()) * inv_d.x());
+    float ty = fmaxf((m_min.y() - o.y()) * inv_d.y(), (m_max.y() - o.y()) * inv_d.y());
+    float tz = fmaxf((m_min.z() - o.z()) * inv_d.z(), (m_max.z() - o.z()) * inv_d.z());
+    float t_exit = fminf(tx, fminf(ty, tz));
+    return (t_enter > min_t && t_enter < max_t) || (t_exit > min_t && t_exit < max_t);
+}
+
+#endif
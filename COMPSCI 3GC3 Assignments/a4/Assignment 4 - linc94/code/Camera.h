@@ -23,6 +23,30 @@ public:
         m_eye = eye;
     }
     
+    Vector3D eye() const
+    {
+        return m_eye;
+    }
+
+    // angle between the rays of neighbouring pixels, for ray cones
+    float pixel_spread(int image_height)
+    {
+        return m_ndc_height / image_height;
+    }
+
+    // inverse of generate_ray: the (col, row) a point projects to, false if it
+    // is not in front of the camera
+    bool project(const Vector3D& point, float& col, float& row)
+    {
+        Vector3D d = point - m_eye;
+        float depth = -dot(d, m_w);
+        if (depth <= 0)
+            return false;
+        col = dot(d, m_u) / depth / m_ndc_width + 0.5f;
+        row = dot(d, m_v) / depth / m_ndc_height + 0.5f;
+        return true;
+    }
+
     Ray generate_ray(float col, float row)
     {
         Vector3D direction = (col - 0.5)*m_ndc_width * m_u + (row-0.5) * m_ndc_height * m_v - m_w;
@@ -0,0 +1,941 @@
+#ifndef CHUNKEDMESH_H
+#define CHUNKEDMESH_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "AABB.h"
+#include "LBVH.h"
+#include "MappedFile.h"
+#include "Triangle.h"
+#include "TraversalStats.h"
+
+// out-of-core triangle meshes. ChunkedMeshBuilder streams an obj file into a
+// mesh file of spatially clustered chunks of about 64k triangles, each with
+// its own BVH, laid out so a chunk is one contiguous page aligned range that
+// is mapped and used as it is. ChunkedMesh keeps only the chunk table and a
+// small BVH over the chunks in memory and pages chunks in through a bounded
+// cache while rays traverse them, so meshes far larger than RAM render with a
+// fixed memory budget.
+//
+// file layout: ChunkFileHeader, m_chunkCount ChunkRecords, then every chunk at
+// a multiple of chunk_alignment: its ChunkNodes followed by its Triangles
+
+const char chunk_file_magic[8] = { 'A', '4', 'C', 'H', 'U', 'N', 'K', 'S' };
+const uint32_t chunk_file_version = 1;
+const uint64_t chunk_alignment = 4096;
+
+class ChunkFileHeader
+{
+public:
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_chunkCount;
+    uint64_t m_triangleCount;
+    float m_min[3];
+    float m_max[3];
+};
+
+class ChunkRecord
+{
+public:
+    AABB bounds() const
+    {
+        return AABB(Vector3D(m_min[0], m_min[1], m_min[2]), Vector3D(m_max[0], m_max[1], m_max[2]));
+    }
+
+    float m_min[3];
+    float m_max[3];
+    uint64_t m_offset;
+    uint64_t m_bytes;
+    uint32_t m_nodeCount;
+    uint32_t m_triangleCount;
+};
+
+// node of a chunk's BVH, stored depth first: an inner node's first child is the
+// node right after it and m_index is its second; a leaf covers the m_count
+// triangles from m_index on
+class ChunkNode
+{
+public:
+    bool is_leaf() const
+    {
+        return m_count > 0;
+    }
+    AABB bounds() const
+    {
+        return AABB(Vector3D(m_min[0], m_min[1], m_min[2]), Vector3D(m_max[0], m_max[1], m_max[2]));
+    }
+    void set_bounds(const AABB& b)
+    {
+        m_min[0] = b.m_min.m_x; m_min[1] = b.m_min.m_y; m_min[2] = b.m_min.m_z;
+        m_max[0] = b.m_max.m_x; m_max[1] = b.m_max.m_y; m_max[2] = b.m_max.m_z;
+    }
+
+    float m_min[3];
+    float m_max[3];
+    int32_t m_index;
+    int32_t m_count;
+};
+
+const int chunk_bvh_bins = 12;
+
+// binned SAH build of the subtree over order[first, first + count), appended to nodes
+int build_chunk_node(const std::vector<AABB>& items, std::vector<int>& order, int first, int count, int max_leaf,
+                     std::vector<ChunkNode>& nodes)
+{
+    AABB bounds;
+    AABB centroids;
+    for (int i = first; i < first + count; ++i)
+    {
+        bounds.grow(items[order[i]]);
+        centroids.grow(items[order[i]].center());
+    }
+    int node = static_cast<int>(nodes.size());
+    nodes.push_back(ChunkNode());
+    nodes[node].set_bounds(bounds);
+    nodes[node].m_index = first;
+    nodes[node].m_count = count;
+    if (count <= max_leaf)
+        return node;
+
+    int axis = centroids.longest_axis();
+    auto coordinate = [axis](const Vector3D& v) { return axis == 0 ? v.m_x : axis == 1 ? v.m_y : v.m_z; };
+    float lo = coordinate(centroids.m_min);
+    float hi = coordinate(centroids.m_max);
+    int left_count = count / 2;
+    if (hi > lo)
+    {
+        float scale = chunk_bvh_bins / (hi - lo);
+        auto bin_of = [&](int item) {
+            return std::min(chunk_bvh_bins - 1, static_cast<int>((coordinate(items[item].center()) - lo) * scale));
+        };
+        AABB bin_bounds[chunk_bvh_bins];
+        int bin_counts[chunk_bvh_bins] = {};
+        for (int i = first; i < first + count; ++i)
+        {
+            int b = bin_of(order[i]);
+            bin_counts[b]++;
+            bin_bounds[b].grow(items[order[i]]);
+        }
+
+        float right_area[chunk_bvh_bins];
+        int right_count[chunk_bvh_bins];
+        AABB acc;
+        int n = 0;
+        for (int b = chunk_bvh_bins - 1; b > 0; --b)
+        {
+            acc.grow(bin_bounds[b]);
+            n += bin_counts[b];
+            right_area[b] = acc.surface_area();
+            right_count[b] = n;
+        }
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best_split = -1;
+        acc = AABB();
+        n = 0;
+        for (int b = 1; b < chunk_bvh_bins; ++b)
+        {
+            acc.grow(bin_bounds[b - 1]);
+            n += bin_counts[b - 1];
+            float cost = acc.surface_area() * n + right_area[b] * right_count[b];
+            if (n > 0 && right_count[b] > 0 && cost < best_cost)
+            {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+
+        // splitting must beat testing every item of the node
+        if (best_split >= 0 && best_cost + bounds.surface_area() >= bounds.surface_area() * count && count <= 4 * max_leaf)
+            return node;
+        if (best_split >= 0)
+        {
+            int* mid = std::partition(&order[first], &order[first] + count, [&](int item) { return bin_of(item) < best_split; });
+            left_count = static_cast<int>(mid - &order[first]);
+        }
+    }
+
+    // all centroids coincide or no plane separates them: halve the range so leaves stay small
+    nodes[node].m_count = 0;
+    build_chunk_node(items, order, first, left_count, max_leaf, nodes);
+    int right = build_chunk_node(items, order, first + left_count, count - left_count, max_leaf, nodes);
+    nodes[node].m_index = right;
+    return node;
+}
+
+// depth first BVH over items given by their bounds; leaves index into order,
+// which receives the permutation of the items
+void build_chunk_bvh(const std::vector<AABB>& items, int max_leaf, std::vector<ChunkNode>& nodes, std::vector<int>& order)
+{
+    nodes.clear();
+    order.resize(items.size());
+    for (size_t i = 0; i < items.size(); ++i)
+        order[i] = static_cast<int>(i);
+    if (!items.empty())
+        build_chunk_node(items, order, 0, static_cast<int>(items.size()), max_leaf, nodes);
+}
+
+// turns an obj file into a mesh file in four streaming passes, so neither the
+// obj's vertices nor its triangles ever have to fit in memory at once:
+//  1. vertex positions are copied to a scratch file and bounded
+//  2. faces are triangulated (as fans) against the mapped vertices and the
+//     triangles appended to a second scratch file, counting how many fall in
+//     each cell of a 2^m_gridBits cells per side grid
+//  3. a counting sort scatters the triangles into Morton order of their cells
+//  4. runs of consecutive cells become chunks of about m_chunkTriangles, and
+//     each chunk gets its BVH and is written out
+// Only positions and faces are read: texture coordinates, normals and
+// materials of the obj are ignored, the whole mesh gets one material.
+class ChunkedMeshBuilder
+{
+public:
+    ChunkedMeshBuilder()
+    {
+        m_chunkTriangles = 1 << 16;
+        m_gridBits = 7;
+        m_triangleCount = 0;
+        m_chunkCount = 0;
+        m_fileBytes = 0;
+    }
+
+    // false, with the reason in m_error, if the obj can't be read or has no triangles
+    bool build(const std::string& obj_path, const std::string& out_path);
+
+    // triangles per chunk; a chunk only grows past it when a single grid cell holds more
+    int m_chunkTriangles;
+    int m_gridBits;
+
+    std::string m_error;
+    long long m_triangleCount;
+    int m_chunkCount;
+    uint64_t m_fileBytes;
+
+private:
+    bool read_vertices(const std::string& obj_path, const std::string& vertices_path);
+    bool read_faces(const std::string& obj_path, const std::string& vertices_path, const std::string& triangles_path);
+    bool sort_triangles(const std::string& triangles_path, const std::string& sorted_path);
+    bool write_chunks(const std::string& sorted_path, const std::string& out_path);
+    uint32_t cell_of(const Triangle& triangle) const;
+
+    long long m_vertexCount;
+    AABB m_vertexBounds;
+    // triangles per grid cell, indexed by the cell's Morton code
+    std::vector<uint64_t> m_cellCounts;
+};
+
+bool ChunkedMeshBuilder::build(const std::string& obj_path, const std::string& out_path)
+{
+    m_error.clear();
+    m_triangleCount = 0;
+    m_chunkCount = 0;
+    m_fileBytes = 0;
+    std::string vertices_path = out_path + ".vertices";
+    std::string triangles_path = out_path + ".triangles";
+    std::string sorted_path = out_path + ".sorted";
+
+    bool ok = read_vertices(obj_path, vertices_path) && read_faces(obj_path, vertices_path, triangles_path);
+    std::remove(vertices_path.c_str());
+    ok = ok && sort_triangles(triangles_path, sorted_path);
+    std::remove(triangles_path.c_str());
+    ok = ok && write_chunks(sorted_path, out_path);
+    std::remove(sorted_path.c_str());
+    return ok;
+}
+
+bool ChunkedMeshBuilder::read_vertices(const std::string& obj_path, const std::string& vertices_path)
+{
+    std::ifstream in(obj_path);
+    if (!in)
+    {
+        m_error = "can't open " + obj_path;
+        return false;
+    }
+    std::ofstream out(vertices_path, std::ios::binary | std::ios::trunc);
+    m_vertexCount = 0;
+    m_vertexBounds = AABB();
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.size() < 2 || line[0] != 'v' || (line[1] != ' ' && line[1] != '\t'))
+            continue;
+        char* p = &line[1];
+        float v[3];
+        for (int k = 0; k < 3; ++k)
+            v[k] = std::strtof(p, &p);
+        out.write(reinterpret_cast<const char*>(v), sizeof(v));
+        m_vertexBounds.grow(Vector3D(v[0], v[1], v[2]));
+        ++m_vertexCount;
+    }
+    if (!out)
+    {
+        m_error = "can't write " + vertices_path;
+        return false;
+    }
+    return true;
+}
+
+bool ChunkedMeshBuilder::read_faces(const std::string& obj_path, const std::string& vertices_path, const std::string& triangles_path)
+{
+    std::ifstream in(obj_path);
+    std::ofstream out(triangles_path, std::ios::binary | std::ios::trunc);
+    MappedFile vertices;
+    if (!in || !vertices.map(vertices_path, 0, static_cast<size_t>(m_vertexCount * 3 * sizeof(float))))
+    {
+        m_error = "can't read the vertices of " + obj_path;
+        return false;
+    }
+    const float* positions = reinterpret_cast<const float*>(vertices.data());
+    auto position = [positions](long long index) {
+        return Vector3D(positions[3 * index], positions[3 * index + 1], positions[3 * index + 2]);
+    };
+
+    m_cellCounts.assign(size_t(1) << (3 * m_gridBits), 0);
+    // negative indices count back from the vertices read so far
+    long long vertices_seen = 0;
+    std::vector<long long> face;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.size() < 2 || (line[1] != ' ' && line[1] != '\t'))
+            continue;
+        if (line[0] == 'v')
+        {
+            ++vertices_seen;
+            continue;
+        }
+        if (line[0] != 'f')
+            continue;
+
+        // "f a b c ...", every corner possibly a/t, a/t/n or a//n
+        face.clear();
+        char* p = &line[1];
+        for (;;)
+        {
+            char* end;
+            long long index = std::strtoll(p, &end, 10);
+            if (end == p)
+                break;
+            index = index < 0 ? vertices_seen + index : index - 1;
+            if (index < 0 || index >= m_vertexCount)
+            {
+                m_error = "face refers to a missing vertex in " + obj_path;
+                return false;
+            }
+            face.push_back(index);
+            p = end;
+            while (*p && *p != ' ' && *p != '\t')
+                ++p;
+        }
+        for (size_t k = 2; k < face.size(); ++k)
+        {
+            Triangle triangle(position(face[0]), position(face[k - 1]), position(face[k]));
+            out.write(reinterpret_cast<const char*>(&triangle), sizeof(Triangle));
+            ++m_cellCounts[cell_of(triangle)];
+            ++m_triangleCount;
+        }
+    }
+    if (!out)
+    {
+        m_error = "can't write " + triangles_path;
+        return false;
+    }
+    if (m_triangleCount == 0)
+    {
+        m_error = "no triangles in " + obj_path;
+        return false;
+    }
+    return true;
+}
+
+uint32_t ChunkedMeshBuilder::cell_of(const Triangle& triangle) const
+{
+    // quantize in a cube around the mesh, like the LBVH builder does
+    Vector3D e = m_vertexBounds.extent();
+    float size = fmaxf(e.m_x, fmaxf(e.m_y, e.m_z));
+    float cells = static_cast<float>((1u << m_gridBits) - 1);
+    float s = size > 0 ? cells / size : 0;
+    Vector3D c = triangle.centroid() - m_vertexBounds.m_min;
+    uint64_t x = static_cast<uint64_t>(clamp(c.m_x * s, 0, cells));
+    uint64_t y = static_cast<uint64_t>(clamp(c.m_y * s, 0, cells));
+    uint64_t z = static_cast<uint64_t>(clamp(c.m_z * s, 0, cells));
+    return static_cast<uint32_t>((expand_bits_3d(x, m_gridBits) << 2) | (expand_bits_3d(y, m_gridBits) << 1) |
+                                 expand_bits_3d(z, m_gridBits));
+}
+
+bool ChunkedMeshBuilder::sort_triangles(const std::string& triangles_path, const std::string& sorted_path)
+{
+    size_t bytes = static_cast<size_t>(m_triangleCount) * sizeof(Triangle);
+    MappedFile unsorted;
+    MappedFile sorted;
+    if (!unsorted.map(triangles_path, 0, bytes) || !create_file(sorted_path, bytes) || !sorted.map(sorted_path, 0, bytes, true))
+    {
+        m_error = "can't map the scratch files next to the mesh file";
+        return false;
+    }
+
+    // first triangle of every cell in the sorted order
+    std::vector<uint64_t> next(m_cellCounts.size());
+    uint64_t sum = 0;
+    for (size_t cell = 0; cell < m_cellCounts.size(); ++cell)
+    {
+        next[cell] = sum;
+        sum += m_cellCounts[cell];
+    }
+    const Triangle* src = reinterpret_cast<const Triangle*>(unsorted.data());
+    Triangle* dst = reinterpret_cast<Triangle*>(sorted.data());
+    for (long long i = 0; i < m_triangleCount; ++i)
+        dst[next[cell_of(src[i])]++] = src[i];
+    return true;
+}
+
+bool ChunkedMeshBuilder::write_chunks(const std::string& sorted_path, const std::string& out_path)
+{
+    MappedFile sorted;
+    if (!sorted.map(sorted_path, 0, static_cast<size_t>(m_triangleCount) * sizeof(Triangle)))
+    {
+        m_error = "can't map " + sorted_path;
+        return false;
+    }
+    const Triangle* triangles = reinterpret_cast<const Triangle*>(sorted.data());
+
+    // cut the Morton order into runs of whole cells
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    for (uint64_t count : m_cellCounts)
+    {
+        end += count;
+        if (end - start >= static_cast<uint64_t>(m_chunkTriangles))
+        {
+            ranges.push_back(std::make_pair(start, end));
+            start = end;
+        }
+    }
+    if (end > start)
+        ranges.push_back(std::make_pair(start, end));
+    m_chunkCount = static_cast<int>(ranges.size());
+
+    std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+    ChunkFileHeader header;
+    std::memcpy(header.m_magic, chunk_file_magic, sizeof(header.m_magic));
+    header.m_version = chunk_file_version;
+    header.m_chunkCount = static_cast<uint32_t>(ranges.size());
+    header.m_triangleCount = static_cast<uint64_t>(m_triangleCount);
+    AABB mesh_bounds;
+    std::vector<ChunkRecord> records(ranges.size());
+    // the table is written last, once the chunks' offsets are known
+    uint64_t offset = sizeof(ChunkFileHeader) + records.size() * sizeof(ChunkRecord);
+
+    std::vector<Triangle> chunk;
+    std::vector<AABB> items;
+    std::vector<ChunkNode> nodes;
+    std::vector<int> order;
+    for (size_t c = 0; c < ranges.size(); ++c)
+    {
+        chunk.assign(triangles + ranges[c].first, triangles + ranges[c].second);
+        items.resize(chunk.size());
+        for (size_t i = 0; i < chunk.size(); ++i)
+            items[i] = chunk[i].bounds();
+        build_chunk_bvh(items, 4, nodes, order);
+
+        uint64_t aligned = (offset + chunk_alignment - 1) / chunk_alignment * chunk_alignment;
+        out.seekp(static_cast<std::streamoff>(aligned));
+        out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(ChunkNode));
+        for (int i : order)
+            out.write(reinterpret_cast<const char*>(&chunk[i]), sizeof(Triangle));
+
+        ChunkRecord& record = records[c];
+        AABB bounds = nodes[0].bounds();
+        mesh_bounds.grow(bounds);
+        record.m_min[0] = bounds.m_min.m_x; record.m_min[1] = bounds.m_min.m_y; record.m_min[2] = bounds.m_min.m_z;
+        record.m_max[0] = bounds.m_max.m_x; record.m_max[1] = bounds.m_max.m_y; record.m_max[2] = bounds.m_max.m_z;
+        record.m_offset = aligned;
+        record.m_nodeCount = static_cast<uint32_t>(nodes.size());
+        record.m_triangleCount = static_cast<uint32_t>(chunk.size());
+        record.m_bytes = nodes.size() * sizeof(ChunkNode) + chunk.size() * sizeof(Triangle);
+        offset = aligned + record.m_bytes;
+    }
+
+    header.m_min[0] = mesh_bounds.m_min.m_x; header.m_min[1] = mesh_bounds.m_min.m_y; header.m_min[2] = mesh_bounds.m_min.m_z;
+    header.m_max[0] = mesh_bounds.m_max.m_x; header.m_max[1] = mesh_bounds.m_max.m_y; header.m_max[2] = mesh_bounds.m_max.m_z;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ChunkRecord));
+    if (!out)
+    {
+        m_error = "can't write " + out_path;
+        return false;
+    }
+    m_fileBytes = offset;
+    return true;
+}
+
+// the chunks of one mesh file that are in memory: at most m_budget bytes of
+// them, unless every resident chunk is pinned by a traversal. A chunk is
+// paged in whole the first time a traversal asks for it, and the least
+// recently used unpinned chunks are dropped to make room.
+class ChunkCache
+{
+public:
+    ChunkCache(const std::string& path, const std::vector<ChunkRecord>& chunks, uint64_t budget);
+
+    // the chunk's nodes followed by its triangles, pinned until release(); nullptr if it can't be read
+    const char* acquire(int chunk);
+    void release(int chunk);
+    bool resident(int chunk);
+
+    uint64_t m_budget;
+    // counters, only read them while no traversal runs
+    long long m_pageIns;
+    long long m_hits;
+    uint64_t m_bytesRead;
+    uint64_t m_residentBytes;
+    uint64_t m_peakBytes;
+
+private:
+    class Entry
+    {
+    public:
+        Entry()
+        {
+            m_pins = 0;
+            m_loading = false;
+            m_lastUse = 0;
+        }
+        std::unique_ptr<MappedFile> m_file;
+        int m_pins;
+        bool m_loading;
+        long long m_lastUse;
+    };
+
+    // evict until bytes more fit in the budget, or nothing unpinned is left
+    void make_room(uint64_t bytes);
+
+    std::string m_path;
+    std::vector<ChunkRecord> m_chunks;
+    std::vector<Entry> m_entries;
+    std::vector<int> m_resident;
+    long long m_clock;
+    std::mutex m_mutex;
+    std::condition_variable m_loaded;
+};
+
+ChunkCache::ChunkCache(const std::string& path, const std::vector<ChunkRecord>& chunks, uint64_t budget)
+    : m_path(path), m_chunks(chunks), m_entries(chunks.size())
+{
+    m_budget = budget;
+    m_pageIns = 0;
+    m_hits = 0;
+    m_bytesRead = 0;
+    m_residentBytes = 0;
+    m_peakBytes = 0;
+    m_clock = 0;
+}
+
+const char* ChunkCache::acquire(int chunk)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Entry& entry = m_entries[chunk];
+    // another thread may be paging the same chunk in
+    while (entry.m_loading)
+        m_loaded.wait(lock);
+    if (entry.m_file)
+    {
+        ++entry.m_pins;
+        entry.m_lastUse = ++m_clock;
+        ++m_hits;
+        return entry.m_file->data();
+    }
+
+    uint64_t bytes = m_chunks[chunk].m_bytes;
+    make_room(bytes);
+    m_residentBytes += bytes;
+    entry.m_loading = true;
+    lock.unlock();
+
+    // the read happens outside the lock, so traversals of resident chunks go on meanwhile
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    bool ok = file->map(m_path, m_chunks[chunk].m_offset, static_cast<size_t>(bytes), false, true);
+
+    lock.lock();
+    entry.m_loading = false;
+    m_loaded.notify_all();
+    if (!ok)
+    {
+        m_residentBytes -= bytes;
+        return nullptr;
+    }
+    entry.m_file = std::move(file);
+    ++entry.m_pins;
+    entry.m_lastUse = ++m_clock;
+    m_resident.push_back(chunk);
+    ++m_pageIns;
+    m_bytesRead += bytes;
+    m_peakBytes = std::max(m_peakBytes, m_residentBytes);
+    return entry.m_file->data();
+}
+
+void ChunkCache::release(int chunk)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    --m_entries[chunk].m_pins;
+}
+
+bool ChunkCache::resident(int chunk)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries[chunk].m_file != nullptr;
+}
+
+void ChunkCache::make_room(uint64_t bytes)
+{
+    while (m_residentBytes + bytes > m_budget)
+    {
+        int victim = -1;
+        for (size_t k = 0; k < m_resident.size(); ++k)
+        {
+            const Entry& entry = m_entries[m_resident[k]];
+            if (entry.m_pins == 0 && (victim < 0 || entry.m_lastUse < m_entries[m_resident[victim]].m_lastUse))
+                victim = static_cast<int>(k);
+        }
+        if (victim < 0)
+            return;
+        int chunk = m_resident[victim];
+        m_resident[victim] = m_resident.back();
+        m_resident.pop_back();
+        m_entries[chunk].m_file.reset();
+        m_residentBytes -= m_chunks[chunk].m_bytes;
+    }
+}
+
+// a mesh file opened for rendering. Single rays (hit, occludes) visit the
+// chunks they cross front to back and page each in as they get to it;
+// hit_batch defers a whole batch of rays into per-chunk queues and works
+// through one chunk at a time, so every chunk the batch needs is paged in
+// about once per batch rather than once per ray.
+class ChunkedMesh
+{
+public:
+    ChunkedMesh()
+    {
+        m_material = -1;
+        m_triangleCount = 0;
+    }
+
+    // a file ChunkedMeshBuilder wrote, keeping at most cache_bytes of it in memory
+    bool open(const std::string& path, uint64_t cache_bytes, int material);
+
+    HitResult hit(Ray& ray, float min_t, float max_t);
+    bool occludes(Ray& ray, float min_t, float max_t);
+    // narrow hits[i] down to the closest hit of rays[i] for every i in live,
+    // hits[i].m_t is that ray's current max_t
+    void hit_batch(std::vector<Ray>& rays, const std::vector<int>& live, float min_t, std::vector<HitResult>& hits);
+
+    AABB bounds() const
+    {
+        return m_bounds;
+    }
+    int chunk_count() const
+    {
+        return static_cast<int>(m_chunks.size());
+    }
+    ChunkCache& cache()
+    {
+        return *m_cache;
+    }
+
+    // index into World::m_materials
+    int m_material;
+    long long m_triangleCount;
+
+private:
+    // append the chunks whose bounds the ray enters between min_t and max_t, nearest first
+    void chunks_along(Ray& ray, const Vector3D& inv_dir, float min_t, float max_t, std::vector<std::pair<float, int>>& visits);
+    void hit_chunk(const char* data, int chunk, Ray& ray, const Vector3D& inv_dir, float min_t, HitResult& hit_result);
+    bool occludes_chunk(const char* data, int chunk, Ray& ray, const Vector3D& inv_dir, float min_t, float max_t);
+
+    std::vector<ChunkRecord> m_chunks;
+    // BVH over the chunks' bounds
+    std::vector<ChunkNode> m_topNodes;
+    std::vector<int> m_topOrder;
+    AABB m_bounds;
+    std::unique_ptr<ChunkCache> m_cache;
+};
+
+bool ChunkedMesh::open(const std::string& path, uint64_t cache_bytes, int material)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+    uint64_t file_size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    ChunkFileHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.m_magic, chunk_file_magic, sizeof(header.m_magic)) != 0 || header.m_version != chunk_file_version)
+        return false;
+    std::vector<ChunkRecord> chunks(header.m_chunkCount);
+    if (!in.read(reinterpret_cast<char*>(chunks.data()), chunks.size() * sizeof(ChunkRecord)))
+        return false;
+    for (const ChunkRecord& chunk : chunks)
+        if (chunk.m_offset + chunk.m_bytes > file_size ||
+            chunk.m_bytes != chunk.m_nodeCount * sizeof(ChunkNode) + chunk.m_triangleCount * sizeof(Triangle))
+            return false;
+
+    m_chunks = chunks;
+    m_triangleCount = static_cast<long long>(header.m_triangleCount);
+    m_bounds = AABB(Vector3D(header.m_min[0], header.m_min[1], header.m_min[2]),
+                    Vector3D(header.m_max[0], header.m_max[1], header.m_max[2]));
+    m_material = material;
+    std::vector<AABB> items(m_chunks.size());
+    for (size_t c = 0; c < m_chunks.size(); ++c)
+        items[c] = m_chunks[c].bounds();
+    build_chunk_bvh(items, 1, m_topNodes, m_topOrder);
+    m_cache.reset(new ChunkCache(path, m_chunks, cache_bytes));
+    return true;
+}
+
+void ChunkedMesh::chunks_along(Ray& ray, const Vector3D& inv_dir, float min_t, float max_t, std::vector<std::pair<float, int>>& visits)
+{
+    if (m_topNodes.empty())
+        return;
+    size_t first = visits.size();
+    Vector3D origin = ray.origin();
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const ChunkNode& n = m_topNodes[stack[--top]];
+        float t_enter;
+        if (!n.bounds().hit(origin, inv_dir, min_t, max_t, t_enter))
+            continue;
+        if (n.is_leaf())
+        {
+            for (int i = n.m_index; i < n.m_index + n.m_count; ++i)
+            {
+                int chunk = m_topOrder[i];
+                if (m_chunks[chunk].bounds().hit(origin, inv_dir, min_t, max_t, t_enter))
+                    visits.push_back(std::make_pair(t_enter, chunk));
+            }
+            continue;
+        }
+        stack[top++] = n.m_index;
+        stack[top++] = static_cast<int>(&n - m_topNodes.data()) + 1;
+    }
+    std::sort(visits.begin() + first, visits.end());
+}
+
+void ChunkedMesh::hit_chunk(const char* data, int chunk, Ray& ray, const Vector3D& inv_dir, float min_t, HitResult& hit_result)
+{
+    const ChunkNode* nodes = reinterpret_cast<const ChunkNode*>(data);
+    const Triangle* triangles = reinterpret_cast<const Triangle*>(data + m_chunks[chunk].m_nodeCount * sizeof(ChunkNode));
+    Vector3D origin = ray.origin();
+
+    const Triangle* best = nullptr;
+    float best_t = hit_result.m_t;
+    float best_u = 0;
+    float best_v = 0;
+    int stack[64];
+    int top = 0;
+    float t_enter;
+    if (!nodes[0].bounds().hit(origin, inv_dir, min_t, best_t, t_enter))
+        return;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int node = stack[--top];
+        const ChunkNode& n = nodes[node];
+        COUNT_NODE_VISIT();
+        if (n.is_leaf())
+        {
+            COUNT_PRIMITIVE_TESTS(n.m_count);
+            for (int i = n.m_index; i < n.m_index + n.m_count; ++i)
+            {
+                float t, u, v;
+                if (triangles[i].intersect(ray, min_t, best_t, t, u, v))
+                {
+                    best = &triangles[i];
+                    best_t = t;
+                    best_u = u;
+                    best_v = v;
+                }
+            }
+            continue;
+        }
+        // nearer child on top of the stack
+        float t_left, t_right;
+        bool left = nodes[node + 1].bounds().hit(origin, inv_dir, min_t, best_t, t_left);
+        bool right = nodes[n.m_index].bounds().hit(origin, inv_dir, min_t, best_t, t_right);
+        if (left && right)
+        {
+            bool left_first = t_left <= t_right;
+            stack[top++] = left_first ? n.m_index : node + 1;
+            stack[top++] = left_first ? node + 1 : n.m_index;
+        }
+        else if (left)
+            stack[top++] = node + 1;
+        else if (right)
+            stack[top++] = n.m_index;
+    }
+    // the hit is filled in while the chunk is still pinned
+    if (best)
+        hit_result = best->hit_at(ray, best_t, best_u, best_v, m_material);
+}
+
+bool ChunkedMesh::occludes_chunk(const char* data, int chunk, Ray& ray, const Vector3D& inv_dir, float min_t, float max_t)
+{
+    const ChunkNode* nodes = reinterpret_cast<const ChunkNode*>(data);
+    const Triangle* triangles = reinterpret_cast<const Triangle*>(data + m_chunks[chunk].m_nodeCount * sizeof(ChunkNode));
+    Vector3D origin = ray.origin();
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int node = stack[--top];
+        const ChunkNode& n = nodes[node];
+        float t_enter;
+        COUNT_NODE_VISIT();
+        if (!n.bounds().hit(origin, inv_dir, min_t, max_t, t_enter))
+            continue;
+        if (n.is_leaf())
+        {
+            COUNT_PRIMITIVE_TESTS(n.m_count);
+            for (int i = n.m_index; i < n.m_index + n.m_count; ++i)
+            {
+                float t, u, v;
+                if (triangles[i].intersect(ray, min_t, max_t, t, u, v))
+                    return true;
+            }
+            continue;
+        }
+        stack[top++] = n.m_index;
+        stack[top++] = node + 1;
+    }
+    return false;
+}
+
+HitResult ChunkedMesh::hit(Ray& ray, float min_t, float max_t)
+{
+    HitResult hit_result;
+    hit_result.m_t = max_t;
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+
+    static thread_local std::vector<std::pair<float, int>> visits;
+    visits.clear();
+    chunks_along(ray, inv_dir, min_t, max_t, visits);
+    for (const auto& visit : visits)
+    {
+        // sorted by entry distance, nothing further can beat the hit found
+        if (visit.first >= hit_result.m_t)
+            break;
+        const char* data = m_cache->acquire(visit.second);
+        if (!data)
+            continue;
+        hit_chunk(data, visit.second, ray, inv_dir, min_t, hit_result);
+        m_cache->release(visit.second);
+    }
+    return hit_result;
+}
+
+bool ChunkedMesh::occludes(Ray& ray, float min_t, float max_t)
+{
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+    static thread_local std::vector<std::pair<float, int>> visits;
+    visits.clear();
+    chunks_along(ray, inv_dir, min_t, max_t, visits);
+    for (const auto& visit : visits)
+    {
+        const char* data = m_cache->acquire(visit.second);
+        if (!data)
+            continue;
+        bool blocked = occludes_chunk(data, visit.second, ray, inv_dir, min_t, max_t);
+        m_cache->release(visit.second);
+        if (blocked)
+            return true;
+    }
+    return false;
+}
+
+void ChunkedMesh::hit_batch(std::vector<Ray>& rays, const std::vector<int>& live, float min_t, std::vector<HitResult>& hits)
+{
+    // every ray's chunks front to back, the rays' lists one after the other
+    std::vector<std::pair<float, int>> visits;
+    std::vector<size_t> next(live.size());
+    std::vector<size_t> end(live.size());
+    std::vector<Vector3D> inv_dirs(live.size());
+    // rays (as positions in live) waiting at each chunk, and the chunks that have any
+    std::vector<std::vector<int>> queues(m_chunks.size());
+    std::vector<int> waiting;
+    auto enqueue = [&](int k) {
+        int chunk = visits[next[k]].second;
+        if (queues[chunk].empty())
+            waiting.push_back(chunk);
+        queues[chunk].push_back(k);
+    };
+
+    for (size_t k = 0; k < live.size(); ++k)
+    {
+        Ray& ray = rays[live[k]];
+        Vector3D dir = ray.direction();
+        inv_dirs[k] = Vector3D(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+        next[k] = visits.size();
+        chunks_along(ray, inv_dirs[k], min_t, hits[live[k]].m_t, visits);
+        end[k] = visits.size();
+        if (next[k] < end[k])
+            enqueue(static_cast<int>(k));
+    }
+
+    std::vector<int> batch;
+    while (!waiting.empty())
+    {
+        // chunks already in memory first, so rays waiting on them don't cause
+        // evictions; among equals the longest queue, it amortizes a page-in best
+        int pick = 0;
+        bool pick_resident = m_cache->resident(waiting[0]);
+        for (size_t w = 1; w < waiting.size(); ++w)
+        {
+            bool resident = m_cache->resident(waiting[w]);
+            if ((resident && !pick_resident) ||
+                (resident == pick_resident && queues[waiting[w]].size() > queues[waiting[pick]].size()))
+            {
+                pick = static_cast<int>(w);
+                pick_resident = resident;
+            }
+        }
+        int chunk = waiting[pick];
+        waiting[pick] = waiting.back();
+        waiting.pop_back();
+        batch.swap(queues[chunk]);
+        queues[chunk].clear();
+
+        const char* data = m_cache->acquire(chunk);
+        for (int k : batch)
+        {
+            HitResult& hit_result = hits[live[k]];
+            if (data && visits[next[k]].first < hit_result.m_t)
+                hit_chunk(data, chunk, rays[live[k]], inv_dirs[k], min_t, hit_result);
+            // on to the ray's next chunk, unless it starts behind the closest hit
+            ++next[k];
+            if (next[k] < end[k] && visits[next[k]].first < hit_result.m_t)
+                enqueue(k);
+        }
+        if (data)
+            m_cache->release(chunk);
+    }
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include "Ray.h"
+#include "HitResult.h"
+#include "AABB.h"
+
+using namespace std;
+
+// flat two-sided disk, i.e. a plane clipped to a radius around its center;
+// hits from behind get the normal flipped to face the ray
+class Disk {
+
+public:
+    Disk() {}
+    Disk(Vector3D center, Vector3D normal, float r, int material)
+    {
+        m_center = center;
+        m_normal = normalize(normal);
+        m_radius = r;
+        m_material = material;
+    }
+    HitResult hit(Ray& r, float min_t, float max_t);
+    bool occludes(Ray& r, float min_t, float max_t)
+    {
+        return hit(r, min_t, max_t).m_isHit;
+    }
+    // loose: the box around the disk's whole sphere
+    AABB bounds() const
+    {
+        Vector3D r(m_radius, m_radius, m_radius);
+        return AABB(m_center - r, m_center + r);
+    }
+
+public:
+    Vector3D m_center;
+    Vector3D m_normal;
+    float m_radius;
+    // index into World::m_materials
+    int m_material;
+};
+
+//test if ray hits this disk within range min_t and max_t
+HitResult Disk::hit(Ray& ray, float min_t, float max_t)
+{
+    HitResult hit_result;
+
+    float denom = dot(m_normal, ray.direction());
+    if (denom == 0.0f)
+        return hit_result;
+
+    float t = dot(m_normal, m_center - ray.origin()) / denom;
+    if (t <= min_t || t >= max_t)
+        return hit_result;
+
+    // hit point on the plane must also lie within the radius
+    Vector3D p = ray.at(t);
+    if ((p - m_center).length_squared() > m_radius * m_radius)
+        return hit_result;
+
+    hit_result.m_isHit = true;
+    hit_result.m_t = t;
+    hit_result.m_hitPos = p;
+    hit_result.m_hitNormal = denom > 0 ? -1 * m_normal : m_normal;
+    hit_result.m_hitMaterial = m_material;
+
+    return hit_result;
+}
+
+#endif
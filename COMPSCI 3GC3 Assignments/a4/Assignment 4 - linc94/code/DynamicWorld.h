@@ -0,0 +1,110 @@
+#ifndef DYNAMICWORLD_H
+#define DYNAMICWORLD_H
+
+#include <chrono>
+
+#include "World.h"
+
+// what one DynamicWorld::update() did
+class UpdateStats
+{
+public:
+    UpdateStats()
+    {
+        m_movedSpheres = 0;
+        m_partialRebuilds = 0;
+        m_fullRebuild = false;
+        m_costRatio = 1;
+        m_seconds = 0;
+    }
+    int m_movedSpheres;
+    // subtrees rebuilt in place
+    int m_partialRebuilds;
+    bool m_fullRebuild;
+    // SAH cost of the tree after the update relative to the last full build
+    float m_costRatio;
+    double m_seconds;
+};
+
+// animation path over a World whose spheres move between frames. Each update
+// refits the BVH bottom-up, and only when its SAH cost has grown past
+// m_rebuildThreshold times the cost of the last full build are the degraded
+// subtrees rebuilt, falling back to a full rebuild if that is not enough.
+class DynamicWorld
+{
+public:
+    DynamicWorld(World& world, float rebuild_threshold = 1.3f)
+        : m_world(world)
+    {
+        m_rebuildThreshold = rebuild_threshold;
+        m_moved = 0;
+        full_rebuild();
+    }
+
+    void move_sphere(int index, const Vector3D& center)
+    {
+        m_world.m_spheres[index].m_center = center;
+        ++m_moved;
+    }
+    void resize_sphere(int index, float radius)
+    {
+        m_world.m_spheres[index].m_radius = radius;
+        ++m_moved;
+    }
+
+    // bring the BVH up to date with everything moved since the last update
+    UpdateStats update();
+
+    World& m_world;
+    float m_rebuildThreshold;
+
+private:
+    void full_rebuild()
+    {
+        m_world.build_bvh();
+        m_builtCost = m_world.m_bvh.sah_cost();
+    }
+
+    int m_moved;
+    float m_builtCost;
+};
+
+UpdateStats DynamicWorld::update()
+{
+    auto start = std::chrono::steady_clock::now();
+    UpdateStats stats;
+    stats.m_movedSpheres = m_moved;
+    m_moved = 0;
+
+    BVH& bvh = m_world.m_bvh;
+    // only the binary BVH can be refit, animated worlds always use it
+    m_world.m_accelerator = Accelerator::BVH;
+    if (!bvh.built() || bvh.m_indices.size() != m_world.m_spheres.size())
+    {
+        // spheres were added or removed, the topology is useless
+        full_rebuild();
+        stats.m_fullRebuild = true;
+    }
+    else
+    {
+        bvh.refit(m_world.m_spheres);
+        float cost = bvh.sah_cost();
+        if (cost > m_rebuildThreshold * m_builtCost)
+        {
+            stats.m_partialRebuilds = bvh.rebuild_degraded(m_world.m_spheres, m_rebuildThreshold);
+            cost = bvh.sah_cost();
+            if (cost > m_rebuildThreshold * m_builtCost)
+            {
+                // degradation is spread thin over the whole tree
+                full_rebuild();
+                stats.m_fullRebuild = true;
+            }
+        }
+    }
+
+    stats.m_costRatio = m_builtCost > 0 ? bvh.sah_cost() / m_builtCost : 1;
+    stats.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+#endif
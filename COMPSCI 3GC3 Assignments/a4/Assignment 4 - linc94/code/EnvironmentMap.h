@@ -0,0 +1,183 @@
+#ifndef ENVIRONMENTMAP_H
+#define ENVIRONMENTMAP_H
+
+#include <string>
+#include <vector>
+
+#include "Image.h"
+#include "Vector3D.h"
+
+// equirectangular HDR image lighting the scene from infinitely far away. Row 0
+// is straight up (+y), columns wrap around the y axis starting at +x.
+// Directions are importance sampled from an alias table over the pixels,
+// weighted by luminance and by the solid angle each row covers.
+class EnvironmentMap
+{
+public:
+    EnvironmentMap()
+    {
+        m_width = 0;
+        m_height = 0;
+        m_intensity = 1;
+        m_importanceSample = true;
+    }
+
+    // loads a .hdr (or any image stb_image reads) and builds the sampling table
+    bool load(const std::string& path);
+    // takes width * height pixels in row-major order, top row first
+    void build(int width, int height, const std::vector<Vector3D>& pixels);
+    bool loaded() const
+    {
+        return m_width > 0;
+    }
+
+    // radiance arriving from direction dir (unit length)
+    Vector3D radiance(const Vector3D& dir) const
+    {
+        return m_intensity * m_pixels[pixel_index(dir)];
+    }
+    // unit direction drawn proportionally to radiance, with its solid angle pdf
+    Vector3D sample(float& pdf) const;
+    // solid angle pdf of sample() producing dir
+    float pdf(const Vector3D& dir) const;
+
+    int m_width;
+    int m_height;
+    float m_intensity;
+    // false: only lit through directions diffuse bounces happen to pick
+    bool m_importanceSample;
+
+private:
+    int pixel_index(const Vector3D& dir) const;
+    // pixel probability to solid angle density at polar angle theta
+    float solid_angle_pdf(int index, float theta) const
+    {
+        float sin_theta = sinf(theta);
+        if (sin_theta <= 0)
+            return 0;
+        return m_pixelPdf[index] * m_width * m_height / (2 * M_PI * M_PI * sin_theta);
+    }
+
+    std::vector<Vector3D> m_pixels;
+    // alias table (Vose): pick a pixel uniformly, keep it with m_keep or take its alias
+    std::vector<float> m_keep;
+    std::vector<int> m_alias;
+    std::vector<float> m_pixelPdf;
+};
+
+bool EnvironmentMap::load(const std::string& path)
+{
+    int width, height, channels;
+    float* data = stbi_loadf(path.c_str(), &width, &height, &channels, 3);
+    if (!data)
+        return false;
+
+    std::vector<Vector3D> pixels(width * height);
+    for (int i = 0; i < width * height; ++i)
+        pixels[i] = Vector3D(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+    stbi_image_free(data);
+
+    build(width, height, pixels);
+    return true;
+}
+
+void EnvironmentMap::build(int width, int height, const std::vector<Vector3D>& pixels)
+{
+    m_width = width;
+    m_height = height;
+    m_pixels = pixels;
+    int count = width * height;
+
+    // pixel weight: luminance times sin(theta), rows near the poles cover less of the sphere
+    std::vector<double> weights(count);
+    double total = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        float sin_theta = sinf((y + 0.5f) / height * M_PI);
+        for (int x = 0; x < width; ++x)
+        {
+            const Vector3D& p = pixels[y * width + x];
+            double w = (0.2126 * p.m_x + 0.7152 * p.m_y + 0.0722 * p.m_z) * sin_theta;
+            weights[y * width + x] = w > 0 ? w : 0;
+            total += weights[y * width + x];
+        }
+    }
+    // a black map still gets a valid (uniform) table
+    if (total <= 0)
+    {
+        weights.assign(count, 1.0);
+        total = count;
+    }
+
+    m_pixelPdf.resize(count);
+    m_keep.resize(count);
+    m_alias.resize(count);
+    std::vector<double> scaled(count);
+    std::vector<int> small, large;
+    for (int i = 0; i < count; ++i)
+    {
+        m_pixelPdf[i] = static_cast<float>(weights[i] / total);
+        scaled[i] = weights[i] / total * count;
+        m_alias[i] = i;
+        if (scaled[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        m_keep[s] = static_cast<float>(scaled[s]);
+        m_alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // leftovers are 1 up to rounding
+    for (int i : small)
+        m_keep[i] = 1;
+    for (int i : large)
+        m_keep[i] = 1;
+}
+
+int EnvironmentMap::pixel_index(const Vector3D& dir) const
+{
+    float u = atan2f(dir.m_z, dir.m_x) / (2 * M_PI);
+    if (u < 0)
+        u += 1;
+    float v = acosf(clamp(dir.m_y, -1, 1)) / M_PI;
+    int x = static_cast<int>(u * m_width);
+    int y = static_cast<int>(v * m_height);
+    x = x < m_width ? x : m_width - 1;
+    y = y < m_height ? y : m_height - 1;
+    return y * m_width + x;
+}
+
+Vector3D EnvironmentMap::sample(float& pdf) const
+{
+    int count = m_width * m_height;
+    int index = static_cast<int>(random_float() * count);
+    if (index >= count)
+        index = count - 1;
+    if (random_float() >= m_keep[index])
+        index = m_alias[index];
+
+    // uniform in (phi, theta) inside the chosen pixel
+    float phi = (index % m_width + random_float()) / m_width * 2 * M_PI;
+    float theta = (index / m_width + random_float()) / m_height * M_PI;
+    pdf = solid_angle_pdf(index, theta);
+    float sin_theta = sinf(theta);
+    return Vector3D(sin_theta * cosf(phi), cosf(theta), sin_theta * sinf(phi));
+}
+
+float EnvironmentMap::pdf(const Vector3D& dir) const
+{
+    return solid_angle_pdf(pixel_index(dir), acosf(clamp(dir.m_y, -1, 1)));
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <limits>
+#include <vector>
+
+#include "Camera.h"
+#include "Parallel.h"
+#include "World.h"
+
+// which primitive array a G-buffer texel's surface comes from
+enum class PrimitiveKind
+{
+    None = 0,
+    Sphere,
+    Plane,
+    Box,
+    Disk
+};
+
+// what the camera sees first, one layer per subpixel offset ("pass"), in the
+// layout the hybrid viewer's shaders write and glReadPixels returns: three
+// rgba float planes of width * height texels, row 0 at the bottom,
+//   m_positions: hit position, index of the primitive in its array
+//   m_normals:   surface normal, material index
+//   m_albedos:   material color (the tint for textured ones), PrimitiveKind
+// A sample of pass k through pixel (i, j) goes through (i + jitter_x(k),
+// j + jitter_y(k)), the way the tracer's random jitter would.
+class GBuffer
+{
+public:
+    GBuffer()
+    {
+        m_width = 0;
+        m_height = 0;
+        m_passCount = 0;
+    }
+
+    void resize(int width, int height, int pass_count);
+    int width() const
+    {
+        return m_width;
+    }
+    int height() const
+    {
+        return m_height;
+    }
+    int pass_count() const
+    {
+        return m_passCount;
+    }
+    // subpixel offsets of a pass, the first points of the (2, 3) Halton sequence
+    float jitter_x(int pass) const
+    {
+        return m_jitter[2 * pass];
+    }
+    float jitter_y(int pass) const
+    {
+        return m_jitter[2 * pass + 1];
+    }
+    // first float of a texel in each plane
+    size_t texel(int pass, int i, int j) const
+    {
+        return 4 * ((size_t(pass) * m_height + j) * m_width + i);
+    }
+    PrimitiveKind kind(int pass, int i, int j) const
+    {
+        return PrimitiveKind(int(m_albedos[texel(pass, i, j) + 3]));
+    }
+
+    // the camera hit of r, the ray of pass through pixel (i, j). The texel
+    // names the primitive, which is intersected on its own: no traversal, and
+    // the same hit world.hit() would return. Where the rasterizer saw the
+    // primitive but the cpu misses it by a rounding at its silhouette, the
+    // texel's position and normal stand in.
+    HitResult hit(int pass, int i, int j, Ray& r, World& world) const;
+    // texels (over all passes) whose primitive differs from other's
+    int differences(const GBuffer& other) const;
+
+    std::vector<float> m_positions;
+    std::vector<float> m_normals;
+    std::vector<float> m_albedos;
+
+private:
+    int m_width;
+    int m_height;
+    int m_passCount;
+    std::vector<float> m_jitter;
+};
+
+// whether every primitive of world can be in a G-buffer: lattices and meshes
+// can't be rasterized
+bool gbuffer_supports(World& world)
+{
+    return world.m_lattices.empty() && world.m_meshes.empty();
+}
+
+float radical_inverse(int index, int base)
+{
+    float inverse = 1.0f / base;
+    float digit = inverse;
+    float result = 0;
+    for (; index > 0; index /= base, digit *= inverse)
+        result += (index % base) * digit;
+    return result;
+}
+
+void GBuffer::resize(int width, int height, int pass_count)
+{
+    m_width = width;
+    m_height = height;
+    m_passCount = pass_count;
+    size_t floats = 4 * size_t(width) * height * pass_count;
+    m_positions.assign(floats, 0.0f);
+    m_normals.assign(floats, 0.0f);
+    m_albedos.assign(floats, 0.0f);
+    m_jitter.resize(2 * pass_count);
+    for (int k = 0; k < pass_count; ++k)
+    {
+        m_jitter[2 * k] = radical_inverse(k + 1, 2);
+        m_jitter[2 * k + 1] = radical_inverse(k + 1, 3);
+    }
+}
+
+HitResult GBuffer::hit(int pass, int i, int j, Ray& r, World& world) const
+{
+    size_t t = texel(pass, i, j);
+    int index = int(m_positions[t + 3]);
+    float max_t = std::numeric_limits<float>::infinity();
+    HitResult hit;
+    switch (PrimitiveKind(int(m_albedos[t + 3])))
+    {
+    case PrimitiveKind::None:
+        return hit;
+    case PrimitiveKind::Sphere:
+        hit = world.m_spheres[index].hit(r, 0.001f, max_t);
+        hit.m_sphere = index;
+        break;
+    case PrimitiveKind::Plane:
+        hit = world.m_planes[index].hit(r, 0.001f, max_t);
+        break;
+    case PrimitiveKind::Box:
+        hit = world.m_boxes[index].hit(r, 0.001f, max_t);
+        break;
+    case PrimitiveKind::Disk:
+        hit = world.m_disks[index].hit(r, 0.001f, max_t);
+        break;
+    }
+    if (!hit.m_isHit)
+    {
+        Vector3D position(m_positions[t], m_positions[t + 1], m_positions[t + 2]);
+        hit.m_isHit = true;
+        hit.m_hitPos = position;
+        hit.m_hitNormal = normalize(Vector3D(m_normals[t], m_normals[t + 1], m_normals[t + 2]));
+        hit.m_hitMaterial = int(m_normals[t + 3]);
+        hit.m_t = dot(position - r.origin(), r.direction()) / r.direction().length_squared();
+    }
+    return hit;
+}
+
+int GBuffer::differences(const GBuffer& other) const
+{
+    int count = 0;
+    for (size_t t = 0; t < m_albedos.size() && t < other.m_albedos.size(); t += 4)
+        if (m_albedos[t + 3] != other.m_albedos[t + 3] || m_positions[t + 3] != other.m_positions[t + 3])
+            ++count;
+    return count;
+}
+
+// fills gbuffer (already resized) by tracing its rays on the cpu, the
+// reference a rasterized one is checked against
+void trace_gbuffer(World& world, Camera& camera, GBuffer& gbuffer, int thread_count = 0)
+{
+    int width = gbuffer.width();
+    int height = gbuffer.height();
+    parallel_for(gbuffer.pass_count() * height, thread_count, [&](int line) {
+        int pass = line / height;
+        int j = line % height;
+        for (int i = 0; i < width; ++i)
+        {
+            Ray r = camera.generate_ray((i + gbuffer.jitter_x(pass)) / (width - 1), (j + gbuffer.jitter_y(pass)) / (height - 1));
+            // world.hit_in_memory()'s order, remembering which array the closest hit is in
+            HitResult hit;
+            hit.m_t = std::numeric_limits<float>::infinity();
+            PrimitiveKind kind = PrimitiveKind::None;
+            int index = -1;
+            world.hit_spheres(r, 0.001f, hit);
+            if (hit.m_isHit)
+            {
+                kind = PrimitiveKind::Sphere;
+                index = hit.m_sphere;
+            }
+            auto closest = [&](auto& prims, PrimitiveKind prim_kind) {
+                for (size_t p = 0; p < prims.size(); ++p)
+                {
+                    HitResult h = prims[p].hit(r, 0.001f, hit.m_t);
+                    if (h.m_isHit)
+                    {
+                        hit = h;
+                        kind = prim_kind;
+                        index = static_cast<int>(p);
+                    }
+                }
+            };
+            closest(world.m_planes, PrimitiveKind::Plane);
+            closest(world.m_boxes, PrimitiveKind::Box);
+            closest(world.m_disks, PrimitiveKind::Disk);
+
+            size_t t = gbuffer.texel(pass, i, j);
+            if (kind == PrimitiveKind::None)
+            {
+                for (int c = 0; c < 4; ++c)
+                    gbuffer.m_positions[t + c] = gbuffer.m_normals[t + c] = gbuffer.m_albedos[t + c] = 0;
+                continue;
+            }
+            Vector3D color = world.material(hit.m_hitMaterial)->m_color;
+            float position[4] = { hit.m_hitPos.m_x, hit.m_hitPos.m_y, hit.m_hitPos.m_z, float(index) };
+            float normal[4] = { hit.m_hitNormal.m_x, hit.m_hitNormal.m_y, hit.m_hitNormal.m_z, float(hit.m_hitMaterial) };
+            float albedo[4] = { color.m_x, color.m_y, color.m_z, float(int(kind)) };
+            for (int c = 0; c < 4; ++c)
+            {
+                gbuffer.m_positions[t + c] = position[c];
+                gbuffer.m_normals[t + c] = normal[c];
+                gbuffer.m_albedos[t + c] = albedo[c];
+            }
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "AABB.h"
+#include "Sphere.h"
+#include "TraversalStats.h"
+
+// 3D-DDA walk (Amanatides & Woo) through the cells of a res[0] x res[1] x res[2]
+// lattice of cell_size cells starting at bounds.m_min. visit(x, y, z) is called
+// for every cell along the ray in order until it returns true or the closest
+// hit found so far (hit_result.m_t) lies before the next cell.
+template <typename F>
+void grid_traverse(const AABB& bounds, const float cell_size[3], const int res[3],
+                   Ray& ray, float min_t, HitResult& hit_result, F visit)
+{
+    Vector3D origin = ray.origin();
+    Vector3D dir = ray.direction();
+    Vector3D inv_dir(1.0f / dir.m_x, 1.0f / dir.m_y, 1.0f / dir.m_z);
+    float t_enter;
+    if (!bounds.hit(origin, inv_dir, min_t, hit_result.m_t, t_enter))
+        return;
+
+    const float o[3] = { origin.m_x, origin.m_y, origin.m_z };
+    const float d[3] = { dir.m_x, dir.m_y, dir.m_z };
+    const float lo[3] = { bounds.m_min.m_x, bounds.m_min.m_y, bounds.m_min.m_z };
+    int cell[3];
+    int step[3];
+    float t_next[3];
+    float t_delta[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        float p = o[a] + t_enter * d[a];
+        cell[a] = std::min(res[a] - 1, std::max(0, static_cast<int>(std::floor((p - lo[a]) / cell_size[a]))));
+        if (d[a] > 0)
+        {
+            step[a] = 1;
+            t_delta[a] = cell_size[a] / d[a];
+            t_next[a] = (lo[a] + (cell[a] + 1) * cell_size[a] - o[a]) / d[a];
+        }
+        else if (d[a] < 0)
+        {
+            step[a] = -1;
+            t_delta[a] = -cell_size[a] / d[a];
+            t_next[a] = (lo[a] + cell[a] * cell_size[a] - o[a]) / d[a];
+        }
+        else
+        {
+            step[a] = 0;
+            t_delta[a] = std::numeric_limits<float>::infinity();
+            t_next[a] = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    while (true)
+    {
+        COUNT_NODE_VISIT();
+        if (visit(cell[0], cell[1], cell[2]))
+            return;
+
+        int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        // nothing beyond this cell can be closer than what we have
+        if (hit_result.m_t <= t_next[axis])
+            return;
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= res[axis])
+            return;
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+// dense uniform grid over the spheres' bounds. Each cell lists every sphere
+// whose box overlaps it, stored as one flat array indexed by m_cellStart.
+class UniformGrid
+{
+public:
+    UniformGrid()
+    {
+        m_res[0] = m_res[1] = m_res[2] = 0;
+    }
+
+    bool built() const
+    {
+        return !m_cellStart.empty();
+    }
+    void clear()
+    {
+        m_cellStart.clear();
+        m_items.clear();
+        m_res[0] = m_res[1] = m_res[2] = 0;
+    }
+
+    // density is the target number of cells per sphere
+    void build(const std::vector<Sphere>& spheres, float density = 2.0f);
+    void hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result);
+    // true as soon as any sphere blocks the ray between min_t and max_t
+    bool occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t);
+
+    int cell_count() const
+    {
+        return m_res[0] * m_res[1] * m_res[2];
+    }
+    int occupied_cells() const;
+    size_t bytes() const
+    {
+        return (m_cellStart.size() + m_items.size()) * sizeof(int);
+    }
+
+public:
+    AABB m_bounds;
+    int m_res[3];
+    float m_cellSize[3];
+    // spheres of cell c are m_items[m_cellStart[c] .. m_cellStart[c + 1])
+    std::vector<int> m_cellStart;
+    std::vector<int> m_items;
+
+private:
+    void cell_range(const AABB& b, int lo[3], int hi[3]) const;
+};
+
+void UniformGrid::build(const std::vector<Sphere>& spheres, float density)
+{
+    clear();
+    if (spheres.empty())
+        return;
+    for (const Sphere& s : spheres)
+        m_bounds.grow(s.bounds());
+
+    // cells roughly cubic, about density of them per sphere
+    Vector3D e = m_bounds.extent();
+    float ext[3] = { e.m_x, e.m_y, e.m_z };
+    float largest = std::max(ext[0], std::max(ext[1], ext[2]));
+    float volume = 1;
+    for (int a = 0; a < 3; ++a)
+        volume *= std::max(ext[a], largest * 1e-3f);
+    float per_unit = std::cbrt(density * spheres.size() / volume);
+    for (int a = 0; a < 3; ++a)
+    {
+        m_res[a] = std::min(512, std::max(1, static_cast<int>(ext[a] * per_unit)));
+        m_cellSize[a] = ext[a] > 0 ? ext[a] / m_res[a] : 1;
+    }
+
+    // count, prefix sum, then fill
+    m_cellStart.assign(cell_count() + 1, 0);
+    int lo[3], hi[3];
+    for (const Sphere& s : spheres)
+    {
+        cell_range(s.bounds(), lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                    m_cellStart[(z * m_res[1] + y) * m_res[0] + x + 1]++;
+    }
+    for (int c = 0; c < cell_count(); ++c)
+        m_cellStart[c + 1] += m_cellStart[c];
+    m_items.resize(m_cellStart.back());
+    std::vector<int> fill(m_cellStart.begin(), m_cellStart.end() - 1);
+    for (size_t i = 0; i < spheres.size(); ++i)
+    {
+        cell_range(spheres[i].bounds(), lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                    m_items[fill[(z * m_res[1] + y) * m_res[0] + x]++] = static_cast<int>(i);
+    }
+}
+
+void UniformGrid::cell_range(const AABB& b, int lo[3], int hi[3]) const
+{
+    const float bmin[3] = { b.m_min.m_x, b.m_min.m_y, b.m_min.m_z };
+    const float bmax[3] = { b.m_max.m_x, b.m_max.m_y, b.m_max.m_z };
+    const float glo[3] = { m_bounds.m_min.m_x, m_bounds.m_min.m_y, m_bounds.m_min.m_z };
+    for (int a = 0; a < 3; ++a)
+    {
+        lo[a] = std::min(m_res[a] - 1, std::max(0, static_cast<int>((bmin[a] - glo[a]) / m_cellSize[a])));
+        hi[a] = std::min(m_res[a] - 1, std::max(0, static_cast<int>((bmax[a] - glo[a]) / m_cellSize[a])));
+    }
+}
+
+int UniformGrid::occupied_cells() const
+{
+    int count = 0;
+    for (int c = 0; c < cell_count(); ++c)
+        count += m_cellStart[c + 1] > m_cellStart[c];
+    return count;
+}
+
+void UniformGrid::hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result)
+{
+    if (!built())
+        return;
+    grid_traverse(m_bounds, m_cellSize, m_res, ray, min_t, hit_result, [&](int x, int y, int z) {
+        int c = (z * m_res[1] + y) * m_res[0] + x;
+        COUNT_PRIMITIVE_TESTS(m_cellStart[c + 1] - m_cellStart[c]);
+        for (int i = m_cellStart[c]; i < m_cellStart[c + 1]; ++i)
+        {
+            HitResult hit = spheres[m_items[i]].hit(ray, min_t, hit_result.m_t);
+            if (hit.m_isHit)
+            {
+                hit_result = hit;
+                hit_result.m_sphere = m_items[i];
+            }
+        }
+        return false;
+    });
+}
+
+bool UniformGrid::occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t)
+{
+    if (!built())
+        return false;
+    // the DDA only reads m_t from the hit result, as the end of the segment
+    HitResult segment;
+    segment.m_t = max_t;
+    bool blocked = false;
+    grid_traverse(m_bounds, m_cellSize, m_res, ray, min_t, segment, [&](int x, int y, int z) {
+        int c = (z * m_res[1] + y) * m_res[0] + x;
+        COUNT_PRIMITIVE_TESTS(m_cellStart[c + 1] - m_cellStart[c]);
+        for (int i = m_cellStart[c]; i < m_cellStart[c + 1]; ++i)
+        {
+            if (spheres[m_items[i]].occludes(ray, min_t, max_t))
+            {
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
+
+// sparse grid: only occupied cells are stored, in an open-addressing hash
+// table keyed by cell coordinate, so memory follows the number of spheres and
+// not the volume of the scene
+class HashGrid
+{
+public:
+    HashGrid()
+    {
+        m_cellSize = 1;
+        m_res[0] = m_res[1] = m_res[2] = 0;
+    }
+
+    bool built() const
+    {
+        return !m_keys.empty();
+    }
+    void clear()
+    {
+        m_keys.clear();
+        m_start.clear();
+        m_count.clear();
+        m_items.clear();
+    }
+
+    // cell_size 0 picks 1.5 times the average sphere diameter
+    void build(const std::vector<Sphere>& spheres, float cell_size = 0);
+    void hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result);
+    // true as soon as any sphere blocks the ray between min_t and max_t
+    bool occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t);
+
+    size_t bytes() const
+    {
+        return m_keys.size() * sizeof(uint64_t) + (m_start.size() + m_count.size() + m_items.size()) * sizeof(int);
+    }
+    int occupied_cells() const
+    {
+        return m_occupied;
+    }
+
+public:
+    float m_cellSize;
+    // cell coordinates are taken relative to m_bounds.m_min
+    AABB m_bounds;
+    int m_res[3];
+    std::vector<uint64_t> m_keys;
+    std::vector<int> m_start;
+    std::vector<int> m_count;
+    std::vector<int> m_items;
+
+    static const uint64_t empty_key = ~0ull;
+
+private:
+    static uint64_t key(int x, int y, int z)
+    {
+        return (static_cast<uint64_t>(x) << 42) | (static_cast<uint64_t>(y) << 21) | static_cast<uint64_t>(z);
+    }
+    static uint64_t hash(uint64_t k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        return k;
+    }
+    int find(uint64_t k) const;
+
+    int m_occupied;
+};
+
+void HashGrid::build(const std::vector<Sphere>& spheres, float cell_size)
+{
+    clear();
+    m_occupied = 0;
+    if (spheres.empty())
+        return;
+    float diameter = 0;
+    for (const Sphere& s : spheres)
+    {
+        m_bounds.grow(s.bounds());
+        diameter += 2 * s.m_radius;
+    }
+    m_cellSize = cell_size > 0 ? cell_size : 1.5f * diameter / spheres.size();
+    Vector3D e = m_bounds.extent();
+    float ext[3] = { e.m_x, e.m_y, e.m_z };
+    // cell coordinates are packed in 21 bits each
+    float largest = std::max(ext[0], std::max(ext[1], ext[2]));
+    if (largest / m_cellSize > (1 << 21) - 1)
+        m_cellSize = largest / ((1 << 21) - 1);
+    for (int a = 0; a < 3; ++a)
+        m_res[a] = std::max(1, static_cast<int>(std::ceil(ext[a] / m_cellSize)));
+
+    // (cell, sphere) pairs sorted by cell give every cell's list contiguously
+    std::vector<std::pair<uint64_t, int>> pairs;
+    for (size_t i = 0; i < spheres.size(); ++i)
+    {
+        AABB b = spheres[i].bounds();
+        int lo[3] = { static_cast<int>((b.m_min.m_x - m_bounds.m_min.m_x) / m_cellSize),
+                      static_cast<int>((b.m_min.m_y - m_bounds.m_min.m_y) / m_cellSize),
+                      static_cast<int>((b.m_min.m_z - m_bounds.m_min.m_z) / m_cellSize) };
+        int hi[3] = { static_cast<int>((b.m_max.m_x - m_bounds.m_min.m_x) / m_cellSize),
+                      static_cast<int>((b.m_max.m_y - m_bounds.m_min.m_y) / m_cellSize),
+                      static_cast<int>((b.m_max.m_z - m_bounds.m_min.m_z) / m_cellSize) };
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = std::min(lo[a], m_res[a] - 1);
+            hi[a] = std::min(hi[a], m_res[a] - 1);
+        }
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                    pairs.push_back(std::make_pair(key(x, y, z), static_cast<int>(i)));
+    }
+    std::sort(pairs.begin(), pairs.end());
+
+    int occupied = 0;
+    for (size_t i = 0; i < pairs.size(); ++i)
+        occupied += i == 0 || pairs[i].first != pairs[i - 1].first;
+    size_t table_size = 16;
+    while (table_size < 2 * static_cast<size_t>(occupied))
+        table_size *= 2;
+    m_keys.assign(table_size, static_cast<uint64_t>(empty_key));
+    m_start.assign(table_size, 0);
+    m_count.assign(table_size, 0);
+    m_items.resize(pairs.size());
+
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        m_items[i] = pairs[i].second;
+        if (i > 0 && pairs[i].first == pairs[i - 1].first)
+            continue;
+        size_t slot = hash(pairs[i].first) & (table_size - 1);
+        while (m_keys[slot] != empty_key)
+            slot = (slot + 1) & (table_size - 1);
+        m_keys[slot] = pairs[i].first;
+        m_start[slot] = static_cast<int>(i);
+        size_t end = i;
+        while (end < pairs.size() && pairs[end].first == pairs[i].first)
+            ++end;
+        m_count[slot] = static_cast<int>(end - i);
+    }
+    m_occupied = occupied;
+}
+
+int HashGrid::find(uint64_t k) const
+{
+    size_t mask = m_keys.size() - 1;
+    for (size_t slot = hash(k) & mask; ; slot = (slot + 1) & mask)
+    {
+        if (m_keys[slot] == k)
+            return static_cast<int>(slot);
+        if (m_keys[slot] == empty_key)
+            return -1;
+    }
+}
+
+void HashGrid::hit(std::vector<Sphere>& spheres, Ray& ray, float min_t, HitResult& hit_result)
+{
+    if (!built())
+        return;
+    float cell_size[3] = { m_cellSize, m_cellSize, m_cellSize };
+    AABB cells(m_bounds.m_min, m_bounds.m_min + m_cellSize * Vector3D(m_res[0], m_res[1], m_res[2]));
+    grid_traverse(cells, cell_size, m_res, ray, min_t, hit_result, [&](int x, int y, int z) {
+        int slot = find(key(x, y, z));
+        if (slot < 0)
+            return false;
+        COUNT_PRIMITIVE_TESTS(m_count[slot]);
+        for (int i = m_start[slot]; i < m_start[slot] + m_count[slot]; ++i)
+        {
+            HitResult hit = spheres[m_items[i]].hit(ray, min_t, hit_result.m_t);
+            if (hit.m_isHit)
+            {
+                hit_result = hit;
+                hit_result.m_sphere = m_items[i];
+            }
+        }
+        return false;
+    });
+}
+
+bool HashGrid::occluded(std::vector<Sphere>& spheres, Ray& ray, float min_t, float max_t)
+{
+    if (!built())
+        return false;
+    float cell_size[3] = { m_cellSize, m_cellSize, m_cellSize };
+    AABB cells(m_bounds.m_min, m_bounds.m_min + m_cellSize * Vector3D(m_res[0], m_res[1], m_res[2]));
+    HitResult segment;
+    segment.m_t = max_t;
+    bool blocked = false;
+    grid_traverse(cells, cell_size, m_res, ray, min_t, segment, [&](int x, int y, int z) {
+        int slot = find(key(x, y, z));
+        if (slot < 0)
+            return false;
+        COUNT_PRIMITIVE_TESTS(m_count[slot]);
+        for (int i = m_start[slot]; i < m_start[slot] + m_count[slot]; ++i)
+        {
+            if (spheres[m_items[i]].occludes(ray, min_t, max_t))
+            {
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
+
+#endif
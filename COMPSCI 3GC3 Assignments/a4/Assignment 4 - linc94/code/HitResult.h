@@ -0,0 +1,28 @@
+#ifndef HITRESULT_H
+#define HITRESULT_H
+
+#include "Vector3D.h"
+
+class HitResult {
+public:
+    HitResult() { m_isHit = false; m_hitMaterial = -1; m_sphere = -1; m_t = 0; m_u = 0; m_v = 0; m_uvScale = 0; m_sphereRadius = 0; m_coneWidth = 0; };
+    bool m_isHit;
+    Vector3D m_hitPos;
+    Vector3D m_hitNormal;
+    // index into World::m_materials
+    int m_hitMaterial;
+    // index into World::m_spheres when a sphere was hit, -1 otherwise
+    int m_sphere;
+    float m_t;
+    // texture coordinates, and how many uv units one unit of world distance spans there
+    float m_u;
+    float m_v;
+    float m_uvScale;
+    // radius of the sphere hit, whose uvs are left to Sphere::uv() until a
+    // texture needs them; 0 when the uvs above are set
+    float m_sphereRadius;
+    // width of the incoming ray cone at the hit point
+    float m_coneWidth;
+};
+
+#endif
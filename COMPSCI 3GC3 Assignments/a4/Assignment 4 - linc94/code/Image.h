@@ -0,0 +1,9 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+// stb_image with its implementation: every program here is a single translation
+// unit, so the first header that needs image decoding compiles it in
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "Vector3D.h"
+
+// one cached irradiance value (Ward's irradiance caching) with its rotational and
+// translational gradients (Ward & Heckbert), one gradient vector per color channel
+class IrradianceRecord
+{
+public:
+    Vector3D m_position;
+    Vector3D m_normal;
+    Vector3D m_irradiance;
+    // harmonic mean distance to the surfaces seen from here, clamped
+    float m_radius;
+    // width of the ray cone that found the point
+    float m_footprint;
+    // bounces the gather rays' paths were allowed
+    int m_bounces;
+    Vector3D m_rotationGradient[3];
+    Vector3D m_translationGradient[3];
+};
+
+// sparse world-space irradiance records, found through a multi-level spatial
+// hash keyed by bounce budget: a record goes into every cell its zone of
+// influence overlaps, on the level whose cells are half as wide as that zone,
+// so a lookup reads one cell per level. Lookups and insertions can run
+// concurrently from any number of threads.
+class IrradianceCache
+{
+public:
+    // accuracy is Ward's a: records are used while their error estimate
+    // |p - p_i| / R_i + sqrt(1 - n . n_i) is below it
+    IrradianceCache(float accuracy = 0.25f, float min_spacing = 0.05f, float max_spacing = 4.0f);
+    IrradianceCache(const IrradianceCache&) = delete;
+    IrradianceCache& operator=(const IrradianceCache&) = delete;
+
+    // weighted, gradient-extrapolated irradiance at (position, normal), false
+    // when no record is close enough. footprint is the width of the looking
+    // ray's cone: a record reaches at least m_footprintScale footprints of the
+    // narrower of that ray's and its own, since neither can resolve finer
+    // detail. Only records whose gathers had the same bounce budget are used,
+    // a path seen through mirrors has fewer left
+    bool lookup(const Vector3D& position, const Vector3D& normal, float footprint, int bounces, Vector3D& irradiance);
+
+    // sample directions of a new record: m_thetaCount x m_phiCount cosine-stratified
+    // cells around normal (world space, unit length), stored in radiance/distance order
+    void gather_directions(const Vector3D& normal, std::vector<Vector3D>& directions);
+    // builds a record from the radiance and hit distance along gather_directions() and stores it.
+    // footprint is the width of the ray cone that found the point
+    void add(const Vector3D& position, const Vector3D& normal, const std::vector<Vector3D>& radiance,
+             const std::vector<float>& distances, float footprint, int bounces);
+
+    int record_count()
+    {
+        std::lock_guard<std::mutex> lock(m_recordMutex);
+        return static_cast<int>(m_records.size());
+    }
+
+    float m_accuracy;
+    float m_minSpacing;
+    float m_maxSpacing;
+    // minimum record radius in ray cone widths, see lookup()
+    float m_footprintScale;
+    int m_thetaCount;
+    int m_phiCount;
+    std::atomic<long long> m_hits;
+    std::atomic<long long> m_misses;
+
+private:
+    // what a lookup tests a record by, copied into its cells so rejecting
+    // it doesn't touch the record
+    class Candidate
+    {
+    public:
+        Vector3D m_position;
+        Vector3D m_normal;
+        float m_radius;
+        float m_footprint;
+        int m_bounces;
+        const IrradianceRecord* m_record;
+    };
+    class Shard
+    {
+    public:
+        std::shared_mutex m_mutex;
+        std::unordered_map<uint64_t, std::vector<Candidate>> m_cells;
+    };
+    static const int shard_count = 64;
+    static const int level_count = 16;
+    // bounce budgets told apart in the keys
+    static const int budget_count = 64;
+
+    float cell_size(int level) const
+    {
+        return ldexpf(m_minSpacing * 2 * m_accuracy, level);
+    }
+    // radius of a record for a lookup with footprint, the widest it gets is
+    // the record's own footprint's (or what the coarsest cells hold)
+    float radius(float record_radius, float record_footprint, float footprint) const
+    {
+        float widest = cell_size(level_count - 1) / (2 * m_accuracy);
+        return fminf(fmaxf(record_radius, m_footprintScale * fminf(footprint, record_footprint)), widest);
+    }
+    static uint64_t cell_key(int level, int bounces, int x, int y, int z)
+    {
+        // 18 bits per axis, wraps for huge coordinates (only costs extra candidates)
+        return (static_cast<uint64_t>(level) << 60) | (static_cast<uint64_t>(bounces & (budget_count - 1)) << 54) |
+               (static_cast<uint64_t>(x & 0x3FFFF) << 36) | (static_cast<uint64_t>(y & 0x3FFFF) << 18) |
+               static_cast<uint64_t>(z & 0x3FFFF);
+    }
+    Shard& shard(uint64_t key)
+    {
+        return m_shards[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+    }
+    // tangent frame around the normal
+    static void frame(const Vector3D& normal, Vector3D& tangent, Vector3D& bitangent)
+    {
+        Vector3D helper = fabsf(normal.m_x) < 0.9f ? Vector3D(1, 0, 0) : Vector3D(0, 1, 0);
+        tangent = normalize(cross(helper, normal));
+        bitangent = cross(normal, tangent);
+    }
+
+    std::mutex m_recordMutex;
+    // deque: records never move once added
+    std::deque<IrradianceRecord> m_records;
+    Shard m_shards[shard_count];
+    // per bounce budget, bit l set once level l holds a record
+    std::atomic<unsigned> m_usedLevels[budget_count];
+};
+
+IrradianceCache::IrradianceCache(float accuracy, float min_spacing, float max_spacing)
+{
+    m_accuracy = accuracy;
+    m_minSpacing = min_spacing;
+    m_maxSpacing = max_spacing;
+    m_footprintScale = 4;
+    m_thetaCount = 4;
+    m_phiCount = 16;
+    m_hits = 0;
+    m_misses = 0;
+    for (auto& levels : m_usedLevels)
+        levels = 0;
+}
+
+bool IrradianceCache::lookup(const Vector3D& position, const Vector3D& normal, float footprint, int bounces, Vector3D& irradiance)
+{
+    Vector3D sum(0, 0, 0);
+    float weight_sum = 0;
+    unsigned levels = m_usedLevels[bounces & (budget_count - 1)];
+    for (int level = 0; level < level_count; ++level)
+    {
+        if (!(levels & (1u << level)))
+            continue;
+        float size = cell_size(level);
+        uint64_t key = cell_key(level, bounces, static_cast<int>(floorf(position.m_x / size)),
+                                static_cast<int>(floorf(position.m_y / size)), static_cast<int>(floorf(position.m_z / size)));
+        Shard& s = shard(key);
+        std::shared_lock<std::shared_mutex> lock(s.m_mutex);
+        auto it = s.m_cells.find(key);
+        if (it == s.m_cells.end())
+            continue;
+        for (const Candidate& c : it->second)
+        {
+            // cheap rejections first: too far away, or facing away
+            Vector3D offset = position - c.m_position;
+            float record_radius = radius(c.m_radius, c.m_footprint, footprint);
+            float reach = m_accuracy * record_radius;
+            float distance_squared = offset.length_squared();
+            if (distance_squared >= reach * reach || c.m_bounces != bounces)
+                continue;
+            float n_dot = dot(normal, c.m_normal);
+            if (n_dot <= 0)
+                continue;
+            float error = sqrtf(distance_squared) / record_radius + sqrtf(fmaxf(0.0f, 1 - n_dot));
+            if (error >= m_accuracy)
+                continue;
+            // records whose surface is in front of p see light p doesn't
+            if (dot(offset, normal + c.m_normal) < -0.01f * record_radius)
+                continue;
+
+            const IrradianceRecord* r = c.m_record;
+            Vector3D turn = cross(r->m_normal, normal);
+            Vector3D value = r->m_irradiance;
+            value.m_x += dot(turn, r->m_rotationGradient[0]) + dot(offset, r->m_translationGradient[0]);
+            value.m_y += dot(turn, r->m_rotationGradient[1]) + dot(offset, r->m_translationGradient[1]);
+            value.m_z += dot(turn, r->m_rotationGradient[2]) + dot(offset, r->m_translationGradient[2]);
+            float weight = 1 / fmaxf(error, 1e-4f);
+            sum += weight * Vector3D(fmaxf(value.m_x, 0.0f), fmaxf(value.m_y, 0.0f), fmaxf(value.m_z, 0.0f));
+            weight_sum += weight;
+        }
+    }
+    if (weight_sum <= 0)
+    {
+        ++m_misses;
+        return false;
+    }
+    ++m_hits;
+    irradiance = sum / weight_sum;
+    return true;
+}
+
+void IrradianceCache::gather_directions(const Vector3D& normal, std::vector<Vector3D>& directions)
+{
+    Vector3D tangent, bitangent;
+    frame(normal, tangent, bitangent);
+    directions.clear();
+    for (int j = 0; j < m_thetaCount; ++j)
+    {
+        for (int k = 0; k < m_phiCount; ++k)
+        {
+            // cosine weighted: sin^2(theta) uniform in each stratum
+            float sin_theta = sqrtf((j + random_float()) / m_thetaCount);
+            float cos_theta = sqrtf(fmaxf(0.0f, 1 - sin_theta * sin_theta));
+            float phi = 2 * M_PI * (k + random_float()) / m_phiCount;
+            directions.push_back(sin_theta * cosf(phi) * tangent + sin_theta * sinf(phi) * bitangent + cos_theta * normal);
+        }
+    }
+}
+
+void IrradianceCache::add(const Vector3D& position, const Vector3D& normal, const std::vector<Vector3D>& radiance,
+                          const std::vector<float>& distances, float footprint, int bounces)
+{
+    int M = m_thetaCount;
+    int N = m_phiCount;
+    IrradianceRecord record;
+    record.m_position = position;
+    record.m_normal = normal;
+
+    Vector3D tangent, bitangent;
+    frame(normal, tangent, bitangent);
+
+    Vector3D sum(0, 0, 0);
+    float inverse_distances = 0;
+    for (int i = 0; i < M * N; ++i)
+    {
+        sum += radiance[i];
+        inverse_distances += 1 / fmaxf(distances[i], 1e-4f);
+    }
+    record.m_irradiance = (M_PI / (M * N)) * sum;
+    record.m_radius = fminf(fmaxf(M * N / inverse_distances, m_minSpacing), m_maxSpacing);
+    record.m_footprint = footprint;
+    record.m_bounces = bounces;
+
+    // gradients (Ward & Heckbert 1992), per channel
+    for (int c = 0; c < 3; ++c)
+    {
+        record.m_rotationGradient[c] = Vector3D(0, 0, 0);
+        record.m_translationGradient[c] = Vector3D(0, 0, 0);
+    }
+    auto channel = [](const Vector3D& v, int c) { return c == 0 ? v.m_x : (c == 1 ? v.m_y : v.m_z); };
+    for (int k = 0; k < N; ++k)
+    {
+        float phi = 2 * M_PI * (k + 0.5f) / N;
+        float phi_minus = 2 * M_PI * k / N;
+        // u along the stratum's azimuth, v perpendicular to it (and to its lower azimuth boundary)
+        Vector3D u = cosf(phi) * tangent + sinf(phi) * bitangent;
+        Vector3D v = -sinf(phi) * tangent + cosf(phi) * bitangent;
+        Vector3D v_minus = -sinf(phi_minus) * tangent + cosf(phi_minus) * bitangent;
+        int k_prev = (k + N - 1) % N;
+        for (int j = 0; j < M; ++j)
+        {
+            int i = j * N + k;
+            float sin_theta = sqrtf((j + 0.5f) / M);
+            float tan_theta = sin_theta / sqrtf(fmaxf(1e-6f, 1 - sin_theta * sin_theta));
+            float sin_minus = sqrtf(static_cast<float>(j) / M);
+            float sin_plus = sqrtf(static_cast<float>(j + 1) / M);
+            float cos2_minus = 1 - sin_minus * sin_minus;
+            for (int c = 0; c < 3; ++c)
+            {
+                float L = channel(radiance[i], c);
+                record.m_rotationGradient[c] += (-tan_theta * L * M_PI / (M * N)) * v;
+                // change across the boundary to the stratum below in theta
+                if (j > 0)
+                {
+                    float L_below = channel(radiance[i - N], c);
+                    float d = fminf(distances[i], distances[i - N]);
+                    record.m_translationGradient[c] += (2 * M_PI / N) * sin_minus * cos2_minus / fmaxf(d, 1e-4f) * (L - L_below) * u;
+                }
+                // change across the boundary to the previous stratum in phi
+                float L_prev = channel(radiance[j * N + k_prev], c);
+                float d = fminf(distances[i], distances[j * N + k_prev]);
+                record.m_translationGradient[c] += (sin_plus - sin_minus) / fmaxf(d, 1e-4f) * (L - L_prev) * v_minus;
+            }
+        }
+    }
+
+    // the level whose cells are half as wide as the record's widest zone of influence
+    float reach = m_accuracy * radius(record.m_radius, footprint, footprint);
+    int level = 0;
+    while (level < level_count - 1 && cell_size(level) < reach)
+        ++level;
+
+    Candidate candidate;
+    candidate.m_position = position;
+    candidate.m_normal = normal;
+    candidate.m_radius = record.m_radius;
+    candidate.m_footprint = footprint;
+    candidate.m_bounces = bounces;
+    {
+        std::lock_guard<std::mutex> lock(m_recordMutex);
+        m_records.push_back(record);
+        candidate.m_record = &m_records.back();
+    }
+    float size = cell_size(level);
+    int lo[3], hi[3];
+    const float p[3] = { position.m_x, position.m_y, position.m_z };
+    for (int a = 0; a < 3; ++a)
+    {
+        lo[a] = static_cast<int>(floorf((p[a] - reach) / size));
+        hi[a] = static_cast<int>(floorf((p[a] + reach) / size));
+    }
+    for (int x = lo[0]; x <= hi[0]; ++x)
+    {
+        for (int y = lo[1]; y <= hi[1]; ++y)
+        {
+            for (int z = lo[2]; z <= hi[2]; ++z)
+            {
+                uint64_t key = cell_key(level, bounces, x, y, z);
+                Shard& s = shard(key);
+                std::unique_lock<std::shared_mutex> lock(s.m_mutex);
+                s.m_cells[key].push_back(candidate);
+            }
+        }
+    }
+    m_usedLevels[bounces & (budget_count - 1)] |= 1u << level;
+}
+
+#endif
@@ -0,0 +1,516 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "BVH.h"
+#include "Parallel.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+int count_leading_zeros(uint64_t x)
+{
+    if (x == 0)
+        return 64;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - static_cast<int>(index);
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+int count_bits(int x)
+{
+    int count = 0;
+    for (; x; x &= x - 1)
+        ++count;
+    return count;
+}
+
+// spread the low bits of x so there are two zero bits between each
+uint64_t expand_bits_3d(uint64_t x, int bits)
+{
+    uint64_t result = 0;
+    for (int b = 0; b < bits; ++b)
+        result |= ((x >> b) & 1ull) << (3 * b);
+    return result;
+}
+
+// linear BVH builder (Karras 2012): spheres are sorted along a Morton curve
+// and the hierarchy is read off the sorted codes, with every step parallel.
+// The result is an ordinary BVH, optionally improved with treelet
+// restructuring (Karras and Aila 2013) and with small subtrees collapsed
+// into leaves of up to BVH::max_leaf_size spheres.
+class LBVHBuilder
+{
+public:
+    LBVHBuilder()
+    {
+        m_wideCodes = false;
+        m_optimizeTreelets = false;
+        m_threadCount = 0;
+    }
+
+    void build(BVH& bvh, const std::vector<Sphere>& spheres);
+
+    // 63-bit codes (21 bits per axis) instead of 30-bit ones, for huge or very uneven scenes
+    bool m_wideCodes;
+    bool m_optimizeTreelets;
+    // 0 means one per cpu
+    int m_threadCount;
+
+    static const int treelet_size = 7;
+
+private:
+    void compute_codes(const std::vector<Sphere>& spheres);
+    void radix_sort();
+    int delta(int i, int j) const;
+    void emit_hierarchy();
+    void compute_bounds(const std::vector<Sphere>& spheres);
+    class Treelet;
+    void optimize_treelets();
+    void optimize_subtree(int node, Treelet& treelet);
+    void node_cost(int node);
+    void optimize_treelet(int root, Treelet& treelet);
+    int assign_treelet(int subset, int root_slot, Treelet& treelet, std::vector<int>& free_slots);
+    void compact(BVH& bvh, const std::vector<Sphere>& spheres);
+    int emit_node(BVH& bvh, const std::vector<Sphere>& spheres, int node, int& first);
+
+    int m_count;
+    int m_bits;
+    std::vector<uint64_t> m_codes;
+    std::vector<int> m_order;
+
+    // karras layout: internal nodes are [0, n - 1), leaf i is node n - 1 + i
+    std::vector<int> m_left;
+    std::vector<int> m_right;
+    std::vector<int> m_parent;
+    std::vector<AABB> m_bounds;
+    std::vector<float> m_cost;
+    std::vector<int> m_primCount;
+
+    // scratch for optimizing one treelet, one per thread
+    class Treelet
+    {
+    public:
+        int m_leaves[treelet_size];
+        AABB m_subsetBounds[1 << treelet_size];
+        float m_subsetCost[1 << treelet_size];
+        int m_subsetSplit[1 << treelet_size];
+    };
+};
+
+void LBVHBuilder::build(BVH& bvh, const std::vector<Sphere>& spheres)
+{
+    bvh.clear();
+    m_count = static_cast<int>(spheres.size());
+    if (m_count == 0)
+        return;
+    m_bits = m_wideCodes ? 21 : 10;
+
+    compute_codes(spheres);
+    radix_sort();
+    emit_hierarchy();
+    compute_bounds(spheres);
+    if (m_optimizeTreelets && m_count > 2)
+        optimize_treelets();
+    compact(bvh, spheres);
+}
+
+void LBVHBuilder::compute_codes(const std::vector<Sphere>& spheres)
+{
+    // bounds of the centroids, reduced per chunk then merged
+    int threads = m_threadCount > 0 ? m_threadCount : default_thread_count();
+    if (threads > m_count)
+        threads = m_count;
+    std::vector<AABB> partial(threads);
+    parallel_chunks(m_count, threads, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            partial[chunk].grow(spheres[i].m_center);
+    });
+    AABB centroids;
+    for (const AABB& b : partial)
+        centroids.grow(b);
+
+    // quantize in a cube around the centroids, stretching a flat axis to the
+    // full grid would make it dominate the curve
+    Vector3D lo = centroids.m_min;
+    Vector3D e = centroids.extent();
+    float size = fmaxf(e.m_x, fmaxf(e.m_y, e.m_z));
+    float cells = static_cast<float>((1u << m_bits) - 1);
+    float s = size > 0 ? cells / size : 0;
+    Vector3D scale(s, s, s);
+
+    m_codes.resize(m_count);
+    m_order.resize(m_count);
+    parallel_for(m_count, threads, [&](int i) {
+        Vector3D c = spheres[i].m_center;
+        uint64_t x = static_cast<uint64_t>((c.m_x - lo.m_x) * scale.m_x);
+        uint64_t y = static_cast<uint64_t>((c.m_y - lo.m_y) * scale.m_y);
+        uint64_t z = static_cast<uint64_t>((c.m_z - lo.m_z) * scale.m_z);
+        m_codes[i] = (expand_bits_3d(x, m_bits) << 2) | (expand_bits_3d(y, m_bits) << 1) | expand_bits_3d(z, m_bits);
+        m_order[i] = i;
+    });
+}
+
+// parallel LSD radix sort of (code, sphere) pairs, 8 bits per pass
+void LBVHBuilder::radix_sort()
+{
+    int threads = m_threadCount > 0 ? m_threadCount : default_thread_count();
+    if (threads > m_count)
+        threads = m_count;
+    int passes = (3 * m_bits + 7) / 8;
+
+    std::vector<uint64_t> codes_tmp(m_count);
+    std::vector<int> order_tmp(m_count);
+    std::vector<int> histogram(threads * 256);
+
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        int shift = pass * 8;
+        std::fill(histogram.begin(), histogram.end(), 0);
+        parallel_chunks(m_count, threads, [&](int chunk, int begin, int end) {
+            int* h = &histogram[chunk * 256];
+            for (int i = begin; i < end; ++i)
+                h[(m_codes[i] >> shift) & 255]++;
+        });
+
+        // exclusive prefix over (digit, chunk) so every chunk scatters stably into its own slots
+        int offset = 0;
+        for (int digit = 0; digit < 256; ++digit)
+        {
+            for (int chunk = 0; chunk < threads; ++chunk)
+            {
+                int n = histogram[chunk * 256 + digit];
+                histogram[chunk * 256 + digit] = offset;
+                offset += n;
+            }
+        }
+
+        parallel_chunks(m_count, threads, [&](int chunk, int begin, int end) {
+            int* h = &histogram[chunk * 256];
+            for (int i = begin; i < end; ++i)
+            {
+                int dst = h[(m_codes[i] >> shift) & 255]++;
+                codes_tmp[dst] = m_codes[i];
+                order_tmp[dst] = m_order[i];
+            }
+        });
+        m_codes.swap(codes_tmp);
+        m_order.swap(order_tmp);
+    }
+}
+
+// length of the common prefix of keys i and j, duplicate codes are told apart by index
+int LBVHBuilder::delta(int i, int j) const
+{
+    if (j < 0 || j >= m_count)
+        return -1;
+    uint64_t a = m_codes[i];
+    uint64_t b = m_codes[j];
+    if (a == b)
+        return 64 + count_leading_zeros(static_cast<uint64_t>(i ^ j));
+    return count_leading_zeros(a ^ b);
+}
+
+void LBVHBuilder::emit_hierarchy()
+{
+    int n = m_count;
+    int nodes = 2 * n - 1;
+    m_left.assign(nodes, -1);
+    m_right.assign(nodes, -1);
+    m_parent.assign(nodes, -1);
+
+    // every internal node finds its key range and split independently
+    parallel_for(n - 1, m_threadCount, [&](int i) {
+        int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+        int delta_min = delta(i, i - d);
+
+        int l_max = 2;
+        while (delta(i, i + l_max * d) > delta_min)
+            l_max *= 2;
+        int l = 0;
+        for (int t = l_max / 2; t >= 1; t /= 2)
+        {
+            if (delta(i, i + (l + t) * d) > delta_min)
+                l += t;
+        }
+        int j = i + l * d;
+
+        int delta_node = delta(i, j);
+        int s = 0;
+        for (int div = 2; ; div *= 2)
+        {
+            int t = (l + div - 1) / div;
+            if (delta(i, i + (s + t) * d) > delta_node)
+                s += t;
+            if (t == 1)
+                break;
+        }
+        int split = i + s * d + (d < 0 ? -1 : 0);
+
+        int left = std::min(i, j) == split ? n - 1 + split : split;
+        int right = std::max(i, j) == split + 1 ? n - 1 + split + 1 : split + 1;
+        m_left[i] = left;
+        m_right[i] = right;
+        m_parent[left] = i;
+        m_parent[right] = i;
+    });
+}
+
+// bottom-up bounds: a thread climbs from every leaf and the second thread to
+// reach a node merges its children, so each node is done exactly once
+void LBVHBuilder::compute_bounds(const std::vector<Sphere>& spheres)
+{
+    int n = m_count;
+    m_bounds.assign(2 * n - 1, AABB());
+    m_primCount.assign(2 * n - 1, 1);
+    std::vector<std::atomic<int>> visits(n > 1 ? n - 1 : 1);
+    for (auto& v : visits)
+        v.store(0);
+
+    parallel_for(n, m_threadCount, [&](int i) {
+        int node = n - 1 + i;
+        m_bounds[node] = spheres[m_order[i]].bounds();
+        int parent = m_parent[node];
+        while (parent >= 0)
+        {
+            if (visits[parent].fetch_add(1, std::memory_order_acq_rel) == 0)
+                break;
+            AABB b = m_bounds[m_left[parent]];
+            b.grow(m_bounds[m_right[parent]]);
+            m_bounds[parent] = b;
+            m_primCount[parent] = m_primCount[m_left[parent]] + m_primCount[m_right[parent]];
+            parent = m_parent[parent];
+        }
+    });
+}
+
+// treelet optimization runs bottom-up over the whole tree. The top of the
+// tree is split into independent subtrees that are optimized in parallel,
+// then the few nodes above them are done last, children before parents.
+void LBVHBuilder::optimize_treelets()
+{
+    m_cost.assign(2 * m_count - 1, 0);
+    int threads = m_threadCount > 0 ? m_threadCount : default_thread_count();
+
+    std::vector<int> roots(1, 0);
+    std::vector<int> top;
+    while (static_cast<int>(roots.size()) < 4 * threads)
+    {
+        // open the biggest internal subtree
+        int best = -1;
+        for (int k = 0; k < static_cast<int>(roots.size()); ++k)
+        {
+            if (m_left[roots[k]] >= 0 && (best < 0 || m_primCount[roots[k]] > m_primCount[roots[best]]))
+                best = k;
+        }
+        if (best < 0)
+            break;
+        int node = roots[best];
+        top.push_back(node);
+        roots[best] = m_left[node];
+        roots.push_back(m_right[node]);
+    }
+
+    parallel_chunks(static_cast<int>(roots.size()), threads, [&](int, int begin, int end) {
+        std::unique_ptr<Treelet> treelet(new Treelet());
+        for (int k = begin; k < end; ++k)
+            optimize_subtree(roots[k], *treelet);
+    });
+
+    Treelet treelet;
+    for (int k = static_cast<int>(top.size()) - 1; k >= 0; --k)
+    {
+        node_cost(top[k]);
+        optimize_treelet(top[k], treelet);
+    }
+}
+
+void LBVHBuilder::optimize_subtree(int node, Treelet& treelet)
+{
+    // small subtrees become a single leaf when compacted, nothing to restructure
+    if (m_left[node] >= 0 && m_primCount[node] > BVH::max_leaf_size)
+    {
+        optimize_subtree(m_left[node], treelet);
+        optimize_subtree(m_right[node], treelet);
+        node_cost(node);
+        optimize_treelet(node, treelet);
+        return;
+    }
+    node_cost(node);
+}
+
+// SAH cost (not normalized by the root area) of the subtree under node
+void LBVHBuilder::node_cost(int node)
+{
+    float area = m_bounds[node].surface_area();
+    if (m_left[node] < 0 || m_primCount[node] <= BVH::max_leaf_size)
+        m_cost[node] = area * m_primCount[node];
+    else
+        m_cost[node] = BVH::traversal_cost * area + m_cost[m_left[node]] + m_cost[m_right[node]];
+}
+
+// restructure the treelet under root into the cheapest binary tree over its leaves
+void LBVHBuilder::optimize_treelet(int root, Treelet& treelet)
+{
+    // grow the treelet by repeatedly opening its largest internal leaf
+    std::vector<int> free_slots;
+    int leaf_count = 2;
+    treelet.m_leaves[0] = m_left[root];
+    treelet.m_leaves[1] = m_right[root];
+    while (leaf_count < treelet_size)
+    {
+        int best = -1;
+        float best_area = -1;
+        for (int k = 0; k < leaf_count; ++k)
+        {
+            int node = treelet.m_leaves[k];
+            if (m_left[node] >= 0 && m_primCount[node] > BVH::max_leaf_size && m_bounds[node].surface_area() > best_area)
+            {
+                best = k;
+                best_area = m_bounds[node].surface_area();
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = treelet.m_leaves[best];
+        free_slots.push_back(opened);
+        treelet.m_leaves[best] = m_left[opened];
+        treelet.m_leaves[leaf_count++] = m_right[opened];
+    }
+    if (leaf_count < 3)
+        return;
+
+    // bounds of every subset of leaves, each built from a smaller one
+    int full = (1 << leaf_count) - 1;
+    for (int k = 0; k < leaf_count; ++k)
+    {
+        treelet.m_subsetBounds[1 << k] = m_bounds[treelet.m_leaves[k]];
+        treelet.m_subsetCost[1 << k] = m_cost[treelet.m_leaves[k]];
+    }
+    for (int subset = 1; subset <= full; ++subset)
+    {
+        int low = subset & -subset;
+        if (subset != low)
+        {
+            treelet.m_subsetBounds[subset] = treelet.m_subsetBounds[subset ^ low];
+            treelet.m_subsetBounds[subset].grow(treelet.m_subsetBounds[low]);
+        }
+    }
+
+    // cheapest tree for every subset, smallest subsets first
+    for (int size = 2; size <= leaf_count; ++size)
+    {
+        for (int subset = 1; subset <= full; ++subset)
+        {
+            if (count_bits(subset) != size)
+                continue;
+            float best = std::numeric_limits<float>::infinity();
+            int best_split = 0;
+            // only partitions holding the lowest bit, so each split is seen once
+            int low = subset & -subset;
+            for (int part = (subset - 1) & subset; part > 0; part = (part - 1) & subset)
+            {
+                if (!(part & low))
+                    continue;
+                float c = treelet.m_subsetCost[part] + treelet.m_subsetCost[subset ^ part];
+                if (c < best)
+                {
+                    best = c;
+                    best_split = part;
+                }
+            }
+            treelet.m_subsetCost[subset] = BVH::traversal_cost * treelet.m_subsetBounds[subset].surface_area() + best;
+            treelet.m_subsetSplit[subset] = best_split;
+        }
+    }
+
+    if (treelet.m_subsetCost[full] >= m_cost[root] * 0.999f)
+        return;
+    assign_treelet(full, root, treelet, free_slots);
+}
+
+// rebuild the subtree for subset into root_slot, internal nodes come from free_slots
+int LBVHBuilder::assign_treelet(int subset, int root_slot, Treelet& treelet, std::vector<int>& free_slots)
+{
+    if ((subset & (subset - 1)) == 0)
+    {
+        int k = 0;
+        while (!(subset & (1 << k)))
+            ++k;
+        return treelet.m_leaves[k];
+    }
+    int node = root_slot;
+    if (node < 0)
+    {
+        node = free_slots.back();
+        free_slots.pop_back();
+    }
+    int left = assign_treelet(treelet.m_subsetSplit[subset], -1, treelet, free_slots);
+    int right = assign_treelet(subset ^ treelet.m_subsetSplit[subset], -1, treelet, free_slots);
+    m_left[node] = left;
+    m_right[node] = right;
+    m_parent[left] = node;
+    m_parent[right] = node;
+    m_bounds[node] = treelet.m_subsetBounds[subset];
+    m_primCount[node] = m_primCount[left] + m_primCount[right];
+    m_cost[node] = treelet.m_subsetCost[subset];
+    return node;
+}
+
+// write the tree out in depth-first order, collapsing small subtrees into leaves
+void LBVHBuilder::compact(BVH& bvh, const std::vector<Sphere>& spheres)
+{
+    bvh.m_indices.resize(m_count);
+    bvh.m_nodes.reserve(2 * m_count / BVH::max_leaf_size + 1);
+    int first = 0;
+    bvh.m_root = emit_node(bvh, spheres, 0, first);
+}
+
+int LBVHBuilder::emit_node(BVH& bvh, const std::vector<Sphere>& spheres, int node, int& first)
+{
+    int index = bvh.alloc_node();
+    BVHNode& out = bvh.m_nodes[index];
+    out.m_bounds = m_bounds[node];
+    out.m_builtArea = m_bounds[node].surface_area();
+    out.m_first = first;
+    out.m_count = m_primCount[node];
+    out.m_left = out.m_right = -1;
+
+    if (m_primCount[node] <= BVH::max_leaf_size || m_left[node] < 0)
+    {
+        // gather the subtree's spheres into the leaf
+        std::vector<int> stack(1, node);
+        while (!stack.empty())
+        {
+            int k = stack.back();
+            stack.pop_back();
+            if (m_left[k] < 0)
+            {
+                bvh.m_indices[first++] = m_order[k - (m_count - 1)];
+            }
+            else
+            {
+                stack.push_back(m_right[k]);
+                stack.push_back(m_left[k]);
+            }
+        }
+        return index;
+    }
+
+    int left = emit_node(bvh, spheres, m_left[node], first);
+    int right = emit_node(bvh, spheres, m_right[node], first);
+    bvh.m_nodes[index].m_left = left;
+    bvh.m_nodes[index].m_right = right;
+    return index;
+}
+
+#endif
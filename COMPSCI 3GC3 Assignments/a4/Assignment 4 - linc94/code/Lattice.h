@@ -0,0 +1,163 @@
+#ifndef LATTICE_H
+#define LATTICE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "AABB.h"
+#include "Grid.h"
+#include "Sphere.h"
+#include "TraversalStats.h"
+
+// a field of spheres that is never stored. Cell (x, y, z) of a lattice of
+// m_spacing wide cells holds at most one sphere, and whether it does, its
+// radius, where it sits and its material all come from a hash of the cell
+// coordinate and m_seed. Rays walk the cells with the grid DDA and make up the
+// sphere of each cell they enter, so memory stays constant however many cells
+// there are and every thread, pass and render sees the same spheres.
+class SphereLattice
+{
+public:
+    SphereLattice() {}
+    // cells [-half_extent, half_extent) around the origin in x and z, layers
+    // cells tall starting at y = base; spheres pick from materials
+    SphereLattice(float spacing, int half_extent, int layers, float base, const std::vector<int>& materials,
+                  uint64_t seed = 1);
+
+    HitResult hit(Ray& ray, float min_t, float max_t);
+    bool occludes(Ray& ray, float min_t, float max_t);
+
+    // the sphere of cell (x, y, z), counted from the lattice's low corner, false for an empty cell
+    bool instance(int x, int y, int z, Sphere& sphere) const;
+    AABB bounds() const
+    {
+        return m_bounds;
+    }
+    double cell_count() const
+    {
+        return static_cast<double>(m_res[0]) * m_res[1] * m_res[2];
+    }
+
+    float m_spacing;
+    // radii are drawn from [m_minRadius, m_maxRadius], at most half the spacing
+    // so every sphere stays inside its own cell
+    float m_minRadius;
+    float m_maxRadius;
+    // chance of a cell holding a sphere
+    float m_occupancy;
+    // indices into World::m_materials
+    std::vector<int> m_materials;
+    uint64_t m_seed;
+
+private:
+    static uint64_t mix(uint64_t k)
+    {
+        // splitmix64 finalizer
+        k ^= k >> 30;
+        k *= 0xbf58476d1ce4e5b9ull;
+        k ^= k >> 27;
+        k *= 0x94d049bb133111ebull;
+        k ^= k >> 31;
+        return k;
+    }
+    // ray parameter a little before the ray passes sphere; far from the ray
+    // origin the quadratic loses most of its precision, so spheres are
+    // intersected from a ray moved up to there
+    static float approach(Ray& ray, const Sphere& sphere, float min_t)
+    {
+        Vector3D d = ray.direction();
+        float t = dot(sphere.m_center - ray.origin(), d) / d.length_squared() - 2 * sphere.m_radius / d.length();
+        return fmaxf(t, min_t);
+    }
+    // bits [shift, shift + 16) of h as a float in [0, 1)
+    static float unit(uint64_t h, int shift)
+    {
+        return ((h >> shift) & 0xFFFF) / 65536.0f;
+    }
+
+    AABB m_bounds;
+    int m_res[3];
+    float m_cellSize[3];
+};
+
+SphereLattice::SphereLattice(float spacing, int half_extent, int layers, float base, const std::vector<int>& materials,
+                             uint64_t seed)
+{
+    m_spacing = spacing;
+    m_minRadius = 0.2f * spacing;
+    m_maxRadius = 0.35f * spacing;
+    m_occupancy = 1;
+    m_materials = materials;
+    m_seed = seed;
+    float half = half_extent * spacing;
+    m_bounds = AABB(Vector3D(-half, base, -half), Vector3D(half, base + layers * spacing, half));
+    m_res[0] = 2 * half_extent;
+    m_res[1] = layers;
+    m_res[2] = 2 * half_extent;
+    m_cellSize[0] = m_cellSize[1] = m_cellSize[2] = spacing;
+}
+
+bool SphereLattice::instance(int x, int y, int z, Sphere& sphere) const
+{
+    // 24 bits of x and z and 16 of y identify the cell
+    uint64_t key = (static_cast<uint64_t>(x & 0xFFFFFF) << 40) | (static_cast<uint64_t>(y & 0xFFFF) << 24) |
+                   static_cast<uint64_t>(z & 0xFFFFFF);
+    uint64_t h = mix(key ^ mix(m_seed));
+    if (unit(h, 0) >= m_occupancy)
+        return false;
+
+    float max_radius = fminf(m_maxRadius, 0.5f * m_spacing);
+    float radius = fminf(m_minRadius, max_radius) + unit(h, 16) * fmaxf(0.0f, max_radius - m_minRadius);
+    // anywhere in the cell that keeps the sphere inside it, resting on the cell's floor
+    float room = m_spacing - 2 * radius;
+    const Vector3D& lo = m_bounds.m_min;
+    sphere.m_center = Vector3D(lo.m_x + x * m_spacing + radius + unit(h, 32) * room, lo.m_y + y * m_spacing + radius,
+                               lo.m_z + z * m_spacing + radius + unit(h, 48) * room);
+    sphere.m_radius = radius;
+    sphere.m_material = m_materials[mix(h) % m_materials.size()];
+    return true;
+}
+
+HitResult SphereLattice::hit(Ray& ray, float min_t, float max_t)
+{
+    HitResult hit_result;
+    hit_result.m_t = max_t;
+    // spheres never leave their cell, so the first hit along the walk is the closest
+    grid_traverse(m_bounds, m_cellSize, m_res, ray, min_t, hit_result, [&](int x, int y, int z) {
+        Sphere sphere;
+        if (!instance(x, y, z, sphere))
+            return false;
+        COUNT_PRIMITIVE_TESTS(1);
+        float t0 = approach(ray, sphere, min_t);
+        Ray moved = ray;
+        moved.m_origin = ray.at(t0);
+        HitResult hit = sphere.hit(moved, min_t - t0, hit_result.m_t - t0);
+        if (!hit.m_isHit)
+            return false;
+        hit_result = hit;
+        hit_result.m_t += t0;
+        return true;
+    });
+    return hit_result;
+}
+
+bool SphereLattice::occludes(Ray& ray, float min_t, float max_t)
+{
+    HitResult segment;
+    segment.m_t = max_t;
+    bool blocked = false;
+    grid_traverse(m_bounds, m_cellSize, m_res, ray, min_t, segment, [&](int x, int y, int z) {
+        Sphere sphere;
+        if (!instance(x, y, z, sphere))
+            return false;
+        COUNT_PRIMITIVE_TESTS(1);
+        float t0 = approach(ray, sphere, min_t);
+        Ray moved = ray;
+        moved.m_origin = ray.at(t0);
+        blocked = sphere.occludes(moved, min_t - t0, max_t - t0);
+        return blocked;
+    });
+    return blocked;
+}
+
+#endif
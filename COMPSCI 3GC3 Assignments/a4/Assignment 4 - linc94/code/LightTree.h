@@ -0,0 +1,219 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "AABB.h"
+#include "Sphere.h"
+
+// emissive spheres in a binary tree storing each subtree's bounds and power
+// (after Conty Estevez & Kulla 2018). A shading point picks a light by walking
+// down from the root, choosing each child in proportion to how much it could
+// contribute there: power over squared distance, times the largest cosine the
+// point's normal can make with the child's bounds. Spheres radiate in every
+// direction, so the emitters' own orientation cone is always the full sphere
+// and only the receiving side is bounded.
+class LightTree
+{
+public:
+    LightTree()
+    {
+        m_uniform = false;
+    }
+
+    // lights are the spheres whose power (luminance times surface area, up to pi) is positive
+    void build(const std::vector<Sphere>& spheres, const std::vector<float>& power);
+    bool empty() const
+    {
+        return m_lights.empty();
+    }
+    int light_count() const
+    {
+        return static_cast<int>(m_lights.size());
+    }
+
+    // a light for the shading point (position, normal), returned as a sphere
+    // index with the probability of picking it, -1 when no light can reach the point
+    int pick(const Vector3D& position, const Vector3D& normal, float& pmf) const;
+    // probability of pick() choosing sphere from (position, normal), 0 if it isn't a light
+    float pmf(const Vector3D& position, const Vector3D& normal, int sphere) const;
+
+    // pick every light with the same probability instead, for comparison
+    bool m_uniform;
+
+private:
+    class Node
+    {
+    public:
+        AABB m_bounds;
+        float m_power;
+        // children, or -1 and the light (index into m_lights) for a leaf
+        int m_left;
+        int m_right;
+        int m_light;
+        int m_parent;
+    };
+
+    int build_node(std::vector<int>& order, int begin, int end, int parent, const std::vector<Sphere>& spheres,
+                   const std::vector<float>& power);
+    float importance(const Node& node, const Vector3D& position, const Vector3D& normal) const;
+
+    std::vector<Node> m_nodes;
+    // sphere index of every light, and the leaf node of every light
+    std::vector<int> m_lights;
+    std::vector<int> m_leaves;
+    // light index of every sphere, -1 for spheres that don't emit
+    std::vector<int> m_lightOfSphere;
+};
+
+void LightTree::build(const std::vector<Sphere>& spheres, const std::vector<float>& power)
+{
+    m_nodes.clear();
+    m_lights.clear();
+    m_lightOfSphere.assign(spheres.size(), -1);
+    for (size_t s = 0; s < spheres.size(); ++s)
+    {
+        if (power[s] > 0)
+        {
+            m_lightOfSphere[s] = static_cast<int>(m_lights.size());
+            m_lights.push_back(static_cast<int>(s));
+        }
+    }
+    m_leaves.assign(m_lights.size(), -1);
+    if (m_lights.empty())
+        return;
+
+    std::vector<int> order(m_lights.size());
+    for (size_t l = 0; l < order.size(); ++l)
+        order[l] = static_cast<int>(l);
+    m_nodes.reserve(2 * m_lights.size());
+    build_node(order, 0, static_cast<int>(order.size()), -1, spheres, power);
+}
+
+int LightTree::build_node(std::vector<int>& order, int begin, int end, int parent, const std::vector<Sphere>& spheres,
+                          const std::vector<float>& power)
+{
+    int index = static_cast<int>(m_nodes.size());
+    m_nodes.push_back(Node());
+    Node node;
+    node.m_power = 0;
+    node.m_left = -1;
+    node.m_right = -1;
+    node.m_light = -1;
+    node.m_parent = parent;
+    AABB centroids;
+    for (int k = begin; k < end; ++k)
+    {
+        const Sphere& sphere = spheres[m_lights[order[k]]];
+        node.m_bounds.grow(sphere.bounds());
+        node.m_power += power[m_lights[order[k]]];
+        centroids.grow(sphere.m_center);
+    }
+
+    if (end - begin == 1)
+    {
+        node.m_light = order[begin];
+        m_leaves[order[begin]] = index;
+        m_nodes[index] = node;
+        return index;
+    }
+
+    // median split along the widest spread of centers
+    int axis = centroids.longest_axis();
+    int middle = (begin + end) / 2;
+    auto coordinate = [&](int light) {
+        const Vector3D& c = spheres[m_lights[light]].m_center;
+        return axis == 0 ? c.m_x : (axis == 1 ? c.m_y : c.m_z);
+    };
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                     [&](int a, int b) { return coordinate(a) < coordinate(b); });
+    node.m_left = build_node(order, begin, middle, index, spheres, power);
+    node.m_right = build_node(order, middle, end, index, spheres, power);
+    m_nodes[index] = node;
+    return index;
+}
+
+float LightTree::importance(const Node& node, const Vector3D& position, const Vector3D& normal) const
+{
+    Vector3D to_center = node.m_bounds.center() - position;
+    float distance_squared = to_center.length_squared();
+    float radius_squared = 0.25f * node.m_bounds.extent().length_squared();
+
+    // largest cosine between the normal and any direction into the bounds' sphere
+    float cos_bound = 1;
+    if (distance_squared > radius_squared)
+    {
+        float distance = sqrtf(distance_squared);
+        float theta = acosf(clamp(dot(normal, to_center) / distance, -1, 1));
+        float theta_bounds = asinf(sqrtf(radius_squared / distance_squared));
+        cos_bound = theta > theta_bounds ? cosf(theta - theta_bounds) : 1;
+        if (cos_bound <= 0)
+            return 0;
+    }
+    // up close the distance stops mattering, the whole subtree is around the point
+    return node.m_power * cos_bound / fmaxf(distance_squared, radius_squared);
+}
+
+int LightTree::pick(const Vector3D& position, const Vector3D& normal, float& pmf) const
+{
+    pmf = 0;
+    if (m_lights.empty())
+        return -1;
+    if (m_uniform)
+    {
+        int light = static_cast<int>(random_float() * m_lights.size());
+        light = light < light_count() ? light : light_count() - 1;
+        pmf = 1.0f / m_lights.size();
+        return m_lights[light];
+    }
+
+    int node = 0;
+    float probability = 1;
+    while (m_nodes[node].m_light < 0)
+    {
+        float left = importance(m_nodes[m_nodes[node].m_left], position, normal);
+        float right = importance(m_nodes[m_nodes[node].m_right], position, normal);
+        if (left + right <= 0)
+            return -1;
+        float p_left = left / (left + right);
+        if (random_float() < p_left)
+        {
+            probability *= p_left;
+            node = m_nodes[node].m_left;
+        }
+        else
+        {
+            probability *= 1 - p_left;
+            node = m_nodes[node].m_right;
+        }
+    }
+    pmf = probability;
+    return m_lights[m_nodes[node].m_light];
+}
+
+float LightTree::pmf(const Vector3D& position, const Vector3D& normal, int sphere) const
+{
+    if (sphere < 0 || sphere >= static_cast<int>(m_lightOfSphere.size()) || m_lightOfSphere[sphere] < 0)
+        return 0;
+    if (m_uniform)
+        return 1.0f / m_lights.size();
+
+    // the choices pick() makes on the way down, evaluated from the leaf up
+    float probability = 1;
+    int node = m_leaves[m_lightOfSphere[sphere]];
+    while (m_nodes[node].m_parent >= 0)
+    {
+        const Node& parent = m_nodes[m_nodes[node].m_parent];
+        float left = importance(m_nodes[parent.m_left], position, normal);
+        float right = importance(m_nodes[parent.m_right], position, normal);
+        if (left + right <= 0)
+            return 0;
+        probability *= (parent.m_left == node ? left : right) / (left + right);
+        node = m_nodes[node].m_parent;
+    }
+    return probability;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+// a byte range of a file in memory. Where mmap exists the range is mapped
+// and the kernel pages it in from the page cache (all of it up front with
+// populate on linux, otherwise as it is touched); everywhere else the range
+// is read into a buffer, and written back on unmap() when writable.
+class MappedFile
+{
+public:
+    MappedFile()
+    {
+        m_data = nullptr;
+        m_size = 0;
+        m_base = nullptr;
+        m_baseSize = 0;
+        m_writable = false;
+        m_offset = 0;
+    }
+    ~MappedFile()
+    {
+        unmap();
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // size bytes of path starting at offset, which must all exist in the file
+    bool map(const std::string& path, uint64_t offset, size_t size, bool writable = false, bool populate = false);
+    void unmap();
+
+    char* data()
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    char* m_data;
+    size_t m_size;
+    // the page aligned mapping m_data lies in
+    void* m_base;
+    size_t m_baseSize;
+    // the read fallback's copy and where it came from
+    std::vector<char> m_buffer;
+    std::string m_path;
+    uint64_t m_offset;
+    bool m_writable;
+};
+
+bool MappedFile::map(const std::string& path, uint64_t offset, size_t size, bool writable, bool populate)
+{
+    unmap();
+    if (size == 0)
+        return true;
+#ifdef HAVE_MMAP
+    int fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return false;
+    // mappings start on a page boundary
+    uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t aligned = offset / page * page;
+    int flags = MAP_SHARED;
+#ifdef __linux__
+    if (populate)
+        flags |= MAP_POPULATE;
+#else
+    (void)populate;
+#endif
+    size_t length = static_cast<size_t>(size + (offset - aligned));
+    void* base = mmap(nullptr, length, PROT_READ | (writable ? PROT_WRITE : 0), flags, fd, static_cast<off_t>(aligned));
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    m_base = base;
+    m_baseSize = length;
+    m_data = static_cast<char*>(base) + (offset - aligned);
+#else
+    (void)populate;
+    std::ifstream in(path, std::ios::binary);
+    m_buffer.resize(size);
+    if (!in.seekg(static_cast<std::streamoff>(offset)) || !in.read(m_buffer.data(), static_cast<std::streamsize>(size)))
+    {
+        m_buffer.clear();
+        return false;
+    }
+    m_path = path;
+    m_offset = offset;
+    m_writable = writable;
+    m_data = m_buffer.data();
+#endif
+    m_size = size;
+    return true;
+}
+
+void MappedFile::unmap()
+{
+#ifdef HAVE_MMAP
+    if (m_base)
+        munmap(m_base, m_baseSize);
+#else
+    if (m_writable && !m_buffer.empty())
+    {
+        std::fstream out(m_path, std::ios::binary | std::ios::in | std::ios::out);
+        out.seekp(static_cast<std::streamoff>(m_offset));
+        out.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+    }
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    m_writable = false;
+#endif
+    m_base = nullptr;
+    m_baseSize = 0;
+    m_data = nullptr;
+    m_size = 0;
+}
+
+// create path as a file of size bytes (sparse where the file system allows),
+// so it can be mapped writable
+bool create_file(const std::string& path, uint64_t size)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    if (size > 0)
+    {
+        out.seekp(static_cast<std::streamoff>(size - 1));
+        out.put(0);
+    }
+    return static_cast<bool>(out);
+}
+
+#endif
@@ -1,7 +1,11 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
-class HitResult;
+#include <vector>
+
+#include "Arena.h"
+#include "Sphere.h"
+#include "Texture.h"
 
 class ReflectResult
 {
@@ -15,6 +19,23 @@ class Material
 public:
     Vector3D m_color;
     virtual ReflectResult reflect(Ray& ray, HitResult& hit) = 0;
+    // copy of this material allocated in another arena
+    virtual Material* clone(Arena& arena) const = 0;
+    // lambertian surfaces get light sampled explicitly when there is an environment map
+    virtual bool is_diffuse() const
+    {
+        return false;
+    }
+    // emissive surfaces radiate m_color and reflect nothing
+    virtual bool is_emissive() const
+    {
+        return false;
+    }
+    // surface color at a hit, textured materials look it up
+    virtual Vector3D albedo(Ray& ray, HitResult& hit)
+    {
+        return m_color;
+    }
 };
 
 
@@ -25,6 +46,16 @@ public:
     {
         m_color = color;
     };
+
+    virtual Material* clone(Arena& arena) const override
+    {
+        return arena.create<Diffuse>(m_color);
+    }
+
+    virtual bool is_diffuse() const override
+    {
+        return true;
+    }
     
     // TODO 4
     virtual ReflectResult reflect(Ray& ray, HitResult& hit) override
@@ -64,6 +95,11 @@ public:
     {
         m_color = color;
     }
+
+    virtual Material* clone(Arena& arena) const override
+    {
+        return arena.create<Specular>(m_color);
+    }
     
     // TODO 5
     virtual ReflectResult reflect(Ray& ray, HitResult& hit) override
@@ -89,4 +125,124 @@ public:
         return res;
     }
 };
+
+// light source, m_color is the radiance it gives off in every direction (and can exceed 1)
+class Emissive : public Material
+{
+public:
+    Emissive(const Vector3D& color)
+    {
+        m_color = color;
+    }
+
+    virtual Material* clone(Arena& arena) const override
+    {
+        return arena.create<Emissive>(m_color);
+    }
+
+    virtual bool is_emissive() const override
+    {
+        return true;
+    }
+
+    // never called, paths end at lights
+    virtual ReflectResult reflect(Ray& ray, HitResult& hit) override
+    {
+        ReflectResult res;
+        res.m_ray.m_origin = hit.m_hitPos;
+        res.m_ray.m_direction = ray.direction();
+        res.m_color = Vector3D(0, 0, 0);
+        return res;
+    }
+};
+
+// diffuse surface colored by a texture from a TextureCache, tinted by m_color
+class Textured : public Material
+{
+public:
+    Textured(const Vector3D& color, TextureCache* cache, int texture)
+    {
+        m_color = color;
+        m_cache = cache;
+        m_texture = texture;
+    }
+
+    virtual Material* clone(Arena& arena) const override
+    {
+        return arena.create<Textured>(m_color, m_cache, m_texture);
+    }
+
+    virtual bool is_diffuse() const override
+    {
+        return true;
+    }
+
+    virtual Vector3D albedo(Ray& ray, HitResult& hit) override;
+
+    virtual ReflectResult reflect(Ray& ray, HitResult& hit) override
+    {
+        // same bounce as Diffuse
+        ReflectResult res;
+        res.m_ray.m_origin = hit.m_hitPos;
+        res.m_ray.m_direction = normalize(normalize(Vector3D::random(-1, 1)) + normalize(hit.m_hitNormal));
+        res.m_color = albedo(ray, hit);
+        return res;
+    }
+
+    TextureCache* m_cache;
+    int m_texture;
+};
+
+// every material of a scene, allocated in one arena and addressed by index
+class MaterialPool
+{
+public:
+    MaterialPool() {}
+    // deep copy, the copy's materials live in its own arena
+    MaterialPool(const MaterialPool& other)
+    {
+        for (Material* m : other.m_materials)
+            m_materials.push_back(m->clone(m_arena));
+    }
+    MaterialPool& operator=(const MaterialPool&) = delete;
+
+    template <typename T, typename... Args>
+    int add(const Vector3D& color, Args... args)
+    {
+        m_materials.push_back(m_arena.create<T>(color, args...));
+        return static_cast<int>(m_materials.size()) - 1;
+    }
+    Material* get(int index)
+    {
+        return m_materials[index];
+    }
+    int size() const
+    {
+        return static_cast<int>(m_materials.size());
+    }
+    size_t bytes_used() const
+    {
+        return m_arena.bytes_used();
+    }
+    void clear()
+    {
+        m_materials.clear();
+        // every material goes away in one release
+        m_arena.release();
+    }
+
+private:
+    Arena m_arena;
+    std::vector<Material*> m_materials;
+};
+
+Vector3D Textured::albedo(Ray& ray, HitResult& hit)
+{
+    Sphere::uv(hit);
+    // a cone hitting the surface at a grazing angle covers a longer strip of it
+    float cos_theta = fabsf(dot(normalize(ray.direction()), normalize(hit.m_hitNormal)));
+    float footprint = hit.m_coneWidth * hit.m_uvScale / fmaxf(cos_theta, 0.05f);
+    return m_color * m_cache->sample(m_texture, hit.m_u, hit.m_v, footprint);
+}
+
 #endif
@@ -0,0 +1,48 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+
+// number of workers used when a caller asks for 0
+int default_thread_count()
+{
+    int count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+// run fn(chunk, begin, end) over [0, count) split into one contiguous chunk per thread
+template <typename F>
+void parallel_chunks(int count, int thread_count, F fn)
+{
+    if (thread_count <= 0)
+        thread_count = default_thread_count();
+    if (thread_count > count)
+        thread_count = count > 0 ? count : 1;
+    if (thread_count == 1)
+    {
+        fn(0, 0, count);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; ++t)
+    {
+        int begin = static_cast<int>(static_cast<long long>(count) * t / thread_count);
+        int end = static_cast<int>(static_cast<long long>(count) * (t + 1) / thread_count);
+        threads.push_back(std::thread(fn, t, begin, end));
+    }
+    for (auto& t : threads)
+        t.join();
+}
+
+// run fn(i) for every i in [0, count)
+template <typename F>
+void parallel_for(int count, int thread_count, F fn)
+{
+    parallel_chunks(count, thread_count, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            fn(i);
+    });
+}
+
+#endif
@@ -0,0 +1,436 @@
+#ifndef PATHGUIDE_H
+#define PATHGUIDE_H
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "AABB.h"
+#include "Vector3D.h"
+
+// lock-free float accumulation for the recording trees
+void atomic_add(std::atomic<float>& target, float value)
+{
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        ;
+}
+
+// quadtree over the square of world-space directions (cos theta about +y, phi),
+// an equal-area mapping, so a quadrant's energy is proportional to its solid
+// angle integral. Each node stores the energy of its four quadrants.
+class DirectionalTree
+{
+public:
+    class Node
+    {
+    public:
+        Node()
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                m_sum[q] = 0;
+                m_child[q] = 0;
+            }
+        }
+        Node(const Node& other)
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                m_sum[q] = other.m_sum[q].load(std::memory_order_relaxed);
+                m_child[q] = other.m_child[q];
+            }
+        }
+        Node& operator=(const Node& other)
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                m_sum[q] = other.m_sum[q].load(std::memory_order_relaxed);
+                m_child[q] = other.m_child[q];
+            }
+            return *this;
+        }
+
+        std::atomic<float> m_sum[4];
+        // 0 for a leaf quadrant (the root is never a child)
+        int m_child[4];
+    };
+
+    DirectionalTree()
+    {
+        m_nodes.resize(1);
+        m_total = 0;
+    }
+
+    // adds value to the leaf quadrant holding dir, any number of threads at once
+    void record(const Vector3D& dir, float value);
+    // a direction drawn proportionally to the energy, with its solid angle pdf
+    Vector3D sample(float& pdf) const;
+    float pdf(const Vector3D& dir) const;
+
+    // sums every node's quadrants from its children, m_total from the root
+    void build();
+    // a tree whose leaves hold about threshold of the total energy or less (but
+    // no deeper than max_depth), emptied for recording the next iteration
+    DirectionalTree refined(float threshold, int max_depth) const;
+    bool trained() const
+    {
+        return m_total > 0;
+    }
+
+    std::vector<Node> m_nodes;
+    float m_total;
+
+private:
+    static void to_square(const Vector3D& dir, float& x, float& y)
+    {
+        x = clamp(0.5f * (dir.m_y + 1), 0, 0.99999f);
+        float phi = atan2f(dir.m_z, dir.m_x);
+        y = phi < 0 ? phi / (2 * M_PI) + 1 : phi / (2 * M_PI);
+        y = clamp(y, 0, 0.99999f);
+    }
+    static Vector3D from_square(float x, float y)
+    {
+        float cos_theta = 2 * x - 1;
+        float sin_theta = sqrtf(fmaxf(0.0f, 1 - cos_theta * cos_theta));
+        float phi = 2 * M_PI * y;
+        return Vector3D(sin_theta * cosf(phi), cos_theta, sin_theta * sinf(phi));
+    }
+    // quadrant of (x, y) in the unit square, which is then rescaled to that quadrant
+    static int quadrant(float& x, float& y)
+    {
+        int q = 0;
+        if (x >= 0.5f)
+        {
+            q |= 1;
+            x -= 0.5f;
+        }
+        if (y >= 0.5f)
+        {
+            q |= 2;
+            y -= 0.5f;
+        }
+        x *= 2;
+        y *= 2;
+        return q;
+    }
+    float build_node(int index);
+};
+
+void DirectionalTree::record(const Vector3D& dir, float value)
+{
+    float x, y;
+    to_square(dir, x, y);
+    int node = 0;
+    while (true)
+    {
+        int q = quadrant(x, y);
+        if (m_nodes[node].m_child[q] == 0)
+        {
+            atomic_add(m_nodes[node].m_sum[q], value);
+            return;
+        }
+        node = m_nodes[node].m_child[q];
+    }
+}
+
+Vector3D DirectionalTree::sample(float& pdf) const
+{
+    // descend by energy, the density of the final quadrant is its share over its area
+    float x0 = 0, y0 = 0, size = 1;
+    float probability = 1;
+    int node = 0;
+    while (true)
+    {
+        const Node& n = m_nodes[node];
+        float sums[4];
+        float total = 0;
+        for (int q = 0; q < 4; ++q)
+        {
+            sums[q] = n.m_sum[q].load(std::memory_order_relaxed);
+            total += sums[q];
+        }
+        float pick = random_float() * total;
+        int q = 0;
+        while (q < 3 && pick >= sums[q])
+            pick -= sums[q++];
+        // floating point can leave us on an empty quadrant past the end
+        while (q > 0 && sums[q] <= 0)
+            --q;
+        probability *= sums[q] / total;
+        size *= 0.5f;
+        x0 += (q & 1) ? size : 0;
+        y0 += (q & 2) ? size : 0;
+        if (n.m_child[q] == 0)
+            break;
+        node = n.m_child[q];
+    }
+    // the square maps onto the sphere's 4 pi with constant jacobian
+    pdf = probability / (size * size) / (4 * M_PI);
+    return from_square(x0 + random_float() * size, y0 + random_float() * size);
+}
+
+float DirectionalTree::pdf(const Vector3D& dir) const
+{
+    if (!trained())
+        return 0;
+    float x, y;
+    to_square(dir, x, y);
+    float density = 1;
+    int node = 0;
+    while (true)
+    {
+        const Node& n = m_nodes[node];
+        float total = 0;
+        for (int q = 0; q < 4; ++q)
+            total += n.m_sum[q].load(std::memory_order_relaxed);
+        int q = quadrant(x, y);
+        if (total <= 0)
+            return 0;
+        // a quadrant covers a quarter of its parent
+        density *= 4 * n.m_sum[q].load(std::memory_order_relaxed) / total;
+        if (n.m_child[q] == 0 || density <= 0)
+            break;
+        node = n.m_child[q];
+    }
+    return density / (4 * M_PI);
+}
+
+void DirectionalTree::build()
+{
+    m_total = build_node(0);
+}
+
+float DirectionalTree::build_node(int index)
+{
+    float total = 0;
+    for (int q = 0; q < 4; ++q)
+    {
+        int child = m_nodes[index].m_child[q];
+        if (child != 0)
+            m_nodes[index].m_sum[q] = build_node(child);
+        total += m_nodes[index].m_sum[q];
+    }
+    return total;
+}
+
+DirectionalTree DirectionalTree::refined(float threshold, int max_depth) const
+{
+    DirectionalTree result;
+    if (!trained())
+        return result;
+
+    // breadth first over (node in this tree or -1 past its leaves, energy, depth)
+    class Item
+    {
+    public:
+        int m_source;
+        int m_target;
+        float m_energy;
+        int m_depth;
+    };
+    std::vector<Item> queue;
+    queue.push_back({ 0, 0, m_total, 1 });
+    for (size_t k = 0; k < queue.size(); ++k)
+    {
+        Item item = queue[k];
+        for (int q = 0; q < 4; ++q)
+        {
+            // a leaf quadrant's energy is spread evenly over the quadrants it's split into
+            float energy = item.m_source >= 0 ? m_nodes[item.m_source].m_sum[q].load(std::memory_order_relaxed)
+                                              : item.m_energy / 4;
+            if (energy <= threshold * m_total || item.m_depth >= max_depth)
+                continue;
+            int child = static_cast<int>(result.m_nodes.size());
+            result.m_nodes.push_back(Node());
+            result.m_nodes[item.m_target].m_child[q] = child;
+            int source = item.m_source >= 0 ? m_nodes[item.m_source].m_child[q] : 0;
+            queue.push_back({ source != 0 ? source : -1, child, energy, item.m_depth + 1 });
+        }
+    }
+    return result;
+}
+
+// practical path guiding (Mueller et al. 2017): a binary kd-tree over the
+// scene whose leaves each hold a directional quadtree of incident radiance.
+// Training runs over progressive iterations of doubling sample counts; every
+// iteration records into fresh trees while sampling from the previous
+// iteration's, then refine() rebuilds both trees from what was recorded.
+class PathGuide
+{
+public:
+    PathGuide()
+    {
+        m_bsdfFraction = 0.5f;
+        m_spatialThreshold = 4000;
+        m_directionalThreshold = 0.01f;
+        m_maxDepth = 20;
+        m_iteration = 0;
+        m_recording = false;
+        reset(AABB(Vector3D(-1, -1, -1), Vector3D(1, 1, 1)));
+    }
+    PathGuide(const PathGuide&) = delete;
+    PathGuide& operator=(const PathGuide&) = delete;
+
+    // forget everything and cover bounds (points outside are clamped into it)
+    void reset(const AABB& bounds);
+    // records the radiance arriving at position from dir, weighted by 1 / its sampling pdf
+    void record(const Vector3D& position, const Vector3D& dir, float radiance)
+    {
+        Leaf& leaf = m_leaves[leaf_index(position)];
+        leaf.m_recording.record(dir, radiance);
+        leaf.m_samples.fetch_add(1, std::memory_order_relaxed);
+    }
+    // learned distribution at position, untrained before the first refine()
+    const DirectionalTree& distribution(const Vector3D& position) const
+    {
+        return m_leaves[leaf_index(position)].m_sampling;
+    }
+    // ends an iteration of samples_per_pixel: splits leaves that saw enough
+    // samples and turns what was recorded into the sampling distributions
+    void refine(int samples_per_pixel);
+
+    int leaf_count() const
+    {
+        return static_cast<int>(m_leaves.size());
+    }
+    int directional_node_count() const;
+    size_t memory_bytes() const;
+
+    // probability of sampling the bounce lambertian rather than from the guide
+    float m_bsdfFraction;
+    // a leaf splits after c * sqrt(samples per pixel of the iteration) records
+    float m_spatialThreshold;
+    // quadrants holding more than this share of a leaf's energy are subdivided
+    float m_directionalThreshold;
+    int m_maxDepth;
+    int m_iteration;
+    // only record while true, the renderer sets it for training iterations
+    bool m_recording;
+
+private:
+    class Node
+    {
+    public:
+        // 0-2 split axis, -1 for a leaf
+        int m_axis;
+        // first of two consecutive children, or leaf index for a leaf
+        int m_index;
+        // nodes at depth d split along axis d % 3
+        int m_depth;
+    };
+    class Leaf
+    {
+    public:
+        Leaf()
+        {
+            m_samples = 0;
+        }
+        Leaf(const Leaf& other)
+        {
+            m_sampling = other.m_sampling;
+            m_recording = other.m_recording;
+            m_samples = other.m_samples.load();
+        }
+        Leaf& operator=(const Leaf& other)
+        {
+            m_sampling = other.m_sampling;
+            m_recording = other.m_recording;
+            m_samples = other.m_samples.load();
+            return *this;
+        }
+
+        DirectionalTree m_sampling;
+        DirectionalTree m_recording;
+        std::atomic<long long> m_samples;
+    };
+
+    int leaf_index(const Vector3D& position) const;
+
+    AABB m_bounds;
+    std::vector<Node> m_nodes;
+    std::vector<Leaf> m_leaves;
+};
+
+void PathGuide::reset(const AABB& bounds)
+{
+    m_bounds = bounds;
+    m_nodes.assign(1, Node{ -1, 0, 0 });
+    m_leaves.assign(1, Leaf());
+    m_iteration = 0;
+}
+
+int PathGuide::leaf_index(const Vector3D& position) const
+{
+    // position in the unit cube, each split halves the current cell
+    Vector3D extent = m_bounds.extent();
+    float p[3] = { clamp((position.m_x - m_bounds.m_min.m_x) / extent.m_x, 0, 1),
+                   clamp((position.m_y - m_bounds.m_min.m_y) / extent.m_y, 0, 1),
+                   clamp((position.m_z - m_bounds.m_min.m_z) / extent.m_z, 0, 1) };
+    int node = 0;
+    while (m_nodes[node].m_axis >= 0)
+    {
+        float& x = p[m_nodes[node].m_axis];
+        int child = m_nodes[node].m_index;
+        if (x >= 0.5f)
+        {
+            ++child;
+            x -= 0.5f;
+        }
+        x *= 2;
+        node = child;
+    }
+    return m_nodes[node].m_index;
+}
+
+void PathGuide::refine(int samples_per_pixel)
+{
+    long long split_threshold = static_cast<long long>(m_spatialThreshold * sqrtf(static_cast<float>(samples_per_pixel)));
+
+    // split busy leaves, both halves inherit the leaf's trees and half its samples
+    for (size_t n = 0; n < m_nodes.size(); ++n)
+    {
+        if (m_nodes[n].m_axis >= 0)
+            continue;
+        int leaf = m_nodes[n].m_index;
+        long long samples = m_leaves[leaf].m_samples;
+        if (samples <= split_threshold)
+            continue;
+        int depth = m_nodes[n].m_depth;
+        int first = static_cast<int>(m_nodes.size());
+        int second_leaf = static_cast<int>(m_leaves.size());
+        m_leaves[leaf].m_samples = samples / 2;
+        m_leaves.push_back(m_leaves[leaf]);
+        m_nodes.push_back(Node{ -1, leaf, depth + 1 });
+        m_nodes.push_back(Node{ -1, second_leaf, depth + 1 });
+        m_nodes[n].m_axis = depth % 3;
+        m_nodes[n].m_index = first;
+    }
+
+    // recorded energy becomes the new sampling distribution, the recording
+    // trees are refined to match it
+    for (Leaf& leaf : m_leaves)
+    {
+        leaf.m_recording.build();
+        leaf.m_sampling = leaf.m_recording;
+        leaf.m_recording = leaf.m_sampling.refined(m_directionalThreshold, m_maxDepth);
+        leaf.m_samples = 0;
+    }
+    ++m_iteration;
+}
+
+int PathGuide::directional_node_count() const
+{
+    int count = 0;
+    for (const Leaf& leaf : m_leaves)
+        count += static_cast<int>(leaf.m_sampling.m_nodes.size() + leaf.m_recording.m_nodes.size());
+    return count;
+}
+
+size_t PathGuide::memory_bytes() const
+{
+    return m_nodes.size() * sizeof(Node) + m_leaves.size() * sizeof(Leaf) +
+           directional_node_count() * sizeof(DirectionalTree::Node);
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PLANE_H
+#define PLANE_H
+
+#include "Ray.h"
+#include "HitResult.h"
+
+using namespace std;
+
+// infinite plane of points p with dot(normal, p) = offset, hit from either
+// side with the normal facing the ray
+class Plane {
+
+public:
+    Plane() {}
+    Plane(Vector3D point, Vector3D normal, int material)
+    {
+        m_normal = normalize(normal);
+        m_offset = dot(m_normal, point);
+        m_material = material;
+        // texture axes in the plane, one texture repeat per world unit
+        Vector3D helper = fabsf(m_normal.m_x) < 0.9f ? Vector3D(1, 0, 0) : Vector3D(0, 0, 1);
+        m_tangent = normalize(cross(helper, m_normal));
+        m_bitangent = cross(m_normal, m_tangent);
+    }
+    HitResult hit(Ray& r, float min_t, float max_t);
+    bool occludes(Ray& r, float min_t, float max_t)
+    {
+        float denom = dot(m_normal, r.direction());
+        if (denom == 0.0f)
+            return false;
+        float t = (m_offset - dot(m_normal, r.origin())) / denom;
+        return t > min_t && t < max_t;
+    }
+
+public:
+    Vector3D m_normal;
+    float m_offset;
+    Vector3D m_tangent;
+    Vector3D m_bitangent;
+    // index into World::m_materials
+    int m_material;
+};
+
+//test if ray hits this plane within range min_t and max_t
+HitResult Plane::hit(Ray& ray, float min_t, float max_t)
+{
+    HitResult hit_result;
+
+    // rays parallel to the plane never hit it
+    float denom = dot(m_normal, ray.direction());
+    if (denom == 0.0f)
+        return hit_result;
+
+    float t = (m_offset - dot(m_normal, ray.origin())) / denom;
+    if (t <= min_t || t >= max_t)
+        return hit_result;
+
+    hit_result.m_isHit = true;
+    hit_result.m_t = t;
+    hit_result.m_hitPos = ray.at(t);
+    hit_result.m_hitNormal = denom > 0 ? -1 * m_normal : m_normal;
+    hit_result.m_hitMaterial = m_material;
+    hit_result.m_u = dot(hit_result.m_hitPos, m_tangent);
+    hit_result.m_v = dot(hit_result.m_hitPos, m_bitangent);
+    hit_result.m_uvScale = 1;
+
+    return hit_result;
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+#include "Parallel.h"
+#include "Renderer.h"
+#include "World.h"
+
+class PreviewSettings
+{
+public:
+    PreviewSettings()
+    {
+        m_width = 768;
+        m_height = 540;
+        m_maxLightBounceNum = 5;
+        m_threadCount = 0;
+        m_tileSize = 32;
+        m_startScale = 8;
+        m_maxSamples = 4096;
+    }
+
+    int m_width;
+    int m_height;
+    int m_maxLightBounceNum;
+    // 0 leaves one cpu to the thread drawing the window
+    int m_threadCount;
+    int m_tileSize;
+    // after every camera change the first pass traces one sample per
+    // m_startScale x m_startScale block of pixels, each following pass halves
+    // the blocks until they are single pixels; a power of two
+    int m_startScale;
+    // stop refining once every pixel has this many samples
+    int m_maxSamples;
+};
+
+// progressive renderer behind the interactive viewer. Worker threads keep
+// refining the image of the current camera in the background, one sample per
+// pixel a pass, and start over from coarse blocks whenever the camera
+// changes, so the first image of a new view only costs a fraction of a sample
+// per pixel. Knows nothing about OpenGL: the window asks for a tone-mapped
+// copy of the image whenever it can take one.
+class ProgressiveRenderer
+{
+public:
+    ProgressiveRenderer(World& world, const Camera& camera, const PreviewSettings& settings);
+    ~ProgressiveRenderer()
+    {
+        stop();
+    }
+
+    void start();
+    void stop();
+    // drop the accumulated image and render from camera
+    void set_camera(const Camera& camera);
+
+    // the image as gamma 2 RGBA8, rows bottom to top (OpenGL's order), into
+    // rgba (m_width * m_height * 4 bytes); false, leaving rgba alone, if
+    // nothing changed since the last snapshot
+    bool snapshot(unsigned char* rgba);
+    // samples every pixel of the current view has, 0 while blocks are coarser than pixels
+    int samples_per_pixel();
+    // seconds from the last camera change until the first pass covered the whole image
+    double first_image_seconds();
+
+    PreviewSettings m_settings;
+    std::atomic<long long> m_rayCount;
+
+private:
+    class Work
+    {
+    public:
+        int m_generation;
+        int m_pass;
+        int m_tile;
+    };
+
+    void worker();
+    // pixels of one block edge in pass, 1 once passes are full resolution
+    int pass_scale(int pass) const
+    {
+        int scale = m_settings.m_startScale >> pass;
+        return scale > 1 ? scale : 1;
+    }
+    void render_tile(const Work& work, const Camera& camera, std::vector<Vector3D>& tile, long long& ray_count);
+    void store_tile(const Work& work, const std::vector<Vector3D>& tile);
+
+    World& m_world;
+    Camera m_camera;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    int m_tilesX;
+    int m_tileCount;
+    // coarse passes before the first full resolution one
+    int m_firstFullPass;
+
+    // everything below is guarded by m_mutex
+    bool m_stopping;
+    // bumped by every camera change, work of older generations is thrown away
+    int m_generation;
+    // next (pass, tile) to hand out, as pass * m_tileCount + tile
+    long long m_next;
+    std::chrono::steady_clock::time_point m_changed;
+    double m_firstImageSeconds;
+    // per tile: latest pass stored, and how many full resolution samples its pixels sum
+    std::vector<int> m_tilePass;
+    std::vector<int> m_tileSamples;
+    int m_tilesCovered;
+    // radiance sums of full resolution passes, or the block colors of a coarse one
+    std::vector<Vector3D> m_pixels;
+    // bumped whenever m_pixels changes, snapshot() compares it with what it last saw
+    long long m_version;
+    long long m_shownVersion;
+};
+
+ProgressiveRenderer::ProgressiveRenderer(World& world, const Camera& camera, const PreviewSettings& settings)
+    : m_world(world), m_camera(camera)
+{
+    m_settings = settings;
+    m_rayCount = 0;
+    m_stopping = false;
+    int size = m_settings.m_tileSize;
+    m_tilesX = (m_settings.m_width + size - 1) / size;
+    m_tileCount = m_tilesX * ((m_settings.m_height + size - 1) / size);
+    m_firstFullPass = 0;
+    while (pass_scale(m_firstFullPass) > 1)
+        ++m_firstFullPass;
+    m_pixels.assign(m_settings.m_width * m_settings.m_height, Vector3D(0, 0, 0));
+    m_version = 0;
+    m_shownVersion = -1;
+    m_generation = -1;
+    m_tileSamples.assign(m_tileCount, 0);
+    set_camera(camera);
+}
+
+void ProgressiveRenderer::start()
+{
+    if (!m_threads.empty())
+        return;
+    m_stopping = false;
+    int thread_count = m_settings.m_threadCount;
+    if (thread_count <= 0)
+        thread_count = std::max(1, default_thread_count() - 1);
+    for (int t = 0; t < thread_count; ++t)
+        m_threads.push_back(std::thread(&ProgressiveRenderer::worker, this));
+}
+
+void ProgressiveRenderer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (auto& t : m_threads)
+        t.join();
+    m_threads.clear();
+}
+
+void ProgressiveRenderer::set_camera(const Camera& camera)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_camera = camera;
+        ++m_generation;
+        m_next = 0;
+        m_changed = std::chrono::steady_clock::now();
+        m_firstImageSeconds = 0;
+        // the old view stays up, as averages, until the new one covers it
+        int size = m_settings.m_tileSize;
+        for (int j = 0; j < m_settings.m_height; ++j)
+            for (int i = 0; i < m_settings.m_width; ++i)
+            {
+                int samples = m_tileSamples[(j / size) * m_tilesX + i / size];
+                if (samples > 1)
+                    m_pixels[j * m_settings.m_width + i] = m_pixels[j * m_settings.m_width + i] / samples;
+            }
+        m_tilePass.assign(m_tileCount, -1);
+        m_tileSamples.assign(m_tileCount, 0);
+        m_tilesCovered = 0;
+    }
+    m_wake.notify_all();
+}
+
+int ProgressiveRenderer::samples_per_pixel()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int samples = m_tileSamples.empty() ? 0 : m_tileSamples[0];
+    for (int s : m_tileSamples)
+        samples = std::min(samples, s);
+    return samples;
+}
+
+double ProgressiveRenderer::first_image_seconds()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_firstImageSeconds;
+}
+
+void ProgressiveRenderer::worker()
+{
+    int size = m_settings.m_tileSize;
+    std::vector<Vector3D> tile(size * size);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping)
+    {
+        int pass = static_cast<int>(m_next / m_tileCount);
+        if (pass - m_firstFullPass >= m_settings.m_maxSamples)
+        {
+            // converged, sleep until the camera moves
+            m_wake.wait(lock);
+            continue;
+        }
+
+        Work work;
+        work.m_generation = m_generation;
+        work.m_pass = pass;
+        work.m_tile = static_cast<int>(m_next % m_tileCount);
+        ++m_next;
+        Camera camera = m_camera;
+        lock.unlock();
+
+        long long rays = 0;
+        render_tile(work, camera, tile, rays);
+        m_rayCount += rays;
+
+        lock.lock();
+        if (work.m_generation == m_generation)
+            store_tile(work, tile);
+    }
+}
+
+void ProgressiveRenderer::render_tile(const Work& work, const Camera& camera, std::vector<Vector3D>& tile, long long& ray_count)
+{
+    int size = m_settings.m_tileSize;
+    int width = m_settings.m_width;
+    int height = m_settings.m_height;
+    int x0 = (work.m_tile % m_tilesX) * size;
+    int y0 = (work.m_tile / m_tilesX) * size;
+    int scale = pass_scale(work.m_pass);
+    Camera view = camera;
+    float spread = view.pixel_spread(height) * scale;
+
+    seed_random(((long long)work.m_pass * m_tileCount + work.m_tile + 1) ^ ((unsigned long long)work.m_generation << 40));
+    // one sample anywhere in each block, copied to all of its pixels
+    for (int by = 0; by < size && y0 + by < height; by += scale)
+    {
+        for (int bx = 0; bx < size && x0 + bx < width; bx += scale)
+        {
+            float col = (x0 + bx + scale * random_float()) / (width - 1);
+            float row = (y0 + by + scale * random_float()) / (height - 1);
+            Ray r = view.generate_ray(col, row);
+            r.m_coneSpread = spread;
+            Vector3D sample = ray_hit_color(r, m_world, m_settings.m_maxLightBounceNum, ray_count);
+            for (int y = by; y < by + scale && y < size; ++y)
+                for (int x = bx; x < bx + scale && x < size; ++x)
+                    tile[y * size + x] = sample;
+        }
+    }
+}
+
+void ProgressiveRenderer::store_tile(const Work& work, const std::vector<Vector3D>& tile)
+{
+    int size = m_settings.m_tileSize;
+    int width = m_settings.m_width;
+    int height = m_settings.m_height;
+    int x0 = (work.m_tile % m_tilesX) * size;
+    int y0 = (work.m_tile / m_tilesX) * size;
+    int& shown = m_tilePass[work.m_tile];
+    int& samples = m_tileSamples[work.m_tile];
+
+    // with several workers a tile's passes can finish out of order: a coarse
+    // pass never covers a finer one, and the first full resolution sample
+    // replaces the blocks instead of adding to them
+    bool full = pass_scale(work.m_pass) == 1;
+    if (!full && work.m_pass <= shown)
+        return;
+    bool add = full && samples > 0;
+    for (int y = 0; y < size && y0 + y < height; ++y)
+    {
+        for (int x = 0; x < size && x0 + x < width; ++x)
+        {
+            Vector3D& pixel = m_pixels[(y0 + y) * width + x0 + x];
+            pixel = add ? pixel + tile[y * size + x] : tile[y * size + x];
+        }
+    }
+    if (shown < 0 && ++m_tilesCovered == m_tileCount)
+        m_firstImageSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_changed).count();
+    shown = std::max(shown, work.m_pass);
+    samples = full ? samples + 1 : 0;
+    ++m_version;
+}
+
+bool ProgressiveRenderer::snapshot(unsigned char* rgba)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_version == m_shownVersion)
+        return false;
+    m_shownVersion = m_version;
+
+    int size = m_settings.m_tileSize;
+    int width = m_settings.m_width;
+    int height = m_settings.m_height;
+    for (int j = 0; j < height; ++j)
+    {
+        for (int i = 0; i < width; ++i)
+        {
+            int samples = m_tileSamples[(j / size) * m_tilesX + i / size];
+            Vector3D c = samples > 1 ? m_pixels[j * width + i] / samples : m_pixels[j * width + i];
+            unsigned char* out = rgba + 4 * (j * width + i);
+            // NaNs come out black, like in the ppm
+            out[0] = static_cast<unsigned char>(c.m_x == c.m_x ? clamp(256 * sqrtf(fmaxf(c.m_x, 0.0f)), 0, 255) : 0);
+            out[1] = static_cast<unsigned char>(c.m_y == c.m_y ? clamp(256 * sqrtf(fmaxf(c.m_y, 0.0f)), 0, 255) : 0);
+            out[2] = static_cast<unsigned char>(c.m_z == c.m_z ? clamp(256 * sqrtf(fmaxf(c.m_z, 0.0f)), 0, 255) : 0);
+            out[3] = 255;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -9,12 +9,25 @@ class Ray
 public:
     Vector3D m_origin;
     Vector3D m_direction;
+    // ray cone for texture filtering: width at the origin and spread angle (radians)
+    float m_coneWidth;
+    float m_coneSpread;
+    // diffuse bounces the path took before this ray
+    int m_diffuseDepth;
     
-    Ray(){}
+    Ray()
+    {
+        m_coneWidth = 0;
+        m_coneSpread = 0;
+        m_diffuseDepth = 0;
+    }
     Ray(Vector3D& origin, Vector3D& direction)
     {
         m_origin = origin;
         m_direction = direction;
+        m_coneWidth = 0;
+        m_coneSpread = 0;
+        m_diffuseDepth = 0;
     }
     Vector3D origin()
     {
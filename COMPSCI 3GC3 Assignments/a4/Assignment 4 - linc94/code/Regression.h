@@ -0,0 +1,400 @@
+#ifndef REGRESSION_H
+#define REGRESSION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Camera.h"
+#include "Renderer.h"
+#include "World.h"
+
+// how far an image is from a reference, both compared after the gamma 2
+// tone mapping the ppm output uses, clamped to [0, 1]
+class ImageMetrics
+{
+public:
+    double m_rmse;
+    // 20 log10(1 / rmse), infinite for identical images
+    double m_psnr;
+    // mean SSIM of the luminance over 8 x 8 windows, 4 pixels apart
+    double m_ssim;
+};
+
+float display_value(float radiance)
+{
+    // NaNs count as black, like in the ppm
+    return radiance == radiance ? clamp(sqrtf(fmaxf(radiance, 0.0f)), 0, 1) : 0;
+}
+
+ImageMetrics compare_images(const std::vector<Vector3D>& image, const std::vector<Vector3D>& reference, int width, int height)
+{
+    ImageMetrics metrics;
+    double sum = 0;
+    std::vector<float> a(width * height), b(width * height);
+    for (int p = 0; p < width * height; ++p)
+    {
+        const Vector3D& x = image[p];
+        const Vector3D& y = reference[p];
+        float d[3] = { display_value(x.m_x) - display_value(y.m_x), display_value(x.m_y) - display_value(y.m_y),
+                       display_value(x.m_z) - display_value(y.m_z) };
+        sum += (d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) / 3.0;
+        a[p] = 0.2126f * display_value(x.m_x) + 0.7152f * display_value(x.m_y) + 0.0722f * display_value(x.m_z);
+        b[p] = 0.2126f * display_value(y.m_x) + 0.7152f * display_value(y.m_y) + 0.0722f * display_value(y.m_z);
+    }
+    metrics.m_rmse = sqrt(sum / (width * height));
+    metrics.m_psnr = metrics.m_rmse > 0 ? 20 * log10(1 / metrics.m_rmse) : std::numeric_limits<double>::infinity();
+
+    // Wang et al. 2004 with the usual constants for a dynamic range of 1
+    const double c1 = 0.01 * 0.01;
+    const double c2 = 0.03 * 0.03;
+    const int window = 8;
+    double ssim_sum = 0;
+    int windows = 0;
+    for (int y0 = 0; y0 + window <= height; y0 += window / 2)
+    {
+        for (int x0 = 0; x0 + window <= width; x0 += window / 2)
+        {
+            double mean_a = 0, mean_b = 0;
+            for (int y = y0; y < y0 + window; ++y)
+                for (int x = x0; x < x0 + window; ++x)
+                {
+                    mean_a += a[y * width + x];
+                    mean_b += b[y * width + x];
+                }
+            mean_a /= window * window;
+            mean_b /= window * window;
+            double var_a = 0, var_b = 0, covariance = 0;
+            for (int y = y0; y < y0 + window; ++y)
+                for (int x = x0; x < x0 + window; ++x)
+                {
+                    double da = a[y * width + x] - mean_a;
+                    double db = b[y * width + x] - mean_b;
+                    var_a += da * da;
+                    var_b += db * db;
+                    covariance += da * db;
+                }
+            var_a /= window * window - 1;
+            var_b /= window * window - 1;
+            covariance /= window * window - 1;
+            ssim_sum += (2 * mean_a * mean_b + c1) * (2 * covariance + c2) /
+                        ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+            ++windows;
+        }
+    }
+    metrics.m_ssim = windows > 0 ? ssim_sum / windows : 1;
+    return metrics;
+}
+
+// linear radiance as a little endian PFM, rows bottom to top like Renderer::pixel
+bool write_pfm(const std::string& path, int width, int height, const std::vector<Vector3D>& image)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+        return false;
+    out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+    for (int p = 0; p < width * height; ++p)
+        out.write(reinterpret_cast<const char*>(&image[p].m_x), 3 * sizeof(float));
+    return static_cast<bool>(out);
+}
+
+bool read_pfm(const std::string& path, int& width, int& height, std::vector<Vector3D>& image)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    float scale;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || scale >= 0)
+        return false;
+    in.get();
+    image.resize(width * height);
+    for (int p = 0; p < width * height; ++p)
+    {
+        float rgb[3];
+        in.read(reinterpret_cast<char*>(rgb), sizeof(rgb));
+        image[p] = Vector3D(rgb[0], rgb[1], rgb[2]);
+    }
+    return static_cast<bool>(in);
+}
+
+// one scene of the regression set, built from a fixed seed
+class RegressionScene
+{
+public:
+    std::string m_name;
+    std::function<void(World&)> m_build;
+};
+
+std::vector<RegressionScene> regression_scenes()
+{
+    std::vector<RegressionScene> scenes;
+    scenes.push_back({ "one_diffuse", [](World& w) { w.generate_scene_one_diffuse(); } });
+    scenes.push_back({ "multi_specular", [](World& w) { w.generate_scene_multi_specular(); } });
+    scenes.push_back({ "all", [](World& w) { w.generate_scene_all(); } });
+    scenes.push_back({ "mixed", [](World& w) { w.generate_scene_mixed(); } });
+    scenes.push_back({ "lights", [](World& w) { w.generate_scene_lights(100); } });
+    scenes.push_back({ "sphere_field", [](World& w) { w.generate_scene_sphere_field(1 << 10); } });
+    return scenes;
+}
+
+// renders every regression scene with fixed seeds and settings and checks it
+// against references made by an earlier (trusted) build. A reference is a
+// long render of the scene; the check render is m_referenceScale times shorter,
+// so it carries Monte Carlo noise. That noise is measured once, when the
+// references are made, and a later build fails when its error exceeds it by
+// more than the tolerances, or when it traces noticeably fewer rays per second.
+class RegressionHarness
+{
+public:
+    RegressionHarness(const std::string& directory)
+    {
+        m_directory = directory;
+        m_settings.m_width = 192;
+        m_settings.m_height = 108;
+        m_settings.m_raysPerPixel = 32;
+        m_referenceScale = 16;
+        m_timingRuns = 3;
+        m_minTimingSeconds = 1;
+        m_rmseTolerance = 0.15;
+        m_ssimTolerance = 0.01;
+        m_speedTolerance = 0.15;
+    }
+
+    // renders the references and records error and speed baselines
+    bool update(std::ostream& out);
+    // true when every scene is within the tolerances
+    bool check(std::ostream& out);
+
+    std::string m_directory;
+    RenderSettings m_settings;
+    int m_referenceScale;
+    // timings are the fastest of at least this many renders of a scene, and
+    // of as many more as it takes to spend m_minTimingSeconds rendering it:
+    // the fastest of three renders of a short scene is too noisy for
+    // m_speedTolerance
+    int m_timingRuns;
+    double m_minTimingSeconds;
+    // allowed growth of the rmse over the baseline, as a fraction
+    double m_rmseTolerance;
+    // allowed drop of the SSIM below the baseline
+    double m_ssimTolerance;
+    // allowed drop of Mrays/s below the baseline, as a fraction
+    double m_speedTolerance;
+
+private:
+    class Result
+    {
+    public:
+        std::vector<Vector3D> m_image;
+        double m_seconds;
+        double m_mrays;
+        // FNV-1a of the image, equal when a change didn't alter a single sample
+        uint64_t m_hash;
+    };
+    void build(const RegressionScene& scene, World& world)
+    {
+        seed_random(1);
+        scene.m_build(world);
+        world.build_accelerator(Accelerator::BVH);
+    }
+    Camera camera() const
+    {
+        return Camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, m_settings.m_width / float(m_settings.m_height));
+    }
+    // one render of scene: its image, the image's hash and the render's speed
+    Result render(const RegressionScene& scene, int samples);
+    // sets every result's speed to that of the fastest of the timing renders,
+    // which go round robin over the scenes so that a stretch of time the
+    // machine is busy with something else doesn't fall on one scene only
+    void time_scenes(const std::vector<RegressionScene>& scenes, std::vector<Result>& results);
+    std::string baseline_path() const
+    {
+        return m_directory + "/baselines.txt";
+    }
+};
+
+RegressionHarness::Result RegressionHarness::render(const RegressionScene& scene, int samples)
+{
+    World world;
+    build(scene, world);
+    RenderSettings settings = m_settings;
+    settings.m_raysPerPixel = samples;
+    Camera view = camera();
+    Renderer renderer(settings);
+    renderer.render(world, view);
+
+    Result result;
+    result.m_seconds = renderer.m_seconds;
+    result.m_mrays = renderer.m_rayCount / renderer.m_seconds / 1e6;
+    result.m_image.resize(settings.m_width * settings.m_height);
+    for (int j = 0; j < settings.m_height; ++j)
+        for (int i = 0; i < settings.m_width; ++i)
+            result.m_image[j * settings.m_width + i] = renderer.pixel(i, j) / renderer.sample_count(i, j);
+    result.m_hash = 0xcbf29ce484222325ull;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(result.m_image.data());
+    for (size_t b = 0; b < result.m_image.size() * sizeof(Vector3D); ++b)
+        result.m_hash = (result.m_hash ^ bytes[b]) * 0x100000001b3ull;
+    return result;
+}
+
+void RegressionHarness::time_scenes(const std::vector<RegressionScene>& scenes, std::vector<Result>& results)
+{
+    std::vector<std::unique_ptr<World>> worlds;
+    for (const RegressionScene& scene : scenes)
+    {
+        worlds.push_back(std::unique_ptr<World>(new World()));
+        build(scene, *worlds.back());
+    }
+    Camera view = camera();
+    std::vector<double> total_seconds(scenes.size(), 0.0);
+    for (int round = 0;; ++round)
+    {
+        bool rendered = false;
+        for (size_t s = 0; s < scenes.size(); ++s)
+        {
+            if (round >= m_timingRuns && total_seconds[s] >= m_minTimingSeconds)
+                continue;
+            Renderer renderer(m_settings);
+            renderer.render(*worlds[s], view);
+            total_seconds[s] += renderer.m_seconds;
+            rendered = true;
+            if (round == 0 || renderer.m_seconds < results[s].m_seconds)
+            {
+                results[s].m_seconds = renderer.m_seconds;
+                results[s].m_mrays = renderer.m_rayCount / renderer.m_seconds / 1e6;
+            }
+        }
+        if (!rendered)
+            break;
+    }
+}
+
+bool RegressionHarness::update(std::ostream& out)
+{
+    // the first update of a new directory makes it
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+    if (error)
+    {
+        out << "can't create " << m_directory << ": " << error.message() << std::endl;
+        return false;
+    }
+    std::ofstream baselines(baseline_path());
+    if (!baselines)
+    {
+        out << "can't write " << baseline_path() << std::endl;
+        return false;
+    }
+    baselines << "# scene seconds mrays rmse ssim hash\n";
+    std::vector<RegressionScene> scenes = regression_scenes();
+    std::vector<Result> results;
+    std::vector<ImageMetrics> noise;
+    for (const RegressionScene& scene : scenes)
+    {
+        Result reference = render(scene, m_settings.m_raysPerPixel * m_referenceScale);
+        write_pfm(m_directory + "/" + scene.m_name + ".pfm", m_settings.m_width, m_settings.m_height, reference.m_image);
+        results.push_back(render(scene, m_settings.m_raysPerPixel));
+        noise.push_back(compare_images(results.back().m_image, reference.m_image, m_settings.m_width, m_settings.m_height));
+    }
+    time_scenes(scenes, results);
+    for (size_t s = 0; s < scenes.size(); ++s)
+    {
+        const RegressionScene& scene = scenes[s];
+        const Result& result = results[s];
+        const ImageMetrics& metrics = noise[s];
+        baselines << scene.m_name << ' ' << result.m_seconds << ' ' << result.m_mrays << ' ' << metrics.m_rmse << ' '
+                  << metrics.m_ssim << ' ' << std::hex << result.m_hash << std::dec << '\n';
+        out << scene.m_name << ": reference written, noise rmse " << metrics.m_rmse << " (" << metrics.m_psnr
+            << " dB), SSIM " << metrics.m_ssim << ", " << result.m_mrays << " Mrays/s" << std::endl;
+    }
+    return true;
+}
+
+bool RegressionHarness::check(std::ostream& out)
+{
+    // scene -> seconds, mrays, rmse, ssim, hash
+    std::map<std::string, std::vector<std::string>> baselines;
+    std::ifstream in(baseline_path());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        std::string name, field;
+        fields >> name;
+        while (fields >> field)
+            baselines[name].push_back(field);
+    }
+    if (baselines.empty())
+    {
+        out << "no baselines in " << m_directory << ", make them with a trusted build first" << std::endl;
+        return false;
+    }
+
+    // images first, then all timings together
+    std::vector<RegressionScene> scenes;
+    std::vector<std::vector<std::string>> scene_baselines;
+    std::vector<std::vector<Vector3D>> references;
+    std::vector<Result> results;
+    bool passed = true;
+    for (const RegressionScene& scene : regression_scenes())
+    {
+        auto baseline = baselines.find(scene.m_name);
+        int width, height;
+        std::vector<Vector3D> reference;
+        if (baseline == baselines.end() || baseline->second.size() < 5 ||
+            !read_pfm(m_directory + "/" + scene.m_name + ".pfm", width, height, reference) || width != m_settings.m_width ||
+            height != m_settings.m_height)
+        {
+            out << std::left << std::setw(16) << scene.m_name << "missing or mismatched reference  FAIL" << std::endl;
+            passed = false;
+            continue;
+        }
+        scenes.push_back(scene);
+        scene_baselines.push_back(baseline->second);
+        references.push_back(reference);
+        results.push_back(render(scene, m_settings.m_raysPerPixel));
+    }
+    time_scenes(scenes, results);
+
+    out << std::left << std::setw(16) << "scene" << std::right << std::setw(10) << "rmse" << std::setw(10) << "limit"
+        << std::setw(9) << "PSNR" << std::setw(8) << "SSIM" << std::setw(8) << "limit" << std::setw(10) << "Mrays/s"
+        << std::setw(10) << "limit" << std::setw(9) << "time" << "  " << std::endl;
+    for (size_t s = 0; s < scenes.size(); ++s)
+    {
+        const RegressionScene& scene = scenes[s];
+        const std::vector<std::string>& baseline = scene_baselines[s];
+        double rmse_limit = std::stod(baseline[2]) * (1 + m_rmseTolerance);
+        double ssim_limit = std::stod(baseline[3]) - m_ssimTolerance;
+        double mrays_limit = std::stod(baseline[1]) * (1 - m_speedTolerance);
+        uint64_t hash = std::stoull(baseline[4], nullptr, 16);
+
+        const Result& result = results[s];
+        ImageMetrics metrics = compare_images(result.m_image, references[s], m_settings.m_width, m_settings.m_height);
+        bool quality = metrics.m_rmse <= rmse_limit && metrics.m_ssim >= ssim_limit;
+        bool speed = result.m_mrays >= mrays_limit;
+        out << std::left << std::setw(16) << scene.m_name << std::right << std::fixed << std::setprecision(5)
+            << std::setw(10) << metrics.m_rmse << std::setw(10) << rmse_limit << std::setprecision(2) << std::setw(9)
+            << metrics.m_psnr << std::setprecision(4) << std::setw(8) << metrics.m_ssim << std::setw(8) << ssim_limit
+            << std::setprecision(2) << std::setw(10) << result.m_mrays << std::setw(10) << mrays_limit << std::setprecision(3)
+            << std::setw(9) << result.m_seconds << "  " << (quality ? "" : "QUALITY ") << (speed ? "" : "SPEED ")
+            << (quality && speed ? (result.m_hash == hash ? "ok, identical" : "ok") : "FAIL") << std::endl;
+        out.unsetf(std::ios::fixed);
+        out << std::setprecision(6);
+        passed = passed && quality && speed;
+    }
+    out << (passed ? "regression check passed" : "regression check FAILED") << std::endl;
+    return passed;
+}
+
+#endif
@@ -0,0 +1,1444 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+#include "Camera.h"
+#include "GBuffer.h"
+#include "World.h"
+#include "Topology.h"
+
+// uniformly distributed on the unit sphere
+Vector3D random_unit_vector()
+{
+    float z = 1 - 2 * random_float();
+    float r = sqrtf(fmaxf(0.0f, 1 - z * z));
+    float phi = 2 * M_PI * random_float();
+    return Vector3D(r * cosf(phi), z, r * sinf(phi));
+}
+
+// spheres hit by the paths of the tile being rendered, see RenderSettings::m_recordTouched
+class TouchedSpheres
+{
+public:
+    void add(int sphere)
+    {
+        if (!m_seen[sphere])
+        {
+            m_seen[sphere] = 1;
+            m_list.push_back(sphere);
+        }
+    }
+    void reset(int sphere_count)
+    {
+        for (int s : m_list)
+            m_seen[s] = 0;
+        m_list.clear();
+        m_seen.resize(sphere_count, 0);
+    }
+
+    std::vector<unsigned char> m_seen;
+    std::vector<int> m_list;
+};
+
+// set by the renderer while it records, null otherwise
+thread_local TouchedSpheres* touched_spheres = nullptr;
+
+// multiple importance sampling weight of a sample from the strategy with density pdf
+float power_heuristic(float pdf, float other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// extra ray cone spread after a diffuse bounce: the bounce direction is random,
+// so later texture lookups get a wide footprint and read coarse, cache-friendly mips
+const float diffuse_cone_spread = 0.3f;
+
+// the reflected ray starts with the cone's width at the hit and carries the path's diffuse bounce count
+void continue_path(Ray& in, HitResult& hit, Material* material, Ray& out)
+{
+    out.m_coneWidth = hit.m_coneWidth;
+    out.m_coneSpread = in.m_coneSpread + (material->is_diffuse() ? diffuse_cone_spread : 0);
+    out.m_diffuseDepth = in.m_diffuseDepth + (material->is_diffuse() ? 1 : 0);
+}
+
+// whether sample_lights() finds the world's light sources, rather than paths
+// stumbling on them
+bool samples_direct_light(World& world)
+{
+    return !world.m_lights.empty() || (world.m_environment.loaded() && world.m_environment.m_importanceSample);
+}
+
+Vector3D shade(Ray& r, HitResult& hit, World& world, int max_light_bounce_num, long long& ray_count, float bounce_pdf);
+Vector3D diffuse_color(Ray& r, HitResult& hit, Material* material, World& world, int max_light_bounce_num, long long& ray_count);
+Vector3D cached_color(Ray& r, HitResult& hit, Material* material, World& world, int max_light_bounce_num, long long& ray_count);
+
+// bounce_pdf is the solid angle density of the diffuse bounce that produced r,
+// 0 for camera rays and mirror bounces (the environment can't be sampled for those)
+Vector3D ray_hit_color(Ray& r, World& world, int max_light_bounce_num, long long& ray_count, float bounce_pdf = 0)
+{
+    if (max_light_bounce_num <= 0)
+        return Vector3D(0,0,0);
+    
+    ++ray_count;
+    COUNT_BOUNCE();
+    HitResult hit = world.hit(r, 0.001, std::numeric_limits<float>::infinity());
+    return shade(r, hit, world, max_light_bounce_num, ray_count, bounce_pdf);
+}
+
+// color carried back along r, which hit (or missed) the scene as given
+Vector3D shade(Ray& r, HitResult& hit, World& world, int max_light_bounce_num, long long& ray_count, float bounce_pdf)
+{
+    EnvironmentMap& environment = world.m_environment;
+    if (hit.m_isHit)
+    {
+        if (touched_spheres && hit.m_sphere >= 0)
+            touched_spheres->add(hit.m_sphere);
+        hit.m_coneWidth = r.m_coneWidth + r.m_coneSpread * hit.m_t * r.direction().length();
+        Material* material = world.material(hit.m_hitMaterial);
+        // lights end the path; diffuse_color() weighs them when it could have sampled them
+        if (material->is_emissive())
+            return material->m_color;
+        // the first diffuse bounce, and camera hits when their direct light is
+        // sampled apart: what's left to interpolate there is smooth
+        if (world.m_irradianceCache && material->is_diffuse() &&
+            (r.m_diffuseDepth == 1 || (r.m_diffuseDepth == 0 && samples_direct_light(world))))
+            return cached_color(r, hit, material, world, max_light_bounce_num, ray_count);
+        if ((environment.loaded() || world.m_pathGuide || !world.m_lights.empty()) && material->is_diffuse())
+            return diffuse_color(r, hit, material, world, max_light_bounce_num, ray_count);
+        ReflectResult res = material->reflect(r, hit);
+        continue_path(r, hit, material, res.m_ray);
+        return res.m_color * ray_hit_color(res.m_ray, world, max_light_bounce_num-1, ray_count);
+    }
+    if (!environment.loaded())
+        return world.m_background;
+
+    Vector3D dir = normalize(r.direction());
+    Vector3D radiance = environment.radiance(dir);
+    // light sampling at the previous vertex could have picked this direction too
+    if (bounce_pdf > 0 && environment.m_importanceSample)
+        radiance *= power_heuristic(bounce_pdf, environment.pdf(dir));
+    return radiance;
+}
+
+Vector3D sample_lights(HitResult& hit, const Vector3D& normal, const Vector3D& albedo, World& world,
+                       int max_light_bounce_num, long long& ray_count, bool weighted);
+
+// whether a gather ray's hit (or miss) is light sample_lights() samples: that
+// is direct light, which cached_color() adds per hit rather than caching
+bool sampled_light(HitResult& hit, World& world)
+{
+    if (!hit.m_isHit)
+        return world.m_environment.loaded() && world.m_environment.m_importanceSample;
+    return hit.m_sphere >= 0 && !world.m_lights.empty() && world.material(hit.m_hitMaterial)->is_emissive();
+}
+
+// indirect irradiance / pi at a diffuse hit (the outgoing radiance for albedo
+// 1), from the cache when records are close enough, otherwise from a new
+// record gathered here
+Vector3D cached_irradiance(Ray& r, HitResult& hit, const Vector3D& normal, World& world, int max_light_bounce_num,
+                           long long& ray_count)
+{
+    // the last bounce, path tracing wouldn't go on either
+    if (max_light_bounce_num <= 1)
+        return Vector3D(0, 0, 0);
+
+    IrradianceCache& cache = *world.m_irradianceCache;
+    Vector3D irradiance;
+    if (cache.lookup(hit.m_hitPos, normal, hit.m_coneWidth, max_light_bounce_num, irradiance))
+        return irradiance / M_PI;
+
+    // not static: the gather rays of a camera hit's record look up the cache in turn
+    std::vector<Vector3D> directions, radiance;
+    std::vector<float> distances;
+    cache.gather_directions(normal, directions);
+    radiance.resize(directions.size());
+    distances.resize(directions.size());
+    for (size_t i = 0; i < directions.size(); ++i)
+    {
+        Ray gather(hit.m_hitPos, directions[i]);
+        gather.m_coneWidth = hit.m_coneWidth;
+        gather.m_coneSpread = r.m_coneSpread + diffuse_cone_spread;
+        gather.m_diffuseDepth = r.m_diffuseDepth + 1;
+        ++ray_count;
+        COUNT_BOUNCE();
+        HitResult gather_hit = world.hit(gather, 0.001, std::numeric_limits<float>::infinity());
+        distances[i] = gather_hit.m_isHit ? gather_hit.m_t : std::numeric_limits<float>::infinity();
+        if (sampled_light(gather_hit, world))
+            radiance[i] = Vector3D(0, 0, 0);
+        else
+            radiance[i] = shade(gather, gather_hit, world, max_light_bounce_num - 1, ray_count, 0);
+    }
+    cache.add(hit.m_hitPos, normal, radiance, distances, hit.m_coneWidth, max_light_bounce_num);
+
+    Vector3D sum(0, 0, 0);
+    for (const Vector3D& L : radiance)
+        sum += L;
+    return sum / directions.size();
+}
+
+// lambertian vertex lit by sampled direct light plus cached indirect light
+Vector3D cached_color(Ray& r, HitResult& hit, Material* material, World& world, int max_light_bounce_num, long long& ray_count)
+{
+    Vector3D normal = normalize(hit.m_hitNormal);
+    if (dot(normal, r.direction()) > 0)
+        normal = -normal;
+    Vector3D albedo = material->albedo(r, hit);
+    Vector3D color = sample_lights(hit, normal, albedo, world, max_light_bounce_num, ray_count, false);
+    return color + albedo * cached_irradiance(r, hit, normal, world, max_light_bounce_num, ray_count);
+}
+
+// solid angle pdf of sample_diffuse_bounce() picking dir
+float diffuse_bounce_pdf(World& world, const Vector3D& position, const Vector3D& normal, const Vector3D& dir)
+{
+    float cosine_pdf = fmaxf(0.0f, dot(normal, dir)) / M_PI;
+    PathGuide* guide = world.m_pathGuide.get();
+    if (!guide)
+        return cosine_pdf;
+    const DirectionalTree& learned = guide->distribution(position);
+    if (!learned.trained())
+        return cosine_pdf;
+    return guide->m_bsdfFraction * cosine_pdf + (1 - guide->m_bsdfFraction) * learned.pdf(dir);
+}
+
+// lambertian bounce direction around normal: cosine weighted, or once the path
+// guide is trained, a mix of that and the guide's learned incident light
+Vector3D sample_diffuse_bounce(World& world, const Vector3D& position, const Vector3D& normal, float& pdf)
+{
+    PathGuide* guide = world.m_pathGuide.get();
+    Vector3D dir;
+    if (guide && guide->distribution(position).trained() && random_float() >= guide->m_bsdfFraction)
+    {
+        float guide_pdf;
+        dir = guide->distribution(position).sample(guide_pdf);
+    }
+    else
+    {
+        dir = normalize(normal + random_unit_vector());
+    }
+    pdf = diffuse_bounce_pdf(world, position, normal, dir);
+    return dir;
+}
+
+// solid angle pdf of sample_sphere_cone(), 0 from inside the sphere
+float sphere_cone_pdf(const Sphere& sphere, const Vector3D& position)
+{
+    float distance_squared = (sphere.m_center - position).length_squared();
+    float sin2_max = sphere.m_radius * sphere.m_radius / distance_squared;
+    if (sin2_max >= 1)
+        return 0;
+    // 1 - cos_max without the cancellation for small, far away spheres
+    float one_minus_cos = sin2_max / (1 + sqrtf(1 - sin2_max));
+    return 1 / (2 * M_PI * one_minus_cos);
+}
+
+// direction uniformly distributed over the cone a sphere subtends from position (outside it)
+Vector3D sample_sphere_cone(const Sphere& sphere, const Vector3D& position)
+{
+    Vector3D axis = sphere.m_center - position;
+    float distance_squared = axis.length_squared();
+    axis = axis / sqrtf(distance_squared);
+    float sin2_max = fminf(sphere.m_radius * sphere.m_radius / distance_squared, 1.0f);
+    float one_minus_cos = sin2_max / (1 + sqrtf(1 - sin2_max));
+
+    float cos_theta = 1 - random_float() * one_minus_cos;
+    float sin_theta = sqrtf(fmaxf(0.0f, 1 - cos_theta * cos_theta));
+    float phi = 2 * M_PI * random_float();
+    Vector3D helper = fabsf(axis.m_x) < 0.9f ? Vector3D(1, 0, 0) : Vector3D(0, 1, 0);
+    Vector3D tangent = normalize(cross(helper, axis));
+    Vector3D bitangent = cross(axis, tangent);
+    return sin_theta * cosf(phi) * tangent + sin_theta * sinf(phi) * bitangent + cos_theta * axis;
+}
+
+// whether the shadow ray is blocked before max_t. When recording, the sphere
+// blocking it counts as touched: moving it can let the light through
+bool shadowed(Ray& shadow, World& world, float max_t)
+{
+    if (!world.occluded(shadow, 0.001, max_t))
+        return false;
+    if (touched_spheres)
+    {
+        HitResult blocker = world.hit(shadow, 0.001, max_t);
+        if (blocker.m_isHit && blocker.m_sphere >= 0)
+            touched_spheres->add(blocker.m_sphere);
+    }
+    return true;
+}
+
+// light sampled at a lambertian vertex, times albedo cos / pi: one sample
+// towards the environment map when there is one and one towards a light from
+// the light tree when there are any. weighted combines them with the vertex's
+// bounce by the power heuristic; unweighted they stand alone, for vertices
+// whose bounces leave out the light they could sample (cached_color())
+Vector3D sample_lights(HitResult& hit, const Vector3D& normal, const Vector3D& albedo, World& world,
+                       int max_light_bounce_num, long long& ray_count, bool weighted)
+{
+    EnvironmentMap& environment = world.m_environment;
+    Vector3D color(0, 0, 0);
+
+    // skipped on the last bounce, where the bounce ray can no longer reach the environment either
+    if (environment.loaded() && environment.m_importanceSample && max_light_bounce_num > 1)
+    {
+        float light_pdf;
+        Vector3D dir = environment.sample(light_pdf);
+        float cos_theta = dot(normal, dir);
+        if (cos_theta > 0 && light_pdf > 0)
+        {
+            ++ray_count;
+            Ray shadow(hit.m_hitPos, dir);
+            if (!shadowed(shadow, world, std::numeric_limits<float>::infinity()))
+            {
+                float weight = 1;
+                if (weighted)
+                    weight = power_heuristic(light_pdf, diffuse_bounce_pdf(world, hit.m_hitPos, normal, dir));
+                color += albedo * environment.radiance(dir) * (cos_theta / M_PI / light_pdf * weight);
+            }
+        }
+    }
+
+    // emissive spheres: the tree picks one, then a direction inside the cone it subtends
+    if (!world.m_lights.empty() && max_light_bounce_num > 1)
+    {
+        float pick_pmf;
+        int light = world.m_lights.pick(hit.m_hitPos, normal, pick_pmf);
+        if (light >= 0)
+        {
+            if (touched_spheres)
+                touched_spheres->add(light);
+            Sphere& sphere = world.m_spheres[light];
+            float cone_pdf = sphere_cone_pdf(sphere, hit.m_hitPos);
+            Vector3D dir = cone_pdf > 0 ? sample_sphere_cone(sphere, hit.m_hitPos) : normal;
+            float cos_theta = dot(normal, dir);
+            if (cos_theta > 0 && cone_pdf > 0)
+            {
+                ++ray_count;
+                Ray shadow(hit.m_hitPos, dir);
+                HitResult light_hit = sphere.hit(shadow, 0.001, std::numeric_limits<float>::infinity());
+                if (light_hit.m_isHit && !shadowed(shadow, world, light_hit.m_t * 0.999f))
+                {
+                    float light_pdf = pick_pmf * cone_pdf;
+                    float weight = 1;
+                    if (weighted)
+                        weight = power_heuristic(light_pdf, diffuse_bounce_pdf(world, hit.m_hitPos, normal, dir));
+                    color += albedo * world.material(sphere.m_material)->m_color * (cos_theta / M_PI / light_pdf * weight);
+                }
+            }
+        }
+    }
+    return color;
+}
+
+// lambertian vertex with explicitly sampled light (sample_lights()), plus one
+// bounce from sample_diffuse_bounce() that also trains the path guide
+Vector3D diffuse_color(Ray& r, HitResult& hit, Material* material, World& world, int max_light_bounce_num, long long& ray_count)
+{
+    Vector3D normal = normalize(hit.m_hitNormal);
+    if (dot(normal, r.direction()) > 0)
+        normal = -normal;
+    Vector3D albedo = material->albedo(r, hit);
+    Vector3D color = sample_lights(hit, normal, albedo, world, max_light_bounce_num, ray_count, true);
+
+    float bounce_pdf;
+    Vector3D dir = sample_diffuse_bounce(world, hit.m_hitPos, normal, bounce_pdf);
+    float cos_theta = dot(normal, dir);
+    if (cos_theta <= 0 || bounce_pdf <= 0)
+        return color;
+    Ray bounce(hit.m_hitPos, dir);
+    continue_path(r, hit, material, bounce);
+    Vector3D incoming(0, 0, 0);
+    if (max_light_bounce_num > 1)
+    {
+        ++ray_count;
+        COUNT_BOUNCE();
+        HitResult bounce_hit = world.hit(bounce, 0.001, std::numeric_limits<float>::infinity());
+        incoming = shade(bounce, bounce_hit, world, max_light_bounce_num - 1, ray_count, bounce_pdf);
+        // a light the light sample above could have picked too
+        if (bounce_hit.m_isHit && bounce_hit.m_sphere >= 0 && world.material(bounce_hit.m_hitMaterial)->is_emissive())
+        {
+            float light_pdf = world.m_lights.pmf(hit.m_hitPos, normal, bounce_hit.m_sphere) *
+                              sphere_cone_pdf(world.m_spheres[bounce_hit.m_sphere], hit.m_hitPos);
+            incoming *= power_heuristic(bounce_pdf, light_pdf);
+        }
+    }
+
+    PathGuide* guide = world.m_pathGuide.get();
+    if (guide && guide->m_recording)
+    {
+        float luminance = 0.2126f * incoming.m_x + 0.7152f * incoming.m_y + 0.0722f * incoming.m_z;
+        if (luminance > 0 && std::isfinite(luminance))
+            guide->record(hit.m_hitPos, dir, luminance / bounce_pdf);
+    }
+    // lambertian cos / pi over the pdf, exactly 1 for a plain cosine-weighted bounce
+    color += albedo * incoming * (cos_theta / M_PI / bounce_pdf);
+    return color;
+}
+
+// compile time list of the material or primitive types a path kernel handles
+template <typename... Ts>
+class TypeList {};
+
+template <typename T, typename List>
+class TypeIndex;
+// position of T in the list, -1 when it isn't in it
+template <typename T>
+class TypeIndex<T, TypeList<>>
+{
+public:
+    static const int value = -1;
+};
+template <typename T, typename First, typename... Rest>
+class TypeIndex<T, TypeList<First, Rest...>>
+{
+public:
+    static const int rest = TypeIndex<T, TypeList<Rest...>>::value;
+    static const int value = std::is_same<T, First>::value ? 0 : rest < 0 ? -1 : rest + 1;
+};
+
+// position of the material's dynamic type in Ts, -1 when it isn't one of them
+template <typename... Ts>
+int material_kind(Material* material, TypeList<Ts...>)
+{
+    const std::type_info* types[] = { &typeid(Ts)... };
+    for (int k = 0; k < static_cast<int>(sizeof...(Ts)); ++k)
+        if (typeid(*material) == *types[k])
+            return k;
+    return -1;
+}
+
+// f(material as the kind-th of Ts); a single type compiles to the plain call
+template <typename T, typename... Rest>
+class MaterialSwitch
+{
+public:
+    template <typename F>
+    static Vector3D apply(int kind, Material* material, F& f)
+    {
+        if constexpr (sizeof...(Rest) == 0)
+            return f(static_cast<T*>(material));
+        else if (kind == 0)
+            return f(static_cast<T*>(material));
+        else
+            return MaterialSwitch<Rest...>::apply(kind - 1, material, f);
+    }
+};
+
+// ray_hit_color() compiled for one set of material and primitive types and a
+// fixed bounce count, for worlds shade() would treat with the plain estimator
+// anyway. Materials are called by their type instead of through the vtable
+// (so reflect() inlines, and with one material type there is no branch on
+// it), only the listed primitive loops are run, and the bounces are
+// instantiated one inside the other, which unrolls the recursion. Sums are
+// taken in the same order as ray_hit_color(), so images match it exactly.
+template <typename Materials, typename Primitives>
+class PathKernel;
+template <typename... Ms, typename... Ps>
+class PathKernel<TypeList<Ms...>, TypeList<Ps...>>
+{
+public:
+    // kinds[i] is the position of material i's type in Ms
+    template <int Bounces>
+    static Vector3D radiance(Ray& r, World& world, const unsigned char* kinds, long long& ray_count)
+    {
+        if constexpr (Bounces <= 0)
+        {
+            return Vector3D(0,0,0);
+        }
+        else
+        {
+            ++ray_count;
+            COUNT_BOUNCE();
+            HitResult hit;
+            hit.m_t = std::numeric_limits<float>::infinity();
+            (hit_primitives<Ps>(world, r, hit), ...);
+            return shade<Bounces>(r, hit, world, kinds, ray_count);
+        }
+    }
+
+    // shade() of a hit r already found, e.g. a camera hit from a G-buffer
+    template <int Bounces>
+    static Vector3D shade(Ray& r, HitResult& hit, World& world, const unsigned char* kinds, long long& ray_count)
+    {
+        if constexpr (Bounces <= 0)
+        {
+            return Vector3D(0,0,0);
+        }
+        else
+        {
+            if (!hit.m_isHit)
+                return world.m_background;
+
+            if (touched_spheres && hit.m_sphere >= 0)
+                touched_spheres->add(hit.m_sphere);
+            hit.m_coneWidth = r.m_coneWidth + r.m_coneSpread * hit.m_t * r.direction().length();
+            auto bounce = [&](auto* material) {
+                typedef typename std::remove_pointer<decltype(material)>::type M;
+                if (material->M::is_emissive())
+                    return material->m_color;
+                ReflectResult res = material->M::reflect(r, hit);
+                // continue_path() with is_diffuse() known
+                bool diffuse = material->M::is_diffuse();
+                res.m_ray.m_coneWidth = hit.m_coneWidth;
+                res.m_ray.m_coneSpread = r.m_coneSpread + (diffuse ? diffuse_cone_spread : 0);
+                res.m_ray.m_diffuseDepth = r.m_diffuseDepth + (diffuse ? 1 : 0);
+                return res.m_color * radiance<Bounces - 1>(res.m_ray, world, kinds, ray_count);
+            };
+            return MaterialSwitch<Ms...>::apply(kinds[hit.m_hitMaterial], world.material(hit.m_hitMaterial), bounce);
+        }
+    }
+
+private:
+    template <typename P>
+    static void hit_primitives(World& world, Ray& r, HitResult& hit)
+    {
+        if constexpr (std::is_same<P, Sphere>::value)
+            world.hit_spheres(r, 0.001f, hit);
+        else if constexpr (std::is_same<P, Plane>::value)
+            world.hit_closest(world.m_planes, r, 0.001f, hit);
+        else if constexpr (std::is_same<P, Box>::value)
+            world.hit_closest(world.m_boxes, r, 0.001f, hit);
+        else
+            world.hit_closest(world.m_disks, r, 0.001f, hit);
+    }
+};
+
+typedef Vector3D (*PathKernelFunction)(Ray& r, World& world, const unsigned char* kinds, long long& ray_count);
+typedef Vector3D (*PathShadeFunction)(Ray& r, HitResult& hit, World& world, const unsigned char* kinds, long long& ray_count);
+
+// kernels are instantiated for every bounce count up to this
+const int max_kernel_bounces = 8;
+
+template <typename Materials, typename Primitives, int Bounces = 1>
+void kernel_for_bounces(int bounces, PathKernelFunction& function, PathShadeFunction& shade)
+{
+    if constexpr (Bounces > max_kernel_bounces)
+    {
+        function = nullptr;
+        shade = nullptr;
+    }
+    else if (bounces == Bounces)
+    {
+        function = &PathKernel<Materials, Primitives>::template radiance<Bounces>;
+        shade = &PathKernel<Materials, Primitives>::template shade<Bounces>;
+    }
+    else
+    {
+        kernel_for_bounces<Materials, Primitives, Bounces + 1>(bounces, function, shade);
+    }
+}
+
+// the kernel choose_kernel() picked for a world, with the kind of every material
+class KernelChoice
+{
+public:
+    KernelChoice()
+    {
+        m_function = nullptr;
+        m_shade = nullptr;
+        m_name = "generic";
+    }
+    PathKernelFunction m_function;
+    // the same kernel from a given first hit
+    PathShadeFunction m_shade;
+    std::vector<unsigned char> m_kinds;
+    const char* m_name;
+};
+
+// the kernel for Materials and Primitives, if they cover every material and
+// non-empty primitive array of world
+template <typename Materials, typename Primitives>
+bool try_kernel(World& world, int bounces, const char* name, KernelChoice& choice)
+{
+    if ((!world.m_planes.empty() && TypeIndex<Plane, Primitives>::value < 0) ||
+        (!world.m_boxes.empty() && TypeIndex<Box, Primitives>::value < 0) ||
+        (!world.m_disks.empty() && TypeIndex<Disk, Primitives>::value < 0))
+        return false;
+    std::vector<unsigned char> kinds(world.m_materials.size());
+    for (int m = 0; m < world.m_materials.size(); ++m)
+    {
+        int kind = material_kind(world.material(m), Materials());
+        if (kind < 0)
+            return false;
+        kinds[m] = static_cast<unsigned char>(kind);
+    }
+    kernel_for_bounces<Materials, Primitives>(bounces, choice.m_function, choice.m_shade);
+    choice.m_kinds = kinds;
+    choice.m_name = name;
+    return true;
+}
+
+// the most specialized pre-instantiated kernel that renders world exactly
+// like ray_hit_color(), or the generic choice (no function) when there is
+// none: worlds that sample lights, an environment, a guide or cached
+// irradiance, worlds with lattices or meshes, and bounce counts past
+// max_kernel_bounces stay on ray_hit_color()
+KernelChoice choose_kernel(World& world, int bounces)
+{
+    KernelChoice choice;
+    if (world.m_environment.loaded() || world.m_pathGuide || world.m_irradianceCache || !world.m_lights.empty() ||
+        !world.m_lattices.empty() || !world.m_meshes.empty() || bounces < 1 || bounces > max_kernel_bounces)
+        return choice;
+
+    typedef TypeList<Sphere, Plane> Spheres;
+    typedef TypeList<Sphere, Plane, Box, Disk> Shapes;
+    try_kernel<TypeList<Diffuse>, Spheres>(world, bounces, "diffuse spheres", choice) ||
+        try_kernel<TypeList<Specular>, Spheres>(world, bounces, "specular spheres", choice) ||
+        try_kernel<TypeList<Diffuse, Specular>, Spheres>(world, bounces, "diffuse and specular spheres", choice) ||
+        try_kernel<TypeList<Diffuse, Specular, Textured>, Spheres>(world, bounces, "textured spheres", choice) ||
+        try_kernel<TypeList<Diffuse, Specular>, Shapes>(world, bounces, "diffuse and specular shapes", choice) ||
+        try_kernel<TypeList<Diffuse, Specular, Textured>, Shapes>(world, bounces, "textured shapes", choice);
+    return choice;
+}
+
+class RenderSettings
+{
+public:
+    RenderSettings()
+    {
+        m_width = 768;
+        m_height = 540;
+        m_raysPerPixel = 100;
+        m_maxLightBounceNum = 5;
+        m_threadCount = 0;
+        m_tileSize = 32;
+        m_pinThreads = false;
+        m_replicateScene = false;
+        m_timeBudget = 0;
+        m_pilotSamples = 4;
+        m_recordTouched = false;
+        m_seed = 0;
+        m_batchMeshRays = true;
+        m_specializeKernels = true;
+    }
+
+    int m_width;
+    int m_height;
+    int m_raysPerPixel;
+    int m_maxLightBounceNum;
+    // 0 means one worker per cpu
+    int m_threadCount;
+    int m_tileSize;
+    // pin every worker to a cpu and have it render tiles owned by its own NUMA node
+    bool m_pinThreads;
+    // give every NUMA node its own copy of the world (only used with m_pinThreads)
+    bool m_replicateScene;
+    // seconds of wall clock for the whole render, 0 renders m_raysPerPixel everywhere.
+    // With a budget every pixel gets m_pilotSamples (at least one even past the
+    // deadline), then the rest of the time goes to the noisiest tiles. A
+    // world's path guide is not trained in this mode
+    double m_timeBudget;
+    int m_pilotSamples;
+    // remember which spheres each tile's paths hit, so edits can find the
+    // tiles they change through reflections, indirect light and shadows
+    bool m_recordTouched;
+    // mixed into every tile's seed; frames of a sequence use different ones so
+    // their noise isn't the same pattern over and over
+    unsigned m_seed;
+    // in worlds with out-of-core meshes, trace each tile's paths a bounce at a
+    // time so the meshes get whole batches of rays (see World::hit_batch)
+    bool m_batchMeshRays;
+    // trace with the PathKernel choose_kernel() picks for the world, off
+    // always uses the generic ray_hit_color()
+    bool m_specializeKernels;
+};
+
+// renders the image in square tiles on a pool of worker threads. The image is
+// split into one horizontal band per NUMA node; a band's pixels (and optionally
+// a copy of the world) are first touched by a thread on that node, and workers
+// drain their own node's band before helping with the others.
+class Renderer
+{
+public:
+    Renderer(const RenderSettings& settings)
+    {
+        m_settings = settings;
+        m_rayCount = 0;
+        m_seconds = 0;
+        m_guideSeconds = 0;
+        m_guideIterations = 0;
+        m_primaryHits = nullptr;
+        m_singlePass = false;
+    }
+
+    void render(World& world, Camera& camera);
+
+    // sum of all samples of pixel (i, j), j counts rows from the bottom
+    Vector3D pixel(int i, int j);
+    // number of samples summed in pixel(i, j)
+    int sample_count(int i, int j);
+    // achieved samples per pixel over a coarse grid of image regions
+    void print_sample_report(std::ostream& out);
+#ifdef TRACE_STATS
+    // primitive tests, node visits and bounces summed over the samples of pixel (i, j)
+    Vector3D pixel_cost(int i, int j);
+#endif
+
+    // incremental updates after a scene edit: the finished image is kept, the
+    // listed tiles are rendered again from scratch (the way render() would
+    // render them, same seeds) and spliced in. The world's accelerator must
+    // already be up to date. Only a render done in one plain pass can be
+    // replayed: after a budgeted or path guided one (whose pass schedule
+    // depended on the clock or the guide's training) nothing is rendered and
+    // false is returned.
+    bool rerender(World& world, Camera& camera, const std::vector<int>& tiles);
+    // tiles the screen-space projection of bounds overlaps
+    std::vector<int> tiles_in_projection(Camera& camera, const AABB& bounds);
+    // tiles whose paths hit the sphere, sampled it as a light or had a shadow
+    // ray blocked by it, needs m_recordTouched
+    std::vector<int> tiles_touching(int sphere);
+    // tiles a change of sphere from old_bounds to its current bounds can affect:
+    // both projections, plus every tile whose paths touched it when recorded.
+    // Paths that only reach the new position (a shadow it starts casting on
+    // a tile its old position never darkened, say) aren't found
+    std::vector<int> tiles_affected_by(Camera& camera, World& world, int sphere, const AABB& old_bounds);
+
+    RenderSettings m_settings;
+    long long m_rayCount;
+    double m_seconds;
+    // with a path guide: time spent refining it between training passes, and how many there were
+    double m_guideSeconds;
+    int m_guideIterations;
+    // the path kernel the last render used
+    KernelChoice m_kernel;
+    // hybrid rendering: when set, camera hits come from this G-buffer of the
+    // world and camera being rendered (same size as the image) instead of
+    // tracing camera rays, sample s of a pixel through its pass s modulo the
+    // pass count. Not used for worlds gbuffer_supports() rejects.
+    const GBuffer* m_primaryHits;
+
+private:
+    class Band
+    {
+    public:
+        int m_node;
+        int m_firstTileRow;
+        int m_endTileRow;
+        std::vector<Vector3D> m_pixels;
+        // per pixel sample count and sum of squared sample luminance, for the variance
+        std::vector<int> m_counts;
+        std::vector<float> m_luminanceSquares;
+#ifdef TRACE_STATS
+        std::vector<Vector3D> m_costs;
+#endif
+        std::unique_ptr<World> m_replica;
+        World* m_world;
+        std::atomic<int> m_nextTile;
+    };
+
+    void init_band(Band& band, World& world, int cpu);
+    void run_pass(Camera& camera, std::atomic<long long>& ray_count);
+    void worker(int node, int cpu, Camera& camera, std::atomic<long long>& ray_count);
+    void render_tile(Band& band, int tile, Camera& camera, std::vector<Vector3D>& scratch, long long& ray_count);
+    bool traces_batches(World& world) const;
+    long long trace_tile_batched(Band& band, int x0, int y0, int samples, Camera& camera, std::vector<Vector3D>& scratch,
+                                 long long& ray_count);
+    void render_budget(Camera& camera, std::atomic<long long>& ray_count, std::chrono::steady_clock::time_point start);
+    void render_guided(World& world, Camera& camera, std::atomic<long long>& ray_count);
+    // estimated squared relative error of every tile's pixels
+    std::vector<double> tile_errors();
+    Band& band_of_row(int j);
+    void clear_tile(int tile);
+
+    int m_tilesX;
+    int m_tilesY;
+    std::vector<std::unique_ptr<Band>> m_bands;
+
+    // samples per pixel each tile gets in the current pass
+    std::vector<int> m_passSamples;
+    int m_pass;
+    // whether the last render() was one pass of m_raysPerPixel over all tiles
+    bool m_singlePass;
+    bool m_hasDeadline;
+    std::chrono::steady_clock::time_point m_deadline;
+    std::atomic<long long> m_passSampleCount;
+    // which cpu every worker runs on, -1 unpinned
+    std::vector<int> m_workerNodes;
+    std::vector<int> m_workerCpus;
+    // sorted spheres touched by each tile's paths, when recording
+    std::vector<std::vector<int>> m_touched;
+};
+
+void Renderer::render(World& world, Camera& camera)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    CpuTopology topology = CpuTopology::detect();
+    int thread_count = m_settings.m_threadCount > 0 ? m_settings.m_threadCount : topology.cpu_count();
+    int node_count = m_settings.m_pinThreads ? topology.node_count() : 1;
+    if (node_count > thread_count)
+        node_count = thread_count;
+
+    // workers are dealt out to nodes round robin, and each node gets a share
+    // of tile rows proportional to its worker count
+    std::vector<int> node_threads(node_count, 0);
+    for (int t = 0; t < thread_count; ++t)
+        node_threads[t % node_count]++;
+
+    m_tilesX = (m_settings.m_width + m_settings.m_tileSize - 1) / m_settings.m_tileSize;
+    m_tilesY = (m_settings.m_height + m_settings.m_tileSize - 1) / m_settings.m_tileSize;
+    m_bands.clear();
+    int threads_before = 0;
+    for (int node = 0; node < node_count; ++node)
+    {
+        std::unique_ptr<Band> band(new Band());
+        band->m_node = node;
+        band->m_firstTileRow = m_tilesY * threads_before / thread_count;
+        threads_before += node_threads[node];
+        band->m_endTileRow = m_tilesY * threads_before / thread_count;
+        band->m_world = &world;
+        band->m_nextTile = 0;
+        m_bands.push_back(std::move(band));
+    }
+
+    // first touch: each band is allocated and zeroed by a thread on its node
+    std::vector<std::thread> threads;
+    for (int node = 0; node < node_count; ++node)
+    {
+        int cpu = m_settings.m_pinThreads ? topology.m_nodeCpus[node][0] : -1;
+        threads.push_back(std::thread(&Renderer::init_band, this, std::ref(*m_bands[node]), std::ref(world), cpu));
+    }
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+
+    m_workerNodes.clear();
+    m_workerCpus.clear();
+    for (int t = 0; t < thread_count; ++t)
+    {
+        int node = t % node_count;
+        const std::vector<int>& cpus = topology.m_nodeCpus[m_settings.m_pinThreads ? node : 0];
+        m_workerNodes.push_back(node);
+        m_workerCpus.push_back(m_settings.m_pinThreads ? cpus[(t / node_count) % cpus.size()] : -1);
+    }
+
+    m_touched.assign(m_settings.m_recordTouched ? m_tilesX * m_tilesY : 0, std::vector<int>());
+
+    m_kernel = m_settings.m_specializeKernels ? choose_kernel(world, m_settings.m_maxLightBounceNum) : KernelChoice();
+
+    std::atomic<long long> ray_count(0);
+    m_pass = 0;
+    m_hasDeadline = m_settings.m_timeBudget > 0;
+    m_singlePass = !m_hasDeadline && !world.m_pathGuide;
+    if (m_hasDeadline)
+    {
+        render_budget(camera, ray_count, start);
+    }
+    else if (world.m_pathGuide)
+    {
+        render_guided(world, camera, ray_count);
+    }
+    else
+    {
+        m_passSamples.assign(m_tilesX * m_tilesY, m_settings.m_raysPerPixel);
+        run_pass(camera, ray_count);
+    }
+
+    m_rayCount = ray_count;
+    m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Renderer::init_band(Band& band, World& world, int cpu)
+{
+    if (cpu >= 0)
+        pin_current_thread(cpu);
+
+    int rows = (band.m_endTileRow - band.m_firstTileRow) * m_settings.m_tileSize;
+    band.m_pixels.assign(rows * m_settings.m_width, Vector3D(0, 0, 0));
+    band.m_counts.assign(rows * m_settings.m_width, 0);
+    band.m_luminanceSquares.assign(rows * m_settings.m_width, 0.0f);
+#ifdef TRACE_STATS
+    band.m_costs.assign(rows * m_settings.m_width, Vector3D(0, 0, 0));
+#endif
+
+    if (m_settings.m_pinThreads && m_settings.m_replicateScene)
+    {
+        band.m_replica.reset(new World(world));
+        band.m_world = band.m_replica.get();
+    }
+}
+
+// one sweep over all tiles, every tile adding m_passSamples[tile] samples per pixel
+void Renderer::run_pass(Camera& camera, std::atomic<long long>& ray_count)
+{
+    for (auto& band : m_bands)
+        band->m_nextTile = 0;
+    m_passSampleCount = 0;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < m_workerCpus.size(); ++t)
+        threads.push_back(std::thread(&Renderer::worker, this, m_workerNodes[t], m_workerCpus[t], std::ref(camera), std::ref(ray_count)));
+    for (auto& t : threads)
+        t.join();
+    ++m_pass;
+}
+
+void Renderer::worker(int node, int cpu, Camera& camera, std::atomic<long long>& ray_count)
+{
+    if (cpu >= 0)
+        pin_current_thread(cpu);
+
+    // per-thread tile buffer, first touched here
+    std::vector<Vector3D> scratch(m_settings.m_tileSize * m_settings.m_tileSize);
+    long long rays = 0;
+
+    // own node's band first, then steal from the others
+    int band_count = static_cast<int>(m_bands.size());
+    for (int k = 0; k < band_count; ++k)
+    {
+        Band& band = *m_bands[(node + k) % band_count];
+        int tile_count = (band.m_endTileRow - band.m_firstTileRow) * m_tilesX;
+        for (int tile = band.m_nextTile++; tile < tile_count; tile = band.m_nextTile++)
+            render_tile(band, tile, camera, scratch, rays);
+    }
+    ray_count += rays;
+}
+
+void Renderer::render_tile(Band& band, int tile, Camera& camera, std::vector<Vector3D>& scratch, long long& ray_count)
+{
+    int size = m_settings.m_tileSize;
+    int tile_row = band.m_firstTileRow + tile / m_tilesX;
+    int x0 = (tile % m_tilesX) * size;
+    int y0 = tile_row * size;
+    int width = m_settings.m_width;
+    int height = m_settings.m_height;
+
+    float spread = camera.pixel_spread(height);
+
+    int global_tile = tile_row * m_tilesX + tile % m_tilesX;
+    int samples = m_passSamples[global_tile];
+    if (samples <= 0)
+        return;
+
+    // seeding per tile (and pass) keeps the image independent of which thread renders what
+    seed_random((global_tile + 1 + (long long)m_pass * m_tilesX * m_tilesY) ^ ((unsigned long long)m_settings.m_seed << 40));
+
+    static thread_local TouchedSpheres touched;
+    if (m_settings.m_recordTouched)
+    {
+        touched.reset(static_cast<int>(band.m_world->m_spheres.size()));
+        touched_spheres = &touched;
+    }
+
+    const GBuffer* primary_hits = m_primaryHits && gbuffer_supports(*band.m_world) ? m_primaryHits : nullptr;
+    long long sample_count = 0;
+    if (traces_batches(*band.m_world))
+    {
+        sample_count = trace_tile_batched(band, x0, y0, samples, camera, scratch, ray_count);
+    }
+    else
+    {
+        for (int y = 0; y < size && y0 + y < height; ++y)
+        {
+            for (int x = 0; x < size && x0 + x < width; ++x)
+            {
+                int i = x0 + x;
+                int j = y0 + y;
+                int p = (j - band.m_firstTileRow * size) * width + i;
+                Vector3D pixel_color(0,0,0);
+                float luminance_squares = 0;
+#ifdef TRACE_STATS
+                TraversalStats before = traversal_stats;
+#endif
+                int s = 0;
+                for (; s < samples; ++s)
+                {
+                    // past the deadline, only pixels that have no sample yet get one
+                    if (m_hasDeadline && (s > 0 || band.m_counts[p] > 0) && std::chrono::steady_clock::now() > m_deadline)
+                        break;
+                    Vector3D sample;
+                    if (primary_hits)
+                    {
+                        int pass = (band.m_counts[p] + s) % primary_hits->pass_count();
+                        float col = (i + primary_hits->jitter_x(pass)) / (width-1);
+                        float row = (j + primary_hits->jitter_y(pass)) / (height-1);
+                        Ray r = camera.generate_ray(col, row);
+                        r.m_coneSpread = spread;
+                        HitResult hit = primary_hits->hit(pass, i, j, r, *band.m_world);
+                        sample = m_kernel.m_shade
+                                     ? m_kernel.m_shade(r, hit, *band.m_world, m_kernel.m_kinds.data(), ray_count)
+                                     : shade(r, hit, *band.m_world, m_settings.m_maxLightBounceNum, ray_count, 0);
+                    }
+                    else
+                    {
+                        float col = (i + random_float()) / (width-1);
+                        float row = (j + random_float()) / (height-1);
+                        Ray r = camera.generate_ray(col, row);
+                        r.m_coneSpread = spread;
+                        sample = m_kernel.m_function
+                                     ? m_kernel.m_function(r, *band.m_world, m_kernel.m_kinds.data(), ray_count)
+                                     : ray_hit_color(r, *band.m_world, m_settings.m_maxLightBounceNum, ray_count);
+                    }
+                    pixel_color += sample;
+                    float luminance = 0.2126f * sample.m_x + 0.7152f * sample.m_y + 0.0722f * sample.m_z;
+                    luminance_squares += luminance * luminance;
+                }
+                scratch[y * size + x] = pixel_color;
+                band.m_counts[p] += s;
+                band.m_luminanceSquares[p] += luminance_squares;
+                sample_count += s;
+#ifdef TRACE_STATS
+                band.m_costs[p] += Vector3D(traversal_stats.m_primitiveTests - before.m_primitiveTests,
+                                            traversal_stats.m_nodeVisits - before.m_nodeVisits,
+                                            traversal_stats.m_bounces - before.m_bounces);
+#endif
+            }
+        }
+    }
+    m_passSampleCount += sample_count;
+
+    if (m_settings.m_recordTouched)
+    {
+        touched_spheres = nullptr;
+        // merged with what earlier passes of this tile touched
+        std::vector<int>& list = m_touched[global_tile];
+        list.insert(list.end(), touched.m_list.begin(), touched.m_list.end());
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+
+    // add the finished tile into the band
+    for (int y = 0; y < size && y0 + y < height; ++y)
+        for (int x = 0; x < size && x0 + x < width; ++x)
+            band.m_pixels[(y0 + y - band.m_firstTileRow * size) * width + x0 + x] += scratch[y * size + x];
+}
+
+// the batched tracer only knows the plain estimator of shade(): worlds that
+// sample lights, the environment, a guide or cached irradiance, and renders
+// against a deadline, trace one path at a time even when they have meshes
+bool Renderer::traces_batches(World& world) const
+{
+    return m_settings.m_batchMeshRays && !world.m_meshes.empty() && !m_hasDeadline && !world.m_environment.loaded() &&
+           !world.m_pathGuide && !world.m_irradianceCache && world.m_lights.empty();
+}
+
+// paths traced together by trace_tile_batched(), the tile's samples are split into waves of about this many
+const int batch_path_count = 32768;
+
+// the same estimate as ray_hit_color() for every sample of a tile, but
+// breadth first: each bounce of all live paths is one World::hit_batch call.
+// Fills scratch and the band's counts like render_tile(), returns the sample count
+long long Renderer::trace_tile_batched(Band& band, int x0, int y0, int samples, Camera& camera, std::vector<Vector3D>& scratch,
+                                       long long& ray_count)
+{
+    World& world = *band.m_world;
+    int size = m_settings.m_tileSize;
+    int width = m_settings.m_width;
+    int height = m_settings.m_height;
+    float spread = camera.pixel_spread(height);
+    int tile_width = std::min(size, width - x0);
+    int tile_height = std::min(size, height - y0);
+    int pixel_count = tile_width * tile_height;
+    int wave = std::max(1, batch_path_count / pixel_count);
+
+    std::vector<float> luminance_squares(pixel_count, 0.0f);
+#ifdef TRACE_STATS
+    // laid out like scratch
+    std::vector<Vector3D> costs(size * size, Vector3D(0, 0, 0));
+#endif
+    for (int y = 0; y < tile_height; ++y)
+        for (int x = 0; x < tile_width; ++x)
+            scratch[y * size + x] = Vector3D(0, 0, 0);
+
+    // per path: its pixel in scratch, ray, hit, what is left of its throughput and what it collected
+    std::vector<int> pixel;
+    std::vector<Ray> rays;
+    std::vector<HitResult> hits;
+    std::vector<Vector3D> throughput;
+    std::vector<Vector3D> radiance;
+    std::vector<int> live;
+    std::vector<int> next;
+    for (int first = 0; first < samples; first += wave)
+    {
+        int wave_samples = std::min(wave, samples - first);
+        int path_count = pixel_count * wave_samples;
+        pixel.resize(path_count);
+        rays.resize(path_count);
+        hits.resize(path_count);
+        throughput.assign(path_count, Vector3D(1, 1, 1));
+        radiance.assign(path_count, Vector3D(0, 0, 0));
+        live.resize(path_count);
+        int path = 0;
+        for (int y = 0; y < tile_height; ++y)
+        {
+            for (int x = 0; x < tile_width; ++x)
+            {
+                for (int s = 0; s < wave_samples; ++s, ++path)
+                {
+                    float col = (x0 + x + random_float()) / (width-1);
+                    float row = (y0 + y + random_float()) / (height-1);
+                    rays[path] = camera.generate_ray(col, row);
+                    rays[path].m_coneSpread = spread;
+                    pixel[path] = y * size + x;
+                    live[path] = path;
+                }
+            }
+        }
+
+        for (int bounce = 0; bounce < m_settings.m_maxLightBounceNum && !live.empty(); ++bounce)
+        {
+            ray_count += live.size();
+#ifdef TRACE_STATS
+            TraversalStats before = traversal_stats;
+#endif
+            world.hit_batch(rays, live, 0.001f, hits);
+            next.clear();
+            for (int p : live)
+            {
+                COUNT_BOUNCE();
+                Ray& r = rays[p];
+                HitResult& hit = hits[p];
+                if (!hit.m_isHit)
+                {
+                    radiance[p] += throughput[p] * world.m_background;
+                    continue;
+                }
+                if (touched_spheres && hit.m_sphere >= 0)
+                    touched_spheres->add(hit.m_sphere);
+                hit.m_coneWidth = r.m_coneWidth + r.m_coneSpread * hit.m_t * r.direction().length();
+                Material* material = world.material(hit.m_hitMaterial);
+                if (material->is_emissive())
+                {
+                    radiance[p] += throughput[p] * material->m_color;
+                    continue;
+                }
+                ReflectResult res = material->reflect(r, hit);
+                continue_path(r, hit, material, res.m_ray);
+                throughput[p] = throughput[p] * res.m_color;
+                r = res.m_ray;
+                next.push_back(p);
+            }
+#ifdef TRACE_STATS
+            // hit_batch() interleaves the paths chunk by chunk, so the bounce's
+            // work is shared out evenly over the paths it traced
+            Vector3D cost = Vector3D(traversal_stats.m_primitiveTests - before.m_primitiveTests,
+                                     traversal_stats.m_nodeVisits - before.m_nodeVisits,
+                                     traversal_stats.m_bounces - before.m_bounces) / float(live.size());
+            for (int p : live)
+                costs[pixel[p]] += cost;
+#endif
+            live.swap(next);
+        }
+
+        for (int p = 0; p < path_count; ++p)
+        {
+            scratch[pixel[p]] += radiance[p];
+            float luminance = 0.2126f * radiance[p].m_x + 0.7152f * radiance[p].m_y + 0.0722f * radiance[p].m_z;
+            luminance_squares[p / wave_samples] += luminance * luminance;
+        }
+    }
+
+    for (int y = 0; y < tile_height; ++y)
+    {
+        for (int x = 0; x < tile_width; ++x)
+        {
+            int p = (y0 + y - band.m_firstTileRow * size) * width + x0 + x;
+            band.m_counts[p] += samples;
+            band.m_luminanceSquares[p] += luminance_squares[y * tile_width + x];
+#ifdef TRACE_STATS
+            band.m_costs[p] += costs[y * size + x];
+#endif
+        }
+    }
+    return static_cast<long long>(samples) * pixel_count;
+}
+
+// training passes of 1, 2, 4, ... samples per pixel, each followed by refining
+// the path guide from what it recorded; the final pass gets whatever is left
+// once that is less than the next two. Every pass is unbiased, so all of them
+// stay in the image.
+void Renderer::render_guided(World& world, Camera& camera, std::atomic<long long>& ray_count)
+{
+    PathGuide& guide = *world.m_pathGuide;
+    guide.reset(world.bounds());
+    m_guideSeconds = 0;
+    m_guideIterations = 0;
+
+    int remaining = m_settings.m_raysPerPixel;
+    for (int samples = 1; remaining > 0; samples *= 2)
+    {
+        bool last = remaining < 3 * samples;
+        int pass_samples = last ? remaining : samples;
+        guide.m_recording = !last;
+        m_passSamples.assign(m_tilesX * m_tilesY, pass_samples);
+        run_pass(camera, ray_count);
+        remaining -= pass_samples;
+        if (!last)
+        {
+            auto refine_start = std::chrono::steady_clock::now();
+            guide.refine(pass_samples);
+            m_guideSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - refine_start).count();
+            ++m_guideIterations;
+        }
+    }
+    guide.m_recording = false;
+}
+
+// pilot pass, then passes that each spend about half the remaining time,
+// handing samples to tiles in proportion to their estimated error
+void Renderer::render_budget(Camera& camera, std::atomic<long long>& ray_count, std::chrono::steady_clock::time_point start)
+{
+    using clock = std::chrono::steady_clock;
+    m_deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(m_settings.m_timeBudget));
+    int tile_count = m_tilesX * m_tilesY;
+    int tile_pixels = m_settings.m_tileSize * m_settings.m_tileSize;
+
+    m_passSamples.assign(tile_count, m_settings.m_pilotSamples > 0 ? m_settings.m_pilotSamples : 1);
+    while (true)
+    {
+        auto pass_start = clock::now();
+        run_pass(camera, ray_count);
+        double pass_seconds = std::chrono::duration<double>(clock::now() - pass_start).count();
+        double remaining = std::chrono::duration<double>(m_deadline - clock::now()).count();
+        if (remaining <= 0 || m_passSampleCount == 0)
+            break;
+
+        // throughput of the pass just finished sizes the next one; the last
+        // few milliseconds go in one pass, the deadline check cuts it short
+        double samples_per_second = m_passSampleCount / fmax(pass_seconds, 1e-6);
+        double pass_budget = remaining < 0.05 ? remaining : remaining * 0.5;
+        double batch = samples_per_second * pass_budget;
+
+        std::vector<double> errors = tile_errors();
+        double total_error = 0;
+        for (double e : errors)
+            total_error += e;
+        for (int t = 0; t < tile_count; ++t)
+        {
+            double share = total_error > 0 ? errors[t] / total_error : 1.0 / tile_count;
+            m_passSamples[t] = static_cast<int>(ceil(batch * share / tile_pixels));
+        }
+    }
+}
+
+std::vector<double> Renderer::tile_errors()
+{
+    int size = m_settings.m_tileSize;
+    int width = m_settings.m_width;
+    int height = m_settings.m_height;
+    std::vector<double> errors(m_tilesX * m_tilesY, 0.0);
+    for (int j = 0; j < height; ++j)
+    {
+        Band& band = band_of_row(j);
+        for (int i = 0; i < width; ++i)
+        {
+            int p = (j - band.m_firstTileRow * size) * width + i;
+            int n = band.m_counts[p];
+            if (n < 2)
+            {
+                // nothing to go on, treat as very noisy
+                errors[(j / size) * m_tilesX + i / size] += 1;
+                continue;
+            }
+            Vector3D sum = band.m_pixels[p];
+            float mean = (0.2126f * sum.m_x + 0.7152f * sum.m_y + 0.0722f * sum.m_z) / n;
+            float variance = fmaxf(0.0f, band.m_luminanceSquares[p] / n - mean * mean);
+            // variance of the pixel estimate relative to its brightness; the
+            // offset keeps near-black pixels from taking every sample
+            errors[(j / size) * m_tilesX + i / size] += variance / n / (mean * mean + 0.01f);
+        }
+    }
+    return errors;
+}
+
+Renderer::Band& Renderer::band_of_row(int j)
+{
+    int tile_row = j / m_settings.m_tileSize;
+    for (auto& band : m_bands)
+    {
+        if (tile_row >= band->m_firstTileRow && tile_row < band->m_endTileRow)
+            return *band;
+    }
+    return *m_bands.back();
+}
+
+Vector3D Renderer::pixel(int i, int j)
+{
+    Band& band = band_of_row(j);
+    return band.m_pixels[(j - band.m_firstTileRow * m_settings.m_tileSize) * m_settings.m_width + i];
+}
+
+bool Renderer::rerender(World& world, Camera& camera, const std::vector<int>& tiles)
+{
+    if (!m_singlePass || world.m_pathGuide)
+        return false;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // replicas hold the world as it was, copy it again
+    for (auto& band : m_bands)
+    {
+        if (band->m_replica)
+        {
+            band->m_replica.reset(new World(world));
+            band->m_world = band->m_replica.get();
+        }
+        else
+        {
+            band->m_world = &world;
+        }
+    }
+
+    m_kernel = m_settings.m_specializeKernels ? choose_kernel(world, m_settings.m_maxLightBounceNum) : KernelChoice();
+
+    m_passSamples.assign(m_tilesX * m_tilesY, 0);
+    for (int tile : tiles)
+    {
+        m_passSamples[tile] = m_settings.m_raysPerPixel;
+        clear_tile(tile);
+    }
+
+    std::atomic<long long> ray_count(0);
+    m_pass = 0;
+    m_hasDeadline = false;
+    run_pass(camera, ray_count);
+
+    m_rayCount = ray_count;
+    m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+void Renderer::clear_tile(int tile)
+{
+    int size = m_settings.m_tileSize;
+    int x0 = (tile % m_tilesX) * size;
+    int y0 = (tile / m_tilesX) * size;
+    for (int j = y0; j < y0 + size && j < m_settings.m_height; ++j)
+    {
+        Band& band = band_of_row(j);
+        for (int i = x0; i < x0 + size && i < m_settings.m_width; ++i)
+        {
+            int p = (j - band.m_firstTileRow * size) * m_settings.m_width + i;
+            band.m_pixels[p] = Vector3D(0, 0, 0);
+            band.m_counts[p] = 0;
+            band.m_luminanceSquares[p] = 0;
+#ifdef TRACE_STATS
+            band.m_costs[p] = Vector3D(0, 0, 0);
+#endif
+        }
+    }
+    if (!m_touched.empty())
+        m_touched[tile].clear();
+}
+
+std::vector<int> Renderer::tiles_in_projection(Camera& camera, const AABB& bounds)
+{
+    std::vector<int> tiles;
+    if (bounds.empty())
+        return tiles;
+
+    // screen rectangle of the eight corners; a box reaching behind the camera
+    // can cover anything
+    float min_col = std::numeric_limits<float>::infinity(), max_col = -min_col;
+    float min_row = min_col, max_row = -min_col;
+    for (int k = 0; k < 8; ++k)
+    {
+        Vector3D corner(k & 1 ? bounds.m_max.m_x : bounds.m_min.m_x,
+                        k & 2 ? bounds.m_max.m_y : bounds.m_min.m_y,
+                        k & 4 ? bounds.m_max.m_z : bounds.m_min.m_z);
+        float col, row;
+        if (!camera.project(corner, col, row))
+        {
+            for (int t = 0; t < m_tilesX * m_tilesY; ++t)
+                tiles.push_back(t);
+            return tiles;
+        }
+        min_col = std::min(min_col, col);
+        max_col = std::max(max_col, col);
+        min_row = std::min(min_row, row);
+        max_row = std::max(max_row, row);
+    }
+
+    // pixel i covers col in [i, i + 1] / (width - 1), one pixel of margin for the jitter
+    int size = m_settings.m_tileSize;
+    int i0 = std::max(0, static_cast<int>(floorf(min_col * (m_settings.m_width - 1))) - 1);
+    int i1 = std::min(m_settings.m_width - 1, static_cast<int>(ceilf(max_col * (m_settings.m_width - 1))) + 1);
+    int j0 = std::max(0, static_cast<int>(floorf(min_row * (m_settings.m_height - 1))) - 1);
+    int j1 = std::min(m_settings.m_height - 1, static_cast<int>(ceilf(max_row * (m_settings.m_height - 1))) + 1);
+    for (int ty = j0 / size; ty <= j1 / size && i0 <= i1 && j0 <= j1; ++ty)
+        for (int tx = i0 / size; tx <= i1 / size; ++tx)
+            tiles.push_back(ty * m_tilesX + tx);
+    return tiles;
+}
+
+std::vector<int> Renderer::tiles_touching(int sphere)
+{
+    std::vector<int> tiles;
+    for (int t = 0; t < (int)m_touched.size(); ++t)
+    {
+        if (std::binary_search(m_touched[t].begin(), m_touched[t].end(), sphere))
+            tiles.push_back(t);
+    }
+    return tiles;
+}
+
+std::vector<int> Renderer::tiles_affected_by(Camera& camera, World& world, int sphere, const AABB& old_bounds)
+{
+    std::vector<int> tiles = tiles_in_projection(camera, old_bounds);
+    std::vector<int> more = tiles_in_projection(camera, world.m_spheres[sphere].bounds());
+    tiles.insert(tiles.end(), more.begin(), more.end());
+    more = tiles_touching(sphere);
+    tiles.insert(tiles.end(), more.begin(), more.end());
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+    return tiles;
+}
+
+int Renderer::sample_count(int i, int j)
+{
+    Band& band = band_of_row(j);
+    return band.m_counts[(j - band.m_firstTileRow * m_settings.m_tileSize) * m_settings.m_width + i];
+}
+
+#ifdef TRACE_STATS
+Vector3D Renderer::pixel_cost(int i, int j)
+{
+    Band& band = band_of_row(j);
+    return band.m_costs[(j - band.m_firstTileRow * m_settings.m_tileSize) * m_settings.m_width + i];
+}
+#endif
+
+void Renderer::print_sample_report(std::ostream& out)
+{
+    // at most 8 x 6 regions, top row of the image first
+    int columns = std::min(8, m_settings.m_width);
+    int rows = std::min(6, m_settings.m_height);
+    long long total = 0;
+    int min_count = std::numeric_limits<int>::max();
+    int max_count = 0;
+    std::vector<long long> sums(columns * rows, 0);
+    std::vector<int> pixels(columns * rows, 0);
+    for (int j = 0; j < m_settings.m_height; ++j)
+    {
+        for (int i = 0; i < m_settings.m_width; ++i)
+        {
+            int n = sample_count(i, j);
+            int region = (rows - 1 - j * rows / m_settings.m_height) * columns + i * columns / m_settings.m_width;
+            sums[region] += n;
+            pixels[region]++;
+            total += n;
+            min_count = std::min(min_count, n);
+            max_count = std::max(max_count, n);
+        }
+    }
+    out << "samples per pixel: " << total / double(m_settings.m_width * m_settings.m_height)
+        << " average, " << min_count << " min, " << max_count << " max, " << m_pass << " passes" << std::endl;
+    for (int r = 0; r < rows; ++r)
+    {
+        for (int c = 0; c < columns; ++c)
+        {
+            std::string value = std::to_string(static_cast<int>(sums[r * columns + c] / double(pixels[r * columns + c]) + 0.5));
+            out << std::string(value.size() < 7 ? 7 - value.size() : 0, ' ') << value;
+        }
+        out << std::endl;
+    }
+}
+
+#endif
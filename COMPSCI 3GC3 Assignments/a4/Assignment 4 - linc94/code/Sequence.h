@@ -0,0 +1,392 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+#include "Parallel.h"
+#include "Renderer.h"
+#include "World.h"
+
+// writes radiance (width * height, row 0 at the bottom) as a gamma 2 P3 ppm, false if that failed
+bool write_ppm(const std::string& path, int width, int height, const std::vector<Vector3D>& radiance)
+{
+    std::ofstream out(path);
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (int j = height - 1; j >= 0; --j)
+    {
+        for (int i = 0; i < width; ++i)
+        {
+            const Vector3D& c = radiance[j * width + i];
+            // NaNs come out black
+            float r = c.m_x == c.m_x ? c.m_x : 0;
+            float g = c.m_y == c.m_y ? c.m_y : 0;
+            float b = c.m_z == c.m_z ? c.m_z : 0;
+            out << int(clamp(256 * sqrt(r), 0, 255)) << ' ' << int(clamp(256 * sqrt(g), 0, 255)) << ' '
+                << int(clamp(256 * sqrt(b), 0, 255)) << '\n';
+        }
+    }
+    return static_cast<bool>(out);
+}
+
+class CameraKey
+{
+public:
+    float m_time;
+    Vector3D m_eye;
+    Vector3D m_target;
+    float m_fov;
+};
+
+// eye, target and fov keyframed over time. Between keys they follow
+// Catmull-Rom splines through the keys, before the first and after the last
+// key they hold still.
+class CameraPath
+{
+public:
+    CameraPath()
+    {
+        m_up = Vector3D(0, 1, 0);
+    }
+
+    // keys go in increasing time
+    void add(float time, const Vector3D& eye, const Vector3D& target, float fov)
+    {
+        CameraKey key;
+        key.m_time = time;
+        key.m_eye = eye;
+        key.m_target = target;
+        key.m_fov = fov;
+        m_keys.push_back(key);
+    }
+    // one turn around center over time [0, 1], at radius and height, looking at center
+    static CameraPath turntable(const Vector3D& center, float radius, float height, float fov, int key_count = 8);
+
+    Camera at(float time, float aspect_ratio) const;
+    float start_time() const
+    {
+        return m_keys.empty() ? 0 : m_keys.front().m_time;
+    }
+    float end_time() const
+    {
+        return m_keys.empty() ? 0 : m_keys.back().m_time;
+    }
+
+    std::vector<CameraKey> m_keys;
+    Vector3D m_up;
+};
+
+CameraPath CameraPath::turntable(const Vector3D& center, float radius, float height, float fov, int key_count)
+{
+    CameraPath path;
+    // one key before 0 and one past 1 give the spline its tangents at the ends
+    for (int k = -1; k <= key_count + 1; ++k)
+    {
+        float angle = 2 * M_PI * k / key_count;
+        path.add(static_cast<float>(k) / key_count, center + Vector3D(radius * cosf(angle), height, radius * sinf(angle)),
+                 center, fov);
+    }
+    return path;
+}
+
+Camera CameraPath::at(float time, float aspect_ratio) const
+{
+    int count = static_cast<int>(m_keys.size());
+    int k = 0;
+    while (k + 2 < count && m_keys[k + 1].m_time <= time)
+        ++k;
+    int k1 = k + 1 < count ? k + 1 : k;
+    float span = m_keys[k1].m_time - m_keys[k].m_time;
+    float u = span > 0 ? clamp((time - m_keys[k].m_time) / span, 0, 1) : 0;
+
+    // uniform Catmull-Rom through keys k-1 .. k+2, clamped at the ends
+    const CameraKey& p0 = m_keys[k > 0 ? k - 1 : k];
+    const CameraKey& p1 = m_keys[k];
+    const CameraKey& p2 = m_keys[k1];
+    const CameraKey& p3 = m_keys[k1 + 1 < count ? k1 + 1 : k1];
+    float u2 = u * u;
+    float u3 = u2 * u;
+    float w0 = 0.5f * (-u3 + 2 * u2 - u);
+    float w1 = 0.5f * (3 * u3 - 5 * u2 + 2);
+    float w2 = 0.5f * (-3 * u3 + 4 * u2 + u);
+    float w3 = 0.5f * (u3 - u2);
+    Vector3D eye = w0 * p0.m_eye + w1 * p1.m_eye + w2 * p2.m_eye + w3 * p3.m_eye;
+    Vector3D target = w0 * p0.m_target + w1 * p1.m_target + w2 * p2.m_target + w3 * p3.m_target;
+    float fov = w0 * p0.m_fov + w1 * p1.m_fov + w2 * p2.m_fov + w3 * p3.m_fov;
+    return Camera(eye, target, m_up, fov, aspect_ratio);
+}
+
+class SequenceSettings
+{
+public:
+    SequenceSettings()
+    {
+        m_frameCount = 24;
+        m_startTime = 0;
+        m_endTime = 1;
+        m_outputPattern = "frame_%04d.ppm";
+        m_temporalReuse = false;
+        m_reuseSamples = 16;
+        m_maxHistory = 32;
+        m_positionTolerance = 0.01f;
+        m_rerenderFraction = 0.25f;
+    }
+
+    int m_frameCount;
+    // frames are spread evenly over [m_startTime, m_endTime] of the camera path
+    float m_startTime;
+    float m_endTime;
+    // printf pattern with one integer conversion for the frame number, empty writes nothing
+    std::string m_outputPattern;
+
+    // temporal reuse: every frame after the first is rendered with only
+    // m_reuseSamples per pixel, and pixels whose surface was visible last frame
+    // start from last frame's radiance there, weighted as the samples it took
+    // up to m_maxHistory. Resampling last frame blurs a little every frame and
+    // reflections lag behind the view, so a short memory beats a long one.
+    bool m_temporalReuse;
+    int m_reuseSamples;
+    int m_maxHistory;
+    // last frame's surface counts as the same when it is off this one's tangent
+    // plane by less than this fraction of the distance to the camera
+    float m_positionTolerance;
+    // tiles where more than this fraction of pixels have no history are rendered at the full rate
+    float m_rerenderFraction;
+};
+
+// renders a camera path frame by frame with one world, whose accelerator is
+// built once by the caller and reused. Frame N is written out on a separate
+// thread while frame N + 1 renders.
+class SequenceRenderer
+{
+public:
+    SequenceRenderer(const RenderSettings& render_settings, const SequenceSettings& settings)
+    {
+        m_renderSettings = render_settings;
+        m_settings = settings;
+        m_seconds = 0;
+        m_renderSeconds = 0;
+        m_writeSeconds = 0;
+        m_rayCount = 0;
+        m_reusedFraction = 0;
+    }
+
+    void render(World& world, const CameraPath& path);
+
+    RenderSettings m_renderSettings;
+    SequenceSettings m_settings;
+    // last frame's radiance, row 0 at the bottom
+    std::vector<Vector3D> m_frame;
+    double m_seconds;
+    // time spent rendering frames, and writing them (overlapped with rendering)
+    double m_renderSeconds;
+    double m_writeSeconds;
+    long long m_rayCount;
+    // with temporal reuse, average fraction of pixels that found history
+    double m_reusedFraction;
+
+private:
+    // what the center ray of a pixel sees
+    class Surface
+    {
+    public:
+        Vector3D m_position;
+        Vector3D m_normal;
+        // -1 for a miss, whose position is far out along the ray
+        int m_material;
+    };
+    void primary_hits(World& world, Camera& camera, std::vector<Surface>& surfaces);
+
+    std::vector<Surface> m_surfaces;
+    // samples behind every pixel of m_frame, history included
+    std::vector<float> m_weights;
+};
+
+void SequenceRenderer::primary_hits(World& world, Camera& camera, std::vector<Surface>& surfaces)
+{
+    int width = m_renderSettings.m_width;
+    int height = m_renderSettings.m_height;
+    surfaces.resize(width * height);
+    parallel_for(height, m_renderSettings.m_threadCount, [&](int j) {
+        for (int i = 0; i < width; ++i)
+        {
+            Ray r = camera.generate_ray((i + 0.5f) / (width - 1), (j + 0.5f) / (height - 1));
+            HitResult hit = world.hit(r, 0.001, std::numeric_limits<float>::infinity());
+            Surface& s = surfaces[j * width + i];
+            s.m_position = hit.m_isHit ? hit.m_hitPos : r.origin() + 1e4f * normalize(r.direction());
+            s.m_normal = hit.m_isHit ? hit.m_hitNormal : -normalize(r.direction());
+            s.m_material = hit.m_isHit ? hit.m_hitMaterial : -1;
+        }
+    });
+}
+
+void SequenceRenderer::render(World& world, const CameraPath& path)
+{
+    auto start = std::chrono::steady_clock::now();
+    int width = m_renderSettings.m_width;
+    int height = m_renderSettings.m_height;
+    int size = m_renderSettings.m_tileSize;
+    int tiles_x = (width + size - 1) / size;
+    int tiles_y = (height + size - 1) / size;
+    float aspect_ratio = width / float(height);
+
+    m_renderSeconds = 0;
+    m_writeSeconds = 0;
+    m_rayCount = 0;
+    m_reusedFraction = 0;
+    std::thread writer;
+    std::vector<Vector3D> written;
+    std::vector<Surface> surfaces;
+    std::vector<Vector3D> history;
+    std::vector<float> history_weights;
+    auto frame_time = [&](int f) {
+        if (m_settings.m_frameCount < 2)
+            return m_settings.m_startTime;
+        return m_settings.m_startTime + (m_settings.m_endTime - m_settings.m_startTime) * f / (m_settings.m_frameCount - 1);
+    };
+
+    for (int f = 0; f < m_settings.m_frameCount; ++f)
+    {
+        Camera camera = path.at(frame_time(f), aspect_ratio);
+        auto frame_start = std::chrono::steady_clock::now();
+
+        RenderSettings settings = m_renderSettings;
+        settings.m_seed = m_renderSettings.m_seed + f;
+        bool reuse = m_settings.m_temporalReuse && f > 0;
+        if (reuse)
+        {
+            // reproject: where each pixel's surface was in the last frame
+            Camera previous = path.at(frame_time(f - 1), aspect_ratio);
+            primary_hits(world, camera, surfaces);
+            history.assign(width * height, Vector3D(0, 0, 0));
+            history_weights.assign(width * height, 0.0f);
+            for (int p = 0; p < width * height; ++p)
+            {
+                float col, row;
+                const Surface& now = surfaces[p];
+                if (!previous.project(now.m_position, col, row))
+                    continue;
+                // bilinear over the four last-frame pixel centers around the
+                // point, leaving out the ones that saw a different surface
+                float x = col * (width - 1) - 0.5f;
+                float y = row * (height - 1) - 0.5f;
+                int i0 = static_cast<int>(floorf(x));
+                int j0 = static_cast<int>(floorf(y));
+                float distance = (now.m_position - camera.eye()).length();
+                Vector3D sum(0, 0, 0);
+                float weight_sum = 0;
+                float history_sum = 0;
+                for (int tap = 0; tap < 4; ++tap)
+                {
+                    int i = i0 + (tap & 1);
+                    int j = j0 + (tap >> 1);
+                    if (i < 0 || i >= width || j < 0 || j >= height)
+                        continue;
+                    int q = j * width + i;
+                    // the same surface: same material, facing the same way, and last
+                    // frame's point on the plane through this one (the sky only
+                    // depends on the direction, misses match misses)
+                    const Surface& then = m_surfaces[q];
+                    if (then.m_material != now.m_material)
+                        continue;
+                    if (now.m_material >= 0 &&
+                        (dot(then.m_normal, now.m_normal) < 0.9f ||
+                         fabsf(dot(then.m_position - now.m_position, now.m_normal)) > m_settings.m_positionTolerance * distance))
+                        continue;
+                    float w = ((tap & 1) ? x - i0 : 1 - (x - i0)) * ((tap >> 1) ? y - j0 : 1 - (y - j0));
+                    sum += w * m_frame[q];
+                    history_sum += w * m_weights[q];
+                    weight_sum += w;
+                }
+                if (weight_sum <= 0.01f)
+                    continue;
+                history[p] = sum / weight_sum;
+                history_weights[p] = fminf(history_sum / weight_sum, static_cast<float>(m_settings.m_maxHistory));
+            }
+            settings.m_raysPerPixel = m_settings.m_reuseSamples;
+        }
+
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        m_rayCount += renderer.m_rayCount;
+
+        if (reuse)
+        {
+            // tiles mostly without history get the full rate after all
+            std::vector<int> missing(tiles_x * tiles_y, 0);
+            int reused = 0;
+            for (int j = 0; j < height; ++j)
+            {
+                for (int i = 0; i < width; ++i)
+                {
+                    bool found = history_weights[j * width + i] > 0;
+                    missing[(j / size) * tiles_x + i / size] += !found;
+                    reused += found;
+                }
+            }
+            std::vector<int> tiles;
+            for (int t = 0; t < tiles_x * tiles_y; ++t)
+                if (missing[t] > m_settings.m_rerenderFraction * size * size)
+                    tiles.push_back(t);
+            if (!tiles.empty())
+            {
+                // budgeted and guided frames can't be replayed, they keep the reuse rate
+                renderer.m_settings.m_raysPerPixel = m_renderSettings.m_raysPerPixel;
+                if (renderer.rerender(world, camera, tiles))
+                    m_rayCount += renderer.m_rayCount;
+            }
+            m_reusedFraction += reused / double(width * height) / (m_settings.m_frameCount - 1);
+        }
+        else if (m_settings.m_temporalReuse)
+        {
+            primary_hits(world, camera, surfaces);
+        }
+
+        // this frame's radiance: its own samples plus any history
+        m_frame.resize(width * height);
+        m_weights.resize(width * height);
+        for (int j = 0; j < height; ++j)
+        {
+            for (int i = 0; i < width; ++i)
+            {
+                int p = j * width + i;
+                float h = reuse ? history_weights[p] : 0;
+                float n = static_cast<float>(renderer.sample_count(i, j));
+                Vector3D sum = renderer.pixel(i, j);
+                if (h > 0)
+                    sum += h * history[p];
+                m_frame[p] = n + h > 0 ? sum / (n + h) : Vector3D(0, 0, 0);
+                m_weights[p] = n + h;
+            }
+        }
+        m_surfaces.swap(surfaces);
+        m_renderSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count();
+
+        // at most one frame is being written while the next one renders
+        if (writer.joinable())
+            writer.join();
+        if (!m_settings.m_outputPattern.empty())
+        {
+            written = m_frame;
+            char path_buffer[1024];
+            snprintf(path_buffer, sizeof(path_buffer), m_settings.m_outputPattern.c_str(), f);
+            std::string file = path_buffer;
+            writer = std::thread([this, file, width, height, &written]() {
+                auto write_start = std::chrono::steady_clock::now();
+                write_ppm(file, width, height, written);
+                m_writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - write_start).count();
+            });
+        }
+    }
+    if (writer.joinable())
+        writer.join();
+    m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif
@@ -1,38 +1,37 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
-#include <memory>
+#include "Ray.h"
+#include "HitResult.h"
+#include "AABB.h"
 
 using namespace std;
-class Material;
-
-class HitResult {
-public:
-    HitResult() { m_isHit = false; };
-    bool m_isHit;
-    Vector3D m_hitPos;
-    Vector3D m_hitNormal;
-    shared_ptr<Material> m_hitMaterial;
-    float m_t;
-};
-
 
 class Sphere {
     
 public:
     Sphere() {}
-    Sphere(Vector3D center, float r, shared_ptr<Material> m)
+    Sphere(Vector3D center, float r, int material)
     {
         m_center = center;
         m_radius = r;
-        m_pMaterial = m;
+        m_material = material;
     }
     HitResult hit(Ray& r, float min_t, float max_t);
+    // fills in the uvs of a sphere hit, only done for hits that get textured
+    static void uv(HitResult& hit);
+    bool occludes(Ray& r, float min_t, float max_t);
+    AABB bounds() const
+    {
+        Vector3D r(m_radius, m_radius, m_radius);
+        return AABB(m_center - r, m_center + r);
+    }
 
     public:
     Vector3D m_center;
     float m_radius;
-    shared_ptr<Material> m_pMaterial;
+    // index into World::m_materials
+    int m_material;
 };
 // TODO 2
 
@@ -95,9 +94,39 @@ HitResult Sphere::hit(Ray& ray, float min_t, float max_t)
     // set remaining values
     hit_result.m_hitPos = ray.at(hit_result.m_t);
     hit_result.m_hitNormal = (hit_result.m_hitPos - m_center) / m_radius;
-    hit_result.m_hitMaterial = m_pMaterial;
+    hit_result.m_hitMaterial = m_material;
+    hit_result.m_sphereRadius = m_radius;
     
     return hit_result;
 }
 
+void Sphere::uv(HitResult& hit)
+{
+    if (hit.m_sphereRadius <= 0)
+        return;
+    // longitude / latitude, v runs from the bottom pole to the top
+    Vector3D& n = hit.m_hitNormal;
+    hit.m_u = 0.5f + atan2f(n.m_z, n.m_x) / (2 * M_PI);
+    hit.m_v = 1 - acosf(clamp(n.m_y, -1, 1)) / M_PI;
+    hit.m_uvScale = 1 / (M_PI * hit.m_sphereRadius);
+    hit.m_sphereRadius = 0;
+}
+
+//test if the ray hits this sphere anywhere within range min_t and max_t, without building a hit result
+bool Sphere::occludes(Ray& ray, float min_t, float max_t)
+{
+    Vector3D oc = ray.origin() - m_center;
+    float half_b = dot(oc, ray.direction());
+    float a = ray.direction().length_squared();
+    float c = oc.length_squared() - m_radius * m_radius;
+    float discriminant = half_b * half_b - a * c;
+    if (discriminant < 0.0)
+        return false;
+
+    float root = sqrt(discriminant);
+    float t1 = (-half_b - root) / a;
+    float t2 = (-half_b + root) / a;
+    return (t1 > min_t && t1 < max_t) || (t2 > min_t && t2 < max_t);
+}
+
 #endif
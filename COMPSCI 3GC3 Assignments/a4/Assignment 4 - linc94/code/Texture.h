@@ -0,0 +1,360 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Image.h"
+#include "Vector3D.h"
+
+// spread the low 16 bits of x to the even bits
+uint32_t spread_bits_2d(uint32_t x)
+{
+    x &= 0xFFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// interleave the low 16 bits of x and y, x in the even bits
+uint32_t morton_2d(uint32_t x, uint32_t y)
+{
+    return spread_bits_2d(x) | (spread_bits_2d(y) << 1);
+}
+
+// textures for the tracer. add() decodes an image once, builds its mip
+// pyramid and writes it to a backing file as 32x32 tiles, Z-ordered both
+// within a tile and across the tiles of a level, then drops the pixels.
+// Lookups page tiles back in on first touch and keep them in an LRU cache
+// of bounded size, so scenes can reference more texture than fits in memory.
+class TextureCache
+{
+public:
+    static const int tile_size = 32;
+    static const int tile_bytes = tile_size * tile_size * 3;
+
+    // resident tiles are capped near budget_bytes (plus a few per render thread)
+    TextureCache(size_t budget_bytes = 64 << 20);
+    ~TextureCache();
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // index of the new texture, or -1 if the image can't be read
+    int add(const std::string& path);
+    // same from memory: width * height 8-bit sRGB texels, row-major, top row first
+    int add(int width, int height, const unsigned char* rgb);
+
+    // trilinear lookup at (u, v), wrapping outside [0, 1). footprint is the
+    // width of the ray cone at the hit in uv units and picks the mip level
+    Vector3D sample(int texture, float u, float v, float footprint);
+
+    int texture_count() const
+    {
+        return static_cast<int>(m_textures.size());
+    }
+    size_t resident_bytes() const
+    {
+        return m_resident * static_cast<size_t>(tile_bytes);
+    }
+
+    // false: always read the finest level, for comparison
+    bool m_useRayCones;
+    // tiles served from the shared cache / paged in from the backing file
+    std::atomic<long long> m_tileHits;
+    std::atomic<long long> m_tileLoads;
+
+private:
+    class Tile
+    {
+    public:
+        unsigned char m_texels[tile_bytes];
+    };
+    class Level
+    {
+    public:
+        int m_width;
+        int m_height;
+        int m_tilesX;
+        // tile (x, y) is at m_firstSlot + m_slot[y * m_tilesX + x] in the backing
+        // file, the tiles of a level are in Z-order
+        long long m_firstSlot;
+        std::vector<int> m_slot;
+    };
+    class Texture
+    {
+    public:
+        std::vector<Level> m_levels;
+    };
+    // the cache is split in shards with their own lock and LRU list
+    class Shard
+    {
+    public:
+        std::mutex m_mutex;
+        std::list<uint64_t> m_lru;
+        std::unordered_map<uint64_t, std::pair<std::shared_ptr<const Tile>, std::list<uint64_t>::iterator>> m_tiles;
+    };
+    static const int shard_count = 16;
+
+    static uint64_t tile_key(int texture, int level, int tile)
+    {
+        return (static_cast<uint64_t>(texture) << 40) | (static_cast<uint64_t>(level) << 32) | static_cast<uint32_t>(tile);
+    }
+    Vector3D texel(int texture, int level, int x, int y);
+    Vector3D bilinear(int texture, int level, float u, float v);
+    std::shared_ptr<const Tile> tile(int texture, int level, int tile_index);
+    std::shared_ptr<const Tile> load_tile(int texture, int level, int tile_index);
+
+    std::vector<Texture> m_textures;
+    std::FILE* m_file;
+    long long m_slotCount;
+    std::mutex m_fileMutex;
+    Shard m_shards[shard_count];
+    size_t m_shardCapacity;
+    std::atomic<long long> m_resident;
+    // tells the per-thread tile memos of different caches apart
+    uint64_t m_id;
+    float m_linear[256];
+};
+
+TextureCache::TextureCache(size_t budget_bytes)
+{
+    m_useRayCones = true;
+    m_tileHits = 0;
+    m_tileLoads = 0;
+    m_file = std::tmpfile();
+    m_slotCount = 0;
+    m_shardCapacity = std::max<size_t>(1, budget_bytes / tile_bytes / shard_count);
+    m_resident = 0;
+    static std::atomic<uint64_t> next_id(1);
+    m_id = next_id++;
+    // textures are stored in sRGB, the tracer works in linear color
+    for (int i = 0; i < 256; ++i)
+        m_linear[i] = powf(i / 255.0f, 2.2f);
+}
+
+TextureCache::~TextureCache()
+{
+    if (m_file)
+        std::fclose(m_file);
+}
+
+int TextureCache::add(const std::string& path)
+{
+    int width, height, channels;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 3);
+    if (!data)
+        return -1;
+    int index = add(width, height, data);
+    stbi_image_free(data);
+    return index;
+}
+
+int TextureCache::add(int width, int height, const unsigned char* rgb)
+{
+    if (!m_file || width <= 0 || height <= 0)
+        return -1;
+
+    Texture texture;
+    std::vector<unsigned char> level(rgb, rgb + width * height * 3);
+    std::vector<unsigned char> tile(tile_bytes);
+    while (true)
+    {
+        Level info;
+        info.m_width = width;
+        info.m_height = height;
+        info.m_tilesX = (width + tile_size - 1) / tile_size;
+        int tiles_y = (height + tile_size - 1) / tile_size;
+
+        // tiles go to the file in Z-order so neighbouring tiles sit close together
+        std::vector<int> order(info.m_tilesX * tiles_y);
+        for (int i = 0; i < (int)order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return morton_2d(a % info.m_tilesX, a / info.m_tilesX) < morton_2d(b % info.m_tilesX, b / info.m_tilesX);
+        });
+        info.m_firstSlot = m_slotCount;
+        info.m_slot.resize(order.size());
+        for (int k = 0; k < (int)order.size(); ++k)
+        {
+            int tx = order[k] % info.m_tilesX;
+            int ty = order[k] / info.m_tilesX;
+            // texels past the image edge repeat the last row / column
+            for (int y = 0; y < tile_size; ++y)
+            {
+                for (int x = 0; x < tile_size; ++x)
+                {
+                    int sx = std::min(tx * tile_size + x, width - 1);
+                    int sy = std::min(ty * tile_size + y, height - 1);
+                    const unsigned char* src = &level[(sy * width + sx) * 3];
+                    unsigned char* dst = &tile[morton_2d(x, y) * 3];
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                }
+            }
+            info.m_slot[order[k]] = k;
+            std::fseek(m_file, (m_slotCount + k) * static_cast<long long>(tile_bytes), SEEK_SET);
+            std::fwrite(tile.data(), 1, tile_bytes, m_file);
+        }
+        m_slotCount += order.size();
+        texture.m_levels.push_back(info);
+        if (width == 1 && height == 1)
+            break;
+
+        // next level: 2x2 box filter, odd edges clamp
+        int next_width = std::max(1, width / 2);
+        int next_height = std::max(1, height / 2);
+        std::vector<unsigned char> next(next_width * next_height * 3);
+        for (int y = 0; y < next_height; ++y)
+        {
+            for (int x = 0; x < next_width; ++x)
+            {
+                int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+                for (int c = 0; c < 3; ++c)
+                {
+                    int sum = level[(y0 * width + x0) * 3 + c] + level[(y0 * width + x1) * 3 + c] +
+                              level[(y1 * width + x0) * 3 + c] + level[(y1 * width + x1) * 3 + c];
+                    next[(y * next_width + x) * 3 + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        level.swap(next);
+        width = next_width;
+        height = next_height;
+    }
+    std::fflush(m_file);
+
+    m_textures.push_back(texture);
+    return static_cast<int>(m_textures.size()) - 1;
+}
+
+Vector3D TextureCache::sample(int texture, float u, float v, float footprint)
+{
+    const Texture& t = m_textures[texture];
+    float lod = 0;
+    if (m_useRayCones && footprint > 0)
+    {
+        // footprint in texels of the finest level
+        lod = log2f(footprint * std::max(t.m_levels[0].m_width, t.m_levels[0].m_height));
+        lod = std::min(std::max(lod, 0.0f), static_cast<float>(t.m_levels.size() - 1));
+    }
+    int level = static_cast<int>(lod);
+    float f = lod - level;
+    Vector3D color = bilinear(texture, level, u, v);
+    if (f > 0 && level + 1 < (int)t.m_levels.size())
+        color = (1 - f) * color + f * bilinear(texture, level + 1, u, v);
+    return color;
+}
+
+Vector3D TextureCache::bilinear(int texture, int level, float u, float v)
+{
+    const Level& l = m_textures[texture].m_levels[level];
+    // v = 0 is the bottom of the image
+    float x = (u - floorf(u)) * l.m_width - 0.5f;
+    float y = (1 - (v - floorf(v))) * l.m_height - 0.5f;
+    int x0 = static_cast<int>(floorf(x));
+    int y0 = static_cast<int>(floorf(y));
+    float fx = x - x0;
+    float fy = y - y0;
+    Vector3D top = (1 - fx) * texel(texture, level, x0, y0) + fx * texel(texture, level, x0 + 1, y0);
+    Vector3D bottom = (1 - fx) * texel(texture, level, x0, y0 + 1) + fx * texel(texture, level, x0 + 1, y0 + 1);
+    return (1 - fy) * top + fy * bottom;
+}
+
+Vector3D TextureCache::texel(int texture, int level, int x, int y)
+{
+    const Level& l = m_textures[texture].m_levels[level];
+    x = ((x % l.m_width) + l.m_width) % l.m_width;
+    y = ((y % l.m_height) + l.m_height) % l.m_height;
+    std::shared_ptr<const Tile> t = tile(texture, level, (y / tile_size) * l.m_tilesX + x / tile_size);
+    const unsigned char* c = &t->m_texels[morton_2d(x % tile_size, y % tile_size) * 3];
+    return Vector3D(m_linear[c[0]], m_linear[c[1]], m_linear[c[2]]);
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::tile(int texture, int level, int tile_index)
+{
+    uint64_t key = tile_key(texture, level, tile_index);
+
+    // every thread remembers its last few tiles, so consecutive lookups don't
+    // touch the shared cache. A remembered tile outlives its eviction.
+    struct Memo
+    {
+        uint64_t m_cache;
+        uint64_t m_key;
+        std::shared_ptr<const Tile> m_tile;
+    };
+    static thread_local Memo memo[64];
+    Memo& m = memo[(key ^ (key >> 29)) * 0x9E3779B97F4A7C15ULL >> 58];
+    if (m.m_cache == m_id && m.m_key == key && m.m_tile)
+        return m.m_tile;
+
+    Shard& shard = m_shards[(key * 0x9E3779B97F4A7C15ULL) >> 60];
+    std::shared_ptr<const Tile> result;
+    {
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        auto it = shard.m_tiles.find(key);
+        if (it != shard.m_tiles.end())
+        {
+            // move to the front of the LRU list
+            shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, it->second.second);
+            result = it->second.first;
+            ++m_tileHits;
+        }
+    }
+    if (!result)
+    {
+        // read outside the shard lock, two threads may race on the same tile and one copy wins
+        result = load_tile(texture, level, tile_index);
+        ++m_tileLoads;
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        auto it = shard.m_tiles.find(key);
+        if (it != shard.m_tiles.end())
+        {
+            result = it->second.first;
+        }
+        else
+        {
+            shard.m_lru.push_front(key);
+            shard.m_tiles[key] = std::make_pair(result, shard.m_lru.begin());
+            ++m_resident;
+            while (shard.m_tiles.size() > m_shardCapacity)
+            {
+                shard.m_tiles.erase(shard.m_lru.back());
+                shard.m_lru.pop_back();
+                --m_resident;
+            }
+        }
+    }
+
+    m.m_cache = m_id;
+    m.m_key = key;
+    m.m_tile = result;
+    return result;
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::load_tile(int texture, int level, int tile_index)
+{
+    const Level& l = m_textures[texture].m_levels[level];
+    long long slot = l.m_firstSlot + l.m_slot[tile_index];
+
+    std::shared_ptr<Tile> result(new Tile());
+    std::lock_guard<std::mutex> lock(m_fileMutex);
+    std::fseek(m_file, slot * tile_bytes, SEEK_SET);
+    if (std::fread(result->m_texels, 1, tile_bytes, m_file) != (size_t)tile_bytes)
+        std::fill(result->m_texels, result->m_texels + tile_bytes, 0);
+    return result;
+}
+
+#endif
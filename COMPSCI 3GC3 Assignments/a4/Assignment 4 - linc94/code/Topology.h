@@ -0,0 +1,96 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// which cpus belong to which NUMA node, read from sysfs on linux; everywhere
+// else (or when sysfs is missing) all cpus count as one node
+class CpuTopology
+{
+public:
+    std::vector<std::vector<int>> m_nodeCpus;
+
+    int node_count() const
+    {
+        return static_cast<int>(m_nodeCpus.size());
+    }
+    int cpu_count() const
+    {
+        int count = 0;
+        for (const auto& cpus : m_nodeCpus)
+            count += static_cast<int>(cpus.size());
+        return count;
+    }
+
+    static CpuTopology detect();
+};
+
+// parse a sysfs cpu list such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        if (range.empty() || range[0] == '\n')
+            continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+CpuTopology CpuTopology::detect()
+{
+    CpuTopology topology;
+#ifdef __linux__
+    for (int node = 0; ; ++node)
+    {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!in)
+            break;
+        std::string list;
+        std::getline(in, list);
+        std::vector<int> cpus = parse_cpu_list(list);
+        if (!cpus.empty())
+            topology.m_nodeCpus.push_back(cpus);
+    }
+#endif
+    if (topology.m_nodeCpus.empty())
+    {
+        int count = std::thread::hardware_concurrency();
+        topology.m_nodeCpus.push_back(std::vector<int>());
+        for (int cpu = 0; cpu < (count > 0 ? count : 1); ++cpu)
+            topology.m_nodeCpus[0].push_back(cpu);
+    }
+    return topology;
+}
+
+// pin the calling thread to one cpu, returns false where that is unsupported
+bool pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TRAVERSALSTATS_H
+#define TRAVERSALSTATS_H
+
+// per-thread traversal counters behind the cost heatmap. They only exist when
+// compiled with -DTRACE_STATS; otherwise the COUNT_ macros expand to nothing
+// and normal renders pay nothing for them.
+#ifdef TRACE_STATS
+
+class TraversalStats
+{
+public:
+    TraversalStats()
+    {
+        m_primitiveTests = 0;
+        m_nodeVisits = 0;
+        m_bounces = 0;
+    }
+    // ray / primitive intersection tests
+    long long m_primitiveTests;
+    // BVH nodes popped, or grid cells stepped through
+    long long m_nodeVisits;
+    // rays traced along a path (shadow rays not included)
+    long long m_bounces;
+};
+
+thread_local TraversalStats traversal_stats;
+
+#define COUNT_PRIMITIVE_TESTS(n) (traversal_stats.m_primitiveTests += (n))
+#define COUNT_NODE_VISIT() (++traversal_stats.m_nodeVisits)
+#define COUNT_BOUNCE() (++traversal_stats.m_bounces)
+
+#else
+
+#define COUNT_PRIMITIVE_TESTS(n) ((void)0)
+#define COUNT_NODE_VISIT() ((void)0)
+#define COUNT_BOUNCE() ((void)0)
+
+#endif
+
+#endif
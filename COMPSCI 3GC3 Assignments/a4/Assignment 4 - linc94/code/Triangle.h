@@ -0,0 +1,111 @@
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+
+#include "Ray.h"
+#include "HitResult.h"
+#include "AABB.h"
+
+using namespace std;
+
+// triangle stored as a corner and its two edges, ready for the Moller-Trumbore
+// test. Plain float arrays rather than Vector3D (which may be the padded SSE
+// type), so arrays of triangles are written to and mapped from disk as they
+// are (see ChunkedMesh.h).
+class Triangle {
+
+public:
+    Triangle() {}
+    Triangle(const Vector3D& a, const Vector3D& b, const Vector3D& c)
+    {
+        store(m_v0, a);
+        store(m_e1, b - a);
+        store(m_e2, c - a);
+    }
+    Vector3D v0() const
+    {
+        return Vector3D(m_v0[0], m_v0[1], m_v0[2]);
+    }
+    Vector3D e1() const
+    {
+        return Vector3D(m_e1[0], m_e1[1], m_e1[2]);
+    }
+    Vector3D e2() const
+    {
+        return Vector3D(m_e2[0], m_e2[1], m_e2[2]);
+    }
+    // t of the hit between min_t and max_t with barycentrics u, v; false on a miss
+    bool intersect(Ray& ray, float min_t, float max_t, float& t, float& u, float& v) const;
+    // the hit of a ray intersect() accepted at t; meshes have no consistent
+    // winding, so the normal is turned to face the ray
+    HitResult hit_at(Ray& ray, float t, float u, float v, int material) const;
+    AABB bounds() const
+    {
+        AABB b;
+        b.grow(v0());
+        b.grow(v0() + e1());
+        b.grow(v0() + e2());
+        return b;
+    }
+    Vector3D centroid() const
+    {
+        return v0() + (e1() + e2()) / 3;
+    }
+
+public:
+    float m_v0[3];
+    float m_e1[3];
+    float m_e2[3];
+
+private:
+    static void store(float* out, const Vector3D& v)
+    {
+        out[0] = v.m_x;
+        out[1] = v.m_y;
+        out[2] = v.m_z;
+    }
+};
+
+bool Triangle::intersect(Ray& ray, float min_t, float max_t, float& t, float& u, float& v) const
+{
+    Vector3D edge1 = e1();
+    Vector3D edge2 = e2();
+    Vector3D dir = ray.direction();
+    Vector3D p = cross(dir, edge2);
+    float det = dot(edge1, p);
+    // parallel to the triangle's plane
+    if (det == 0.0f)
+        return false;
+    float inv_det = 1 / det;
+
+    Vector3D s = ray.origin() - v0();
+    u = dot(s, p) * inv_det;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3D q = cross(s, edge1);
+    v = dot(dir, q) * inv_det;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = dot(edge2, q) * inv_det;
+    return t > min_t && t < max_t;
+}
+
+HitResult Triangle::hit_at(Ray& ray, float t, float u, float v, int material) const
+{
+    HitResult hit_result;
+    Vector3D n = cross(e1(), e2());
+    Vector3D normal = normalize(n);
+    if (dot(normal, ray.direction()) > 0)
+        normal = -1 * normal;
+
+    hit_result.m_isHit = true;
+    hit_result.m_t = t;
+    hit_result.m_hitPos = ray.at(t);
+    hit_result.m_hitNormal = normal;
+    hit_result.m_hitMaterial = material;
+    hit_result.m_u = u;
+    hit_result.m_v = v;
+    hit_result.m_uvScale = 1 / sqrtf(fmaxf(n.length(), 1e-12f));
+    return hit_result;
+}
+
+#endif
@@ -0,0 +1,603 @@
+#ifndef VEC3A_H
+#define VEC3A_H
+
+// SIMD members of the vector family, included by Vector3D.h (which provides
+// random_float and the scalar Vec3). Vec3A has exactly Vec3's interface, so
+// switching the Vector3D typedef ports the whole renderer; Vec3x8 is eight
+// vectors in structure-of-arrays form for packet code.
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define VEC3A_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VEC3A_NEON
+#endif
+
+// 16-byte aligned vector whose fourth lane is kept at 0, backed by one SSE or
+// NEON register (plain floats when neither is available)
+class alignas(16) Vec3A
+{
+public:
+    Vec3A()
+    {
+#if defined(VEC3A_SSE)
+        m_v = _mm_setzero_ps();
+#elif defined(VEC3A_NEON)
+        m_v = vdupq_n_f32(0);
+#else
+        m_x = m_y = m_z = m_w = 0;
+#endif
+    }
+    Vec3A(float x, float y, float z)
+    {
+#if defined(VEC3A_SSE)
+        m_v = _mm_set_ps(0, z, y, x);
+#elif defined(VEC3A_NEON)
+        float lanes[4] = { x, y, z, 0 };
+        m_v = vld1q_f32(lanes);
+#else
+        m_x = x;
+        m_y = y;
+        m_z = z;
+        m_w = 0;
+#endif
+    }
+#if defined(VEC3A_SSE)
+    explicit Vec3A(__m128 v)
+    {
+        m_v = v;
+    }
+#elif defined(VEC3A_NEON)
+    explicit Vec3A(float32x4_t v)
+    {
+        m_v = v;
+    }
+#endif
+
+    float x() const
+    {
+        return m_x;
+    }
+    float y() const
+    {
+        return m_y;
+    }
+    float z() const
+    {
+        return m_z;
+    }
+
+    Vec3A operator-() const;
+    Vec3A& operator+=(const Vec3A& v);
+    Vec3A& operator*=(const float t);
+    Vec3A& operator/=(const float t)
+    {
+        return *this *= 1 / t;
+    }
+
+    float length() const
+    {
+        return sqrtf(length_squared());
+    }
+    float length_squared() const;
+
+    static Vec3A random()
+    {
+        return Vec3A(random_float(), random_float(), random_float());
+    }
+    static Vec3A random(float min, float max)
+    {
+        return Vec3A(random_float(min, max), random_float(min, max), random_float(min, max));
+    }
+
+public:
+    // the named floats alias the register lanes
+    union
+    {
+#if defined(VEC3A_SSE)
+        __m128 m_v;
+#elif defined(VEC3A_NEON)
+        float32x4_t m_v;
+#endif
+        struct
+        {
+            float m_x;
+            float m_y;
+            float m_z;
+            float m_w;
+        };
+    };
+};
+
+#if defined(VEC3A_SSE)
+
+Vec3A Vec3A::operator-() const
+{
+    return Vec3A(_mm_sub_ps(_mm_setzero_ps(), m_v));
+}
+Vec3A& Vec3A::operator+=(const Vec3A& v)
+{
+    m_v = _mm_add_ps(m_v, v.m_v);
+    return *this;
+}
+Vec3A& Vec3A::operator*=(const float t)
+{
+    m_v = _mm_mul_ps(m_v, _mm_set1_ps(t));
+    return *this;
+}
+
+Vec3A operator+(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(_mm_add_ps(u.m_v, v.m_v));
+}
+Vec3A operator-(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(_mm_sub_ps(u.m_v, v.m_v));
+}
+Vec3A operator*(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(_mm_mul_ps(u.m_v, v.m_v));
+}
+Vec3A operator*(float t, const Vec3A& v)
+{
+    return Vec3A(_mm_mul_ps(_mm_set1_ps(t), v.m_v));
+}
+
+// x*x' + y*y' + z*z' in every lane (the fourth lanes are 0)
+__m128 dot_splat(__m128 u, __m128 v)
+{
+    __m128 m = _mm_mul_ps(u, v);
+    __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+float dot(const Vec3A& u, const Vec3A& v)
+{
+    return _mm_cvtss_f32(dot_splat(u.m_v, v.m_v));
+}
+
+Vec3A cross(const Vec3A& u, const Vec3A& v)
+{
+    // u * v.yzx - u.yzx * v gives the cross product in zxy order
+    __m128 u_yzx = _mm_shuffle_ps(u.m_v, u.m_v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 v_yzx = _mm_shuffle_ps(v.m_v, v.m_v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(u.m_v, v_yzx), _mm_mul_ps(u_yzx, v.m_v));
+    return Vec3A(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+// rsqrt's 12-bit estimate refined by one Newton step, to within a few ulp
+Vec3A normalize(Vec3A v)
+{
+    __m128 length_squared = dot_splat(v.m_v, v.m_v);
+    __m128 r = _mm_rsqrt_ps(length_squared);
+    __m128 half_l = _mm_mul_ps(_mm_set1_ps(0.5f), length_squared);
+    r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(half_l, _mm_mul_ps(r, r))));
+    return Vec3A(_mm_mul_ps(v.m_v, r));
+}
+
+float Vec3A::length_squared() const
+{
+    return _mm_cvtss_f32(dot_splat(m_v, m_v));
+}
+
+#elif defined(VEC3A_NEON)
+
+Vec3A Vec3A::operator-() const
+{
+    return Vec3A(vnegq_f32(m_v));
+}
+Vec3A& Vec3A::operator+=(const Vec3A& v)
+{
+    m_v = vaddq_f32(m_v, v.m_v);
+    return *this;
+}
+Vec3A& Vec3A::operator*=(const float t)
+{
+    m_v = vmulq_n_f32(m_v, t);
+    return *this;
+}
+
+Vec3A operator+(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(vaddq_f32(u.m_v, v.m_v));
+}
+Vec3A operator-(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(vsubq_f32(u.m_v, v.m_v));
+}
+Vec3A operator*(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(vmulq_f32(u.m_v, v.m_v));
+}
+Vec3A operator*(float t, const Vec3A& v)
+{
+    return Vec3A(vmulq_n_f32(v.m_v, t));
+}
+
+float dot(const Vec3A& u, const Vec3A& v)
+{
+    return vaddvq_f32(vmulq_f32(u.m_v, v.m_v));
+}
+
+Vec3A cross(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(u.m_y * v.m_z - u.m_z * v.m_y, u.m_z * v.m_x - u.m_x * v.m_z, u.m_x * v.m_y - u.m_y * v.m_x);
+}
+
+// NEON's estimate is only 8 bits, it takes two Newton steps
+Vec3A normalize(Vec3A v)
+{
+    float32x4_t length_squared = vdupq_n_f32(dot(v, v));
+    float32x4_t r = vrsqrteq_f32(length_squared);
+    r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(length_squared, r), r));
+    r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(length_squared, r), r));
+    return Vec3A(vmulq_f32(v.m_v, r));
+}
+
+float Vec3A::length_squared() const
+{
+    return dot(*this, *this);
+}
+
+#else
+
+Vec3A Vec3A::operator-() const
+{
+    return Vec3A(-m_x, -m_y, -m_z);
+}
+Vec3A& Vec3A::operator+=(const Vec3A& v)
+{
+    m_x += v.m_x;
+    m_y += v.m_y;
+    m_z += v.m_z;
+    return *this;
+}
+Vec3A& Vec3A::operator*=(const float t)
+{
+    m_x *= t;
+    m_y *= t;
+    m_z *= t;
+    return *this;
+}
+
+Vec3A operator+(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(u.m_x + v.m_x, u.m_y + v.m_y, u.m_z + v.m_z);
+}
+Vec3A operator-(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(u.m_x - v.m_x, u.m_y - v.m_y, u.m_z - v.m_z);
+}
+Vec3A operator*(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(u.m_x * v.m_x, u.m_y * v.m_y, u.m_z * v.m_z);
+}
+Vec3A operator*(float t, const Vec3A& v)
+{
+    return Vec3A(t * v.m_x, t * v.m_y, t * v.m_z);
+}
+
+float dot(const Vec3A& u, const Vec3A& v)
+{
+    return u.m_x * v.m_x + u.m_y * v.m_y + u.m_z * v.m_z;
+}
+
+Vec3A cross(const Vec3A& u, const Vec3A& v)
+{
+    return Vec3A(u.m_y * v.m_z - u.m_z * v.m_y, u.m_z * v.m_x - u.m_x * v.m_z, u.m_x * v.m_y - u.m_y * v.m_x);
+}
+
+Vec3A normalize(Vec3A v)
+{
+    return (1 / sqrtf(dot(v, v))) * v;
+}
+
+float Vec3A::length_squared() const
+{
+    return dot(*this, *this);
+}
+
+#endif
+
+Vec3A operator*(const Vec3A& v, float t)
+{
+    return t * v;
+}
+
+Vec3A operator/(Vec3A v, float t)
+{
+    return (1 / t) * v;
+}
+
+// eight vectors as three 8-wide registers (AVX, plain arrays otherwise), for
+// running one ray against eight primitives or eight rays against one
+class alignas(32) Vec3x8
+{
+public:
+    Vec3x8() {}
+    // the same vector in every lane
+    explicit Vec3x8(const Vec3A& v);
+    // lane k is v[k]
+    static Vec3x8 load(const Vec3A* v);
+    Vec3A lane(int k) const
+    {
+        return Vec3A(m_x[k], m_y[k], m_z[k]);
+    }
+
+    // the lanes alias the registers
+    union
+    {
+#if defined(__AVX__)
+        struct
+        {
+            __m256 m_vx;
+            __m256 m_vy;
+            __m256 m_vz;
+        };
+#endif
+        struct
+        {
+            float m_x[8];
+            float m_y[8];
+            float m_z[8];
+        };
+    };
+};
+
+// eight floats, what Vec3x8's dot product gives
+class alignas(32) Float8
+{
+public:
+    Float8() {}
+    // t in every lane
+    explicit Float8(float t);
+    float operator[](int k) const
+    {
+        return m_f[k];
+    }
+
+    union
+    {
+#if defined(__AVX__)
+        __m256 m_v;
+#endif
+        float m_f[8];
+    };
+};
+
+#if defined(__AVX__)
+
+Float8::Float8(float t)
+{
+    m_v = _mm256_set1_ps(t);
+}
+
+Float8 operator+(const Float8& a, const Float8& b)
+{
+    Float8 r;
+    r.m_v = _mm256_add_ps(a.m_v, b.m_v);
+    return r;
+}
+Float8 operator-(const Float8& a, const Float8& b)
+{
+    Float8 r;
+    r.m_v = _mm256_sub_ps(a.m_v, b.m_v);
+    return r;
+}
+Float8 operator*(const Float8& a, const Float8& b)
+{
+    Float8 r;
+    r.m_v = _mm256_mul_ps(a.m_v, b.m_v);
+    return r;
+}
+// bit k set where a[k] > b[k]
+int greater_mask(const Float8& a, const Float8& b)
+{
+    return _mm256_movemask_ps(_mm256_cmp_ps(a.m_v, b.m_v, _CMP_GT_OQ));
+}
+
+Vec3x8::Vec3x8(const Vec3A& v)
+{
+    m_vx = _mm256_set1_ps(v.m_x);
+    m_vy = _mm256_set1_ps(v.m_y);
+    m_vz = _mm256_set1_ps(v.m_z);
+}
+
+Vec3x8 Vec3x8::load(const Vec3A* v)
+{
+    // transpose four lanes at a time: 128-bit rows in, x/y/z columns out
+    __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(v[0].m_v), v[4].m_v, 1);
+    __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(v[1].m_v), v[5].m_v, 1);
+    __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(v[2].m_v), v[6].m_v, 1);
+    __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(v[3].m_v), v[7].m_v, 1);
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t2 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    Vec3x8 result;
+    result.m_vx = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+    result.m_vy = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+    result.m_vz = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    return result;
+}
+
+Vec3x8 operator+(const Vec3x8& u, const Vec3x8& v)
+{
+    Vec3x8 r;
+    r.m_vx = _mm256_add_ps(u.m_vx, v.m_vx);
+    r.m_vy = _mm256_add_ps(u.m_vy, v.m_vy);
+    r.m_vz = _mm256_add_ps(u.m_vz, v.m_vz);
+    return r;
+}
+Vec3x8 operator-(const Vec3x8& u, const Vec3x8& v)
+{
+    Vec3x8 r;
+    r.m_vx = _mm256_sub_ps(u.m_vx, v.m_vx);
+    r.m_vy = _mm256_sub_ps(u.m_vy, v.m_vy);
+    r.m_vz = _mm256_sub_ps(u.m_vz, v.m_vz);
+    return r;
+}
+Vec3x8 operator*(const Float8& t, const Vec3x8& v)
+{
+    Vec3x8 r;
+    r.m_vx = _mm256_mul_ps(t.m_v, v.m_vx);
+    r.m_vy = _mm256_mul_ps(t.m_v, v.m_vy);
+    r.m_vz = _mm256_mul_ps(t.m_v, v.m_vz);
+    return r;
+}
+
+Float8 dot(const Vec3x8& u, const Vec3x8& v)
+{
+    Float8 r;
+    r.m_v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u.m_vx, v.m_vx), _mm256_mul_ps(u.m_vy, v.m_vy)),
+                          _mm256_mul_ps(u.m_vz, v.m_vz));
+    return r;
+}
+
+Vec3x8 cross(const Vec3x8& u, const Vec3x8& v)
+{
+    Vec3x8 r;
+    r.m_vx = _mm256_sub_ps(_mm256_mul_ps(u.m_vy, v.m_vz), _mm256_mul_ps(u.m_vz, v.m_vy));
+    r.m_vy = _mm256_sub_ps(_mm256_mul_ps(u.m_vz, v.m_vx), _mm256_mul_ps(u.m_vx, v.m_vz));
+    r.m_vz = _mm256_sub_ps(_mm256_mul_ps(u.m_vx, v.m_vy), _mm256_mul_ps(u.m_vy, v.m_vx));
+    return r;
+}
+
+Vec3x8 normalize(const Vec3x8& v)
+{
+    __m256 length_squared = dot(v, v).m_v;
+    __m256 r = _mm256_rsqrt_ps(length_squared);
+    __m256 half_l = _mm256_mul_ps(_mm256_set1_ps(0.5f), length_squared);
+    Float8 scale;
+    scale.m_v = _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(half_l, _mm256_mul_ps(r, r))));
+    return scale * v;
+}
+
+#else
+
+Float8::Float8(float t)
+{
+    for (int k = 0; k < 8; ++k)
+        m_f[k] = t;
+}
+
+Float8 operator+(const Float8& a, const Float8& b)
+{
+    Float8 r;
+    for (int k = 0; k < 8; ++k)
+        r.m_f[k] = a.m_f[k] + b.m_f[k];
+    return r;
+}
+Float8 operator-(const Float8& a, const Float8& b)
+{
+    Float8 r;
+    for (int k = 0; k < 8; ++k)
+        r.m_f[k] = a.m_f[k] - b.m_f[k];
+    return r;
+}
+Float8 operator*(const Float8& a, const Float8& b)
+{
+    Float8 r;
+    for (int k = 0; k < 8; ++k)
+        r.m_f[k] = a.m_f[k] * b.m_f[k];
+    return r;
+}
+int greater_mask(const Float8& a, const Float8& b)
+{
+    int mask = 0;
+    for (int k = 0; k < 8; ++k)
+        mask |= (a.m_f[k] > b.m_f[k] ? 1 : 0) << k;
+    return mask;
+}
+
+Vec3x8::Vec3x8(const Vec3A& v)
+{
+    for (int k = 0; k < 8; ++k)
+    {
+        m_x[k] = v.m_x;
+        m_y[k] = v.m_y;
+        m_z[k] = v.m_z;
+    }
+}
+
+Vec3x8 Vec3x8::load(const Vec3A* v)
+{
+    Vec3x8 result;
+    for (int k = 0; k < 8; ++k)
+    {
+        result.m_x[k] = v[k].m_x;
+        result.m_y[k] = v[k].m_y;
+        result.m_z[k] = v[k].m_z;
+    }
+    return result;
+}
+
+Vec3x8 operator+(const Vec3x8& u, const Vec3x8& v)
+{
+    Vec3x8 r;
+    for (int k = 0; k < 8; ++k)
+    {
+        r.m_x[k] = u.m_x[k] + v.m_x[k];
+        r.m_y[k] = u.m_y[k] + v.m_y[k];
+        r.m_z[k] = u.m_z[k] + v.m_z[k];
+    }
+    return r;
+}
+Vec3x8 operator-(const Vec3x8& u, const Vec3x8& v)
+{
+    Vec3x8 r;
+    for (int k = 0; k < 8; ++k)
+    {
+        r.m_x[k] = u.m_x[k] - v.m_x[k];
+        r.m_y[k] = u.m_y[k] - v.m_y[k];
+        r.m_z[k] = u.m_z[k] - v.m_z[k];
+    }
+    return r;
+}
+Vec3x8 operator*(const Float8& t, const Vec3x8& v)
+{
+    Vec3x8 r;
+    for (int k = 0; k < 8; ++k)
+    {
+        r.m_x[k] = t.m_f[k] * v.m_x[k];
+        r.m_y[k] = t.m_f[k] * v.m_y[k];
+        r.m_z[k] = t.m_f[k] * v.m_z[k];
+    }
+    return r;
+}
+
+Float8 dot(const Vec3x8& u, const Vec3x8& v)
+{
+    Float8 r;
+    for (int k = 0; k < 8; ++k)
+        r.m_f[k] = u.m_x[k] * v.m_x[k] + u.m_y[k] * v.m_y[k] + u.m_z[k] * v.m_z[k];
+    return r;
+}
+
+Vec3x8 cross(const Vec3x8& u, const Vec3x8& v)
+{
+    Vec3x8 r;
+    for (int k = 0; k < 8; ++k)
+    {
+        r.m_x[k] = u.m_y[k] * v.m_z[k] - u.m_z[k] * v.m_y[k];
+        r.m_y[k] = u.m_z[k] * v.m_x[k] - u.m_x[k] * v.m_z[k];
+        r.m_z[k] = u.m_x[k] * v.m_y[k] - u.m_y[k] * v.m_x[k];
+    }
+    return r;
+}
+
+Vec3x8 normalize(const Vec3x8& v)
+{
+    Float8 length_squared = dot(v, v);
+    Float8 scale;
+    for (int k = 0; k < 8; ++k)
+        scale.m_f[k] = 1 / sqrtf(length_squared.m_f[k]);
+    return scale * v;
+}
+
+#endif
+
+#endif
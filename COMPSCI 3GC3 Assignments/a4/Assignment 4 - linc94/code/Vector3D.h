@@ -10,9 +10,34 @@ float clamp(float x, float min, float max)
     return x;
 }
 
+// min and max that compile to single instructions; fminf and fmaxf are library
+// calls because of their NaN rules. With a NaN argument these return b
+float min_float(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+float max_float(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+// every thread has its own generator state so render workers never contend on rand()
+thread_local unsigned long long random_state = 0x853c49e6748fea9bULL;
+
+void seed_random(unsigned long long seed)
+{
+    random_state = seed * 0x9E3779B97F4A7C15ULL + 0x853c49e6748fea9bULL;
+    if (random_state == 0) random_state = 1;
+}
+
 float random_float(/*[0,1)*/)
 {
-    return rand() / (RAND_MAX + 1.0);
+    // xorshift64*, top 24 bits become the float mantissa
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return ((random_state * 0x2545F4914F6CDD1DULL) >> 40) / 16777216.0f;
 }
 
 float random_float(float min, float max)
@@ -25,16 +50,17 @@ int random_int(int min, int max)
     return static_cast<int>(random_float(min, max+1));
 }
 
-class Vector3D
+// plain three-float vector
+class Vec3
 {
 public:
-    Vector3D()
+    Vec3()
     {
         m_x= 0;
         m_y = 0;
         m_z = 0;
     }
-    Vector3D(float x, float y, float z)
+    Vec3(float x, float y, float z)
     {
         m_x = x;
         m_y = y;
@@ -54,12 +80,12 @@ public:
         return m_z;
     }
     
-    Vector3D operator-() const
+    Vec3 operator-() const
     {
-        return Vector3D(-m_x, -m_y, -m_z);
+        return Vec3(-m_x, -m_y, -m_z);
     }
     
-    Vector3D& operator+=(const Vector3D &v)
+    Vec3& operator+=(const Vec3 &v)
     {
         m_x += v.m_x;
         m_y += v.m_y;
@@ -67,7 +93,7 @@ public:
         return *this;
     }
     
-    Vector3D& operator*=(const float t)
+    Vec3& operator*=(const float t)
     {
         m_x *= t;
         m_y *= t;
@@ -75,7 +101,7 @@ public:
         return *this;
     }
     
-    Vector3D& operator/=(const float t)
+    Vec3& operator/=(const float t)
     {
         return *this *= 1/t;
     }
@@ -90,12 +116,12 @@ public:
         return m_x*m_x + m_y*m_y + m_z*m_z;
     }
 
-    static Vector3D random() {
-        return Vector3D(random_float(), random_float(), random_float());
+    static Vec3 random() {
+        return Vec3(random_float(), random_float(), random_float());
     }
 
-    static Vector3D random(float min, float max) {
-        return Vector3D(random_float(min,max), random_float(min,max), random_float(min,max));
+    static Vec3 random(float min, float max) {
+        return Vec3(random_float(min,max), random_float(min,max), random_float(min,max));
     }
     
 public:
@@ -104,51 +130,57 @@ public:
     float m_z;
 };
 
-Vector3D operator+(const Vector3D &u, const Vector3D &v)
+Vec3 operator+(const Vec3 &u, const Vec3 &v)
 {
-    return Vector3D(u.m_x + v.m_x, u.m_y + v.m_y, u.m_z + v.m_z);
+    return Vec3(u.m_x + v.m_x, u.m_y + v.m_y, u.m_z + v.m_z);
 }
 
-Vector3D operator-(const Vector3D &u, const Vector3D &v)
+Vec3 operator-(const Vec3 &u, const Vec3 &v)
 {
-    return Vector3D(u.m_x - v.m_x, u.m_y - v.m_y, u.m_z - v.m_z);
+    return Vec3(u.m_x - v.m_x, u.m_y - v.m_y, u.m_z - v.m_z);
 }
 
-Vector3D operator*(const Vector3D &u, const Vector3D &v)
+Vec3 operator*(const Vec3 &u, const Vec3 &v)
 {
-    return Vector3D(u.m_x * v.m_x, u.m_y * v.m_y, u.m_z * v.m_z);
+    return Vec3(u.m_x * v.m_x, u.m_y * v.m_y, u.m_z * v.m_z);
 }
 
-Vector3D operator*(float t, const Vector3D &v)
+Vec3 operator*(float t, const Vec3 &v)
 {
-    return Vector3D(t*v.m_x, t*v.m_y, t*v.m_z);
+    return Vec3(t*v.m_x, t*v.m_y, t*v.m_z);
 }
 
-Vector3D operator*(const Vector3D &v, float t)
+Vec3 operator*(const Vec3 &v, float t)
 {
     return t * v;
 }
 
-Vector3D operator/(Vector3D v, float t)
+Vec3 operator/(Vec3 v, float t)
 {
     return (1/t) * v;
 }
 
-float dot(const Vector3D &u, const Vector3D &v)
+float dot(const Vec3 &u, const Vec3 &v)
 {
     return u.m_x * v.m_x + u.m_y * v.m_y + u.m_z * v.m_z;
 }
 
-Vector3D cross(const Vector3D &u, const Vector3D &v)
+Vec3 cross(const Vec3 &u, const Vec3 &v)
 {
-    return Vector3D(u.m_y * v.m_z- u.m_z * v.m_y,
+    return Vec3(u.m_y * v.m_z- u.m_z * v.m_y,
                 u.m_z * v.m_x - u.m_x * v.m_z,
                 u.m_x * v.m_y - u.m_y * v.m_x);
 }
 
-Vector3D normalize(Vector3D v)
+Vec3 normalize(Vec3 v)
 {
     return v / v.length();
 }
 
+#include "Vec3A.h"
+
+// the vector type everything is written against: Vec3 is three plain floats,
+// Vec3A the 16-byte SSE/NEON version with a fast normalize
+typedef Vec3 Vector3D;
+
 #endif
@@ -1,89 +1,422 @@
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include "Sphere.h"
+#include "Plane.h"
+#include "Box.h"
+#include "Disk.h"
+#include "Lattice.h"
+#include "ChunkedMesh.h"
+#include "BVH.h"
+#include "LBVH.h"
+#include "BVH8.h"
+#include "Grid.h"
 #include "Material.h"
+#include "EnvironmentMap.h"
+#include "IrradianceCache.h"
+#include "PathGuide.h"
+#include "LightTree.h"
+#include "TraversalStats.h"
 
 using namespace std;
+
+// structure World::hit uses to find sphere hits
+enum class Accelerator { None, BVH, BVH8, Grid, HashGrid };
+
+const char* accelerator_name(Accelerator accelerator)
+{
+    switch (accelerator)
+    {
+    case Accelerator::BVH: return "BVH";
+    case Accelerator::BVH8: return "BVH8";
+    case Accelerator::Grid: return "uniform grid";
+    case Accelerator::HashGrid: return "hash grid";
+    default: return "none";
+    }
+}
+
 class World
 {
 public:
-    std::vector<shared_ptr<Sphere>> m_spheres;
+    // every primitive type is kept by value in its own array so each type is
+    // intersected in its own loop
+    std::vector<Sphere> m_spheres;
+    std::vector<Plane> m_planes;
+    std::vector<Box> m_boxes;
+    std::vector<Disk> m_disks;
+    // procedural sphere fields, their spheres are made up during traversal
+    std::vector<SphereLattice> m_lattices;
+    // out-of-core triangle meshes, paged in from their files while rendering;
+    // shared with copies of this world, so replicas share one cache budget
+    std::vector<std::shared_ptr<ChunkedMesh>> m_meshes;
+
+    // primitives refer to materials by index into the pool
+    MaterialPool m_materials;
+
+    // lights every ray that leaves the scene; when nothing is loaded the sky is m_background
+    EnvironmentMap m_environment;
+    Vector3D m_background;
+    // spheres with emissive materials, sampled explicitly at diffuse surfaces;
+    // rebuild it (build_accelerator() does) after changing them
+    LightTree m_lights;
+    // images used by Textured materials, shared with copies of this world
+    std::shared_ptr<TextureCache> m_textures;
+    // optional: interpolate indirect diffuse light from cached records (shared
+    // with copies of this world, emptied by clear())
+    std::shared_ptr<IrradianceCache> m_irradianceCache;
+    // optional: learn where light comes from and sample diffuse bounces towards
+    // it; the renderer trains it over the first passes of every render
+    std::shared_ptr<PathGuide> m_pathGuide;
+
+    // optional acceleration structures over m_spheres, only m_accelerator is
+    // used; rebuild it after adding or removing spheres
+    Accelerator m_accelerator;
+    BVH m_bvh;
+    // compressed 8-wide copy of m_bvh
+    BVH8 m_bvh8;
+    UniformGrid m_grid;
+    HashGrid m_hashGrid;
     
-    World() {}
+    World()
+    {
+        m_accelerator = Accelerator::None;
+        m_background = Vector3D(1, 1, 1);
+    }
     HitResult hit(Ray& ray, float min_t, float max_t);
+    // closest hits of rays[i] for every i in live, into hits[i]. Meshes get
+    // the rays as one batch, which pages each of their chunks in once per
+    // call instead of once per ray
+    void hit_batch(std::vector<Ray>& rays, const std::vector<int>& live, float min_t, std::vector<HitResult>& hits);
+    // any-hit query for shadow and visibility rays: is anything between min_t and max_t?
+    bool occluded(Ray& ray, float min_t, float max_t);
+    // the loops hit() is made of, for integrators that know which primitive
+    // types a scene has: narrow hit_result down to the closest sphere hit
+    // (through m_accelerator) or the closest hit among prims, m_t is the current max_t
+    void hit_spheres(Ray& ray, float min_t, HitResult& hit_result);
+    template <typename T>
+    void hit_closest(std::vector<T>& prims, Ray& ray, float min_t, HitResult& hit_result);
+    void clear();
+    // bounds of every stored primitive, planes and lattices are left out
+    AABB bounds();
+    void build_accelerator(Accelerator accelerator);
+    void build_lights();
+    void build_bvh()
+    {
+        m_bvh.build(m_spheres);
+        m_accelerator = Accelerator::BVH;
+    }
+    // faster parallel build of a somewhat worse tree, for huge scenes
+    void build_lbvh(bool optimize_treelets = false)
+    {
+        LBVHBuilder builder;
+        builder.m_optimizeTreelets = optimize_treelets;
+        builder.build(m_bvh, m_spheres);
+        m_accelerator = Accelerator::BVH;
+    }
+    // collapse the current BVH into the compressed 8-wide layout
+    void build_bvh8()
+    {
+        if (!m_bvh.built())
+            m_bvh.build(m_spheres);
+        m_bvh8.build(m_bvh);
+        m_accelerator = Accelerator::BVH8;
+    }
+    void build_grid()
+    {
+        m_grid.build(m_spheres);
+        m_accelerator = Accelerator::Grid;
+    }
+    void build_hash_grid()
+    {
+        m_hashGrid.build(m_spheres);
+        m_accelerator = Accelerator::HashGrid;
+    }
+
+    template <typename T, typename... Args>
+    int add_material(const Vector3D& color, Args... args)
+    {
+        return m_materials.add<T>(color, args...);
+    }
+    Material* material(int index)
+    {
+        return m_materials.get(index);
+    }
+    void enable_irradiance_cache(float accuracy = 0.25f)
+    {
+        m_irradianceCache = std::make_shared<IrradianceCache>(accuracy);
+    }
+    void enable_path_guiding()
+    {
+        m_pathGuide = std::make_shared<PathGuide>();
+    }
+    TextureCache& textures()
+    {
+        if (!m_textures)
+            m_textures = std::make_shared<TextureCache>();
+        return *m_textures;
+    }
+    // a mesh file ChunkedMeshBuilder wrote, with at most cache_bytes of it in
+    // memory at a time; its index in m_meshes, or -1 if it can't be opened
+    int add_mesh(const std::string& path, int material, uint64_t cache_bytes)
+    {
+        std::shared_ptr<ChunkedMesh> mesh = std::make_shared<ChunkedMesh>();
+        if (!mesh->open(path, cache_bytes, material))
+            return -1;
+        m_meshes.push_back(mesh);
+        return static_cast<int>(m_meshes.size()) - 1;
+    }
+    // diffuse material colored by an image file, or -1 if it can't be loaded
+    int add_textured_material(const std::string& path)
+    {
+        int texture = textures().add(path);
+        if (texture < 0)
+            return -1;
+        return add_material<Textured>(Vector3D(1, 1, 1), m_textures.get(), texture);
+    }
     
     void generate_scene_one_diffuse();
     void generate_scene_one_specular();
     void generate_scene_multi_diffuse();
     void generate_scene_multi_specular();
     void generate_scene_all();
+    void generate_scene_mixed();
+    // the showcase scene at night, with light_count small glowing spheres floating between the others
+    void generate_scene_lights(int light_count);
+    // the showcase scene's spheres continued procedurally over (2 * half_extent)^2 cells
+    void generate_scene_sphere_field(int half_extent);
+    // textured spheres on a textured floor, untextured diffuse where an image can't be read
+    void generate_scene_textured(const std::string& sphere_texture, const std::string& floor_texture);
+
+private:
+    // hit() without the meshes
+    HitResult hit_in_memory(Ray& ray, float min_t, float max_t);
+    template <typename T>
+    bool occluded_any(std::vector<T>& prims, Ray& ray, float min_t, float max_t);
 };
 
 // TODO 3
 HitResult World::hit(Ray& ray, float min_t, float max_t)
+{
+    HitResult hit_result = hit_in_memory(ray, min_t, max_t);
+    for (auto& mesh : m_meshes)
+    {
+        HitResult hit = mesh->hit(ray, min_t, hit_result.m_t);
+        if (hit.m_isHit)
+            hit_result = hit;
+    }
+    return hit_result;
+}
+
+void World::hit_batch(std::vector<Ray>& rays, const std::vector<int>& live, float min_t, std::vector<HitResult>& hits)
+{
+    for (int i : live)
+        hits[i] = hit_in_memory(rays[i], min_t, std::numeric_limits<float>::infinity());
+    for (auto& mesh : m_meshes)
+        mesh->hit_batch(rays, live, min_t, hits);
+}
+
+HitResult World::hit_in_memory(Ray& ray, float min_t, float max_t)
 {
     // initialize hit result
     HitResult hit_result;
 
-    // boolean to check if the ray hit any object
-    bool hit_anything = false;
+    // m_t holds the closest distance so far, the loops only accept hits in front of it
+    hit_result.m_t = max_t;
 
-    // loop through all objects
-    for (const auto& sphere : m_spheres) {
-        // get hit result for the sphere
-        HitResult hit = sphere->hit(ray, min_t, max_t);
+    // every primitive type gets its own loop
+    hit_spheres(ray, min_t, hit_result);
+    hit_closest(m_planes, ray, min_t, hit_result);
+    hit_closest(m_boxes, ray, min_t, hit_result);
+    hit_closest(m_disks, ray, min_t, hit_result);
+    hit_closest(m_lattices, ray, min_t, hit_result);
 
-        // if we found our first hit
-        if (hit_anything == false && hit.m_isHit) {
-            // we found a hit
-            hit_anything = true;
-            // it is our first hit, so it is the closest hit
+    // return hit_result
+    return hit_result;
+}
+
+void World::hit_spheres(Ray& ray, float min_t, HitResult& hit_result)
+{
+    switch (m_accelerator)
+    {
+    case Accelerator::BVH:
+        m_bvh.hit(m_spheres, ray, min_t, hit_result);
+        break;
+    case Accelerator::BVH8:
+        m_bvh8.hit(m_spheres, ray, min_t, hit_result);
+        break;
+    case Accelerator::Grid:
+        m_grid.hit(m_spheres, ray, min_t, hit_result);
+        break;
+    case Accelerator::HashGrid:
+        m_hashGrid.hit(m_spheres, ray, min_t, hit_result);
+        break;
+    default:
+        hit_closest(m_spheres, ray, min_t, hit_result);
+        break;
+    }
+}
+
+// narrow hit_result down to the closest hit among prims, m_t is the current max_t
+template <typename T>
+void World::hit_closest(std::vector<T>& prims, Ray& ray, float min_t, HitResult& hit_result)
+{
+    COUNT_PRIMITIVE_TESTS(prims.size());
+    for (T& prim : prims) {
+        HitResult hit = prim.hit(ray, min_t, hit_result.m_t);
+        if (hit.m_isHit) {
             hit_result = hit;
+            if (std::is_same<T, Sphere>::value)
+                hit_result.m_sphere = static_cast<int>(&prim - prims.data());
         }
+    }
+}
 
-        // check if this new hit is closer than our previous
-        else {
-            if (hit.m_isHit && (hit.m_t < hit_result.m_t)) {
-                // if it is, set it as the new closest hit
-                hit_result = hit;
-            }
+bool World::occluded(Ray& ray, float min_t, float max_t)
+{
+    // large, cheap occluders first
+    if (occluded_any(m_planes, ray, min_t, max_t) || occluded_any(m_boxes, ray, min_t, max_t) ||
+        occluded_any(m_disks, ray, min_t, max_t))
+        return true;
+    if (occluded_any(m_lattices, ray, min_t, max_t))
+        return true;
+
+    bool spheres;
+    switch (m_accelerator)
+    {
+    case Accelerator::BVH:
+        spheres = m_bvh.occluded(m_spheres, ray, min_t, max_t);
+        break;
+    case Accelerator::BVH8:
+        spheres = m_bvh8.occluded(m_spheres, ray, min_t, max_t);
+        break;
+    case Accelerator::Grid:
+        spheres = m_grid.occluded(m_spheres, ray, min_t, max_t);
+        break;
+    case Accelerator::HashGrid:
+        spheres = m_hashGrid.occluded(m_spheres, ray, min_t, max_t);
+        break;
+    default:
+        spheres = occluded_any(m_spheres, ray, min_t, max_t);
+        break;
+    }
+    if (spheres)
+        return true;
+
+    // meshes last: they may have to page chunks in from disk
+    for (auto& mesh : m_meshes)
+        if (mesh->occludes(ray, min_t, max_t))
+            return true;
+    return false;
+}
+
+template <typename T>
+bool World::occluded_any(std::vector<T>& prims, Ray& ray, float min_t, float max_t)
+{
+    for (T& prim : prims) {
+        COUNT_PRIMITIVE_TESTS(1);
+        if (prim.occludes(ray, min_t, max_t))
+            return true;
+    }
+    return false;
+}
+
+void World::build_accelerator(Accelerator accelerator)
+{
+    switch (accelerator)
+    {
+    case Accelerator::BVH: build_bvh(); break;
+    case Accelerator::BVH8: build_bvh8(); break;
+    case Accelerator::Grid: build_grid(); break;
+    case Accelerator::HashGrid: build_hash_grid(); break;
+    default: m_accelerator = Accelerator::None; break;
+    }
+    build_lights();
+}
+
+void World::build_lights()
+{
+    // power up to a constant factor: luminance of the radiance times surface area
+    std::vector<float> power(m_spheres.size(), 0.0f);
+    for (size_t s = 0; s < m_spheres.size(); ++s)
+    {
+        Material* m = material(m_spheres[s].m_material);
+        if (m->is_emissive())
+        {
+            Vector3D c = m->m_color;
+            power[s] = (0.2126f * c.m_x + 0.7152f * c.m_y + 0.0722f * c.m_z) * m_spheres[s].m_radius * m_spheres[s].m_radius;
         }
     }
+    m_lights.build(m_spheres, power);
+}
 
-    // return hit_result
-    return hit_result;
+AABB World::bounds()
+{
+    AABB bounds;
+    for (const Sphere& s : m_spheres)
+        bounds.grow(s.bounds());
+    for (const Box& b : m_boxes)
+        bounds.grow(b.bounds());
+    for (const Disk& d : m_disks)
+        bounds.grow(d.bounds());
+    for (auto& mesh : m_meshes)
+        bounds.grow(mesh->bounds());
+    return bounds;
 }
 
-void World::generate_scene_one_diffuse()
+void World::clear()
 {
     m_spheres.clear();
+    m_planes.clear();
+    m_boxes.clear();
+    m_disks.clear();
+    m_lattices.clear();
+    m_meshes.clear();
+    m_materials.clear();
+    if (m_irradianceCache)
+        m_irradianceCache = std::make_shared<IrradianceCache>(m_irradianceCache->m_accuracy, m_irradianceCache->m_minSpacing,
+                                                              m_irradianceCache->m_maxSpacing);
+    m_accelerator = Accelerator::None;
+    m_bvh.clear();
+    m_bvh8.clear();
+    m_grid.clear();
+    m_hashGrid.clear();
+    m_lights.build(m_spheres, std::vector<float>());
+    m_background = Vector3D(1, 1, 1);
+}
+
+void World::generate_scene_one_diffuse()
+{
+    clear();
     
-    auto material_diffuse = make_shared<Diffuse>(Vector3D(0.3, 0.4, 0.5));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(4, 1, 0), 1.0, material_diffuse));
+    int material_diffuse = add_material<Diffuse>(Vector3D(0.3, 0.4, 0.5));
+    m_spheres.push_back(Sphere(Vector3D(4, 1, 0), 1.0, material_diffuse));
     
     //floor
-    auto material_floor = make_shared<Diffuse>(Vector3D(0.5, 0.5, 0.5));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(0,-2000,0), 2000, material_floor));
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
 }
 
 void World::generate_scene_one_specular()
 {
-    m_spheres.clear();
+    clear();
     
-    auto material_diffuse = make_shared<Specular>(Vector3D(1, 1, 1));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(4, 1, 0), 1.0, material_diffuse));
+    int material_diffuse = add_material<Specular>(Vector3D(1, 1, 1));
+    m_spheres.push_back(Sphere(Vector3D(4, 1, 0), 1.0, material_diffuse));
     
     //floor
-    auto material_floor = make_shared<Diffuse>(Vector3D(0.5, 0.5, 0.5));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(0,-2000,0), 2000, material_floor));
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
 }
 
 void World::generate_scene_multi_diffuse()
 {
-    m_spheres.clear();
+    clear();
     
     for (int row = -3; row < 3; ++row)
     {
@@ -91,22 +424,22 @@ void World::generate_scene_multi_diffuse()
         {
             float radius = random_float(0.2, 0.8);
             Vector3D center(3*row + 0.5*random_float(), radius, 3*col + 0.5*random_float());
-            shared_ptr<Material> sphere_material;
+            int sphere_material;
             
             Vector3D color = Vector3D::random() * Vector3D::random();
-            sphere_material = make_shared<Diffuse>(color);
-            m_spheres.push_back(make_shared<Sphere>(center, radius, sphere_material));
+            sphere_material = add_material<Diffuse>(color);
+            m_spheres.push_back(Sphere(center, radius, sphere_material));
         }
     }
     
     //floor
-    auto material_floor = make_shared<Diffuse>(Vector3D(0.5, 0.5, 0.5));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(0,-2000,0), 2000, material_floor));
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
 }
 
 void World::generate_scene_multi_specular()
 {
-    m_spheres.clear();
+    clear();
     
     for (int row = -3; row < 3; ++row)
     {
@@ -114,22 +447,22 @@ void World::generate_scene_multi_specular()
         {
             float radius = random_float(0.2, 0.8);
             Vector3D center(3*row + 0.5*random_float(), radius, 3*col + 0.5*random_float());
-            shared_ptr<Material> sphere_material;
+            int sphere_material;
             
             Vector3D color = Vector3D::random(0.3, 1);
-            sphere_material = make_shared<Specular>(color);
-            m_spheres.push_back(make_shared<Sphere>(center, radius, sphere_material));
+            sphere_material = add_material<Specular>(color);
+            m_spheres.push_back(Sphere(center, radius, sphere_material));
         }
     }
     
     //floor
-    auto material_floor = make_shared<Diffuse>(Vector3D(0.5, 0.5, 0.5));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(0,-2000,0), 2000, material_floor));
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
     
 }
 void World::generate_scene_all()
 {
-    m_spheres.clear();
+    clear();
     for (int row = -5; row < 10; ++row)
     {
         for (int col = -5; col < 5; ++col)
@@ -140,19 +473,102 @@ void World::generate_scene_all()
             bool isDiffuse = random_float() <= 0.6;
             Vector3D color = isDiffuse ? Vector3D::random() * Vector3D::random() : Vector3D::random(0.5, 1);
             
-            shared_ptr<Material> material;
+            int material;
             if(isDiffuse)
-                material = make_shared<Diffuse>(color);
+                material = add_material<Diffuse>(color);
+            else
+                material = add_material<Specular>(color);
+            m_spheres.push_back(Sphere(center, radius, material));
+        }
+    }
+    
+    //floor
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
+}
+
+void World::generate_scene_mixed()
+{
+    clear();
+    for (int row = -3; row < 3; ++row)
+    {
+        for (int col = -3; col < 3; ++col)
+        {
+            float size = random_float(0.2, 0.5);
+            Vector3D center(3*row + 0.5*random_float(), size, 3*col + 0.5*random_float());
+            Vector3D color = Vector3D::random() * Vector3D::random();
+            
+            // alternate between spheres, boxes and disks
+            int kind = random_int(0, 2);
+            if (kind == 0)
+                m_spheres.push_back(Sphere(center, size, add_material<Diffuse>(color)));
+            else if (kind == 1)
+                m_boxes.push_back(Box(center - Vector3D(size, size, size), center + Vector3D(size, size, size), add_material<Diffuse>(color)));
             else
-                material = make_shared<Specular>(color);
-            m_spheres.push_back(make_shared<Sphere>(center, radius, material));
+                m_disks.push_back(Disk(center, Vector3D(1, 1, 0), size, add_material<Specular>(Vector3D::random(0.5, 1))));
         }
     }
     
     //floor
-    auto material_floor = make_shared<Diffuse>(Vector3D(0.5, 0.5, 0.5));
-    m_spheres.push_back(make_shared<Sphere>(Vector3D(0,-2000,0), 2000, material_floor));
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
 }
 
+void World::generate_scene_sphere_field(int half_extent)
+{
+    clear();
+
+    // a palette in generate_scene_all's proportions, each sphere picks one by its hash
+    std::vector<int> palette;
+    for (int k = 0; k < 64; ++k)
+    {
+        bool isDiffuse = random_float() <= 0.6;
+        if (isDiffuse)
+            palette.push_back(add_material<Diffuse>(Vector3D::random() * Vector3D::random()));
+        else
+            palette.push_back(add_material<Specular>(Vector3D::random(0.5, 1)));
+    }
+    SphereLattice field(1.5f, half_extent, 1, 0, palette);
+    field.m_minRadius = 0.2f;
+    field.m_maxRadius = 0.5f;
+    m_lattices.push_back(field);
+
+    //floor
+    int material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
+}
+
+void World::generate_scene_lights(int light_count)
+{
+    generate_scene_all();
+    m_background = Vector3D(0, 0, 0);
+
+    // the lights share a fixed total power, so scenes with more of them aren't brighter
+    float radius = 0.05f;
+    Vector3D radiance = (2000.0f / light_count) * Vector3D(1.0, 0.85, 0.6);
+    for (int i = 0; i < light_count; ++i)
+    {
+        Vector3D center(random_float(-8, 15), random_float(1.0, 3.0), random_float(-8, 8));
+        m_spheres.push_back(Sphere(center, radius, add_material<Emissive>(radiance * random_float(0.5, 1.5))));
+    }
+}
+
+void World::generate_scene_textured(const std::string& sphere_texture, const std::string& floor_texture)
+{
+    clear();
+
+    int material_sphere = add_textured_material(sphere_texture);
+    if (material_sphere < 0)
+        material_sphere = add_material<Diffuse>(Vector3D(0.3, 0.4, 0.5));
+    for (int i = 0; i < 4; ++i)
+        m_spheres.push_back(Sphere(Vector3D(1.5*i - 2, 0.5, -1.0*i + 1), 0.5, material_sphere));
+    m_spheres.push_back(Sphere(Vector3D(-1, 1, -2.5), 1.0, add_material<Specular>(Vector3D(0.9, 0.9, 0.9))));
+
+    //floor
+    int material_floor = add_textured_material(floor_texture);
+    if (material_floor < 0)
+        material_floor = add_material<Diffuse>(Vector3D(0.5, 0.5, 0.5));
+    m_planes.push_back(Plane(Vector3D(0,0,0), Vector3D(0,1,0), material_floor));
+}
 
 #endif
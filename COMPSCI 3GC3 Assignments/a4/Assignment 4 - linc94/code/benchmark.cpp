@@ -0,0 +1,1261 @@
+#include "Camera.h"
+#include "World.h"
+#include "Renderer.h"
+#include "DynamicWorld.h"
+#include "Autotune.h"
+#include "Sequence.h"
+#include "Batch.h"
+#include "Preview.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+// standalone timing runs for the tracer, build it like main.cpp (with -O2 -pthread,
+// and -mavx2 for the vectorized BVH8 kernel; -DTRACE_STATS adds traversal counts)
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const std::string& name, double seconds)
+{
+    std::cout << "  " << name << ": " << seconds * 1000.0 << " ms" << std::endl;
+}
+
+// center of the i-th sphere on a square lattice, like generate_scene_all
+Vector3D lattice_center(int i, int count, float radius)
+{
+    int side = static_cast<int>(sqrt(count));
+    int row = i / side - side / 2;
+    int col = i % side - side / 2;
+    return Vector3D(1.5*row + 0.5*random_float(), radius, 1.5*col + 0.5*random_float());
+}
+
+// count spheres with their own materials
+void generate_scene_lattice(World& world, int count)
+{
+    world.clear();
+    for (int i = 0; i < count; ++i)
+    {
+        float radius = random_float(0.2, 0.5);
+        Vector3D center = lattice_center(i, count, radius);
+        int material = world.add_material<Diffuse>(Vector3D::random());
+        world.m_spheres.push_back(Sphere(center, radius, material));
+    }
+}
+
+// the old layout: every sphere and material is its own make_shared allocation
+struct SharedSphere
+{
+    shared_ptr<Sphere> m_sphere;
+    shared_ptr<Material> m_material;
+};
+
+void bench_arena(int count, int ray_count)
+{
+    std::cout << "scene storage, " << count << " spheres, " << ray_count << " rays" << std::endl;
+
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+
+    // shared_ptr per object
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<SharedSphere>* spheres = new std::vector<SharedSphere>();
+        for (int i = 0; i < count; ++i)
+        {
+            float radius = random_float(0.2, 0.5);
+            Vector3D center = lattice_center(i, count, radius);
+            SharedSphere s;
+            s.m_material = make_shared<Diffuse>(Vector3D::random());
+            s.m_sphere = make_shared<Sphere>(center, radius, 0);
+            spheres->push_back(s);
+        }
+        report("make_shared build", seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        int hits = 0;
+        for (int i = 0; i < ray_count; ++i)
+        {
+            Ray r = camera.generate_ray(random_float(), random_float());
+            HitResult closest;
+            closest.m_t = std::numeric_limits<float>::infinity();
+            for (const SharedSphere& s : *spheres)
+            {
+                HitResult hit = s.m_sphere->hit(r, 0.001, closest.m_t);
+                if (hit.m_isHit)
+                    closest = hit;
+            }
+            hits += closest.m_isHit;
+        }
+        report("make_shared traversal", seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        delete spheres;
+        report("make_shared destruction", seconds_since(start));
+    }
+
+    // arena
+    {
+        auto start = std::chrono::steady_clock::now();
+        World* world = new World();
+        generate_scene_lattice(*world, count);
+        report("arena build", seconds_since(start));
+        std::cout << "  arena bytes: " << world->m_materials.bytes_used() << std::endl;
+
+        start = std::chrono::steady_clock::now();
+        int hits = 0;
+        for (int i = 0; i < ray_count; ++i)
+        {
+            Ray r = camera.generate_ray(random_float(), random_float());
+            hits += world->hit(r, 0.001, std::numeric_limits<float>::infinity()).m_isHit;
+        }
+        report("arena traversal", seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        delete world;
+        report("arena destruction", seconds_since(start));
+    }
+}
+
+// Mrays/s of a threaded render with and without pinning / NUMA-local tiles
+void bench_numa()
+{
+    CpuTopology topology = CpuTopology::detect();
+    std::cout << "thread placement, " << topology.node_count() << " NUMA node(s), "
+              << topology.cpu_count() << " cpus" << std::endl;
+
+    World world;
+    world.generate_scene_all();
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 768 / 540.0f);
+
+    const char* names[3] = { "unpinned", "pinned", "pinned + replicated scene" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        RenderSettings settings;
+        settings.m_width = 384;
+        settings.m_height = 270;
+        settings.m_raysPerPixel = 16;
+        settings.m_pinThreads = mode > 0;
+        settings.m_replicateScene = mode > 1;
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        std::cout << "  " << names[mode] << ": " << renderer.m_rayCount / renderer.m_seconds / 1e6
+                  << " Mrays/s" << std::endl;
+    }
+}
+
+// traversal time of ray_count camera rays
+double time_traversal(World& world, int ray_count)
+{
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    seed_random(7);
+    auto start = std::chrono::steady_clock::now();
+    int hits = 0;
+    for (int i = 0; i < ray_count; ++i)
+    {
+        Ray r = camera.generate_ray(random_float(), random_float());
+        hits += world.hit(r, 0.001, std::numeric_limits<float>::infinity()).m_isHit;
+    }
+    return seconds_since(start);
+}
+
+// per-frame cost of keeping the BVH current while a tenth of the spheres move
+void bench_dynamic(int count, int frames)
+{
+    std::cout << "animated scene, " << count << " spheres, " << frames << " frames" << std::endl;
+
+    World world;
+    generate_scene_lattice(world, count);
+    std::vector<Vector3D> velocity(count);
+    for (int i = 0; i < count; ++i)
+        velocity[i] = i % 10 == 0 ? Vector3D::random(-0.2, 0.2) : Vector3D(0, 0, 0);
+
+    // from scratch every frame
+    double rebuild_seconds = 0;
+    World rebuilt(world);
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        for (int i = 0; i < count; i += 10)
+            rebuilt.m_spheres[i].m_center += velocity[i];
+        auto start = std::chrono::steady_clock::now();
+        rebuilt.build_bvh();
+        rebuild_seconds += seconds_since(start);
+    }
+    report("full rebuild per frame", rebuild_seconds / frames);
+    report("traversal after full rebuilds", time_traversal(rebuilt, 20000));
+
+    // refit, rebuilding only when the SAH cost degrades
+    DynamicWorld dynamic(world);
+    double update_seconds = 0;
+    int partial = 0;
+    int full = 0;
+    float ratio = 1;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        for (int i = 0; i < count; i += 10)
+            dynamic.move_sphere(i, world.m_spheres[i].m_center + velocity[i]);
+        UpdateStats stats = dynamic.update();
+        update_seconds += stats.m_seconds;
+        partial += stats.m_partialRebuilds;
+        full += stats.m_fullRebuild;
+        ratio = stats.m_costRatio;
+    }
+    report("refit update per frame", update_seconds / frames);
+    std::cout << "  partial rebuilds: " << partial << ", full rebuilds: " << full
+              << ", final SAH cost ratio: " << ratio << std::endl;
+    report("traversal after refits", time_traversal(world, 20000));
+}
+
+// build time against tree quality for the SAH and linear builders
+void bench_builders(int count)
+{
+    std::cout << "BVH builders, " << count << " spheres, " << default_thread_count() << " threads" << std::endl;
+
+    World world;
+    generate_scene_lattice(world, count);
+
+    const char* names[4] = { "binned SAH", "LBVH 30-bit", "LBVH 63-bit", "LBVH 30-bit + treelets" };
+    for (int mode = 0; mode < 4; ++mode)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (mode == 0)
+        {
+            world.build_bvh();
+        }
+        else
+        {
+            LBVHBuilder builder;
+            builder.m_wideCodes = mode == 2;
+            builder.m_optimizeTreelets = mode == 3;
+            builder.build(world.m_bvh, world.m_spheres);
+        }
+        double build = seconds_since(start);
+        std::cout << "  " << names[mode] << ": build " << build * 1000.0 << " ms, SAH cost "
+                  << world.m_bvh.sah_cost() << ", " << world.m_bvh.node_count() << " nodes, traversal "
+                  << time_traversal(world, 100000) * 1000.0 << " ms" << std::endl;
+    }
+}
+
+// compressed 8-wide layout against the binary one it is collapsed from
+void bench_bvh8(int count)
+{
+#if defined(__AVX2__)
+    std::cout << "BVH8 (AVX2 kernel), " << count << " spheres" << std::endl;
+#else
+    std::cout << "BVH8 (scalar kernel), " << count << " spheres" << std::endl;
+#endif
+
+    World world;
+    generate_scene_lattice(world, count);
+    world.build_bvh();
+    size_t binary_bytes = world.m_bvh.m_nodes.size() * sizeof(BVHNode) + world.m_bvh.m_indices.size() * sizeof(int);
+    std::cout << "  binary: " << world.m_bvh.node_count() << " nodes, " << binary_bytes / 1024 << " KiB, traversal "
+              << time_traversal(world, 200000) * 1000.0 << " ms" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    world.build_bvh8();
+    double build = seconds_since(start);
+    std::cout << "  BVH8: " << world.m_bvh8.m_nodes.size() << " nodes, " << world.m_bvh8.bytes() / 1024
+              << " KiB, collapse " << build * 1000.0 << " ms, traversal "
+              << time_traversal(world, 200000) * 1000.0 << " ms" << std::endl;
+}
+
+// every accelerator on a lattice scene, and what the heuristic and autotuner pick
+void bench_accelerators(int count)
+{
+    std::cout << "accelerators, " << count << " lattice spheres" << std::endl;
+
+    World world;
+    generate_scene_lattice(world, count);
+    Accelerator all[4] = { Accelerator::BVH, Accelerator::BVH8, Accelerator::Grid, Accelerator::HashGrid };
+    for (Accelerator a : all)
+    {
+        auto start = std::chrono::steady_clock::now();
+        world.build_accelerator(a);
+        double build = seconds_since(start);
+        std::cout << "  " << accelerator_name(a) << ": build " << build * 1000.0 << " ms, traversal "
+                  << time_traversal(world, 200000) * 1000.0 << " ms" << std::endl;
+#ifdef TRACE_STATS
+        // built with -DTRACE_STATS: where the traversal time goes
+        TraversalStats before = traversal_stats;
+        time_traversal(world, 20000);
+        std::cout << "    per ray: " << (traversal_stats.m_nodeVisits - before.m_nodeVisits) / 20000.0 << " node visits, "
+                  << (traversal_stats.m_primitiveTests - before.m_primitiveTests) / 20000.0 << " primitive tests" << std::endl;
+#endif
+    }
+    std::cout << "  heuristic picks " << accelerator_name(choose_accelerator(world)) << std::endl;
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    std::cout << "  autotuner picks " << accelerator_name(autotune_accelerator(world, camera, 20000, false)) << std::endl;
+}
+
+// ambient occlusion style probes: short segments from primary hit points in random
+// directions, answered once by the closest-hit query and once by the any-hit query
+void bench_occlusion(int count, int probe_count)
+{
+    std::cout << "occlusion, " << count << " lattice spheres, " << probe_count << " probes" << std::endl;
+
+    World world;
+    generate_scene_lattice(world, count);
+    world.build_accelerator(Accelerator::BVH);
+
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    seed_random(11);
+    std::vector<Ray> probes;
+    while ((int)probes.size() < probe_count)
+    {
+        Ray r = camera.generate_ray(random_float(), random_float());
+        HitResult hit = world.hit(r, 0.001, std::numeric_limits<float>::infinity());
+        if (!hit.m_isHit)
+            continue;
+        Vector3D dir = normalize(hit.m_hitNormal + Vector3D::random(-1, 1));
+        probes.push_back(Ray(hit.m_hitPos, dir));
+    }
+    const float probe_length = 1.0f;
+
+    Accelerator all[4] = { Accelerator::BVH, Accelerator::BVH8, Accelerator::Grid, Accelerator::HashGrid };
+    for (Accelerator a : all)
+    {
+        world.build_accelerator(a);
+
+        auto start = std::chrono::steady_clock::now();
+        int closest_blocked = 0;
+        for (Ray& r : probes)
+            closest_blocked += world.hit(r, 0.001, probe_length).m_isHit;
+        double closest = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        int any_blocked = 0;
+        for (Ray& r : probes)
+            any_blocked += world.occluded(r, 0.001, probe_length);
+        double any = seconds_since(start);
+
+        std::cout << "  " << accelerator_name(a) << ": closest hit " << closest * 1000.0 << " ms, any hit "
+                  << any * 1000.0 << " ms (" << any_blocked << " blocked"
+                  << (any_blocked == closest_blocked ? "" : ", MISMATCH") << ")" << std::endl;
+    }
+}
+
+// root mean square difference of two renders, per sample
+double render_error(Renderer& a, Renderer& b)
+{
+    const RenderSettings& s = a.m_settings;
+    double sum = 0;
+    for (int j = 0; j < s.m_height; ++j)
+    {
+        for (int i = 0; i < s.m_width; ++i)
+        {
+            Vector3D d = a.pixel(i, j) / s.m_raysPerPixel - b.pixel(i, j) / b.m_settings.m_raysPerPixel;
+            sum += d.length_squared();
+        }
+    }
+    return sqrt(sum / (s.m_width * s.m_height));
+}
+
+// a diffuse sphere under a synthetic sky with a small, very bright sun: light
+// sampling against bounces that only reach the sun by chance
+void bench_environment(int samples)
+{
+    std::cout << "environment map, sun sky, " << samples << " samples per pixel" << std::endl;
+
+    World world;
+    world.generate_scene_one_diffuse();
+    int width = 256, height = 128;
+    std::vector<Vector3D> sky(width * height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            sky[y * width + x] = y < height / 2 ? Vector3D(0.3, 0.4, 0.6) : Vector3D(0.1, 0.1, 0.1);
+    for (int y = 30; y < 32; ++y)
+        for (int x = 100; x < 102; ++x)
+            sky[y * width + x] = Vector3D(20000, 19000, 17000);
+    world.m_environment.build(width, height, sky);
+
+    Camera camera(Vector3D(13, 2, 3), Vector3D(4, 1, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    RenderSettings settings;
+    settings.m_width = 160;
+    settings.m_height = 90;
+
+    settings.m_raysPerPixel = samples * 64;
+    Renderer reference(settings);
+    reference.render(world, camera);
+
+    settings.m_raysPerPixel = samples;
+    bool modes[2] = { false, true };
+    for (bool importance : modes)
+    {
+        world.m_environment.m_importanceSample = importance;
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        std::cout << "  " << (importance ? "light sampling + MIS" : "bounces only") << ": "
+                  << renderer.m_seconds * 1000.0 << " ms, rms error " << render_error(renderer, reference) << std::endl;
+    }
+}
+
+// textured spheres on a textured floor, with procedural textures much larger
+// than the cache budget: ray cones against always reading the finest level
+void bench_textures(int texture_size, size_t budget_bytes)
+{
+    std::cout << "textures, " << texture_size << "^2 texels, " << (budget_bytes >> 20) << " MB tile cache" << std::endl;
+
+    World world;
+    world.m_textures = std::make_shared<TextureCache>(budget_bytes);
+    std::vector<unsigned char> rgb(texture_size * texture_size * 3);
+    int materials[2];
+    for (int k = 0; k < 2; ++k)
+    {
+        for (int y = 0; y < texture_size; ++y)
+        {
+            for (int x = 0; x < texture_size; ++x)
+            {
+                unsigned char* c = &rgb[(y * texture_size + x) * 3];
+                bool check = ((x >> (4 + k)) ^ (y >> (4 + k))) & 1;
+                c[0] = check ? 200 : (x * 255) / texture_size;
+                c[1] = check ? 200 : (y * 255) / texture_size;
+                c[2] = check ? 60 : 140;
+            }
+        }
+        int texture = world.textures().add(texture_size, texture_size, rgb.data());
+        materials[k] = world.add_material<Textured>(Vector3D(1, 1, 1), world.m_textures.get(), texture);
+    }
+    for (int i = 0; i < 50; ++i)
+        world.m_spheres.push_back(Sphere(Vector3D(random_float(-8, 8), 0.5, random_float(-8, 8)), 0.5, materials[0]));
+    world.m_planes.push_back(Plane(Vector3D(0, 0, 0), Vector3D(0, 1, 0), materials[1]));
+    world.build_accelerator(Accelerator::BVH);
+
+    Camera camera(Vector3D(12, 3, 9), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 30, 16 / 9.0f);
+    RenderSettings settings;
+    settings.m_width = 320;
+    settings.m_height = 180;
+    settings.m_raysPerPixel = 16;
+    bool modes[2] = { false, true };
+    for (bool cones : modes)
+    {
+        TextureCache& textures = world.textures();
+        textures.m_useRayCones = cones;
+        textures.m_tileHits = 0;
+        textures.m_tileLoads = 0;
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        std::cout << "  " << (cones ? "ray cones" : "finest level") << ": " << renderer.m_seconds * 1000.0 << " ms, "
+                  << textures.m_tileLoads << " tile loads, " << textures.m_tileHits << " shared cache hits, "
+                  << (textures.resident_bytes() >> 20) << " MB resident" << std::endl;
+    }
+}
+
+// pixels of a that differ from b
+int pixels_differing(Renderer& a, Renderer& b)
+{
+    int count = 0;
+    for (int j = 0; j < a.m_settings.m_height; ++j)
+    {
+        for (int i = 0; i < a.m_settings.m_width; ++i)
+        {
+            Vector3D d = a.pixel(i, j) - b.pixel(i, j);
+            count += d.length_squared() > 0;
+        }
+    }
+    return count;
+}
+
+// path tracing against the irradiance cache on the diffuse scenes under the
+// sky, and on the diffuse spheres shut in a room lit by one glowing sphere
+// (long interreflection paths). rms error against a 16 times longer path
+// traced render; path tracing also runs at 4 times the samples, to compare at
+// equal error. Each time the fastest of 3 runs
+void bench_irradiance(int samples)
+{
+    std::cout << "irradiance cache, " << samples << " samples per pixel" << std::endl;
+
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    RenderSettings settings;
+    settings.m_width = 192;
+    settings.m_height = 108;
+
+    const char* scenes[] = { "multi_diffuse", "all", "room" };
+    for (const char* scene : scenes)
+    {
+        World world;
+        seed_random(3);
+        if (std::string(scene) == "all")
+        {
+            world.generate_scene_all();
+        }
+        else
+        {
+            world.generate_scene_multi_diffuse();
+        }
+        if (std::string(scene) == "room")
+        {
+            int wall = world.add_material<Diffuse>(Vector3D(0.7, 0.7, 0.7));
+            world.m_planes.push_back(Plane(Vector3D(0, 6, 0), Vector3D(0, -1, 0), wall));
+            world.m_planes.push_back(Plane(Vector3D(-12, 0, 0), Vector3D(1, 0, 0), wall));
+            world.m_planes.push_back(Plane(Vector3D(24, 0, 0), Vector3D(-1, 0, 0), wall));
+            world.m_planes.push_back(Plane(Vector3D(0, 0, -12), Vector3D(0, 0, 1), wall));
+            world.m_planes.push_back(Plane(Vector3D(0, 0, 12), Vector3D(0, 0, -1), wall));
+            world.m_spheres.push_back(Sphere(Vector3D(0, 5, 0), 0.5f, world.add_material<Emissive>(Vector3D(80, 76, 70))));
+            world.m_background = Vector3D(0, 0, 0);
+        }
+        world.build_accelerator(Accelerator::BVH);
+
+        settings.m_raysPerPixel = samples * 16;
+        Renderer reference(settings);
+        reference.render(world, camera);
+
+        // path traced at 1 and 4 times the samples, then the cache at two accuracies
+        const float accuracies[4] = { 0, 0, 0.25f, 0.4f };
+        const int spp[4] = { samples, samples * 4, samples, samples };
+        for (int v = 0; v < 4; ++v)
+        {
+            float accuracy = accuracies[v];
+            settings.m_raysPerPixel = spp[v];
+            // a fresh cache each run, so every run builds its records
+            double best = 1e30;
+            double error = 0;
+            int records = 0;
+            for (int run = 0; run < 3; ++run)
+            {
+                world.m_irradianceCache.reset();
+                if (accuracy > 0)
+                    world.enable_irradiance_cache(accuracy);
+                Renderer renderer(settings);
+                renderer.render(world, camera);
+                best = std::min(best, renderer.m_seconds);
+                error = render_error(renderer, reference);
+                records = accuracy > 0 ? world.m_irradianceCache->record_count() : 0;
+            }
+            std::cout << "  " << scene << ", ";
+            if (accuracy > 0)
+                std::cout << "cache a=" << accuracy << " (" << records << " records)";
+            else
+                std::cout << "path traced, " << spp[v] << " spp";
+            std::cout << ": " << best * 1000.0 << " ms, rms error " << error << std::endl;
+        }
+        world.m_irradianceCache.reset();
+    }
+}
+
+// spheres under a wide low slab: the sky only reaches them through the thin
+// gap at its edges, which cosine-weighted bounces rarely find
+void bench_guiding(int samples)
+{
+    std::cout << "path guiding, light through a gap, " << samples << " samples per pixel" << std::endl;
+
+    World world;
+    seed_random(3);
+    world.generate_scene_multi_diffuse();
+    world.m_boxes.push_back(Box(Vector3D(-12, 1.8f, -12), Vector3D(12, 2.0f, 12), world.add_material<Diffuse>(Vector3D(0.7, 0.7, 0.7))));
+    world.build_accelerator(Accelerator::BVH);
+    Camera camera(Vector3D(9, 1.0f, 2), Vector3D(0, 0.5f, 0), Vector3D(0, 1, 0), 40, 16 / 9.0f);
+    RenderSettings settings;
+    settings.m_width = 160;
+    settings.m_height = 90;
+    settings.m_maxLightBounceNum = 8;
+
+    // the baseline keeps the guide but never samples from it: Diffuse::reflect
+    // isn't exactly cosine weighted, so it would converge to a different image
+    world.enable_path_guiding();
+    world.m_pathGuide->m_bsdfFraction = 1;
+    settings.m_raysPerPixel = samples * 16;
+    Renderer reference(settings);
+    reference.render(world, camera);
+
+    settings.m_raysPerPixel = samples;
+    bool modes[2] = { false, true };
+    for (bool guided : modes)
+    {
+        world.m_pathGuide->m_bsdfFraction = guided ? 0.5f : 1;
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        std::cout << "  " << (guided ? "guided" : "cosine bounces") << ": " << renderer.m_seconds * 1000.0
+                  << " ms, rms error " << render_error(renderer, reference);
+        if (guided)
+            std::cout << ", " << world.m_pathGuide->leaf_count() << " regions, "
+                      << world.m_pathGuide->memory_bytes() / 1024 << " KB, " << renderer.m_guideIterations
+                      << " training passes refined in " << renderer.m_guideSeconds * 1000.0 << " ms";
+        std::cout << std::endl;
+    }
+    world.m_pathGuide.reset();
+}
+
+// the diffuse spheres at night, lit only by small glowing spheres of a fixed
+// total power hanging above the frame (lights in view and mirrors reflecting
+// them are noisy whatever the light sampling). With the light tree the noise
+// should hardly grow with the number of lights
+void bench_lights(int samples)
+{
+    std::cout << "light tree, " << samples << " samples per pixel, rms error relative to the mean" << std::endl;
+
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    RenderSettings settings;
+    settings.m_width = 128;
+    settings.m_height = 72;
+
+    int light_counts[5] = { 10, 100, 1000, 10000, 100000 };
+    for (int light_count : light_counts)
+    {
+        World world;
+        seed_random(3);
+        world.generate_scene_multi_diffuse();
+        world.m_background = Vector3D(0, 0, 0);
+        for (int i = 0; i < light_count; ++i)
+        {
+            Vector3D center(random_float(-10, 10), random_float(8.0, 12.0), random_float(-10, 10));
+            int material = world.add_material<Emissive>((125000.0f / light_count) * Vector3D(1.0, 0.85, 0.6));
+            world.m_spheres.push_back(Sphere(center, 0.02f, material));
+        }
+        world.build_accelerator(Accelerator::BVH);
+
+        world.m_lights.m_uniform = false;
+        settings.m_raysPerPixel = samples * 16;
+        Renderer reference(settings);
+        reference.render(world, camera);
+        double mean = 0;
+        for (int j = 0; j < settings.m_height; ++j)
+            for (int i = 0; i < settings.m_width; ++i)
+                mean += reference.pixel(i, j).length() / settings.m_raysPerPixel;
+        mean /= settings.m_width * settings.m_height;
+
+        settings.m_raysPerPixel = samples;
+        std::cout << "  " << light_count << " lights:";
+        bool modes[2] = { true, false };
+        for (bool uniform : modes)
+        {
+            world.m_lights.m_uniform = uniform;
+            Renderer renderer(settings);
+            renderer.render(world, camera);
+            std::cout << (uniform ? " uniform " : ", tree ") << render_error(renderer, reference) / mean << " ("
+                      << renderer.m_seconds * 1000.0 << " ms)";
+        }
+        std::cout << std::endl;
+    }
+}
+
+// move one sphere of the showcase scene and splice re-rendered tiles into the
+// old image, checked against a full render of the edited scene. With lamp the
+// scene is lit at night by one glowing sphere off to the side, so the moved
+// sphere's shadow falls on tiles it isn't seen in or reflected by
+void bench_incremental(bool lamp)
+{
+    std::cout << "incremental re-render, one sphere moved" << (lamp ? ", lit by a lamp" : "") << std::endl;
+
+    World world;
+    seed_random(3);
+    world.generate_scene_all();
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    RenderSettings settings;
+    settings.m_width = 384;
+    settings.m_height = 216;
+    settings.m_raysPerPixel = 16;
+    settings.m_recordTouched = true;
+
+    // the largest sphere in view
+    int sphere = 0;
+    for (int s = 0; s < (int)world.m_spheres.size(); ++s)
+    {
+        float col, row;
+        if (camera.project(world.m_spheres[s].m_center, col, row) && col > 0.2f && col < 0.8f && row > 0.2f &&
+            row < 0.8f && world.m_spheres[s].m_radius > world.m_spheres[sphere].m_radius)
+            sphere = s;
+    }
+    if (lamp)
+    {
+        world.m_background = Vector3D(0, 0, 0);
+        Vector3D center = world.m_spheres[sphere].m_center + Vector3D(-1, 3, 4);
+        world.m_spheres.push_back(Sphere(center, 0.5f, world.add_material<Emissive>(Vector3D(40, 36, 30))));
+    }
+    world.build_accelerator(Accelerator::BVH);
+
+    Renderer incremental(settings);
+    incremental.render(world, camera);
+    double full_seconds = incremental.m_seconds;
+
+    AABB old_bounds = world.m_spheres[sphere].bounds();
+    world.m_spheres[sphere].m_center += Vector3D(0, 0, 0.6);
+    world.build_accelerator(Accelerator::BVH);
+
+    Renderer reference(settings);
+    reference.render(world, camera);
+
+    int tile_count = ((settings.m_width + 31) / 32) * ((settings.m_height + 31) / 32);
+    std::vector<int> projected = incremental.tiles_in_projection(camera, old_bounds);
+    std::vector<int> more = incremental.tiles_in_projection(camera, world.m_spheres[sphere].bounds());
+    projected.insert(projected.end(), more.begin(), more.end());
+    std::sort(projected.begin(), projected.end());
+    projected.erase(std::unique(projected.begin(), projected.end()), projected.end());
+    std::vector<int> affected = incremental.tiles_affected_by(camera, world, sphere, old_bounds);
+
+    // tiles the edit changed at all, and how many of them each dirty set misses
+    std::vector<int> changed;
+    int size = settings.m_tileSize;
+    int tiles_x = (settings.m_width + size - 1) / size;
+    for (int j = 0; j < settings.m_height; ++j)
+        for (int i = 0; i < settings.m_width; ++i)
+            if ((incremental.pixel(i, j) - reference.pixel(i, j)).length_squared() > 0)
+                changed.push_back((j / size) * tiles_x + i / size);
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    auto missed = [&](const std::vector<int>& dirty) {
+        int count = 0;
+        for (int t : changed)
+            count += !std::binary_search(dirty.begin(), dirty.end(), t);
+        return count;
+    };
+    std::cout << "  " << changed.size() << "/" << tile_count << " tiles changed" << std::endl;
+
+    // the same old image again, patched using the projections alone
+    Renderer projection_only(settings);
+    World before(world);
+    before.m_spheres[sphere].m_center = old_bounds.center();
+    before.build_accelerator(Accelerator::BVH);
+    projection_only.render(before, camera);
+    projection_only.rerender(world, camera, projected);
+    std::cout << "  projection only: " << projected.size() << "/" << tile_count << " tiles, "
+              << projection_only.m_seconds * 1000.0 << " ms, " << missed(projected) << " changed tiles missed, "
+              << pixels_differing(projection_only, reference) << " pixels differ from a full render" << std::endl;
+
+    incremental.rerender(world, camera, affected);
+    std::cout << "  with touched spheres: " << affected.size() << "/" << tile_count << " tiles, "
+              << incremental.m_seconds * 1000.0 << " ms, " << missed(affected) << " changed tiles missed, "
+              << pixels_differing(incremental, reference) << " pixels differ from a full render" << std::endl;
+    std::cout << "  full render: " << full_seconds * 1000.0 << " ms" << std::endl;
+}
+
+// the vector operations shading leans on, over arrays of V: normalize, dot, cross
+template <typename V>
+double time_vector_ops(const std::vector<V>& a, const std::vector<V>& b, float& checksum)
+{
+    auto start = std::chrono::steady_clock::now();
+    float sum = 0;
+    for (int pass = 0; pass < 10; ++pass)
+    {
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            V n = normalize(a[i]);
+            sum += dot(n, b[i]) + cross(n, b[i]).length_squared();
+        }
+    }
+    checksum = sum;
+    return seconds_since(start);
+}
+
+// one ray against every sphere center in c, how many it hits
+template <typename V>
+int count_sphere_hits(const std::vector<V>& c, float radius, const V& origin, const V& dir)
+{
+    int hits = 0;
+    for (size_t i = 0; i < c.size(); ++i)
+    {
+        V oc = origin - c[i];
+        float b = dot(oc, dir);
+        hits += b * b - dot(oc, oc) + radius * radius > 0;
+    }
+    return hits;
+}
+
+// the same eight spheres at a time
+int count_sphere_hits_x8(const std::vector<Vec3A>& c, float radius, const Vec3A& origin, const Vec3A& dir)
+{
+    Vec3x8 origins(origin);
+    Vec3x8 dirs(dir);
+    Float8 radius_squared(radius * radius);
+    int hits = 0;
+    for (size_t i = 0; i + 8 <= c.size(); i += 8)
+    {
+        Vec3x8 oc = origins - Vec3x8::load(&c[i]);
+        Float8 b = dot(oc, dirs);
+        hits += __builtin_popcount(greater_mask(b * b + radius_squared, dot(oc, oc)));
+    }
+    return hits;
+}
+
+// the scalar Vec3 against the SSE/NEON Vec3A and the eight-wide Vec3x8
+void bench_vectors(int count)
+{
+    std::cout << "vectors, " << count << " elements, Vec3A is " << sizeof(Vec3A) << " bytes aligned to "
+              << alignof(Vec3A) << std::endl;
+
+    std::vector<Vec3> a(count), b(count);
+    std::vector<Vec3A> a4(count), b4(count);
+    for (int i = 0; i < count; ++i)
+    {
+        a[i] = Vec3::random(-1, 1);
+        b[i] = Vec3::random(-1, 1);
+        a4[i] = Vec3A(a[i].m_x, a[i].m_y, a[i].m_z);
+        b4[i] = Vec3A(b[i].m_x, b[i].m_y, b[i].m_z);
+    }
+
+    // fast normalize against the exact one
+    float worst = 0;
+    for (int i = 0; i < count; ++i)
+        worst = fmaxf(worst, fabsf(normalize(a4[i]).length() - 1));
+    std::cout << "  Vec3A normalize: largest length error " << worst << std::endl;
+
+    float sum, sum4;
+    double scalar = time_vector_ops(a, b, sum);
+    double simd = time_vector_ops(a4, b4, sum4);
+    std::cout << "  normalize/dot/cross: Vec3 " << scalar * 1000.0 << " ms, Vec3A " << simd * 1000.0
+              << " ms (checksums " << sum << ", " << sum4 << ")" << std::endl;
+
+    Vec3 origin(0, 0, -3);
+    Vec3 dir = normalize(Vec3(0.1f, 0.05f, 1));
+    Vec3A origin4(origin.m_x, origin.m_y, origin.m_z);
+    Vec3A dir4(dir.m_x, dir.m_y, dir.m_z);
+    int hits[3] = { 0, 0, 0 };
+    double times[3];
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < 10; ++pass)
+        hits[0] += count_sphere_hits(a, 0.1f, origin, dir);
+    times[0] = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < 10; ++pass)
+        hits[1] += count_sphere_hits(a4, 0.1f, origin4, dir4);
+    times[1] = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < 10; ++pass)
+        hits[2] += count_sphere_hits_x8(a4, 0.1f, origin4, dir4);
+    times[2] = seconds_since(start);
+    std::cout << "  ray vs spheres: Vec3 " << times[0] * 1000.0 << " ms, Vec3A " << times[1] * 1000.0 << " ms, Vec3x8 "
+              << times[2] * 1000.0 << " ms (hits " << hits[0] << ", " << hits[1] << ", " << hits[2] << ")" << std::endl;
+}
+
+// a procedural sphere field against the same spheres stored in a BVH, then the
+// field grown to billions of cells
+void bench_lattice(int half_extent)
+{
+    int side = 2 * half_extent;
+    std::cout << "procedural lattice, " << side << " x " << side << " cells" << std::endl;
+
+    World procedural;
+    std::vector<int> palette;
+    for (int k = 0; k < 16; ++k)
+        palette.push_back(procedural.add_material<Diffuse>(Vector3D::random()));
+    procedural.m_lattices.push_back(SphereLattice(1.5f, half_extent, 1, 0, palette));
+
+    // the same spheres, made up front (traversal never looks at the materials)
+    World stored;
+    auto start = std::chrono::steady_clock::now();
+    Sphere sphere;
+    for (int x = 0; x < side; ++x)
+        for (int z = 0; z < side; ++z)
+            if (procedural.m_lattices[0].instance(x, 0, z, sphere))
+                stored.m_spheres.push_back(sphere);
+    stored.build_bvh();
+    double build = seconds_since(start);
+    size_t stored_bytes = stored.m_spheres.size() * sizeof(Sphere) + stored.m_bvh.m_nodes.size() * sizeof(BVHNode) +
+                          stored.m_bvh.m_indices.size() * sizeof(int);
+    std::cout << "  stored: " << stored.m_spheres.size() << " spheres, " << stored_bytes / 1024 << " KiB, build "
+              << build * 1000.0 << " ms, traversal " << time_traversal(stored, 200000) * 1000.0 << " ms" << std::endl;
+    std::cout << "  procedural: " << sizeof(SphereLattice) << " bytes, traversal "
+              << time_traversal(procedural, 200000) * 1000.0 << " ms" << std::endl;
+
+    // both must see the same spheres
+    Camera camera(Vector3D(20, 3, 3), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 20, 16 / 9.0f);
+    seed_random(7);
+    int mismatches = 0;
+    for (int i = 0; i < 20000; ++i)
+    {
+        Ray r = camera.generate_ray(random_float(), random_float());
+        HitResult a = stored.hit(r, 0.001, std::numeric_limits<float>::infinity());
+        HitResult b = procedural.hit(r, 0.001, std::numeric_limits<float>::infinity());
+        mismatches += a.m_isHit != b.m_isHit || (a.m_isHit && fabsf(a.m_t - b.m_t) > 1e-3f * a.m_t);
+    }
+    // the few that do are grazing hits far from the camera, where the stored
+    // spheres' quadratic is the one that disagrees with a double precision test
+    std::cout << "  rays that disagree: " << mismatches << "/20000" << std::endl;
+
+    World field;
+    field.m_lattices.push_back(SphereLattice(1.5f, 1 << 15, 1, 0, palette));
+    std::cout << "  " << field.m_lattices[0].cell_count() / 1e9 << " billion cells: traversal "
+              << time_traversal(field, 200000) * 1000.0 << " ms" << std::endl;
+}
+
+// a quarter turntable of the showcase scene: once the way separate runs would
+// do it (scene and BVH rebuilt for every frame, each frame written before the
+// next starts), then as one sequence, then with temporal reuse at a quarter
+// of the samples (and without it, for comparison). The last frame of each is
+// compared against a long render.
+void bench_sequence(int frames, int samples)
+{
+    std::cout << "sequence, " << frames << " frames at " << samples << " samples per pixel" << std::endl;
+
+    RenderSettings settings;
+    settings.m_width = 256;
+    settings.m_height = 144;
+    settings.m_raysPerPixel = samples;
+    float aspect_ratio = settings.m_width / float(settings.m_height);
+    CameraPath path = CameraPath::turntable(Vector3D(0, 0, 0), 19.9f, 3, 20);
+    SequenceSettings sequence_settings;
+    sequence_settings.m_frameCount = frames;
+    sequence_settings.m_endTime = 0.25f;
+    std::string pattern = (std::filesystem::temp_directory_path() / "sequence_%04d.ppm").string();
+    sequence_settings.m_outputPattern = pattern;
+
+    World world;
+    Camera last = path.at(sequence_settings.m_endTime, aspect_ratio);
+    RenderSettings reference_settings = settings;
+    reference_settings.m_raysPerPixel = samples * 16;
+    seed_random(5);
+    world.generate_scene_all();
+    world.build_accelerator(Accelerator::BVH);
+    Renderer reference(reference_settings);
+    reference.render(world, last);
+    // rms difference of a frame's radiance from the reference
+    auto frame_error = [&](const std::vector<Vector3D>& frame) {
+        double sum = 0;
+        for (int j = 0; j < settings.m_height; ++j)
+            for (int i = 0; i < settings.m_width; ++i)
+                sum += (frame[j * settings.m_width + i] - reference.pixel(i, j) / reference_settings.m_raysPerPixel).length_squared();
+        return sqrt(sum / (settings.m_width * settings.m_height));
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Vector3D> frame(settings.m_width * settings.m_height);
+    for (int f = 0; f < frames; ++f)
+    {
+        seed_random(5);
+        world.generate_scene_all();
+        world.build_accelerator(Accelerator::BVH);
+        Camera camera = path.at(sequence_settings.m_endTime * f / (frames - 1), aspect_ratio);
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        for (int j = 0; j < settings.m_height; ++j)
+            for (int i = 0; i < settings.m_width; ++i)
+                frame[j * settings.m_width + i] = renderer.pixel(i, j) / renderer.sample_count(i, j);
+        char file[1024];
+        snprintf(file, sizeof(file), pattern.c_str(), f);
+        write_ppm(file, settings.m_width, settings.m_height, frame);
+    }
+    std::cout << "  separate frames: " << seconds_since(start) << " s, last frame rms " << frame_error(frame) << std::endl;
+
+    SequenceRenderer sequence(settings, sequence_settings);
+    sequence.render(world, path);
+    std::cout << "  sequence: " << sequence.m_seconds << " s (" << sequence.m_writeSeconds
+              << " s of writing overlapped), last frame rms " << frame_error(sequence.m_frame) << std::endl;
+
+    // what a quarter of the samples gives without reuse
+    SequenceRenderer quarter(settings, sequence_settings);
+    quarter.m_renderSettings.m_raysPerPixel = samples / 4;
+    quarter.render(world, path);
+    std::cout << "  quarter samples: " << quarter.m_seconds << " s, last frame rms " << frame_error(quarter.m_frame) << std::endl;
+
+    sequence.m_settings.m_temporalReuse = true;
+    sequence.m_settings.m_reuseSamples = samples / 4;
+    sequence.render(world, path);
+    std::cout << "  temporal reuse: " << sequence.m_seconds << " s, " << sequence.m_reusedFraction * 100
+              << "% of pixels reprojected, last frame rms " << frame_error(sequence.m_frame) << std::endl;
+}
+
+void bench_batch(int samples)
+{
+    std::cout << "batch, 6 scenes at 2 resolutions, " << samples << " samples per pixel" << std::endl;
+
+    const char* scenes[] = { "one_diffuse", "multi_specular", "all", "mixed", "lights:100", "sphere_field:1024" };
+    std::vector<BatchJob> jobs;
+    for (const char* scene : scenes)
+    {
+        for (int scale = 1; scale <= 2; ++scale)
+        {
+            BatchJob job;
+            job.m_scene = scene;
+            job.m_width = 192 * scale;
+            job.m_height = 108 * scale;
+            job.m_raysPerPixel = samples;
+            std::string name = std::string("batch_") + scene + "_" + std::to_string(job.m_width) + ".ppm";
+            std::replace(name.begin(), name.end(), ':', '_');
+            job.m_output = (std::filesystem::temp_directory_path() / name).string();
+            jobs.push_back(job);
+        }
+    }
+    // the last job is wanted first
+    jobs.back().m_priority = 1;
+
+    // what running the jobs one after another does: every job builds its scene and renders alone
+    RenderSettings settings;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> separate;
+    for (const BatchJob& job : jobs)
+    {
+        World world;
+        build_batch_scene(world, job);
+        settings.m_width = job.m_width;
+        settings.m_height = job.m_height;
+        settings.m_raysPerPixel = job.m_raysPerPixel;
+        Camera camera(job.m_eye, job.m_target, Vector3D(0, 1, 0), job.m_fov, job.m_width / float(job.m_height));
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        std::vector<Vector3D> image(job.m_width * job.m_height);
+        for (int j = 0; j < job.m_height; ++j)
+            for (int i = 0; i < job.m_width; ++i)
+                image[j * job.m_width + i] = renderer.pixel(i, j) / renderer.sample_count(i, j);
+        std::string path = job.m_output + ".separate.ppm";
+        write_ppm(path, job.m_width, job.m_height, image);
+        separate.push_back(path);
+    }
+    double separate_seconds = seconds_since(start);
+    std::cout << "  back to back: " << separate_seconds << " s" << std::endl;
+
+    BatchRenderer batch(settings);
+    batch.m_verbose = false;
+    batch.render(jobs);
+    auto contents = [](const std::string& path) {
+        std::ifstream in(path);
+        std::stringstream text;
+        text << in.rdbuf();
+        return text.str();
+    };
+    int identical = 0;
+    for (size_t j = 0; j < jobs.size(); ++j)
+    {
+        identical += contents(jobs[j].m_output) == contents(separate[j]);
+        std::filesystem::remove(separate[j]);
+    }
+    std::cout << "  batch: " << batch.m_seconds << " s (" << separate_seconds / batch.m_seconds << "x), "
+              << batch.m_sceneCount << " scenes built in " << batch.m_sceneSeconds * 1000.0 << " ms, priority job done at "
+              << jobs.back().m_seconds << " s, " << identical << " of " << jobs.size() << " images identical" << std::endl;
+}
+
+void bench_preview(int moves)
+{
+    std::cout << "preview, " << moves << " camera moves at 768x540" << std::endl;
+
+    World world;
+    seed_random(1);
+    world.generate_scene_all();
+    world.build_accelerator(Accelerator::BVH);
+    PreviewSettings settings;
+    float aspect_ratio = settings.m_width / float(settings.m_height);
+    CameraPath path = CameraPath::turntable(Vector3D(0, 0, 0), 20.2f, 3, 20);
+
+    // first image of every new view, from coarse blocks and at full resolution straight away
+    for (int start_scale : { 8, 1 })
+    {
+        settings.m_startScale = start_scale;
+        ProgressiveRenderer preview(world, path.at(0, aspect_ratio), settings);
+        preview.start();
+        double sum = 0, worst = 0;
+        for (int m = 1; m <= moves; ++m)
+        {
+            preview.set_camera(path.at(0.25f * m / moves, aspect_ratio));
+            while (preview.first_image_seconds() == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            sum += preview.first_image_seconds();
+            worst = std::max(worst, preview.first_image_seconds());
+        }
+        auto start = std::chrono::steady_clock::now();
+        long long rays = preview.m_rayCount;
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        std::cout << "  blocks of " << start_scale << ": first image after " << sum / moves * 1000.0 << " ms on average, "
+                  << worst * 1000.0 << " ms at most; " << preview.samples_per_pixel() << " spp after 2 s, "
+                  << (preview.m_rayCount - rays) / seconds_since(start) / 1e6 << " Mrays/s" << std::endl;
+    }
+}
+
+void bench_kernels(int samples)
+{
+    std::cout << "specialized path kernels against ray_hit_color(), " << samples
+              << " samples per pixel, fastest of alternating runs, at least 3 and 2 s each" << std::endl;
+    const char* scenes[] = { "one_diffuse", "multi_diffuse", "multi_specular", "all", "mixed" };
+    for (const char* scene : scenes)
+    {
+        BatchJob job;
+        job.m_scene = scene;
+        World world;
+        build_batch_scene(world, job);
+        Camera camera(job.m_eye, job.m_target, Vector3D(0, 1, 0), job.m_fov, 16 / 9.0f);
+        RenderSettings settings;
+        settings.m_width = 384;
+        settings.m_height = 216;
+        settings.m_raysPerPixel = samples;
+
+        // the two alternate, so a slow phase of the machine hits both alike
+        double best[2] = { 1e30, 1e30 };
+        double total[2] = { 0, 0 };
+        std::vector<Vector3D> images[2];
+        std::string kernel;
+        for (int run = 0; run < 6 || std::min(total[0], total[1]) < 2; ++run)
+        {
+            int k = run % 2;
+            settings.m_specializeKernels = k == 1;
+            Renderer renderer(settings);
+            renderer.render(world, camera);
+            best[k] = std::min(best[k], renderer.m_seconds);
+            total[k] += renderer.m_seconds;
+            kernel = k == 1 ? renderer.m_kernel.m_name : kernel;
+            images[k].clear();
+            for (int j = 0; j < settings.m_height; ++j)
+                for (int i = 0; i < settings.m_width; ++i)
+                    images[k].push_back(renderer.pixel(i, j));
+        }
+        bool identical = true;
+        for (size_t p = 0; p < images[0].size(); ++p)
+            identical = identical && images[0][p].m_x == images[1][p].m_x && images[0][p].m_y == images[1][p].m_y &&
+                        images[0][p].m_z == images[1][p].m_z;
+        std::cout << "  " << scene << " (" << kernel << "): generic " << best[0] * 1000.0 << " ms, kernel "
+                  << best[1] * 1000.0 << " ms (" << best[0] / best[1] << "x), images "
+                  << (identical ? "identical" : "DIFFER") << std::endl;
+    }
+}
+
+// the tracing side of the hybrid renderer (hybrid.cpp): paths starting from a
+// G-buffer against the plain tracer. The G-buffer is traced on the cpu here,
+// hybrid.cpp rasterizes it instead and reports that time.
+void bench_hybrid(int samples)
+{
+    std::cout << "paths from a 4 pass G-buffer against tracing camera rays, " << samples << " samples per pixel, best of 3"
+              << std::endl;
+    const char* scenes[] = { "all", "mixed", "lights" };
+    for (const char* scene : scenes)
+    {
+        BatchJob job;
+        job.m_scene = scene;
+        World world;
+        build_batch_scene(world, job);
+        Camera camera(job.m_eye, job.m_target, Vector3D(0, 1, 0), job.m_fov, 16 / 9.0f);
+        RenderSettings settings;
+        settings.m_width = 384;
+        settings.m_height = 216;
+        settings.m_raysPerPixel = samples;
+
+        GBuffer gbuffer;
+        gbuffer.resize(settings.m_width, settings.m_height, 4);
+        auto start = std::chrono::steady_clock::now();
+        trace_gbuffer(world, camera, gbuffer);
+        double gbuffer_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double best[2] = { 1e30, 1e30 };
+        long long rays[2] = { 0, 0 };
+        for (int run = 0; run < 6; ++run)
+        {
+            int k = run % 2;
+            Renderer renderer(settings);
+            renderer.m_primaryHits = k == 1 ? &gbuffer : nullptr;
+            renderer.render(world, camera);
+            best[k] = std::min(best[k], renderer.m_seconds);
+            rays[k] = renderer.m_rayCount;
+        }
+        std::cout << "  " << scene << ": traced " << best[0] * 1000.0 << " ms, from the G-buffer " << best[1] * 1000.0
+                  << " ms (" << best[0] / best[1] << "x), " << rays[1] << " of " << rays[0] << " rays; G-buffer traced in "
+                  << gbuffer_seconds * 1000.0 << " ms" << std::endl;
+    }
+}
+
+// rippled square terrain of 2 * grid^2 triangles over [-10, 10]^2, written as an obj
+void write_terrain_obj(const std::string& path, int grid)
+{
+    std::ofstream out(path);
+    for (int j = 0; j <= grid; ++j)
+    {
+        for (int i = 0; i <= grid; ++i)
+        {
+            float x = -10 + 20.0f * i / grid;
+            float z = -10 + 20.0f * j / grid;
+            out << "v " << x << ' ' << 0.6f * sinf(2 * x) * cosf(3 * z) + 0.2f * sinf(17 * x + 11 * z) << ' ' << z << '\n';
+        }
+    }
+    for (int j = 0; j < grid; ++j)
+    {
+        for (int i = 0; i < grid; ++i)
+        {
+            int a = j * (grid + 1) + i + 1;
+            out << "f " << a << ' ' << a + 1 << ' ' << a + grid + 2 << ' ' << a + grid + 1 << '\n';
+        }
+    }
+}
+
+void bench_out_of_core(int grid, int cache_fraction)
+{
+    std::cout << "out-of-core mesh, " << 2.0 * grid * grid / 1e6 << "M triangles, cache of 1/" << cache_fraction
+              << " of the mesh" << std::endl;
+    std::string obj = (std::filesystem::temp_directory_path() / "terrain.obj").string();
+    std::string chunks = (std::filesystem::temp_directory_path() / "terrain.chunks").string();
+    write_terrain_obj(obj, grid);
+    ChunkedMeshBuilder builder;
+    builder.m_chunkTriangles = 1 << 14;
+    auto start = std::chrono::steady_clock::now();
+    if (!builder.build(obj, chunks))
+    {
+        std::cout << "  " << builder.m_error << std::endl;
+        return;
+    }
+    std::cout << "  preprocessed into " << builder.m_chunkCount << " chunks, " << builder.m_fileBytes / (1 << 20)
+              << " MiB, in " << seconds_since(start) << " s" << std::endl;
+    std::filesystem::remove(obj);
+
+    RenderSettings settings;
+    settings.m_width = 256;
+    settings.m_height = 144;
+    settings.m_raysPerPixel = 32;
+    Camera camera(Vector3D(0, 4, 13), Vector3D(0, 0, 0), Vector3D(0, 1, 0), 40, 16 / 9.0f);
+    auto render = [&](uint64_t budget, bool batched, std::vector<Vector3D>& image) {
+        World world;
+        world.add_mesh(chunks, world.add_material<Diffuse>(Vector3D(0.6, 0.5, 0.4)), budget);
+        settings.m_batchMeshRays = batched;
+        Renderer renderer(settings);
+        renderer.render(world, camera);
+        image.resize(settings.m_width * settings.m_height);
+        for (int j = 0; j < settings.m_height; ++j)
+            for (int i = 0; i < settings.m_width; ++i)
+                image[j * settings.m_width + i] = renderer.pixel(i, j) / renderer.sample_count(i, j);
+        ChunkCache& cache = world.m_meshes[0]->cache();
+        std::cout << renderer.m_seconds << " s, " << cache.m_pageIns << " page-ins, " << cache.m_bytesRead / (1 << 20)
+                  << " MiB read, peak " << cache.m_peakBytes / (1 << 20) << " MiB resident" << std::endl;
+#ifdef TRACE_STATS
+        // both tracers have to fill in the cost image
+        Vector3D cost(0, 0, 0);
+        for (int j = 0; j < settings.m_height; ++j)
+            for (int i = 0; i < settings.m_width; ++i)
+                cost += renderer.pixel_cost(i, j);
+        long long samples = static_cast<long long>(settings.m_width) * settings.m_height * settings.m_raysPerPixel;
+        std::cout << "    per sample: " << cost.m_x / samples << " primitive tests, " << cost.m_y / samples
+                  << " node visits, " << cost.m_z / samples << " bounces"
+                  << (cost.m_x > 0 && cost.m_z > 0 ? "" : " (EMPTY cost image)") << std::endl;
+#endif
+    };
+
+    std::vector<Vector3D> resident, single, batched;
+    std::cout << "  whole mesh cached: ";
+    render(builder.m_fileBytes, true, resident);
+    std::cout << "  bounded, ray by ray: ";
+    render(builder.m_fileBytes / cache_fraction, false, single);
+    std::cout << "  bounded, batched per chunk: ";
+    render(builder.m_fileBytes / cache_fraction, true, batched);
+    // hits don't depend on what was cached, so the batched images must match exactly
+    bool identical = true;
+    for (size_t p = 0; p < resident.size(); ++p)
+        identical = identical && batched[p].m_x == resident[p].m_x && batched[p].m_y == resident[p].m_y &&
+                    batched[p].m_z == resident[p].m_z;
+    std::cout << "  bounded batched image " << (identical ? "identical to" : "DIFFERS from")
+              << " the fully cached one" << std::endl;
+    std::filesystem::remove(chunks);
+}
+
+int main()
+{
+    bench_arena(1000000, 200);
+    bench_numa();
+    bench_dynamic(100000, 30);
+    bench_builders(1000000);
+    bench_bvh8(1000000);
+    bench_accelerators(100000);
+    bench_occlusion(100000, 200000);
+    bench_environment(16);
+    bench_textures(4096, 8 << 20);
+    bench_incremental(false);
+    bench_incremental(true);
+    bench_irradiance(16);
+    bench_guiding(64);
+    bench_lights(8);
+    bench_vectors(4000000);
+    bench_lattice(500);
+    bench_sequence(24, 64);
+    bench_batch(16);
+    bench_preview(20);
+    bench_kernels(16);
+    bench_out_of_core(1000, 4);
+    bench_hybrid(16);
+}
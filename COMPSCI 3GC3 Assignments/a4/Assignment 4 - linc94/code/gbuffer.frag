@@ -0,0 +1,103 @@
+#version 330 core
+
+// the G-buffer texel of a primitive: its hit along the pixel's (jittered) ray,
+// the ray camera.generate_ray() makes for the pixel, with the same
+// intersection tests as Sphere.h, Plane.h, Box.h and Disk.h (plane and disk
+// normals facing the ray). Depth is the ray's t, so the closest primitive wins.
+uniform vec3 eye;
+// direction for (col, row) = (0, 0), and its change over the image
+uniform vec3 rayCorner;
+uniform vec3 rayRight;
+uniform vec3 rayUp;
+uniform vec2 jitter;
+// 1 / (width - 1), 1 / (height - 1)
+uniform vec2 pixelStep;
+
+flat in vec4 Shape;
+flat in vec4 Shape2;
+flat in vec3 Ids;
+flat in vec3 Albedo;
+
+// position and primitive index, normal and material, albedo and kind (see GBuffer.h)
+layout (location = 0) out vec4 Position;
+layout (location = 1) out vec4 Normal;
+layout (location = 2) out vec4 AlbedoKind;
+
+const float min_t = 0.001;
+
+void main()
+{
+    vec2 colRow = (floor(gl_FragCoord.xy) + jitter) * pixelStep;
+    vec3 dir = rayCorner + colRow.x * rayRight + colRow.y * rayUp;
+    int kind = int(Ids.z);
+    float t = -1.0;
+    vec3 normal = vec3(0.0);
+
+    if (kind == 1)
+    {
+        // sphere: center, radius
+        vec3 oc = eye - Shape.xyz;
+        float half_b = dot(oc, dir);
+        float a = dot(dir, dir);
+        float c = dot(oc, oc) - Shape.w * Shape.w;
+        float discriminant = half_b * half_b - a * c;
+        if (discriminant < 0.0)
+            discard;
+        float root = sqrt(discriminant);
+        t = (-half_b - root) / a;
+        if (t <= min_t)
+            t = (-half_b + root) / a;
+        normal = (eye + t * dir - Shape.xyz) / Shape.w;
+    }
+    else if (kind == 2)
+    {
+        // plane: normal, offset
+        float denom = dot(Shape.xyz, dir);
+        if (denom == 0.0)
+            discard;
+        t = (Shape.w - dot(Shape.xyz, eye)) / denom;
+        normal = denom > 0.0 ? -Shape.xyz : Shape.xyz;
+    }
+    else if (kind == 3)
+    {
+        // box: min, max; the entry face, or the exit face from inside
+        vec3 inv_d = 1.0 / dir;
+        vec3 t0 = (Shape.xyz - eye) * inv_d;
+        vec3 t1 = (Shape2.xyz - eye) * inv_d;
+        vec3 near = min(t0, t1);
+        vec3 far = max(t0, t1);
+        float t_enter = max(near.x, max(near.y, near.z));
+        float t_exit = min(far.x, min(far.y, far.z));
+        if (t_enter > t_exit)
+            discard;
+        if (t_enter > min_t)
+        {
+            t = t_enter;
+            normal = -sign(dir) * vec3(equal(near, vec3(t_enter)));
+        }
+        else
+        {
+            t = t_exit;
+            normal = sign(dir) * vec3(equal(far, vec3(t_exit)));
+        }
+    }
+    else
+    {
+        // disk: center, radius, normal
+        float denom = dot(Shape2.xyz, dir);
+        if (denom == 0.0)
+            discard;
+        t = dot(Shape2.xyz, Shape.xyz - eye) / denom;
+        vec3 offset = eye + t * dir - Shape.xyz;
+        if (dot(offset, offset) > Shape.w * Shape.w)
+            discard;
+        normal = denom > 0.0 ? -Shape2.xyz : Shape2.xyz;
+    }
+    if (t <= min_t)
+        discard;
+
+    gl_FragDepth = t / (t + 1.0);
+    Position = vec4(eye + t * dir, Ids.x);
+    Normal = vec4(normal, Ids.y);
+    AlbedoKind = vec4(Albedo, Ids.z);
+}
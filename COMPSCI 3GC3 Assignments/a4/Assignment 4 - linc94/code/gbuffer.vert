@@ -0,0 +1,46 @@
+#version 330 core
+
+// every primitive but planes is drawn as its bounding box, whose 36 corners
+// come from gl_VertexID; planes are drawn as one triangle covering the window.
+// The fragment shader intersects the pixel's ray with the real shape.
+layout (location = 0) in vec4 aShape;
+layout (location = 1) in vec4 aShape2;
+layout (location = 2) in vec4 aBoundsMin;
+layout (location = 3) in vec4 aBoundsMax;
+layout (location = 4) in vec4 aAlbedo;
+
+uniform mat4 viewProjection;
+uniform vec3 eye;
+// angle between neighbouring pixels' rays, to grow the boxes by a couple of
+// pixels so jittered rays near a silhouette still get a fragment
+uniform float pixelSpread;
+uniform bool fullscreen;
+
+flat out vec4 Shape;
+flat out vec4 Shape2;
+// primitive index, material index, kind
+flat out vec3 Ids;
+flat out vec3 Albedo;
+
+const int faces[36] = int[36](0, 4, 6, 0, 6, 2,  1, 3, 7, 1, 7, 5,
+                              0, 1, 5, 0, 5, 4,  2, 6, 7, 2, 7, 3,
+                              0, 2, 3, 0, 3, 1,  4, 5, 7, 4, 7, 6);
+
+void main()
+{
+    Shape = aShape;
+    Shape2 = aShape2;
+    Ids = vec3(aBoundsMin.w, aBoundsMax.w, aAlbedo.w);
+    Albedo = aAlbedo.rgb;
+    if (fullscreen)
+    {
+        vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+        gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+        return;
+    }
+    int c = faces[gl_VertexID];
+    vec3 corner = vec3(c & 1, (c >> 1) & 1, (c >> 2) & 1);
+    vec3 position = mix(aBoundsMin.xyz, aBoundsMax.xyz, corner);
+    position += (corner * 2.0 - 1.0) * (2.0 * pixelSpread * distance(position, eye));
+    gl_Position = viewProjection * vec4(position, 1.0);
+}
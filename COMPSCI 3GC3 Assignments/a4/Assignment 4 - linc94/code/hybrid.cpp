@@ -0,0 +1,335 @@
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+
+#include "shader.h"
+
+#include "Camera.h"
+#include "World.h"
+#include "GBuffer.h"
+#include "Renderer.h"
+#include "Sequence.h"
+#include "Regression.h"
+#include "Batch.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// hybrid renderer: OpenGL rasterizes what the camera sees into a G-buffer
+// (position, normal, albedo, material and primitive per pixel), which is read
+// back and handed to the tracer as the first hit of every path, so no camera
+// ray is traced. Build like viewer.cpp; it opens a hidden window only for the
+// GL context, so it also runs headless on software GL, e.g. under xvfb-run
+// with LIBGL_ALWAYS_SOFTWARE=1 (Mesa llvmpipe).
+//
+// --scene <name>: one of build_batch_scene's scenes, all by default (lattices
+//   and meshes can't be rasterized)
+// --width <w> --height <h> --spp <n>: image size and samples per pixel
+// --passes <n>: G-buffer layers with different subpixel offsets, samples
+//   cycle through them (4 by default)
+// --output <path>: the image, hybrid.ppm by default
+// --compare: also trace the G-buffer on the cpu and render the image the
+//   plain tracer makes, and report how far the hybrid image is from both
+
+// floats per primitive in the instance buffer, five vec4 attributes
+const int instance_floats = 20;
+
+// one instance per primitive, planes first; returns the plane count
+int primitive_instances(World& world, std::vector<float>& instances)
+{
+    instances.clear();
+    auto add = [&](PrimitiveKind kind, int index, int material, const Vector3D& a, float a_w, const Vector3D& b,
+                   const AABB& bounds) {
+        Vector3D color = world.material(material)->m_color;
+        float values[instance_floats] = { a.m_x, a.m_y, a.m_z, a_w,
+                                          b.m_x, b.m_y, b.m_z, 0,
+                                          bounds.m_min.m_x, bounds.m_min.m_y, bounds.m_min.m_z, float(index),
+                                          bounds.m_max.m_x, bounds.m_max.m_y, bounds.m_max.m_z, float(material),
+                                          color.m_x, color.m_y, color.m_z, float(int(kind)) };
+        instances.insert(instances.end(), values, values + instance_floats);
+    };
+    for (size_t p = 0; p < world.m_planes.size(); ++p)
+    {
+        Plane& plane = world.m_planes[p];
+        add(PrimitiveKind::Plane, int(p), plane.m_material, plane.m_normal, plane.m_offset, Vector3D(0, 0, 0), AABB());
+    }
+    for (size_t s = 0; s < world.m_spheres.size(); ++s)
+    {
+        Sphere& sphere = world.m_spheres[s];
+        add(PrimitiveKind::Sphere, int(s), sphere.m_material, sphere.m_center, sphere.m_radius, Vector3D(0, 0, 0), sphere.bounds());
+    }
+    for (size_t b = 0; b < world.m_boxes.size(); ++b)
+    {
+        Box& box = world.m_boxes[b];
+        add(PrimitiveKind::Box, int(b), box.m_material, box.m_min, 0, box.m_max, box.bounds());
+    }
+    for (size_t d = 0; d < world.m_disks.size(); ++d)
+    {
+        Disk& disk = world.m_disks[d];
+        add(PrimitiveKind::Disk, int(d), disk.m_material, disk.m_center, disk.m_radius, disk.m_normal, disk.bounds());
+    }
+    return static_cast<int>(world.m_planes.size());
+}
+
+// point the five instance attributes at the instance buffer, starting first instances in
+void set_instance_attributes(int first)
+{
+    for (int a = 0; a < 5; ++a)
+    {
+        glVertexAttribPointer(a, 4, GL_FLOAT, GL_FALSE, instance_floats * sizeof(float),
+                              (void*)((first * instance_floats + 4 * a) * sizeof(float)));
+        glEnableVertexAttribArray(a);
+        glVertexAttribDivisor(a, 1);
+    }
+}
+
+// the camera's rays as the shaders see them, and the matrix that puts the
+// point a ray (col, row) goes through on window pixel (col, row) * (size - 1)
+void set_camera_uniforms(Shader& shader, Camera& camera, int width, int height)
+{
+    Vector3D eye = camera.eye();
+    Vector3D corner = camera.generate_ray(0, 0).direction();
+    Vector3D right = camera.generate_ray(1, 0).direction() - corner;
+    Vector3D up = camera.generate_ray(0, 1).direction() - corner;
+    glm::vec3 e(eye.m_x, eye.m_y, eye.m_z), c(corner.m_x, corner.m_y, corner.m_z);
+    glm::vec3 r(right.m_x, right.m_y, right.m_z), u(up.m_x, up.m_y, up.m_z);
+    shader.setVec3("eye", e);
+    shader.setVec3("rayCorner", c);
+    shader.setVec3("rayRight", r);
+    shader.setVec3("rayUp", u);
+    shader.setVec2("pixelStep", 1.0f / (width - 1), 1.0f / (height - 1));
+    shader.setFloat("pixelSpread", camera.pixel_spread(height));
+
+    // point - eye = z * (corner + col * right + row * up): solve for (z col, z row, z),
+    // then ndc x = 2 col (width - 1) / width - 1 with w = z; depth comes from the shader
+    glm::mat3 inverse = glm::inverse(glm::mat3(r, u, c));
+    glm::mat4 to_ray(inverse);
+    to_ray[3] = glm::vec4(-(inverse * e), 1.0f);
+    glm::mat4 to_clip(0.0f);
+    to_clip[0][0] = 2.0f * (width - 1) / width;
+    to_clip[1][1] = 2.0f * (height - 1) / height;
+    to_clip[2][0] = -1;
+    to_clip[2][1] = -1;
+    to_clip[2][3] = 1;
+    shader.setMat4("viewProjection", to_clip * to_ray);
+}
+
+int main(int argc, char* argv[])
+{
+    BatchJob scene;
+    int pass_count = 4;
+    std::string output = "hybrid.ppm";
+    bool compare = false;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+            scene.m_scene = argv[++a];
+        else if (strcmp(argv[a], "--width") == 0 && a + 1 < argc)
+            scene.m_width = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--height") == 0 && a + 1 < argc)
+            scene.m_height = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--spp") == 0 && a + 1 < argc)
+            scene.m_raysPerPixel = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--passes") == 0 && a + 1 < argc)
+            pass_count = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+            output = argv[++a];
+        else if (strcmp(argv[a], "--compare") == 0)
+            compare = true;
+    }
+    int width = scene.m_width;
+    int height = scene.m_height;
+    if (width < 2 || height < 2 || pass_count < 1)
+    {
+        std::cout << "bad image size or pass count" << std::endl;
+        return -1;
+    }
+
+    World world;
+    if (!build_batch_scene(world, scene))
+    {
+        std::cout << "unknown scene " << scene.m_scene << std::endl;
+        return -1;
+    }
+    if (!gbuffer_supports(world))
+    {
+        std::cout << "scene " << scene.m_scene << " has primitives that can't be rasterized" << std::endl;
+        return -1;
+    }
+    Camera camera(scene.m_eye, scene.m_target, Vector3D(0, 1, 0), scene.m_fov, width / float(height));
+
+    // glfw: initialize and configure; the window is never shown
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    GLFWwindow* window = glfwCreateWindow(64, 64, "A4 hybrid", NULL, NULL);
+    if (window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+
+    // glad: load all OpenGL function pointers
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        return -1;
+    }
+    std::cout << "OpenGL " << glGetString(GL_VERSION) << " on " << glGetString(GL_RENDERER) << std::endl;
+
+    Shader ourShader("gbuffer.vert", "gbuffer.frag");
+
+    // the G-buffer: three float color attachments and a float depth buffer
+    GLuint FBO;
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    GLuint attachments[3];
+    glGenRenderbuffers(3, attachments);
+    for (int a = 0; a < 3; a++)
+    {
+        glBindRenderbuffer(GL_RENDERBUFFER, attachments[a]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32F, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + a, GL_RENDERBUFFER, attachments[a]);
+    }
+    GLuint depth;
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    GLenum draw_buffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+    glDrawBuffers(3, draw_buffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cout << "G-buffer framebuffer is not complete" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+
+    // every primitive is an instance; the vertices come from gl_VertexID
+    std::vector<float> instances;
+    int plane_count = primitive_instances(world, instances);
+    int shape_count = static_cast<int>(instances.size()) / instance_floats - plane_count;
+    unsigned int VAO, VBO;
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(float), instances.data(), GL_STATIC_DRAW);
+
+    ourShader.use();
+    set_camera_uniforms(ourShader, camera, width, height);
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glDisable(GL_CULL_FACE);
+
+    GBuffer gbuffer;
+    gbuffer.resize(width, height, pass_count);
+    const float none[4] = { 0, 0, 0, 0 };
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < pass_count; pass++)
+    {
+        for (int a = 0; a < 3; a++)
+            glClearBufferfv(GL_COLOR, a, none);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        ourShader.setVec2("jitter", gbuffer.jitter_x(pass), gbuffer.jitter_y(pass));
+
+        ourShader.setBool("fullscreen", true);
+        set_instance_attributes(0);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 3, plane_count);
+        ourShader.setBool("fullscreen", false);
+        set_instance_attributes(plane_count);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 36, shape_count);
+
+        // read back, rows come bottom first like the tracer's
+        size_t offset = gbuffer.texel(pass, 0, 0);
+        float* planes[3] = { &gbuffer.m_positions[offset], &gbuffer.m_normals[offset], &gbuffer.m_albedos[offset] };
+        for (int a = 0; a < 3; a++)
+        {
+            glReadBuffer(GL_COLOR_ATTACHMENT0 + a);
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, planes[a]);
+        }
+    }
+    glFinish();
+    double raster_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the paths start from the G-buffer
+    RenderSettings settings;
+    settings.m_width = width;
+    settings.m_height = height;
+    settings.m_raysPerPixel = scene.m_raysPerPixel;
+    Renderer renderer(settings);
+    renderer.m_primaryHits = &gbuffer;
+    renderer.render(world, camera);
+    std::cout << "G-buffer of " << pass_count << " passes in " << raster_seconds << " s, traced in " << renderer.m_seconds
+              << " s (" << renderer.m_kernel.m_name << " kernel)" << std::endl;
+
+    auto image = [&](Renderer& r) {
+        std::vector<Vector3D> radiance(width * height);
+        for (int j = 0; j < height; ++j)
+            for (int i = 0; i < width; ++i)
+                radiance[j * width + i] = r.pixel(i, j) / float(std::max(r.sample_count(i, j), 1));
+        return radiance;
+    };
+    std::vector<Vector3D> hybrid = image(renderer);
+    if (write_ppm(output, width, height, hybrid))
+        std::cout << "ppm saved at " << output << std::endl;
+
+    if (compare)
+    {
+        // the same render from a G-buffer traced on the cpu: differs only
+        // where the rasterizer picked another primitive
+        GBuffer traced;
+        traced.resize(width, height, pass_count);
+        auto trace_start = std::chrono::steady_clock::now();
+        trace_gbuffer(world, camera, traced);
+        double trace_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - trace_start).count();
+        Renderer reference(settings);
+        reference.m_primaryHits = &traced;
+        reference.render(world, camera);
+        ImageMetrics same = compare_images(hybrid, image(reference), width, height);
+
+        // and the plain tracer, with its own random subpixel offsets
+        Renderer plain(settings);
+        plain.render(world, camera);
+        ImageMetrics noise = compare_images(hybrid, image(plain), width, height);
+        // how far apart two plain renders are, for scale
+        RenderSettings reseeded = settings;
+        reseeded.m_seed = 1;
+        Renderer other(reseeded);
+        other.render(world, camera);
+        ImageMetrics floor = compare_images(image(other), image(plain), width, height);
+
+        std::cout << gbuffer.differences(traced) << " of " << width * height * pass_count
+                  << " texels name another primitive than the cpu's G-buffer (traced in " << trace_seconds << " s)" << std::endl;
+        std::cout << "against the cpu G-buffer's image: PSNR " << same.m_psnr << " dB, SSIM " << same.m_ssim << std::endl;
+        std::cout << "against the plain tracer's image: PSNR " << noise.m_psnr << " dB, SSIM " << noise.m_ssim << ", rendered in "
+                  << plain.m_seconds << " s, " << plain.m_rayCount << " rays to the hybrid's " << renderer.m_rayCount << std::endl;
+        std::cout << "two plain renders with different seeds: PSNR " << floor.m_psnr << " dB, SSIM " << floor.m_ssim << std::endl;
+    }
+
+    // optional: de-allocate all resources once they've outlived their purpose:
+    glDeleteBuffers(1, &VBO);
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteRenderbuffers(3, attachments);
+    glDeleteRenderbuffers(1, &depth);
+    glDeleteFramebuffers(1, &FBO);
+
+    // glfw: terminate, clearing all previously allocated GLFW resources.
+    glfwTerminate();
+    return 0;
+}
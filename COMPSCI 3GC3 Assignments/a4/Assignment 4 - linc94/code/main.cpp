@@ -1,6 +1,14 @@
 #include "Camera.h"
 #include "World.h"
+#include "Renderer.h"
+#include "Autotune.h"
+#include "Sequence.h"
+#include "Regression.h"
+#include "Batch.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 
@@ -12,34 +20,151 @@ void write_color_to_file(std::ostream &out, Vector3D pixel_color, int samples_pe
     if (r != r) r = 0.0;
     if (g != g) g = 0.0;
     if (b != b) b = 0.0;
-    auto scale = 1.0 / samples_per_pixel;
+    auto scale = samples_per_pixel > 0 ? 1.0 / samples_per_pixel : 0.0;
     r = clamp(256 * sqrt(scale * r), 0, 255);
     g = clamp(256 * sqrt(scale * g), 0, 255);
     b = clamp(256 * sqrt(scale * b), 0, 255);
     out << int(r) << ' ' << int(g) << ' ' << int(b)<< '\n';
 }
 
-Vector3D ray_hit_color(Ray& r, World& world, int max_light_bounce_num)
+#ifdef TRACE_STATS
+// blue for cheap through cyan, green and yellow to red at x = 1
+Vector3D heat_color(float x)
 {
-    if (max_light_bounce_num <= 0)
-        return Vector3D(0,0,0);
-    
-    HitResult hit = world.hit(r, 0.001, std::numeric_limits<float>::infinity());
-    if (hit.m_isHit)
+    x = clamp(x, 0, 1) * 4;
+    int k = x < 4 ? int(x) : 3;
+    Vector3D stops[5] = { Vector3D(0, 0, 1), Vector3D(0, 1, 1), Vector3D(0, 1, 0), Vector3D(1, 1, 0), Vector3D(1, 0, 0) };
+    return (1 - (x - k)) * stops[k] + (x - k) * stops[k + 1];
+}
+
+// next to the beauty image: <name>_cost.ppm, a heatmap of primitive tests plus
+// node visits per sample scaled to the 99th percentile, and <name>_cost.pfm with
+// the raw per-sample primitive tests, node visits and bounces as floats
+void write_cost_images(const std::string& beauty_path, Renderer& renderer, int width, int height)
+{
+    std::string base = beauty_path;
+    if (base.size() > 4 && base.substr(base.size() - 4) == ".ppm")
+        base = base.substr(0, base.size() - 4);
+
+    std::vector<Vector3D> costs(width * height);
+    std::vector<float> totals(width * height);
+    for (int j = 0; j < height; ++j)
     {
-        ReflectResult res = hit.m_hitMaterial->reflect(r, hit);
-        return res.m_color * ray_hit_color(res.m_ray, world, max_light_bounce_num-1);
+        for (int i = 0; i < width; ++i)
+        {
+            int n = renderer.sample_count(i, j);
+            costs[j * width + i] = n > 0 ? renderer.pixel_cost(i, j) / n : Vector3D(0, 0, 0);
+            totals[j * width + i] = costs[j * width + i].m_x + costs[j * width + i].m_y;
+        }
     }
-    return Vector3D(1, 1, 1);
+    std::vector<float> sorted = totals;
+    std::sort(sorted.begin(), sorted.end());
+    float scale = sorted[sorted.size() * 99 / 100];
+
+    std::ofstream heatmap(base + "_cost.ppm");
+    heatmap << "P3\n" << width << ' ' << height << "\n255\n";
+    for (int j = height-1; j >= 0; --j)
+    {
+        for (int i = 0; i < width; ++i)
+        {
+            Vector3D c = 255.0f * heat_color(scale > 0 ? totals[j * width + i] / scale : 0);
+            heatmap << int(c.m_x) << ' ' << int(c.m_y) << ' ' << int(c.m_z) << '\n';
+        }
+    }
+
+    // PFM rows run bottom to top, negative scale means little endian
+    std::ofstream raw(base + "_cost.pfm", std::ios::binary);
+    raw << "PF\n" << width << ' ' << height << "\n-1.0\n";
+    for (int p = 0; p < width * height; ++p)
+        raw.write(reinterpret_cast<const char*>(&costs[p].m_x), 3 * sizeof(float));
+
+    std::cout << "cost heatmap saved at " << base << "_cost.ppm (white point " << scale << " tests + visits per sample)" << std::endl;
 }
+#endif
 
-int main()
+int main(int argc, char* argv[])
 {
+    // --time-budget <seconds>: stop at the deadline instead of after rays_per_pixel samples
+    // --frames <n>: render a turntable of n frames around the target instead of one image
+    // --temporal: in a turntable, start every frame from the last one's reprojected radiance
+    // --regress <dir>: render the regression scenes and compare them with the references in dir,
+    //   exits with 1 when quality or speed regressed
+    // --regress-update <dir>: make those references (and timing baselines) with this build
+    // --batch <manifest>: render every job of the manifest (see read_batch_manifest) on one pool of workers
+    // --build-mesh <obj> <out>: preprocess an obj file into a chunked mesh file for World::add_mesh
+    // --autotune: time every acceleration structure on this scene and keep the fastest,
+    //   instead of picking one from the scene's size
+    double time_budget = 0;
+    int frame_count = 0;
+    bool temporal = false;
+    std::string regress_dir;
+    bool regress_update = false;
+    std::string manifest;
+    std::string mesh_obj, mesh_out;
+    bool autotune = false;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "--time-budget") == 0 && a + 1 < argc)
+            time_budget = atof(argv[++a]);
+        else if (strcmp(argv[a], "--frames") == 0 && a + 1 < argc)
+            frame_count = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--temporal") == 0)
+            temporal = true;
+        else if ((strcmp(argv[a], "--regress") == 0 || strcmp(argv[a], "--regress-update") == 0) && a + 1 < argc)
+        {
+            regress_update = strcmp(argv[a], "--regress-update") == 0;
+            regress_dir = argv[++a];
+        }
+        else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc)
+            manifest = argv[++a];
+        else if (strcmp(argv[a], "--build-mesh") == 0 && a + 2 < argc)
+        {
+            mesh_obj = argv[++a];
+            mesh_out = argv[++a];
+        }
+        else if (strcmp(argv[a], "--autotune") == 0)
+            autotune = true;
+    }
+    if (!mesh_obj.empty())
+    {
+        ChunkedMeshBuilder builder;
+        auto start = std::chrono::steady_clock::now();
+        if (!builder.build(mesh_obj, mesh_out))
+        {
+            std::cerr << builder.m_error << std::endl;
+            return 1;
+        }
+        std::cout << builder.m_triangleCount << " triangles in " << builder.m_chunkCount << " chunks, "
+                  << builder.m_fileBytes / (1 << 20) << " MB, built in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+        return 0;
+    }
+    if (!regress_dir.empty())
+    {
+        RegressionHarness harness(regress_dir);
+        bool ok = regress_update ? harness.update(std::cout) : harness.check(std::cout);
+        return ok ? 0 : 1;
+    }
+    if (!manifest.empty())
+    {
+        std::vector<BatchJob> jobs;
+        if (!read_batch_manifest(manifest, jobs, std::cerr))
+            return 1;
+        BatchRenderer batch((RenderSettings()));
+        bool ok = batch.render(jobs);
+        std::cout << jobs.size() << " jobs in " << batch.m_seconds << " s, " << batch.m_rayCount / batch.m_seconds / 1e6
+                  << " Mrays/s, " << batch.m_sceneCount << " scenes built in " << batch.m_sceneSeconds << " s" << std::endl;
+        return ok ? 0 : 1;
+    }
+
     int width =  768;
     int height = 540;
     float aspect_ratio = width / float(height);
     int rays_per_pixel = 100;
     const int max_light_bounce_num = 5;
+    // on multi-socket machines: pin workers and keep their tiles and scene NUMA-local
+    bool pin_threads = false;
+    bool replicate_scene = false;
     
     Vector3D eye(20,3,3);
     Vector3D target(0,0,0);
@@ -55,29 +180,88 @@ int main()
     // world.generate_scene_multi_diffuse();
     // world.generate_scene_multi_specular();
     world.generate_scene_all();
+    // world.generate_scene_mixed();
+    // world.generate_scene_lights(300);
+    // world.generate_scene_sphere_field(1 << 15);
+    // world.generate_scene_textured("../../../a3/code files/asset/bucket.jpg", "../../../a3/code files/asset/floor.jpeg");
+
+    // a mesh preprocessed with --build-mesh, paged in from disk with at most 512 MB of it in memory
+    // world.add_mesh("C:/Users/Corinna/Documents/painge/assignment 4/meshes/statue.chunks", world.add_material<Diffuse>(Vector3D(0.6, 0.6, 0.6)), 512ull << 20);
+
+    // interpolate indirect diffuse light from cached records (biased; pays off in lamp-lit rooms, not under an open sky, see bench_irradiance)
+    // world.enable_irradiance_cache();
+
+    // learn where indirect light comes from during the first passes and aim diffuse bounces there
+    // world.enable_path_guiding();
+
+    // light the scene with an HDR image instead of the white sky
+    // world.m_environment.load("C:/Users/Corinna/Documents/painge/assignment 4/hdr/sky.hdr");
+
+    // pick an acceleration structure for the scene, or time them all with --autotune
+    if (autotune)
+        autotune_accelerator(world, camera);
+    else
+        world.build_accelerator(choose_accelerator(world));
+    // world.build_lbvh(true);
    
     //TODO: 1. set your own path for output image
     std::string result_ppm_path = "C:/Users/Corinna/Documents/painge/assignment 4/ppms/all.ppm";
     
+    RenderSettings settings;
+    settings.m_width = width;
+    settings.m_height = height;
+    settings.m_raysPerPixel = rays_per_pixel;
+    settings.m_maxLightBounceNum = max_light_bounce_num;
+    settings.m_pinThreads = pin_threads;
+    settings.m_replicateScene = replicate_scene;
+    settings.m_timeBudget = time_budget;
+
+    if (frame_count > 0)
+    {
+        // the scene and its accelerator are built once for every frame
+        Vector3D offset = eye - target;
+        CameraPath path = CameraPath::turntable(target, sqrt(offset.m_x * offset.m_x + offset.m_z * offset.m_z), offset.m_y, fov);
+        SequenceSettings sequence_settings;
+        sequence_settings.m_frameCount = frame_count;
+        // the turntable's last frame would repeat the first
+        sequence_settings.m_endTime = 1 - 1.0f / frame_count;
+        sequence_settings.m_outputPattern = result_ppm_path.substr(0, result_ppm_path.size() - 4) + "_%04d.ppm";
+        sequence_settings.m_temporalReuse = temporal;
+        SequenceRenderer sequence(settings, sequence_settings);
+        sequence.render(world, path);
+        std::cout << frame_count << " frames in " << sequence.m_seconds << " s (" << sequence.m_renderSeconds
+                  << " s rendering, " << sequence.m_writeSeconds << " s writing alongside), "
+                  << sequence.m_rayCount / sequence.m_seconds / 1e6 << " Mrays/s" << std::endl;
+        if (temporal)
+            std::cout << sequence.m_reusedFraction * 100 << "% of pixels started from the last frame" << std::endl;
+        std::cout << "frames saved as " << sequence_settings.m_outputPattern << std::endl;
+        return 0;
+    }
+
+    Renderer renderer(settings);
+    renderer.render(world, camera);
+    std::cout << "rendered in " << renderer.m_seconds << " s, "
+              << renderer.m_rayCount / renderer.m_seconds / 1e6 << " Mrays/s (" << renderer.m_kernel.m_name << " kernel)" << std::endl;
+    if (time_budget > 0)
+        renderer.print_sample_report(std::cout);
+    if (world.m_pathGuide)
+        std::cout << "path guide: " << world.m_pathGuide->leaf_count() << " regions, "
+                  << world.m_pathGuide->memory_bytes() / 1024 << " KB, " << renderer.m_guideIterations
+                  << " training passes, refining took " << renderer.m_guideSeconds * 1000.0 << " ms" << std::endl;
+
     std::ofstream fout (result_ppm_path);
     fout << "P3\n" << width << ' ' << height << "\n255\n";
     for (int j = height-1; j >= 0; --j)
     {
-        std::cout << "casting row " << j << std::endl;
         for (int i = 0; i < width; ++i)
         {
-            Vector3D pixel_color(0,0,0);
-            for (int s = 0; s < rays_per_pixel; ++s)
-            {
-                float col = (i + random_float()) / (width-1);
-                float row = (j + random_float()) / (height-1);
-                Ray r = camera.generate_ray(col, row);
-                pixel_color += ray_hit_color(r, world, max_light_bounce_num);
-            }
-            write_color_to_file(fout, pixel_color, rays_per_pixel);
+            write_color_to_file(fout, renderer.pixel(i, j), renderer.sample_count(i, j));
         }
     }
 
     std::cout << "raytracing done!" << std::endl << "ppm saved at " << result_ppm_path << std::endl;
+#ifdef TRACE_STATS
+    write_cost_images(result_ppm_path, renderer, width, height);
+#endif
 }
 
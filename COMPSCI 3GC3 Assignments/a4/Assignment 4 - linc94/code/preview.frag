@@ -0,0 +1,13 @@
+#version 330 core
+
+// the tracer's image, already tone mapped
+uniform sampler2D image;
+
+in vec2 TexCoord;
+
+out vec4 FragColor;
+
+void main()
+{
+    FragColor = texture(image, TexCoord);
+}
@@ -0,0 +1,364 @@
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "shader.h"
+
+#include "Camera.h"
+#include "World.h"
+#include "Preview.h"
+#include "Batch.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+// interactive preview of the a4 tracer. Build like the a3 programs: viewer.cpp
+// plus glad.c against the glfw/glad/glm headers in "a3/code files/libraries"
+// (-pthread, and -lglfw -ldl on linux). Drag with the left button to orbit,
+// scroll to zoom, WASD / QE to move the target, P saves the window, ESC quits.
+//
+// --scene <name>: one of build_batch_scene's scenes, all by default
+// --frames <n>: run n frames in a hidden window with the camera orbiting on
+//   its own, print how long moves took to show, then quit; for headless
+//   testing, e.g. under xvfb-run with LIBGL_ALWAYS_SOFTWARE=1 (Mesa llvmpipe)
+// --capture <path>: with --frames, save the last frame as a ppm
+
+void framebuffer_size_callback(GLFWwindow* window, int width, int height);
+void scroll_callback(GLFWwindow* window, double x_offset, double y_offset);
+bool processInput(GLFWwindow* window);
+void dump_framebuffer_to_ppm(const std::string& file_name, unsigned int width, unsigned int height);
+
+// settings
+const unsigned int SCR_WIDTH = 768;
+const unsigned int SCR_HEIGHT = 540;
+
+// the camera orbits its target, yaw and pitch in radians
+Vector3D camera_target(0, 0, 0);
+float camera_distance = 0;
+float camera_yaw = 0;
+float camera_pitch = 0;
+float camera_fov = 20;
+float scroll = 0;
+
+Camera orbit_camera()
+{
+    Vector3D offset(cos(camera_pitch) * sin(camera_yaw), sin(camera_pitch), cos(camera_pitch) * cos(camera_yaw));
+    return Camera(camera_target + camera_distance * offset, camera_target, Vector3D(0, 1, 0), camera_fov, SCR_WIDTH / float(SCR_HEIGHT));
+}
+
+int main(int argc, char* argv[])
+{
+    BatchJob scene;
+    int frame_limit = 0;
+    std::string capture_path;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+            scene.m_scene = argv[++a];
+        else if (strcmp(argv[a], "--frames") == 0 && a + 1 < argc)
+            frame_limit = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--capture") == 0 && a + 1 < argc)
+            capture_path = argv[++a];
+    }
+
+    // same starting view as main.cpp
+    Vector3D eye(20, 3, 3);
+    Vector3D offset = eye - camera_target;
+    camera_distance = offset.length();
+    camera_yaw = atan2(offset.m_x, offset.m_z);
+    camera_pitch = asin(offset.m_y / camera_distance);
+
+    World world;
+    if (!build_batch_scene(world, scene))
+    {
+        std::cout << "unknown scene " << scene.m_scene << std::endl;
+        return -1;
+    }
+
+    // glfw: initialize and configure
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if (frame_limit > 0)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    // glfw window creation
+    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "A4 preview", NULL, NULL);
+    if (window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSwapInterval(frame_limit > 0 ? 0 : 1);
+
+    // glad: load all OpenGL function pointers
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        return -1;
+    }
+    std::cout << "OpenGL " << glGetString(GL_VERSION) << " on " << glGetString(GL_RENDERER) << std::endl;
+
+    Shader ourShader("preview.vert", "preview.frag");
+    ourShader.use();
+    ourShader.setInt("image", 0);
+
+    // core profile needs a vertex array bound even though the triangle comes from gl_VertexID
+    unsigned int VAO;
+    glGenVertexArrays(1, &VAO);
+
+    // the image texture, filled from the pixel buffers
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    // two pixel buffers: while the texture is updated from the one written
+    // last frame, the tracer's image is copied into the other, so neither the
+    // copy nor the upload waits for the other to finish
+    const int image_bytes = SCR_WIDTH * SCR_HEIGHT * 4;
+    GLuint PBOs[2];
+    glGenBuffers(2, PBOs);
+    for (int i = 0; i < 2; i++)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBOs[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, image_bytes, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    // whether a buffer holds an image not uploaded yet, and the camera move
+    // whose view that image covers completely, -1 if it doesn't
+    bool filled[2] = { false, false };
+    int complete[2] = { -1, -1 };
+
+    PreviewSettings settings;
+    settings.m_width = SCR_WIDTH;
+    settings.m_height = SCR_HEIGHT;
+    ProgressiveRenderer preview(world, orbit_camera(), settings);
+    preview.start();
+
+    // time from every camera move until the first frame covering the new view was on screen
+    double moved_at = glfwGetTime();
+    int view = 0;
+    bool waiting = true;
+    double latency_sum = 0, latency_max = 0, last_latency = 0;
+    int moves = 0;
+    double title_at = 0;
+
+    // render loop
+    for (int frame = 0; !glfwWindowShouldClose(window) && (frame_limit <= 0 || frame < frame_limit); frame++)
+    {
+        // input
+        bool moved = processInput(window);
+        if (frame_limit > 0 && frame < frame_limit * 3 / 4 && !waiting)
+        {
+            // scripted orbit for headless runs, a step as soon as the last one
+            // is on screen; still at the end so the image refines
+            camera_yaw += 0.02f;
+            moved = true;
+        }
+        if (moved)
+        {
+            preview.set_camera(orbit_camera());
+            moved_at = glfwGetTime();
+            view++;
+            waiting = true;
+        }
+
+        int fill = frame % 2;
+        int upload = 1 - fill;
+
+        // texture from the buffer filled last frame
+        glBindTexture(GL_TEXTURE_2D, texture);
+        bool shows_new_view = false;
+        if (filled[upload])
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBOs[upload]);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCR_WIDTH, SCR_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            filled[upload] = false;
+            shows_new_view = complete[upload] == view;
+        }
+
+        // the tracer's latest image into the other one; orphaning it first
+        // gives a fresh block of memory instead of waiting on an upload still reading it
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBOs[fill]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, image_bytes, NULL, GL_STREAM_DRAW);
+        unsigned char* pixels = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, image_bytes,
+                                                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (pixels)
+        {
+            complete[fill] = preview.first_image_seconds() > 0 ? view : -1;
+            filled[fill] = preview.snapshot(pixels);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        // render
+        glClear(GL_COLOR_BUFFER_BIT);
+        ourShader.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glBindVertexArray(VAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        if (frame_limit > 0 && frame == frame_limit - 1 && !capture_path.empty())
+            dump_framebuffer_to_ppm(capture_path, SCR_WIDTH, SCR_HEIGHT);
+
+        // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+        glfwSwapBuffers(window);
+        glfwPollEvents();
+
+        if (waiting && shows_new_view)
+        {
+            last_latency = glfwGetTime() - moved_at;
+            latency_sum += last_latency;
+            latency_max = fmax(latency_max, last_latency);
+            moves++;
+            waiting = false;
+        }
+        if (glfwGetTime() - title_at > 0.25)
+        {
+            title_at = glfwGetTime();
+            std::string title = "A4 preview - " + std::to_string(preview.samples_per_pixel()) + " spp - last move shown in " +
+                                std::to_string(int(last_latency * 1000)) + " ms";
+            glfwSetWindowTitle(window, title.c_str());
+        }
+    }
+
+    preview.stop();
+    if (moves > 0)
+        std::cout << moves << " camera moves shown after " << latency_sum / moves * 1000 << " ms on average, "
+                  << latency_max * 1000 << " ms at most; " << preview.samples_per_pixel() << " spp at the end" << std::endl;
+
+    // optional: de-allocate all resources once they've outlived their purpose:
+    glDeleteBuffers(2, PBOs);
+    glDeleteTextures(1, &texture);
+    glDeleteVertexArrays(1, &VAO);
+
+    // glfw: terminate, clearing all previously allocated GLFW resources.
+    glfwTerminate();
+    return 0;
+}
+
+void dump_framebuffer_to_ppm(const std::string& file_name, unsigned int width, unsigned int height)
+{
+    std::vector<GLubyte> pixels(3 * width * height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    std::ofstream fout(file_name);
+    fout << "P3\n" << width << " " << height << "\n" << 255 << std::endl;
+    for (size_t i = 0; i < height; i++)
+    {
+        for (size_t j = 0; j < width; j++)
+        {
+            size_t cur = 3 * ((height - i - 1) * width + j);
+            fout << (int)pixels[cur] << " " << (int)pixels[cur + 1] << " " << (int)pixels[cur + 2] << " ";
+        }
+        fout << std::endl;
+    }
+    std::cout << "frame saved at " << file_name << std::endl;
+}
+
+// process all input: query GLFW whether relevant keys are pressed/released this
+// frame and react accordingly; true when the camera moved
+bool processInput(GLFWwindow* window)
+{
+    static double last_x = 0, last_y = 0;
+    static bool dragging = false;
+    bool moved = false;
+
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    // press p to capture screen
+    static bool p_down = false;
+    bool p_pressed = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+    if (p_pressed && !p_down)
+    {
+        int buffer_width, buffer_height;
+        glfwGetFramebufferSize(window, &buffer_width, &buffer_height);
+        dump_framebuffer_to_ppm("preview.ppm", buffer_width, buffer_height);
+    }
+    p_down = p_pressed;
+
+    // left drag orbits, half a turn across the window
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
+    {
+        if (dragging && (x != last_x || y != last_y))
+        {
+            camera_yaw -= float((x - last_x) / SCR_WIDTH * M_PI);
+            camera_pitch = clamp(camera_pitch + float((y - last_y) / SCR_HEIGHT * M_PI), -1.5f, 1.5f);
+            moved = true;
+        }
+        dragging = true;
+    }
+    else
+    {
+        dragging = false;
+    }
+    last_x = x;
+    last_y = y;
+
+    if (scroll != 0)
+    {
+        camera_distance *= pow(0.9f, scroll);
+        scroll = 0;
+        moved = true;
+    }
+
+    // WASD moves the target across the ground, QE up and down
+    float step = 0.02f * camera_distance;
+    Vector3D forward(-sin(camera_yaw), 0, -cos(camera_yaw));
+    Vector3D right(cos(camera_yaw), 0, -sin(camera_yaw));
+    Vector3D move(0, 0, 0);
+    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+        move += forward;
+    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+        move += -1 * forward;
+    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+        move += right;
+    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+        move += -1 * right;
+    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+        move += Vector3D(0, 1, 0);
+    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+        move += Vector3D(0, -1, 0);
+    if (move.length_squared() > 0)
+    {
+        camera_target += step * move;
+        moved = true;
+    }
+    return moved;
+}
+
+void scroll_callback(GLFWwindow* window, double x_offset, double y_offset)
+{
+    scroll += float(y_offset);
+}
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+    // make sure the viewport matches the new window dimensions; note that width and
+    // height will be significantly larger than specified on retina displays.
+    glViewport(0, 0, width, height);
+}